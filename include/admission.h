@@ -0,0 +1,241 @@
+/*
+ * admission.h
+ *
+ * Admission control for the fixed pool of ENet peers of the master.
+ *
+ * Every connection request belongs to a role; roles are ordered by priority
+ * (game servers > server list browsers > NAT clients > anything else). Each role
+ * can have some slots reserved that lower priority roles cannot take. Only when the
+ * pool is full, finished sessions are recycled and then the lowest priority (and
+ * among those the oldest) session is evicted to make room for a higher priority one;
+ * otherwise a finished session completes its graceful disconnect.
+ *
+ * Connection requests are screened from ENet's intercept callback, in the middle of
+ * receiving. ENet must not be re-entered from there (enet_peer_disconnect_now flushes
+ * the host), so the slot reclaimed for a request is only marked and the request is
+ * dropped; housekeeping() releases the marked slots and the client's retransmitted
+ * connect (ENet retries it after 500 ms) finds one free.
+ */
+
+#ifndef INCLUDE_ADMISSION_H_
+#define INCLUDE_ADMISSION_H_
+
+#include <array>
+#include <vector>
+#include <algorithm>
+#include <enet/enet.h>
+#include "masterserver.h"
+
+struct admission_stats {
+    unsigned long long admitted = 0;
+    unsigned long long rejected = 0;
+    unsigned long long evicted = 0;
+    unsigned long long recycled = 0;
+    unsigned long long deferred = 0; // dropped while a slot was reclaimed for them, admitted when the client retransmits
+};
+
+struct admission_controller {
+    // slots that only the role itself or roles with higher priority may use
+    std::array<size_t, PEER_ROLES_COUNT> reserved = { 8, 8, 0, 0 };
+    std::array<admission_stats, PEER_ROLES_COUNT> stats;
+
+    static PEER_ROLE roleOf(enet_uint32 requestData) {
+        if (requestData >= static_cast<enet_uint32>(REQUEST_TYPE::COUNT)) {
+            return PEER_ROLE::OTHER;
+        }
+        switch (static_cast<REQUEST_TYPE>(requestData)) {
+        case REQUEST_TYPE::SERVER_REGISTER:
+        case REQUEST_TYPE::SERVER_UPDATE:
+        case REQUEST_TYPE::SERVER_NAT_GET_PEERS:
+        case REQUEST_TYPE::MASTER_PUSH_NAT_PEERS_TO_SERVER:
+            return PEER_ROLE::SERVER;
+        case REQUEST_TYPE::CLIENT_REQUEST_SERVERLIST:
+            return PEER_ROLE::BROWSER;
+        case REQUEST_TYPE::CLIENT_NAT_CONNECT_TO_SERVER:
+            return PEER_ROLE::NAT_CLIENT;
+        case REQUEST_TYPE::CLIENT_SUBSCRIBE_SERVERLIST:
+            // holds its slot for good, gives way to every request and subscribes again later
+            return PEER_ROLE::OTHER;
+        default:
+            return PEER_ROLE::OTHER;
+        }
+    }
+
+    static PEER_ROLE roleOf(const ENetPeer *peer) {
+        if (peer->data != nullptr) {
+            return ((peer_entry*) peer->data)->role;
+        }
+        // handshake in progress, ENet keeps the connect data of incoming peers in eventData
+        return roleOf(peer->eventData);
+    }
+
+    // the master only disconnects peers whose exchange is complete, once ENet has delivered all
+    // their data and sent the disconnect, the slot can be reused without waiting for the acknowledgement
+    static bool finished(const ENetPeer *peer) {
+        return peer->state == ENET_PEER_STATE_DISCONNECTING;
+    }
+
+    // called from the intercept callback for each connection request before ENet allocates a peer for it
+    bool admit(ENetHost *host, const ENetAddress &from, enet_uint32 requestData) {
+        for (size_t i = 0; i < host->peerCount; i++) {
+            ENetPeer *peer = &host->peers[i];
+            if (peer->state != ENET_PEER_STATE_DISCONNECTED && peer->address.host == from.host && peer->address.port == from.port) {
+                // retransmitted connect, ENet takes care of it
+                return true;
+            }
+        }
+        PEER_ROLE role = roleOf(requestData);
+        admission_stats &s = stats[static_cast<size_t>(role)];
+        if (hasRoom(host, role, marked.size())) {
+            s.admitted++;
+            return true;
+        }
+        if (reclaim(host, role, true)) {
+            s.deferred++;
+        } else {
+            s.rejected++;
+        }
+        return false;
+    }
+
+    // makes sure that there is a free slot the role can use, evicting sessions of lower priority if needed;
+    // releases right away, not for the intercept callback
+    bool makeRoom(ENetHost *host, PEER_ROLE role) {
+        admission_stats &s = stats[static_cast<size_t>(role)];
+        releaseMarked();
+        if (hasRoom(host, role, marked.size()) || reclaim(host, role, false)) {
+            s.admitted++;
+            return true;
+        }
+        s.rejected++;
+        return false;
+    }
+
+    // releases the slots admit() reclaimed, from housekeeping; a slot that was freed or reused meanwhile is left alone
+    size_t releaseMarked() {
+        size_t released = 0;
+        for (const marked_slot &m : marked) {
+            if (m.peer->state != ENET_PEER_STATE_DISCONNECTED && m.peer->connectID == m.connectID) {
+                releasePeer(m.peer);
+                released++;
+            }
+        }
+        marked.clear();
+        return released;
+    }
+
+    admission_stats total() const {
+        admission_stats result;
+        for (auto &s : stats) {
+            result.admitted += s.admitted;
+            result.rejected += s.rejected;
+            result.evicted += s.evicted;
+            result.recycled += s.recycled;
+            result.deferred += s.deferred;
+        }
+        return result;
+    }
+
+private:
+    struct marked_slot {
+        ENetPeer *peer;
+        enet_uint32 connectID;
+    };
+    std::vector<marked_slot> marked;
+
+    bool isMarked(const ENetPeer *peer, size_t from = 0) const {
+        return std::any_of(marked.begin() + from, marked.end(), [peer](const marked_slot &m) {
+            return m.peer == peer;
+        });
+    }
+
+    // the slots marked from index `freedFrom` on count as free, they are released before the retransmitted connect
+    // arrives; the ones marked before are taken by the requests they were marked for
+    bool hasRoom(ENetHost *host, PEER_ROLE role, size_t freedFrom) {
+        std::array<size_t, PEER_ROLES_COUNT> used = { };
+        size_t free = 0;
+        for (size_t i = 0; i < host->peerCount; i++) {
+            ENetPeer *peer = &host->peers[i];
+            if (peer->state == ENET_PEER_STATE_DISCONNECTED || isMarked(peer, freedFrom)) {
+                free++;
+            } else {
+                used[static_cast<size_t>(roleOf(peer))]++;
+            }
+        }
+        size_t reservedAbove = 0;
+        for (size_t r = 0; r < static_cast<size_t>(role); r++) {
+            reservedAbove += used[r] < reserved[r] ? reserved[r] - used[r] : 0;
+        }
+        return free > reservedAbove;
+    }
+
+    // frees slots until the role has room: finished sessions first, then sessions of lower priority. Nothing is
+    // freed when that is not enough. With `later` the slots are only marked for releaseMarked()
+    bool reclaim(ENetHost *host, PEER_ROLE role, bool later) {
+        size_t before = marked.size();
+        while (!hasRoom(host, role, before)) {
+            ENetPeer *slot = findFinished(host);
+            if (slot == nullptr) {
+                slot = findVictim(host, role);
+            }
+            if (slot == nullptr) {
+                marked.resize(before);
+                return false;
+            }
+            marked.push_back( { slot, slot->connectID });
+        }
+        for (size_t i = before; i < marked.size(); i++) {
+            ENetPeer *slot = marked[i].peer;
+            admission_stats &owner = stats[static_cast<size_t>(roleOf(slot))];
+            (finished(slot) ? owner.recycled : owner.evicted)++;
+        }
+        if (!later) {
+            std::vector<marked_slot> slots(marked.begin() + before, marked.end());
+            marked.resize(before);
+            for (const marked_slot &m : slots) {
+                releasePeer(m.peer);
+            }
+        }
+        return true;
+    }
+
+    ENetPeer* findFinished(ENetHost *host) {
+        for (size_t i = 0; i < host->peerCount; i++) {
+            ENetPeer *peer = &host->peers[i];
+            if (finished(peer) && !isMarked(peer)) {
+                return peer;
+            }
+        }
+        return nullptr;
+    }
+
+    ENetPeer* findVictim(ENetHost *host, PEER_ROLE role) {
+        ENetPeer *victim = nullptr;
+        for (size_t i = 0; i < host->peerCount; i++) {
+            ENetPeer *peer = &host->peers[i];
+            if (peer->state == ENET_PEER_STATE_DISCONNECTED || roleOf(peer) <= role || isMarked(peer)) {
+                continue;
+            }
+            if (victim == nullptr || evictsBefore(peer, victim)) {
+                victim = peer;
+            }
+        }
+        return victim;
+    }
+
+    // lowest priority first, then half-open handshakes, then the session closest to its end
+    static bool evictsBefore(const ENetPeer *a, const ENetPeer *b) {
+        if (roleOf(a) != roleOf(b)) {
+            return roleOf(a) > roleOf(b);
+        }
+        if ((a->data == nullptr) != (b->data == nullptr)) {
+            return a->data == nullptr;
+        }
+        if (a->data == nullptr) {
+            return false;
+        }
+        return ((peer_entry*) a->data)->validUntil < ((peer_entry*) b->data)->validUntil;
+    }
+};
+
+#endif /* INCLUDE_ADMISSION_H_ */
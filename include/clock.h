@@ -0,0 +1,44 @@
+/*
+ * clock.h
+ *
+ * Time source of the master's event loop. The handlers read the global `now` (masterserver.h),
+ * the loop refreshes it from a master_clock - the steady clock in production, a virtual clock
+ * in the simulator.
+ */
+
+#ifndef INCLUDE_CLOCK_H_
+#define INCLUDE_CLOCK_H_
+
+#include <chrono>
+
+struct master_clock {
+    virtual ~master_clock() {
+    }
+    virtual std::chrono::steady_clock::time_point time() = 0;
+};
+
+struct steady_master_clock: public master_clock {
+    std::chrono::steady_clock::time_point time() override {
+        return std::chrono::steady_clock::now();
+    }
+};
+
+struct virtual_clock: public master_clock {
+    std::chrono::steady_clock::time_point current;
+
+    virtual_clock(std::chrono::steady_clock::time_point start = std::chrono::steady_clock::time_point())
+        : current(start) {
+    }
+
+    std::chrono::steady_clock::time_point time() override {
+        return current;
+    }
+
+    void advanceTo(std::chrono::steady_clock::time_point t) {
+        if (t > current) {
+            current = t;
+        }
+    }
+};
+
+#endif /* INCLUDE_CLOCK_H_ */
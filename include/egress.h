@@ -0,0 +1,263 @@
+/*
+ * egress.h
+ *
+ * Egress scheduler of the master, a master_network in front of the ENet one.
+ *
+ * Outgoing packets are classified by their packet type: control traffic, NAT traffic
+ * (peers, punch schedules, busy answers, relay offers) and bulk server lists. Control
+ * and NAT packets are small and latency critical, they are handed to ENet right away.
+ * Server lists wait in per-peer queues and leave by deficit round robin between the
+ * peers, paced to `rate` bytes per second by a token bucket that the control and NAT
+ * packets are charged to as well - a burst of list requests then no longer lands in
+ * ENet's queues at once and the punch traffic sharing the link keeps its latency.
+ *
+ * Deltas (broadcast) are not paced, except for a peer that still has lists queued: it gets
+ * its own copy queued behind them so that a delta never overtakes the snapshot (or the
+ * earlier delta pages) it applies to.
+ *
+ * disconnectLater() of a peer with queued lists is held back until its queue drained,
+ * a peer that went away (or whose slot was reused, see connectID) loses its queue.
+ * flush() has to be called from the event loop; with rate 0 nothing is ever queued.
+ */
+
+#ifndef INCLUDE_EGRESS_H_
+#define INCLUDE_EGRESS_H_
+
+#include <map>
+#include <deque>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <enet/enet.h>
+#include "network.h"
+#include "protocol.h"
+
+#define EGRESS_QUANTUM 4096                // bytes a peer may send per round robin visit
+#define EGRESS_DEFAULT_BURST (16 * 1024)    // also the most the link can have queued ahead of a punch packet
+
+enum class EGRESS_CLASS {
+    CONTROL,
+    NAT,
+    BULK
+};
+#define EGRESS_CLASSES_COUNT 3
+
+struct egress_stats {
+    unsigned long long packets[EGRESS_CLASSES_COUNT] = { }; // indexed by EGRESS_CLASS
+    unsigned long long bytes[EGRESS_CLASSES_COUNT] = { };
+    unsigned long long deferred = 0;      // lists that had to wait for the pacing budget
+    unsigned long long totalWaitMs = 0;   // sum of their waits
+    unsigned long long dropped = 0;       // queued for a peer that went away
+    size_t peakQueuedBytes = 0;
+};
+
+struct egress_network: public master_network {
+    typedef std::chrono::steady_clock::time_point time_point;
+
+    struct queued_packet {
+        ENetPacket *packet;
+        time_point queuedAt;
+    };
+
+    struct peer_queue {
+        enet_uint32 connectID = 0;
+        std::deque<queued_packet> packets;
+        size_t deficit = 0;
+        bool disconnectLater = false; // held back until the queue drained
+        enet_uint32 disconnectData = 0;
+    };
+
+    master_network &inner;
+    float rate = 0; // bytes per second, 0 = no pacing
+    float burst = EGRESS_DEFAULT_BURST;
+    size_t quantum = EGRESS_QUANTUM;
+    egress_stats stats;
+
+    float tokens = EGRESS_DEFAULT_BURST;
+    time_point lastRefill;
+    time_point current;
+    std::map<ENetPeer*, peer_queue> queues;
+    std::deque<ENetPeer*> active; // round robin order of the peers with queued lists
+    size_t queuedBytes = 0;
+    std::vector<ENetPeer*> unqueued; // scratch of broadcast()
+
+    egress_network(master_network &inner)
+        : inner(inner) {
+    }
+
+    ~egress_network() {
+        for (auto &q : queues) {
+            drop(q.second);
+        }
+    }
+
+    static EGRESS_CLASS classOf(const ENetPacket *packet) {
+        if (packet->dataLength == 0) {
+            return EGRESS_CLASS::CONTROL;
+        }
+        switch (packet->data[0]) {
+        case PACKET_TYPE::SERVER_LIST:
+        case PACKET_TYPE::SERVER_LIST_DELTA:
+            return EGRESS_CLASS::BULK;
+        case PACKET_TYPE::SERVER_NAT_PEERS:
+        case PACKET_TYPE::NAT_PUNCH_SCHEDULE:
+        case PACKET_TYPE::NAT_PUNCH_BUSY:
+        case PACKET_TYPE::RELAY_OFFER:
+            return EGRESS_CLASS::NAT;
+        default:
+            return EGRESS_CLASS::CONTROL;
+        }
+    }
+
+    bool pending() const {
+        return !active.empty();
+    }
+
+    ENetPeer* connect(const ENetAddress &address, enet_uint32 data) override {
+        return inner.connect(address, data);
+    }
+    void timeout(ENetPeer *peer, enet_uint32 limit, enet_uint32 minimum, enet_uint32 maximum) override {
+        inner.timeout(peer, limit, minimum, maximum);
+    }
+
+    void send(ENetPeer *peer, ENetPacket *packet) override {
+        EGRESS_CLASS c = classOf(packet);
+        if (c != EGRESS_CLASS::BULK || rate <= 0) {
+            forward(peer, packet, c);
+            return;
+        }
+        auto it = queues.find(peer);
+        if (it != queues.end() && it->second.connectID != peer->connectID) {
+            forget(peer);
+        }
+        peer_queue &q = queues[peer];
+        q.connectID = peer->connectID;
+        if (q.packets.empty()) {
+            active.push_back(peer);
+        }
+        q.packets.push_back( { packet, current });
+        queuedBytes += packet->dataLength;
+        stats.peakQueuedBytes = std::max(stats.peakQueuedBytes, queuedBytes);
+        // an idle link sends right away
+        flush(current);
+    }
+
+    // not paced, a delta is small and shared by all the peers - but the ones with queued lists
+    void broadcast(const std::vector<ENetPeer*> &peers, ENetPacket *packet) override {
+        const std::vector<ENetPeer*> *direct = &peers;
+        if (!queues.empty()) {
+            unqueued.clear();
+            for (ENetPeer *peer : peers) {
+                if (hasQueued(peer)) {
+                    send(peer, enet_packet_create(packet->data, packet->dataLength, packet->flags));
+                } else {
+                    unqueued.push_back(peer);
+                }
+            }
+            direct = &unqueued;
+        }
+        EGRESS_CLASS c = classOf(packet);
+        stats.packets[static_cast<int>(c)] += direct->size();
+        stats.bytes[static_cast<int>(c)] += direct->size() * packet->dataLength;
+        if (rate > 0) {
+            tokens -= direct->size() * packet->dataLength;
+        }
+        inner.broadcast(*direct, packet);
+    }
+    void disconnect(ENetPeer *peer, enet_uint32 data) override {
+        forget(peer);
+        inner.disconnect(peer, data);
+    }
+    void disconnectLater(ENetPeer *peer, enet_uint32 data) override {
+        auto it = queues.find(peer);
+        if (it != queues.end() && !it->second.packets.empty()) {
+            it->second.disconnectLater = true;
+            it->second.disconnectData = data;
+            return;
+        }
+        inner.disconnectLater(peer, data);
+    }
+    void disconnectNow(ENetPeer *peer, enet_uint32 data) override {
+        forget(peer);
+        inner.disconnectNow(peer, data);
+    }
+
+    void flush(time_point now) {
+        current = now;
+        if (rate > 0) {
+            tokens = std::min(burst, tokens + rate * std::chrono::duration<float>(now - lastRefill).count());
+        }
+        lastRefill = now;
+        while (!active.empty() && tokens > 0) {
+            ENetPeer *peer = active.front();
+            active.pop_front();
+            peer_queue &q = queues[peer];
+            if (peer->state != ENET_PEER_STATE_CONNECTED || peer->connectID != q.connectID) {
+                drop(q);
+                queues.erase(peer);
+                continue;
+            }
+            q.deficit += quantum;
+            while (!q.packets.empty() && q.packets.front().packet->dataLength <= q.deficit && tokens > 0) {
+                queued_packet p = q.packets.front();
+                q.packets.pop_front();
+                q.deficit -= p.packet->dataLength;
+                queuedBytes -= p.packet->dataLength;
+                if (now > p.queuedAt) {
+                    stats.deferred++;
+                    stats.totalWaitMs += std::chrono::duration_cast<std::chrono::milliseconds>(now - p.queuedAt).count();
+                }
+                forward(peer, p.packet, EGRESS_CLASS::BULK);
+            }
+            if (!q.packets.empty()) {
+                active.push_back(peer);
+                continue;
+            }
+            bool disconnectLater = q.disconnectLater;
+            enet_uint32 data = q.disconnectData;
+            queues.erase(peer);
+            if (disconnectLater) {
+                inner.disconnectLater(peer, data);
+            }
+        }
+    }
+
+private:
+    bool hasQueued(ENetPeer *peer) const {
+        auto it = queues.find(peer);
+        return it != queues.end() && it->second.connectID == peer->connectID && !it->second.packets.empty();
+    }
+
+    void forward(ENetPeer *peer, ENetPacket *packet, EGRESS_CLASS c) {
+        stats.packets[static_cast<int>(c)]++;
+        stats.bytes[static_cast<int>(c)] += packet->dataLength;
+        if (rate > 0) {
+            // may go into debt, lists then wait until it is paid
+            tokens -= packet->dataLength;
+        }
+        inner.send(peer, packet);
+    }
+
+    void drop(peer_queue &q) {
+        for (queued_packet &p : q.packets) {
+            queuedBytes -= p.packet->dataLength;
+            enet_packet_destroy(p.packet);
+            stats.dropped++;
+        }
+        q.packets.clear();
+        q.deficit = 0;
+        q.disconnectLater = false;
+    }
+
+    void forget(ENetPeer *peer) {
+        auto it = queues.find(peer);
+        if (it == queues.end()) {
+            return;
+        }
+        drop(it->second);
+        queues.erase(it);
+        active.erase(std::remove(active.begin(), active.end(), peer), active.end());
+    }
+};
+
+#endif /* INCLUDE_EGRESS_H_ */
@@ -0,0 +1,130 @@
+/*
+ * endian.h
+ *
+ * Byte order of the wire format: integers are little-endian, IPv4 addresses
+ * (address_t, the ENetAddress::host value) keep their network byte order and
+ * are copied as raw bytes (see masterserver::raw in serialize.h).
+ *
+ * On little-endian targets the conversions are identities and compile away,
+ * elsewhere they use the compiler's byte swap intrinsics.
+ */
+
+#ifndef INCLUDE_ENDIAN_H_
+#define INCLUDE_ENDIAN_H_
+
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+namespace masterserver {
+
+#if defined(__BYTE_ORDER__) && defined(__ORDER_BIG_ENDIAN__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    constexpr bool hostIsLittleEndian = false;
+#else
+    // GCC and Clang define __BYTE_ORDER__, MSVC only targets little-endian platforms
+    constexpr bool hostIsLittleEndian = true;
+#endif
+
+    template<typename T>
+    constexpr T byteSwap(T v) {
+        static_assert(std::is_integral<T>::value, "only integers can be swapped");
+        typedef typename std::make_unsigned<T>::type U;
+        if constexpr (sizeof(T) == 1) {
+            return v;
+        } else if constexpr (sizeof(T) == 2) {
+#if defined(__GNUC__) || defined(__clang__)
+            return static_cast<T>(__builtin_bswap16(static_cast<U>(v)));
+#else
+            return static_cast<T>(static_cast<U>((static_cast<U>(v) >> 8) | (static_cast<U>(v) << 8)));
+#endif
+        } else if constexpr (sizeof(T) == 4) {
+#if defined(__GNUC__) || defined(__clang__)
+            return static_cast<T>(__builtin_bswap32(static_cast<U>(v)));
+#else
+            U u = static_cast<U>(v);
+            return static_cast<T>(((u & 0xff) << 24) | ((u & 0xff00) << 8) | ((u >> 8) & 0xff00) | (u >> 24));
+#endif
+        } else {
+            static_assert(sizeof(T) == 8, "unsupported integer size");
+#if defined(__GNUC__) || defined(__clang__)
+            return static_cast<T>(__builtin_bswap64(static_cast<U>(v)));
+#else
+            U u = static_cast<U>(v);
+            return static_cast<T>((static_cast<U>(byteSwap(static_cast<uint32_t>(u))) << 32) | byteSwap(static_cast<uint32_t>(u >> 32)));
+#endif
+        }
+    }
+
+    // conversions for a host of the given byte order, the wire is little-endian
+    template<bool littleEndianHost, typename T>
+    constexpr T toLittleEndianOn(T v) {
+        if constexpr (littleEndianHost || sizeof(T) == 1) {
+            return v;
+        } else {
+            return byteSwap(v);
+        }
+    }
+
+    template<bool littleEndianHost, typename T>
+    constexpr T toBigEndianOn(T v) {
+        if constexpr (!littleEndianHost || sizeof(T) == 1) {
+            return v;
+        } else {
+            return byteSwap(v);
+        }
+    }
+
+    template<typename T>
+    constexpr T toWire(T v) {
+        return toLittleEndianOn<hostIsLittleEndian>(v);
+    }
+
+    template<typename T>
+    constexpr T fromWire(T v) {
+        return toLittleEndianOn<hostIsLittleEndian>(v);
+    }
+
+    // network byte order, used by STUN
+    template<typename T>
+    constexpr T toBigEndian(T v) {
+        return toBigEndianOn<hostIsLittleEndian>(v);
+    }
+
+    template<typename T>
+    constexpr T fromBigEndian(T v) {
+        return toBigEndianOn<hostIsLittleEndian>(v);
+    }
+
+    template<typename T>
+    inline void storeWire(unsigned char *dst, T v) {
+        v = toWire(v);
+        memcpy(dst, &v, sizeof(T));
+    }
+
+    template<typename T>
+    inline T loadWire(const unsigned char *src) {
+        T v;
+        memcpy(&v, src, sizeof(T));
+        return fromWire(v);
+    }
+
+    template<typename T>
+    inline void storeBigEndian(unsigned char *dst, T v) {
+        v = toBigEndian(v);
+        memcpy(dst, &v, sizeof(T));
+    }
+
+    template<typename T>
+    inline T loadBigEndian(const unsigned char *src) {
+        T v;
+        memcpy(&v, src, sizeof(T));
+        return fromBigEndian(v);
+    }
+
+    static_assert(byteSwap<uint16_t>(0x1234) == 0x3412, "byteSwap 16");
+    static_assert(byteSwap<uint32_t>(0x12345678) == 0x78563412, "byteSwap 32");
+    static_assert(byteSwap<uint64_t>(0x0102030405060708ull) == 0x0807060504030201ull, "byteSwap 64");
+    static_assert(toLittleEndianOn<false>(toLittleEndianOn<false>(0x12345678u)) == 0x12345678u, "round trip on big-endian");
+}
+
+#endif /* INCLUDE_ENDIAN_H_ */
@@ -0,0 +1,195 @@
+#include <cstring>
+#include <algorithm>
+#include "flare.h"
+
+namespace flare {
+
+    transaction_t makeTransaction(port_t localPort, uint64_t nonce) {
+        transaction_t t;
+        t[0] = 'D';
+        t[1] = '6';
+        masterserver::storeWire(t.data() + 2, localPort);
+        masterserver::storeWire(t.data() + 4, nonce);
+        return t;
+    }
+
+    bool parseTransaction(const unsigned char *transaction, port_t &localPort) {
+        if (transaction[0] != 'D' || transaction[1] != '6') {
+            return false;
+        }
+        localPort = masterserver::loadWire<port_t>(transaction + 2);
+        return true;
+    }
+
+    transaction_t filterProbeTransaction(const transaction_t &t) {
+        transaction_t probe = t;
+        for (size_t i = 4; i < probe.size(); i++) {
+            probe[i] ^= 0xff;
+        }
+        return probe;
+    }
+
+    NAT_TYPE classify(const std::vector<port_t> &mapped, bool unsolicitedReached, int32_t &portDelta) {
+        portDelta = 0;
+        std::vector<port_t> seen;
+        for (port_t p : mapped) {
+            if (p != 0) {
+                seen.push_back(p);
+            }
+        }
+        if (seen.empty()) {
+            return NAT_TYPE::UNKNOWN;
+        }
+        if (std::all_of(seen.begin(), seen.end(), [&seen](port_t p) { return p == seen[0]; })) {
+            return unsolicitedReached ? NAT_TYPE::CONE : NAT_TYPE::PORT_RESTRICTED;
+        }
+        // the prober sends in probe port order, a NAT allocating sequentially shows a constant step
+        int32_t delta = (int32_t) seen[1] - seen[0];
+        for (size_t i = 2; i < seen.size(); i++) {
+            if ((int32_t) seen[i] - seen[i - 1] != delta) {
+                delta = 0;
+                break;
+            }
+        }
+        portDelta = delta;
+        return NAT_TYPE::SYMMETRIC;
+    }
+
+    const char* natTypeName(NAT_TYPE type) {
+        switch (type) {
+        case NAT_TYPE::OPEN:
+            return "open";
+        case NAT_TYPE::CONE:
+            return "cone";
+        case NAT_TYPE::PORT_RESTRICTED:
+            return "port restricted";
+        case NAT_TYPE::SYMMETRIC:
+            return "symmetric";
+        default:
+            return "unknown";
+        }
+    }
+
+    flare_service::~flare_service() {
+        probes.clear();
+        reserve.reset();
+        for (ENetSocket socket : sockets) {
+            enet_socket_destroy(socket);
+        }
+    }
+
+    bool flare_service::open(address_t host, const std::vector<port_t> &ports, masterserver::TRANSPORT_BACKEND backend) {
+        if (ports.size() < 3) {
+            return false;
+        }
+        for (port_t port : ports) {
+            ENetSocket socket = masterserver::openDatagramSocket(host, port);
+            if (socket == ENET_SOCKET_NULL) {
+                return false;
+            }
+            sockets.push_back(socket);
+        }
+        for (size_t i = 0; i + 1 < sockets.size(); i++) {
+            probes.push_back(std::make_unique<stun::responder>(masterserver::createTransport(backend, sockets[i])));
+            probes.back()->observer = [this, i](const masterserver::datagram &d) {
+                observe(i, d);
+            };
+        }
+        reserve = masterserver::createTransport(backend, sockets.back());
+        return true;
+    }
+
+    void flare_service::observe(size_t probe, const masterserver::datagram &d) {
+        port_t localPort;
+        if (!stun::isBindingRequest(d.data, d.length) || !stun::hasMagicCookie(d.data, d.length)
+            || !parseTransaction(d.data + 8, localPort)) {
+            return;
+        }
+        stats.requests++;
+        transaction_t t;
+        memcpy(t.data(), d.data + 8, t.size());
+        auto key = std::make_pair(d.address.host, t);
+        auto it = sessions.find(key);
+        if (it == sessions.end()) {
+            if (sessions.size() >= FLARE_MAX_SESSIONS) {
+                stats.dropped++;
+                return;
+            }
+            session &s = sessions[key];
+            s.localPort = localPort;
+            s.mapped.assign(probes.size(), 0);
+            s.started = current;
+            stats.sessions++;
+            // unsolicited: the prober never sent anything to the reserve port
+            reserveBatch.clear();
+            masterserver::datagram *probeRequest = reserveBatch.next();
+            probeRequest->address = d.address;
+            probeRequest->length = stun::buildBindingRequest(probeRequest->data, sizeof(probeRequest->data),
+                filterProbeTransaction(t).data());
+            stats.filterProbes += reserve->send(reserveBatch);
+            it = sessions.find(key);
+        }
+        it->second.mapped[probe] = d.address.port;
+    }
+
+    void flare_service::receiveFilterAnswers() {
+        while (reserve->receive(reserveBatch) > 0) {
+            for (size_t i = 0; i < reserveBatch.count; i++) {
+                masterserver::datagram &d = reserveBatch[i];
+                if (d.length < STUN_HEADER_SIZE) {
+                    continue;
+                }
+                transaction_t probe;
+                memcpy(probe.data(), d.data + 8, probe.size());
+                ENetAddress mapped;
+                if (!stun::parseBindingResponse(d.data, d.length, probe.data(), mapped)) {
+                    continue;
+                }
+                auto it = sessions.find(std::make_pair(d.address.host, filterProbeTransaction(probe)));
+                if (it != sessions.end()) {
+                    it->second.reached = true;
+                }
+            }
+            if (reserveBatch.count < DATAGRAM_BATCH_SIZE) {
+                break;
+            }
+        }
+    }
+
+    void flare_service::finish(const std::pair<address_t, transaction_t> &key, session &s) {
+        size_t seen = std::count_if(s.mapped.begin(), s.mapped.end(), [](port_t p) { return p != 0; });
+        if (seen < 2) {
+            stats.incomplete++;
+            return;
+        }
+        nat_classification c;
+        c.address = key.first;
+        c.localPort = s.localPort;
+        c.type = classify(s.mapped, s.reached, c.portDelta);
+        c.mappedPort = *std::find_if(s.mapped.begin(), s.mapped.end(), [](port_t p) { return p != 0; });
+        stats.classified++;
+        if (classified) {
+            classified(c);
+        }
+    }
+
+    void flare_service::service(time_point now) {
+        current = now;
+        for (auto &probe : probes) {
+            probe->service();
+        }
+        receiveFilterAnswers();
+        for (auto it = sessions.begin(); it != sessions.end();) {
+            session &s = it->second;
+            bool allSeen = std::find(s.mapped.begin(), s.mapped.end(), 0) == s.mapped.end();
+            bool done = (allSeen && (s.reached || now - s.started >= std::chrono::milliseconds(FLARE_FILTER_WAIT_MS)))
+                || now - s.started >= std::chrono::milliseconds(FLARE_DEADLINE_MS);
+            if (done) {
+                finish(it->first, s);
+                it = sessions.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+}
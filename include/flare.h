@@ -0,0 +1,101 @@
+/*
+ * flare.h
+ *
+ * NAT classification, the master side of source/beacon.cpp (formerly the beacon-flare tool).
+ *
+ * The master answers STUN binding requests on a few probe ports and notes the public mapping
+ * each request came from. A prober sends a request from one local socket to all probe ports at
+ * once, every request with the same transaction id:
+ *  - the same mapping toward every probe port means a cone NAT, different mappings a symmetric
+ *    one; a constant step between consecutive mappings is the port delta
+ *  - on the first request of a session the master sends a binding request of its own from the
+ *    reserve port, which the prober never contacted. An answer means the NAT lets unsolicited
+ *    packets through, silence for FLARE_FILTER_WAIT_MS means port restricted filtering
+ * The transaction id carries the prober's local port, so the result can be matched to the
+ * registered server. A classification takes a round trip plus the filter wait.
+ */
+
+#ifndef INCLUDE_FLARE_H_
+#define INCLUDE_FLARE_H_
+
+#include <array>
+#include <map>
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <functional>
+#include <enet/enet.h>
+#include "protocol.h"
+#include "transport.h"
+#include "stun.h"
+
+#define FLARE_FILTER_WAIT_MS 250
+#define FLARE_DEADLINE_MS 1000
+#define FLARE_MAX_SESSIONS 1024
+
+namespace flare {
+
+    typedef std::array<unsigned char, STUN_TRANSACTION_SIZE> transaction_t;
+
+    // 'D' '6', the prober's local port, then a nonce
+    transaction_t makeTransaction(port_t localPort, uint64_t nonce);
+    bool parseTransaction(const unsigned char *transaction, port_t &localPort);
+    // transaction of the master's unsolicited probe for a session (and back, it flips the nonce)
+    transaction_t filterProbeTransaction(const transaction_t &t);
+
+    struct nat_classification {
+        address_t address = 0; // public address of the prober
+        port_t localPort = 0;
+        NAT_TYPE type = NAT_TYPE::UNKNOWN;
+        port_t mappedPort = 0; // mapping toward the first probe port that answered
+        int32_t portDelta = 0; // SYMMETRIC: step between the mappings of consecutive probe ports, 0 when not constant
+    };
+
+    // `mapped` in probe port order, 0 = no request seen through that port
+    NAT_TYPE classify(const std::vector<port_t> &mapped, bool unsolicitedReached, int32_t &portDelta);
+
+    const char* natTypeName(NAT_TYPE type);
+
+    struct flare_stats {
+        unsigned long long requests = 0;     // binding requests of probers (plain STUN clients are not counted)
+        unsigned long long sessions = 0;
+        unsigned long long classified = 0;
+        unsigned long long incomplete = 0;   // fewer than two probe ports reached before the deadline
+        unsigned long long filterProbes = 0;
+        unsigned long long dropped = 0;      // session table full
+    };
+
+    struct flare_service {
+        typedef std::chrono::steady_clock::time_point time_point;
+
+        struct session {
+            port_t localPort = 0;
+            std::vector<port_t> mapped;
+            bool reached = false;
+            time_point started;
+        };
+
+        std::vector<ENetSocket> sockets; // probe ports, the reserve port last
+        std::vector<std::unique_ptr<stun::responder>> probes;
+        std::unique_ptr<masterserver::udp_transport> reserve;
+        masterserver::datagram_batch reserveBatch;
+        std::map<std::pair<address_t, transaction_t>, session> sessions;
+        std::function<void(const nat_classification&)> classified;
+        flare_stats stats;
+        time_point current;
+
+        ~flare_service();
+
+        // the last port is the reserve one, at least two probe ports are needed to tell cone from symmetric NAT
+        bool open(address_t host, const std::vector<port_t> &ports, masterserver::TRANSPORT_BACKEND backend);
+        // answers pending requests and reports the sessions that are done
+        void service(time_point now);
+
+    private:
+        void observe(size_t probe, const masterserver::datagram &d);
+        void receiveFilterAnswers();
+        void finish(const std::pair<address_t, transaction_t> &key, session &s);
+    };
+}
+
+#endif /* INCLUDE_FLARE_H_ */
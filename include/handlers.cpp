@@ -0,0 +1,584 @@
+#include <cstdio>
+#include <chrono>
+#include <list>
+#include "handlers.h"
+#include "intercept.h"
+
+std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+ENetHost *server;
+master_network *network;
+
+entryMap hostList;
+rate_limiter connectLimiter;
+admission_controller admission;
+punch_stats punchStats;
+update_stats updateStats;
+relay::issuer relayIssuer;
+liveness_prober liveness;
+list_subscriptions subscriptions;
+
+bool addNATPeer(ENetPeer *peer, address_t address, port_t port, address_t clientLocalNetworkAddress, port_t clientLocalNetworkPort) {
+    PROFILE_SCOPE("addNATPeer");
+    if (!hostList.has(address, port)) {
+        printf("The NAT punch request refers to unknown server %s !\n", hostToIPaddress(address, port).c_str());
+        return false;
+    }
+    server_list_entry &e = hostList.get(address, port);
+    if (!e.needsNAT) {
+        // should not happen
+        printf("server does not support NAT punch\n");
+        return false;
+    }
+    switch (e.registerNatClient(peer->address.host, peer->address.port, clientLocalNetworkAddress, clientLocalNetworkPort)) {
+    case nat_waiters::ADDED::QUEUED:
+        punchStats.queued++;
+        break;
+    case nat_waiters::ADDED::REFRESHED:
+        punchStats.refreshed++;
+        break;
+    case nat_waiters::ADDED::FULL: {
+        punchStats.busy++;
+        packetHeader header;
+        header.type = PACKET_TYPE::NAT_PUNCH_BUSY;
+        packet_punch_busy busy;
+        busy.serverAddress = address;
+        busy.serverPort = port;
+        busy.retryAfterMs = busyRetryAfter(e.rtt);
+        // the pushes of the queued clients are under way, they empty the ring
+        ENetPacket *packet = buildPacket(ENET_PACKET_FLAG_RELIABLE, header, busy);
+        if (packet != NULL) {
+            network->send(peer, packet);
+        }
+        return false;
+    }
+    }
+    pushNATPeersToServer(e);
+    return true;
+}
+
+void pushNATPeersToServer(server_list_entry &e) {
+    printf("Pushing peers back to the server ... connecting\n");
+    ENetAddress address;
+    address.host = e.address;
+    address.port = e.port;
+    ENetPeer *peer = nullptr;
+    if (admission.makeRoom(server, PEER_ROLE::SERVER)) {
+        peer = network->connect(address, static_cast<enet_uint32>(REQUEST_TYPE::MASTER_PUSH_NAT_PEERS_TO_SERVER));
+    }
+    if (peer == nullptr) {
+        printf("Pushing peers back to the server ... no free peer\n");
+        return;
+    }
+    network->timeout(peer, 100, 100, 1000);
+    peer_entry *pe = new peer_entry(PEER_MODE::MASTER_TO_SERVER, now + std::chrono::seconds(2));
+    pe->role = PEER_ROLE::SERVER;
+    peer->data = (void*) pe;
+    pe->connectedCallback = [](ENetPeer *peer) {
+        printf("Pushing peers back to the server ... connected\n");
+        sendWaitingNATPeersToServer(peer);
+    };
+}
+
+// the client's flare probes ran from its game port, the one it reports as its local one
+static packet_nat_peers::_port_window predictClientPorts(const peer_address_t &client) {
+    const entryMap::nat_record *r = hostList.natRecord(std::get<0>(client), std::get<3>(client));
+    if (r == nullptr || r->type != NAT_TYPE::SYMMETRIC) {
+        return packet_nat_peers::_port_window();
+    }
+    packet_nat_peers::_port_window w = predictPorts(std::get<1>(client), r->portDelta, r->observations);
+    if (w.count == 0) {
+        punchStats.unpredictable++;
+    } else {
+        punchStats.predicted++;
+        punchStats.predictedPorts += w.count * PUNCH_BURST_COUNT;
+        hostList.predicted(std::get<0>(client), std::get<3>(client));
+    }
+    return w;
+}
+
+void sendWaitingNATPeersToServer(ENetPeer *server) {
+    PROFILE_SCOPE("sendWaitingNATPeersToServer");
+    server_list_entry &e = hostList.get(server->address.host, server->address.port);
+    packetHeader header;
+    header.type = PACKET_TYPE::SERVER_NAT_PEERS;
+
+    // reused with their capacity, like the drained addresses
+    static packet_nat_peers p;
+    static std::vector<peer_address_t> addresses;
+    p.peers.clear();
+    p.predictions.clear();
+    p.yourPublicAddress = e.publicIPAddress != 0 ? e.publicIPAddress : e.address;
+    p.yourPublicPort = e.publicPort != 0 ? e.publicPort : e.port;
+
+    e.scrubNATClients(addresses);
+    for (auto &c : addresses) {
+        packet_nat_peers::_peer peer;
+        peer.address = std::get<0>(c);
+        peer.port = std::get<1>(c);
+        peer.localNetworkAddress = std::get<2>(c);
+        peer.localNetworkPort = std::get<3>(c);
+        p.peers.push_back(peer);
+        p.predictions.push_back(predictClientPorts(c));
+    }
+    p.peerCount = p.peers.size();
+
+    ENetPacket *enetPacket = buildPacket(ENET_PACKET_FLAG_RELIABLE, header, p);
+    if (enetPacket == NULL) {
+        printf("Cannot build the NAT peers packet for %zu peers\n", p.peers.size());
+        return;
+    }
+    network->send(server, enetPacket);
+
+    for (auto &c : addresses) {
+        schedulePunchPair(server, e, c);
+    }
+
+    header.type = PACKET_TYPE::RELAY_OFFER;
+    for (auto &o : e.relayOffers) {
+        ENetPacket *offer = buildPacket(ENET_PACKET_FLAG_RELIABLE, header, o.first);
+        if (offer != NULL) {
+            network->send(server, offer);
+        }
+    }
+    e.relayOffers.clear();
+}
+
+bool offerRelay(ENetPeer *client, address_t address, port_t port) {
+    if (!relayIssuer.enabled() || !hostList.has(address, port)) {
+        printf("No relay for %s\n", hostToIPaddress(address, port).c_str());
+        punchStats.relayRefused++;
+        return false;
+    }
+    server_list_entry &e = hostList.get(address, port);
+    if (e.relayOffers.size() >= 10) {
+        punchStats.relayRefused++;
+        return false;
+    }
+    // each end can bind only from the host it talks to the master from
+    std::array<relay::credentials, 2> c = relayIssuer.issue(e.address, client->address.host);
+    packet_relay_offer toServer;
+    toServer.relayAddress = relayIssuer.address;
+    toServer.relayPort = relayIssuer.port;
+    toServer.session = c[relay::SERVER].session;
+    toServer.expires = c[relay::SERVER].expires;
+    toServer.mac = c[relay::SERVER].mac;
+    packet_relay_offer toClient = toServer;
+    toClient.mac = c[relay::CLIENT].mac;
+
+    toClient.peerAddress = e.address;
+    toClient.peerPort = e.port;
+    toClient.role = relay::CLIENT;
+    packetHeader header;
+    header.type = PACKET_TYPE::RELAY_OFFER;
+    ENetPacket *packet = buildPacket(ENET_PACKET_FLAG_RELIABLE, header, toClient);
+    if (packet == NULL) {
+        punchStats.relayRefused++;
+        return false;
+    }
+    network->send(client, packet);
+
+    toServer.peerAddress = client->address.host;
+    toServer.peerPort = client->address.port;
+    toServer.role = relay::SERVER;
+    e.relayOffers.emplace_back(toServer, now + std::chrono::seconds(RELAY_CREDENTIALS_TTL_S));
+    pushNATPeersToServer(e);
+    punchStats.relayOffered++;
+    return true;
+}
+
+// the client waits for its schedule on the session it sent CLIENT_NAT_PUNCH on
+static ENetPeer* findWaitingClient(address_t address, port_t port) {
+    for (size_t i = 0; i < server->peerCount; i++) {
+        ENetPeer *p = &server->peers[i];
+        peer_entry *pe = (peer_entry*) p->data;
+        if (p->state == ENET_PEER_STATE_CONNECTED && pe != nullptr && pe->mode == PEER_MODE::CLIENT
+            && p->address.host == address && p->address.port == port) {
+            return p;
+        }
+    }
+    return nullptr;
+}
+
+void schedulePunchPair(ENetPeer *serverPeer, server_list_entry &e, const peer_address_t &client) {
+    PROFILE_SCOPE("schedulePunchPair");
+    ENetPeer *clientPeer = findWaitingClient(std::get<0>(client), std::get<1>(client));
+    enet_uint32 serverRtt = punchRtt(serverPeer, e.rtt);
+    enet_uint32 clientRtt = clientPeer != nullptr ? punchRtt(clientPeer) : serverRtt;
+    enet_uint32 variance = std::max(serverPeer->roundTripTimeVariance,
+        clientPeer != nullptr ? clientPeer->roundTripTimeVariance : 0);
+    PUNCH_STRATEGY strategy = punchStrategy(hostList.natTypeOf(e));
+    punch_timing timing = schedulePunch(serverRtt, clientRtt, variance, strategy);
+
+    packetHeader header;
+    header.type = PACKET_TYPE::NAT_PUNCH_SCHEDULE;
+    packet_punch_schedule toServer;
+    toServer.peerAddress = std::get<0>(client);
+    toServer.peerPort = std::get<1>(client);
+    toServer.peerLocalNetworkAddress = std::get<2>(client);
+    toServer.peerLocalNetworkPort = std::get<3>(client);
+    toServer.startInMs = timing.serverDelay;
+    toServer.burstCount = PUNCH_BURST_COUNT;
+    toServer.burstIntervalMs = PUNCH_BURST_INTERVAL_MS;
+    ENetPacket *packet = buildPacket(ENET_PACKET_FLAG_RELIABLE, header, toServer);
+    if (packet == NULL) {
+        return;
+    }
+    network->send(serverPeer, packet);
+
+    if (clientPeer == nullptr) {
+        punchStats.serverOnly++;
+        return;
+    }
+    packet_punch_schedule toClient;
+    toClient.peerAddress = e.publicIPAddress != 0 ? e.publicIPAddress : e.address;
+    toClient.peerPort = e.publicPort != 0 ? e.publicPort : e.port;
+    toClient.peerLocalNetworkAddress = e.localNetworkAddress;
+    toClient.peerLocalNetworkPort = e.localNetworkPort;
+    toClient.startInMs = timing.clientDelay;
+    toClient.burstCount = PUNCH_BURST_COUNT;
+    toClient.burstIntervalMs = PUNCH_BURST_INTERVAL_MS;
+    packet = buildPacket(ENET_PACKET_FLAG_RELIABLE, header, toClient);
+    if (packet == NULL) {
+        return;
+    }
+    network->send(clientPeer, packet);
+    network->disconnectLater(clientPeer, 0);
+    punchStats.scheduled++;
+    punchStats.byStrategy[static_cast<int>(strategy)]++;
+    punchStats.totalDelayMs += timing.serverDelay + serverRtt / 2;
+}
+
+void onNatClassified(const flare::nat_classification &c) {
+    printf("NAT of %s (local port %u): %s, port delta %d\n", hostToIPaddress(c.address, c.mappedPort).c_str(), c.localPort,
+        flare::natTypeName(c.type), c.portDelta);
+    hostList.classifyNat(c.address, c.localPort, c.type, c.portDelta);
+}
+
+// encoded list packet for one proximity bucket, reused while the registry generation holds
+// and none of the listed servers expires
+struct serverlist_snapshot {
+    uint64_t generation = 0;
+    std::chrono::steady_clock::time_point validUntil;
+    std::vector<unsigned char> data;
+};
+std::map<address_t, serverlist_snapshot> listSnapshots;
+#define NO_BUCKET UINT32_MAX // bucketOf() never returns it, shared by clients without servers nearby
+
+void buildServerList(address_t client, serverlist_snapshot &snapshot) {
+    PROFILE_SCOPE("buildServerList");
+    static std::list<server_list_entry*> validHosts;
+    validHosts.clear();
+    {
+        PROFILE_SCOPE("getValidHostsNear");
+        hostList.getValidHostsNear(client, validHosts, hostList.listLimit);
+    }
+
+    packetHeader header;
+    header.type = PACKET_TYPE::SERVER_LIST;
+    packet_serverlist_encoded p;
+    p.serverCount = validHosts.size();
+    p.servers.reserve(validHosts.size());
+    snapshot.validUntil = std::chrono::steady_clock::time_point::max();
+    for (server_list_entry *e : validHosts) {
+        const std::vector<unsigned char> &wire = e->wire();
+        p.servers.push_back( { wire.data(), wire.size() });
+        snapshot.validUntil = std::min(snapshot.validUntil, e->validUntil);
+    }
+
+    PROFILE_SCOPE("serialize list");
+    masterserver::sizer sizer;
+    sizer << header;
+    sizer << p;
+    snapshot.data.resize(sizer.size);
+    masterserver::buffer_serializer s(snapshot.data.data(), snapshot.data.size());
+    s << header;
+    s << p;
+    snapshot.generation = hostList.generation;
+}
+
+void sendHostsToPeer(ENetPeer *peer) {
+    PROFILE_SCOPE("sendHostsToPeer");
+    address_t bucket = entryMap::bucketOf(peer->address.host);
+    if (!hostList.hasBucket(bucket)) {
+        bucket = NO_BUCKET;
+    }
+    if (listSnapshots.size() > hostList.byBucket.size() + 1) {
+        listSnapshots.clear();
+    }
+    serverlist_snapshot &snapshot = listSnapshots[bucket];
+    if (snapshot.data.empty() || snapshot.generation != hostList.generation || snapshot.validUntil < now) {
+        buildServerList(peer->address.host, snapshot);
+    }
+    ENetPacket *enetPacket = enet_packet_create(snapshot.data.data(), snapshot.data.size(), ENET_PACKET_FLAG_RELIABLE);
+
+    network->send(peer, enetPacket);
+}
+
+void onPacketReceived(ENetPeer *peer, ENetPacket *p) {
+    masterserver::deserializer d(p->data, p->dataLength);
+    packetHeader header;
+    d >> header;
+
+    switch (header.type) {
+    case PACKET_TYPE::SERVER_UPDATE: {
+        // reused so that descr keeps its capacity from the previous update
+        static packet_update s;
+        s.descr.clear();
+        s.localNetworkAddress = s.publicIPAddress = 0;
+        s.localNetworkPort = s.publicPort = 0;
+        s.needsNAT = false;
+        d >> s;
+        printf("server %s: update `%s` %s/pub:%s\n",
+            hostToIPaddress(peer->address.host, peer->address.port).c_str(), s.descr.c_str(),
+            hostToIPaddress(s.localNetworkAddress, s.localNetworkPort).c_str(),
+            hostToIPaddress(s.publicIPAddress, s.publicPort).c_str());
+        if (s.descr.length() > 100) {
+            s.descr = "long PP";
+        }
+        updateStats.full++;
+        updateStats.bytes += p->dataLength;
+        if (!hostList.update(peer->address.host, peer->address.port,
+            s.descr,
+            s.localNetworkAddress, s.localNetworkPort,
+            s.publicIPAddress, s.publicPort,
+            s.needsNAT)) {
+            updateStats.unchanged++;
+        }
+        break;
+    }
+    case PACKET_TYPE::SERVER_UPDATE_PARTIAL: {
+        static packet_update_partial s;
+        s.fields = 0;
+        s.descr.clear();
+        if (!(d >> s)) {
+            break;
+        }
+        printf("server %s: partial update (fields %x)\n", hostToIPaddress(peer->address.host, peer->address.port).c_str(),
+            s.fields);
+        if (s.descr.length() > 100) {
+            s.descr = "long PP";
+        }
+        updateStats.partial++;
+        updateStats.bytes += p->dataLength;
+        if (!hostList.get(peer->address.host, peer->address.port).described) {
+            updateStats.beforeFull++;
+        }
+        if (!hostList.updatePartial(peer->address.host, peer->address.port, s)) {
+            updateStats.unchanged++;
+        }
+        // what the same entry would have cost as a full update
+        server_list_entry &e = hostList.get(peer->address.host, peer->address.port);
+        static packet_update full;
+        full.descr.assign(e.descr.data, e.descr.length);
+        masterserver::sizer sizer;
+        sizer << header;
+        sizer << full;
+        if (sizer.size > p->dataLength) {
+            updateStats.bytesSaved += sizer.size - p->dataLength;
+        }
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+void onPeerPacketReceived(ENetPeer *peer, ENetPacket *p) {
+    masterserver::deserializer d(p->data, p->dataLength);
+    packetHeader header;
+    d >> header;
+
+    switch (header.type) {
+    case PACKET_TYPE::CLIENT_NAT_PUNCH: {
+        printf("It's a NAT punch request!\n");
+        packet_nat_punch s;
+        d >> s;
+        if (!addNATPeer(peer, s.address, s.port, s.clientLocalNetworkAddress, s.clientLocalNetworkPort)) {
+            network->disconnectLater(peer, 0);
+        }
+        // otherwise the session is kept until the punch schedule is sent (schedulePunchPair) or it expires
+        break;
+    }
+    case PACKET_TYPE::CLIENT_RELAY_REQUEST: {
+        printf("It's a relay request!\n");
+        packet_nat_punch s;
+        d >> s;
+        // flare probes ran from the game port, the one reported as the local one
+        if (hostList.predictionFailed(peer->address.host, s.clientLocalNetworkPort, std::chrono::seconds(PUNCH_PREDICTION_RELAY_S))) {
+            punchStats.predictedRelays++;
+        }
+        offerRelay(peer, s.address, s.port);
+        network->disconnectLater(peer, 0);
+        break;
+    }
+
+    default:
+        break;
+    }
+}
+// drops connection requests over the per-source budget before ENet allocates a peer for them
+int ENET_CALLBACK interceptPacket(ENetHost *host, ENetEvent *event) {
+    if (liveness.onDatagram(hostList, host->receivedAddress, host->receivedData, host->receivedDataLength, now)) {
+        return 1;
+    }
+    enet_uint32 requestData;
+    if (!peekConnectRequest(host->receivedData, host->receivedDataLength, requestData)) {
+        return 0;
+    }
+    return admitConnection(host, host->receivedAddress, requestData) ? 0 : 1;
+}
+
+// heartbeat sessions are short, the lowest sample is not skewed by ENet's 500 ms initial estimate
+static void sampleServerRtt(ENetPeer *peer) {
+    peer_entry *pe = (peer_entry*) peer->data;
+    if (pe != nullptr && pe->mode == PEER_MODE::SERVER) {
+        hostList.sampleRtt(peer->address.host, peer->address.port, std::min(peer->roundTripTime, peer->lowestRoundTripTime));
+    }
+}
+
+void releasePeer(ENetPeer *peer) {
+    // a recycled heartbeat session ends without a DISCONNECT event
+    sampleServerRtt(peer);
+    subscriptions.unsubscribe(peer);
+    delete ((peer_entry*) peer->data);
+    peer->data = NULL;
+    network->disconnectNow(peer, 0);
+}
+
+bool admitConnection(ENetHost *host, const ENetAddress &from, enet_uint32 requestData) {
+    if (!connectLimiter.allow(from.host, requestData, host->serviceTime)) {
+        return false;
+    }
+    return admission.admit(host, from, requestData);
+}
+
+void housekeeping() {
+    PROFILE_SCOPE("housekeeping");
+    hostList.purgeOld();
+    admission.releaseMarked();
+    for (size_t i = 0; i < server->peerCount; i++) {
+        ENetPeer *p = &server->peers[i];
+        peer_entry *pe = (peer_entry*) p->data;
+        if (p->state == ENetPeerState::ENET_PEER_STATE_CONNECTED && pe != nullptr && pe->validUntil < now) {
+            network->disconnectLater(p, 0);
+        }
+    }
+}
+
+void handleConnect(ENetEvent &event) {
+    PROFILE_SCOPE("handleConnect");
+    REQUEST_TYPE rt = REQUEST_TYPE::NONE;
+    PEER_ROLE role = admission_controller::roleOf(event.data);
+    if (event.data < static_cast<int>(REQUEST_TYPE::COUNT)) {
+        rt = static_cast<REQUEST_TYPE>(event.data);
+    } else {
+        network->disconnect(event.peer, 255);
+        return;
+    }
+    switch (rt) {
+    case REQUEST_TYPE::SERVER_REGISTER: {
+        printf("server %s connected\n", hostToIPaddress(event.peer->address.host, event.peer->address.port).c_str());
+        event.peer->data = (void*) new peer_entry(PEER_MODE::SERVER, now + std::chrono::seconds(5));
+        hostList.refresh(event.peer->address.host, event.peer->address.port);
+        network->disconnect(event.peer, 0);
+        break;
+    }
+    case REQUEST_TYPE::SERVER_UPDATE: {
+        printf("server %s connected [update]\n", hostToIPaddress(event.peer->address.host, event.peer->address.port).c_str());
+        event.peer->data = (void*) new peer_entry(PEER_MODE::SERVER, now + std::chrono::seconds(5));
+        hostList.refresh(event.peer->address.host, event.peer->address.port);
+        break;
+    }
+    case REQUEST_TYPE::CLIENT_REQUEST_SERVERLIST: {
+        printf("peer %s requesting server list \n", hostToIPaddress(event.peer->address.host, event.peer->address.port).c_str());
+        event.peer->data = (void*) new peer_entry(PEER_MODE::CLIENT, now + std::chrono::seconds(1));
+        sendHostsToPeer(event.peer);
+        network->disconnectLater(event.peer, 0);
+        break;
+    }
+    case REQUEST_TYPE::CLIENT_SUBSCRIBE_SERVERLIST: {
+        printf("peer %s subscribing to the server list\n", hostToIPaddress(event.peer->address.host, event.peer->address.port).c_str());
+        bool subscribed = subscriptions.subscribe(event.peer, hostList, *network, now);
+        event.peer->data = (void*) new peer_entry(subscribed ? PEER_MODE::SUBSCRIBER : PEER_MODE::CLIENT,
+            subscribed ? std::chrono::steady_clock::time_point::max() : now + std::chrono::seconds(1));
+        sendHostsToPeer(event.peer);
+        if (subscribed) {
+            subscriptions.sendRemainder(event.peer, hostList, *network);
+        } else {
+            // a plain list request then, the client polls or subscribes again later
+            network->disconnectLater(event.peer, 0);
+        }
+        break;
+    }
+    case REQUEST_TYPE::SERVER_NAT_GET_PEERS: {
+        printf("server %s requesting peers for NAT punch through \n",
+            hostToIPaddress(event.peer->address.host, event.peer->address.port).c_str());
+        event.peer->data = (void*) new peer_entry(PEER_MODE::SERVER, now + std::chrono::seconds(5));
+        hostList.refresh(event.peer->address.host, event.peer->address.port, true);
+        sendWaitingNATPeersToServer(event.peer);
+        network->disconnectLater(event.peer, 0);
+        break;
+    }
+    case REQUEST_TYPE::CLIENT_NAT_CONNECT_TO_SERVER: {
+        printf("peer %s requesting NAT punch\n", hostToIPaddress(event.peer->address.host, event.peer->address.port).c_str());
+        event.peer->data = (void*) new peer_entry(PEER_MODE::CLIENT, now + std::chrono::seconds(5));
+        break;
+    }
+
+    case REQUEST_TYPE::NONE:
+    // possibly outgoing request
+    if (event.peer->data != nullptr) {
+        peer_entry *pe = (peer_entry*) event.peer->data;
+        if (pe->mode == PEER_MODE::MASTER_TO_SERVER) {
+            printf("server %s picked up connection to push peers waiting for NAT punch\n",
+                hostToIPaddress(event.peer->address.host, event.peer->address.port).c_str());
+            pe->onConnected(event.peer);
+        }
+    }
+    //fall through
+    case REQUEST_TYPE::COUNT:
+
+    default:
+    network->disconnectLater(event.peer, 0);
+        break;
+    }
+    if (rt != REQUEST_TYPE::NONE && event.peer->data != nullptr) {
+        ((peer_entry*) event.peer->data)->role = role;
+    }
+}
+
+void handleDisconnect(ENetEvent &event) {
+    PROFILE_SCOPE("handleDisconnect");
+    peer_entry *pe = (peer_entry*) event.peer->data;
+    if (pe != nullptr && pe->mode == PEER_MODE::SUBSCRIBER) {
+        subscriptions.unsubscribe(event.peer);
+    }
+    sampleServerRtt(event.peer);
+    delete ((peer_entry*) event.peer->data);
+    event.peer->data = NULL;
+}
+
+void handleReceive(ENetEvent &event) {
+    PROFILE_SCOPE("handleReceive");
+    peer_entry *pe = (peer_entry*) event.peer->data;
+    if (pe == nullptr) {
+        return;
+    }
+    switch (pe->mode) {
+    case PEER_MODE::NONE: {
+        break;
+    }
+    case PEER_MODE::SERVER: {
+        onPacketReceived(event.peer, event.packet);
+        break;
+    }
+    case PEER_MODE::CLIENT: {
+        onPeerPacketReceived(event.peer, event.packet);
+        break;
+    }
+    case PEER_MODE::MASTER_TO_SERVER:
+    case PEER_MODE::SUBSCRIBER: {
+        break;
+    }
+    }
+}
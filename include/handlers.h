@@ -0,0 +1,61 @@
+/*
+ * handlers.h
+ *
+ * Request handling of the master - everything that reacts to ENet events. Shared by the
+ * master itself and by the offline tools (replay) that drive the same code without sockets.
+ */
+
+#ifndef INCLUDE_HANDLERS_H_
+#define INCLUDE_HANDLERS_H_
+
+#include <enet/enet.h>
+#include "masterserver.h"
+#include "ratelimit.h"
+#include "admission.h"
+#include "network.h"
+#include "punch.h"
+#include "flare.h"
+#include "relay.h"
+#include "liveness.h"
+#include "subscription.h"
+
+extern ENetHost *server;
+extern master_network *network;
+extern entryMap hostList;
+extern rate_limiter connectLimiter;
+extern admission_controller admission;
+extern punch_stats punchStats;
+extern update_stats updateStats;
+extern relay::issuer relayIssuer;
+extern liveness_prober liveness;
+extern list_subscriptions subscriptions;
+
+// queues the client for the server, returns false when it cannot be queued (the client then gets no punch schedule,
+// a NAT_PUNCH_BUSY when the server has too many clients waiting)
+bool addNATPeer(ENetPeer *peer, address_t address, port_t port, address_t clientLocalNetworkAddress, port_t clientLocalNetworkPort);
+void pushNATPeersToServer(server_list_entry &e);
+void sendWaitingNATPeersToServer(ENetPeer *server);
+// sends both sides of a NAT punch the instant to start punching, see punch.h
+void schedulePunchPair(ENetPeer *server, server_list_entry &e, const peer_address_t &client);
+// records the result of a flare probe, schedulePunchPair then picks the punch strategy by it
+void onNatClassified(const flare::nat_classification &c);
+// hands both ends relay credentials after the client's punch timed out, the server gets them with its NAT peers
+bool offerRelay(ENetPeer *client, address_t address, port_t port);
+void sendHostsToPeer(ENetPeer *peer);
+void onPacketReceived(ENetPeer *peer, ENetPacket *p);
+void onPeerPacketReceived(ENetPeer *peer, ENetPacket *p);
+
+// takes the probe answers (liveness.h) and screens connection requests before ENet sees them
+int ENET_CALLBACK interceptPacket(ENetHost *host, ENetEvent *event);
+// pre-handshake checks (rate limiting, admission control) of a connection request, host->serviceTime is the current time in ms
+bool admitConnection(ENetHost *host, const ENetAddress &from, enet_uint32 requestData);
+
+// periodic work, called from the event loop with `now` already updated
+void housekeeping();
+
+void handleConnect(ENetEvent &event);
+void handleDisconnect(ENetEvent &event);
+// does not destroy the packet
+void handleReceive(ENetEvent &event);
+
+#endif /* INCLUDE_HANDLERS_H_ */
@@ -0,0 +1,341 @@
+#include <cstring>
+#include <cstdio>
+#include <strings.h>
+#include <algorithm>
+#include "http.h"
+
+namespace http {
+
+    void appendJsonString(std::string &out, const char *s, size_t length) {
+        out += '"';
+        for (size_t i = 0; i < length; i++) {
+            unsigned char c = s[i];
+            switch (c) {
+            case '"':
+                out += "\\\"";
+                break;
+            case '\\':
+                out += "\\\\";
+                break;
+            case '\n':
+                out += "\\n";
+                break;
+            case '\r':
+                out += "\\r";
+                break;
+            case '\t':
+                out += "\\t";
+                break;
+            default:
+                if (c < 0x20) {
+                    char escaped[8];
+                    snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                    out += escaped;
+                } else {
+                    out += c;
+                }
+            }
+        }
+        out += '"';
+    }
+
+    // value of a header in the header block (names are case insensitive), empty when missing
+    static std::string headerValue(const std::string &block, const char *name) {
+        size_t nameLength = strlen(name);
+        size_t line = block.find("\r\n");
+        while (line != std::string::npos && line + 2 < block.size()) {
+            size_t start = line + 2;
+            size_t end = block.find("\r\n", start);
+            if (end == std::string::npos) {
+                end = block.size();
+            }
+            if (end - start > nameLength && block[start + nameLength] == ':'
+                && strncasecmp(block.c_str() + start, name, nameLength) == 0) {
+                size_t value = block.find_first_not_of(" \t", start + nameLength + 1);
+                if (value == std::string::npos || value >= end) {
+                    return "";
+                }
+                size_t valueEnd = block.find_last_not_of(" \t", end - 1);
+                return block.substr(value, valueEnd + 1 - value);
+            }
+            line = end;
+        }
+        return "";
+    }
+
+    static bool hasToken(const std::string &value, const char *token) {
+        std::string lower = value;
+        std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+        return lower.find(token) != std::string::npos;
+    }
+
+    http_service::~http_service() {
+        for (auto &c : connections) {
+            enet_socket_destroy(c->socket);
+        }
+        if (listener != ENET_SOCKET_NULL) {
+            enet_socket_destroy(listener);
+        }
+    }
+
+    bool http_service::open(address_t address, port_t port) {
+        listener = enet_socket_create(ENET_SOCKET_TYPE_STREAM);
+        if (listener == ENET_SOCKET_NULL) {
+            return false;
+        }
+        enet_socket_set_option(listener, ENET_SOCKOPT_REUSEADDR, 1);
+        ENetAddress bindAddress;
+        bindAddress.host = address;
+        bindAddress.port = port;
+        if (enet_socket_bind(listener, &bindAddress) < 0 || enet_socket_listen(listener, HTTP_MAX_CONNECTIONS) < 0) {
+            enet_socket_destroy(listener);
+            listener = ENET_SOCKET_NULL;
+            return false;
+        }
+        enet_socket_set_option(listener, ENET_SOCKOPT_NONBLOCK, 1);
+        startedAt = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+        return true;
+    }
+
+    void http_service::addSockets(ENetSocketSet &readable, ENetSocketSet &writable, ENetSocket &highest) const {
+        if (listener == ENET_SOCKET_NULL) {
+            return;
+        }
+        ENET_SOCKETSET_ADD(readable, listener);
+        highest = std::max(highest, listener);
+        for (auto &c : connections) {
+            if (!c->closing && c->pending < HTTP_MAX_PENDING_BYTES) {
+                ENET_SOCKETSET_ADD(readable, c->socket);
+            }
+            if (c->pending > 0) {
+                ENET_SOCKETSET_ADD(writable, c->socket);
+            }
+            highest = std::max(highest, c->socket);
+        }
+    }
+
+    void http_service::service(ENetSocketSet &readable, ENetSocketSet &writable, time_point now) {
+        if (listener == ENET_SOCKET_NULL) {
+            return;
+        }
+        if (ENET_SOCKETSET_CHECK(readable, listener)) {
+            accept(now);
+        }
+        for (auto &c : connections) {
+            bool open = true;
+            if (ENET_SOCKETSET_CHECK(readable, c->socket) && !c->closing) {
+                open = read(*c);
+                c->lastActive = now;
+            }
+            open = open && answer(*c);
+            if (open && c->pending > 0) {
+                // a response that fits the socket buffer leaves without another wait
+                open = write(*c);
+                if (ENET_SOCKETSET_CHECK(writable, c->socket)) {
+                    c->lastActive = now;
+                }
+            }
+            if (open && c->closing && c->pending == 0) {
+                open = false;
+            }
+            if (open && now - c->lastActive > std::chrono::milliseconds(HTTP_IDLE_TIMEOUT_MS)) {
+                stats.closedIdle++;
+                open = false;
+            }
+            if (!open) {
+                enet_socket_destroy(c->socket);
+                c->socket = ENET_SOCKET_NULL;
+            }
+        }
+        connections.erase(std::remove_if(connections.begin(), connections.end(), [](const std::unique_ptr<connection> &c) {
+            return c->socket == ENET_SOCKET_NULL;
+        }), connections.end());
+    }
+
+    void http_service::accept(time_point now) {
+        for (int i = 0; i < HTTP_ACCEPTS_PER_SERVICE; i++) {
+            ENetAddress address;
+            ENetSocket socket = enet_socket_accept(listener, &address);
+            if (socket == ENET_SOCKET_NULL) {
+                return;
+            }
+            if (connections.size() >= HTTP_MAX_CONNECTIONS) {
+                stats.rejected++;
+                enet_socket_destroy(socket);
+                continue;
+            }
+            enet_socket_set_option(socket, ENET_SOCKOPT_NONBLOCK, 1);
+            auto c = std::make_unique<connection>();
+            c->socket = socket;
+            c->address = address;
+            c->lastActive = now;
+            connections.push_back(std::move(c));
+            stats.accepted++;
+        }
+    }
+
+    bool http_service::read(connection &c) {
+        char buffer[HTTP_READ_CHUNK];
+        // the wait reported the socket readable: nothing on the first receive is the end of the stream
+        for (int chunk = 0; chunk < 4; chunk++) {
+            ENetBuffer b;
+            b.data = buffer;
+            b.dataLength = sizeof(buffer);
+            int received = enet_socket_receive(c.socket, NULL, &b, 1);
+            if (received < 0 || (received == 0 && chunk == 0)) {
+                return false;
+            }
+            c.input.append(buffer, received);
+            if (received < (int) sizeof(buffer)) {
+                break;
+            }
+        }
+        return true;
+    }
+
+    void http_service::refreshList() {
+        uint64_t g = generation();
+        if (listBody != nullptr && g == listGeneration) {
+            return;
+        }
+        auto body = std::make_shared<std::string>();
+        renderList(*body);
+        listBody = body;
+        // rendering may retire expired entries
+        g = generation();
+        listGeneration = g;
+        char tag[48];
+        snprintf(tag, sizeof(tag), "\"%llx-%llx\"", (unsigned long long) startedAt, (unsigned long long) g);
+        listTag = tag;
+        stats.renders++;
+    }
+
+    void http_service::respond(connection &c, const char *status, const char *contentType, const std::string *etag,
+        std::shared_ptr<const std::string> body, bool head) {
+        auto header = std::make_shared<std::string>();
+        header->reserve(192);
+        *header += "HTTP/1.1 ";
+        *header += status;
+        *header += "\r\n";
+        if (body != nullptr) {
+            *header += "Content-Type: ";
+            *header += contentType;
+            *header += "\r\nContent-Length: ";
+            *header += std::to_string(body->size());
+            *header += "\r\n";
+        }
+        if (etag != nullptr) {
+            *header += "ETag: ";
+            *header += *etag;
+            *header += "\r\n";
+        }
+        *header += "Cache-Control: no-cache\r\nAccess-Control-Allow-Origin: *\r\n";
+        if (c.closing) {
+            *header += "Connection: close\r\n";
+        }
+        *header += "\r\n";
+        c.pending += header->size();
+        c.output.push_back( { header, 0 });
+        if (body != nullptr && !head && !body->empty()) {
+            c.pending += body->size();
+            c.output.push_back( { body, 0 });
+        }
+    }
+
+    bool http_service::answer(connection &c) {
+        static const std::shared_ptr<const std::string> notFound = std::make_shared<const std::string>("{\"error\":\"not found\"}");
+        static const std::shared_ptr<const std::string> badRequest = std::make_shared<const std::string>("{\"error\":\"bad request\"}");
+        size_t consumed = 0;
+        while (!c.closing && c.pending < HTTP_MAX_PENDING_BYTES) {
+            size_t end = c.input.find("\r\n\r\n", consumed);
+            if (end == std::string::npos) {
+                if (c.input.size() - consumed > HTTP_MAX_REQUEST_BYTES) {
+                    stats.badRequests++;
+                    c.closing = true;
+                    respond(c, "431 Request Header Fields Too Large", "application/json", nullptr, badRequest, false);
+                }
+                break;
+            }
+            std::string block = c.input.substr(consumed, end + 2 - consumed);
+            consumed = end + 4;
+            stats.requests++;
+
+            size_t lineEnd = block.find("\r\n");
+            std::string line = block.substr(0, lineEnd);
+            size_t space1 = line.find(' ');
+            size_t space2 = space1 == std::string::npos ? std::string::npos : line.find(' ', space1 + 1);
+            std::string contentLength = headerValue(block, "Content-Length");
+            if (space2 == std::string::npos || !headerValue(block, "Transfer-Encoding").empty()
+                || (!contentLength.empty() && contentLength != "0")) {
+                // request bodies are not supported, the stream cannot be followed after one
+                stats.badRequests++;
+                c.closing = true;
+                respond(c, "400 Bad Request", "application/json", nullptr, badRequest, false);
+                break;
+            }
+            std::string method = line.substr(0, space1);
+            std::string target = line.substr(space1 + 1, space2 - space1 - 1);
+            std::string version = line.substr(space2 + 1);
+            std::string connectionHeader = headerValue(block, "Connection");
+            bool keepAlive = version == "HTTP/1.1" ? !hasToken(connectionHeader, "close") : hasToken(connectionHeader, "keep-alive");
+            if (!keepAlive) {
+                c.closing = true;
+            }
+            std::string path = target.substr(0, target.find('?'));
+            bool head = method == "HEAD";
+            if (method != "GET" && !head) {
+                stats.badRequests++;
+                respond(c, "405 Method Not Allowed", "application/json", nullptr, badRequest, false);
+            } else if (path == "/servers.json") {
+                refreshList();
+                std::string match = headerValue(block, "If-None-Match");
+                if (!match.empty() && (match == "*" || match.find(listTag) != std::string::npos)) {
+                    stats.notModified++;
+                    respond(c, "304 Not Modified", nullptr, &listTag, nullptr, head);
+                } else {
+                    respond(c, "200 OK", "application/json", &listTag, listBody, head);
+                }
+            } else if (path == "/health") {
+                auto body = std::make_shared<std::string>();
+                renderHealth(*body);
+                respond(c, "200 OK", "application/json", nullptr, body, head);
+            } else {
+                stats.notFound++;
+                respond(c, "404 Not Found", "application/json", nullptr, notFound, head);
+            }
+        }
+        c.input.erase(0, consumed);
+        return true;
+    }
+
+    bool http_service::write(connection &c) {
+        while (!c.output.empty()) {
+            ENetBuffer buffers[8];
+            size_t count = 0;
+            for (auto it = c.output.begin(); it != c.output.end() && count < 8; ++it, count++) {
+                buffers[count].data = (void*) (it->data->data() + it->offset);
+                buffers[count].dataLength = it->data->size() - it->offset;
+            }
+            int sent = enet_socket_send(c.socket, NULL, buffers, count);
+            if (sent < 0) {
+                return false;
+            }
+            if (sent == 0) {
+                return true;
+            }
+            stats.bytesSent += sent;
+            c.pending -= sent;
+            size_t left = sent;
+            while (left > 0) {
+                segment &s = c.output.front();
+                size_t n = std::min(left, s.data->size() - s.offset);
+                s.offset += n;
+                left -= n;
+                if (s.offset == s.data->size()) {
+                    c.output.pop_front();
+                }
+            }
+        }
+        return true;
+    }
+}
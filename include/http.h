@@ -0,0 +1,113 @@
+/*
+ * http.h
+ *
+ * Minimal HTTP/1.1 listener of the master (--http=port) for web server browsers and
+ * monitoring: GET /servers.json (the listed servers) and GET /health.
+ *
+ * The list body is rendered once per registry generation and shared by every response
+ * until the generation changes; its ETag carries the generation, a poll with a matching
+ * If-None-Match gets a 304 without a body. Connections are kept alive (HTTP/1.1, or 1.0
+ * asking for it) and pipelined requests are answered in order.
+ *
+ * Everything is non-blocking and bounded so the UDP path never waits on a slow client:
+ * the event loop selects on the sockets from addSockets() and calls service() after the
+ * ENet events; a connection with a full output queue is not read until it drains, one
+ * sending too large a request or idle for HTTP_IDLE_TIMEOUT_MS is closed.
+ */
+
+#ifndef INCLUDE_HTTP_H_
+#define INCLUDE_HTTP_H_
+
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <functional>
+#include <enet/enet.h>
+#include "protocol.h"
+
+#define HTTP_MAX_CONNECTIONS 64
+#define HTTP_MAX_REQUEST_BYTES 8192
+#define HTTP_MAX_PENDING_BYTES (1024 * 1024) // output queued for a connection before its requests wait
+#define HTTP_IDLE_TIMEOUT_MS 15000
+#define HTTP_ACCEPTS_PER_SERVICE 16
+#define HTTP_READ_CHUNK 4096
+
+namespace http {
+
+    struct http_stats {
+        unsigned long long accepted = 0;
+        unsigned long long rejected = 0; // over HTTP_MAX_CONNECTIONS
+        unsigned long long closedIdle = 0;
+        unsigned long long requests = 0;
+        unsigned long long notModified = 0;
+        unsigned long long notFound = 0;
+        unsigned long long badRequests = 0;
+        unsigned long long renders = 0;  // list bodies rendered, one per generation asked for
+        unsigned long long bytesSent = 0;
+    };
+
+    // escapes into a JSON string literal, quotes included
+    void appendJsonString(std::string &out, const char *s, size_t length);
+
+    class http_service {
+    public:
+        typedef std::chrono::steady_clock::time_point time_point;
+
+        // the registry generation, a list body is rendered again when it changed
+        std::function<uint64_t()> generation;
+        std::function<void(std::string &body)> renderList;
+        std::function<void(std::string &body)> renderHealth;
+        http_stats stats;
+
+        ~http_service();
+        bool open(address_t address, port_t port);
+        bool isOpen() const {
+            return listener != ENET_SOCKET_NULL;
+        }
+        size_t connectionCount() const {
+            return connections.size();
+        }
+
+        // the sockets to wait on, `highest` is raised to the highest of them
+        void addSockets(ENetSocketSet &readable, ENetSocketSet &writable, ENetSocket &highest) const;
+        // accepts, reads, answers and writes what the wait reported ready, closes idle connections
+        void service(ENetSocketSet &readable, ENetSocketSet &writable, time_point now);
+
+    private:
+        struct segment {
+            std::shared_ptr<const std::string> data;
+            size_t offset = 0;
+        };
+
+        struct connection {
+            ENetSocket socket;
+            ENetAddress address;
+            std::string input;
+            std::deque<segment> output;
+            size_t pending = 0;     // bytes in output
+            time_point lastActive;
+            bool closing = false;   // close once the output is written
+        };
+
+        ENetSocket listener = ENET_SOCKET_NULL;
+        std::vector<std::unique_ptr<connection>> connections;
+        uint64_t startedAt = 0; // part of the ETag, generations start over with the master
+
+        std::shared_ptr<const std::string> listBody;
+        std::string listTag;
+        uint64_t listGeneration = 0;
+
+        void accept(time_point now);
+        // false when the connection has to be closed
+        bool read(connection &c);
+        bool answer(connection &c);
+        bool write(connection &c);
+        void respond(connection &c, const char *status, const char *contentType, const std::string *etag,
+            std::shared_ptr<const std::string> body, bool head);
+        void refreshList();
+    };
+}
+
+#endif /* INCLUDE_HTTP_H_ */
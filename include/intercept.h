@@ -0,0 +1,42 @@
+/*
+ * intercept.h
+ *
+ * Helpers for the ENet intercept callback - they look into raw datagrams before
+ * ENet processes them.
+ */
+
+#ifndef INCLUDE_INTERCEPT_H_
+#define INCLUDE_INTERCEPT_H_
+
+#include <cstddef>
+#include <cstring>
+#include <enet/enet.h>
+
+// returns true when the datagram carries an ENet CONNECT command, `data` is set to the
+// connect data (REQUEST_TYPE for the master)
+inline bool peekConnectRequest(const enet_uint8 *datagram, size_t length, enet_uint32 &data) {
+    if (length < offsetof(ENetProtocolHeader, sentTime)) {
+        return false;
+    }
+    ENetProtocolHeader header;
+    memcpy(&header, datagram, offsetof(ENetProtocolHeader, sentTime));
+    enet_uint16 peerID = ENET_NET_TO_HOST_16(header.peerID);
+    enet_uint16 flags = peerID & ENET_PROTOCOL_HEADER_FLAG_MASK;
+    peerID &= ~(ENET_PROTOCOL_HEADER_FLAG_MASK | ENET_PROTOCOL_HEADER_SESSION_MASK);
+    if (peerID != ENET_PROTOCOL_MAXIMUM_PEER_ID || (flags & ENET_PROTOCOL_HEADER_FLAG_COMPRESSED)) {
+        return false;
+    }
+    size_t headerSize = (flags & ENET_PROTOCOL_HEADER_FLAG_SENT_TIME) ? sizeof(ENetProtocolHeader) : offsetof(ENetProtocolHeader, sentTime);
+    if (length < headerSize + sizeof(ENetProtocolConnect)) {
+        return false;
+    }
+    ENetProtocolConnect connect;
+    memcpy(&connect, datagram + headerSize, sizeof(connect));
+    if ((connect.header.command & ENET_PROTOCOL_COMMAND_MASK) != ENET_PROTOCOL_COMMAND_CONNECT) {
+        return false;
+    }
+    data = ENET_NET_TO_HOST_32(connect.data);
+    return true;
+}
+
+#endif /* INCLUDE_INTERCEPT_H_ */
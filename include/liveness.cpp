@@ -0,0 +1,108 @@
+#include <cstdio>
+#include <algorithm>
+#include "liveness.h"
+#include "masterserver.h"
+
+bool liveness_prober::open(ENetSocket socket, masterserver::TRANSPORT_BACKEND backend) {
+    if (socket == ENET_SOCKET_NULL) {
+        return false;
+    }
+    random.seed(std::chrono::steady_clock::now().time_since_epoch().count());
+    return open(masterserver::createTransport(backend, socket));
+}
+
+bool liveness_prober::open(std::unique_ptr<masterserver::udp_transport> transport) {
+    this->transport = std::move(transport);
+    return this->transport != nullptr;
+}
+
+void liveness_prober::service(entryMap &registry, time_point now) {
+    if (transport == nullptr || interval.count() <= 0) {
+        return;
+    }
+    if (!started) {
+        started = true;
+        lastService = now;
+        return;
+    }
+    size_t servers = registry.mapa.size();
+    double elapsed = std::chrono::duration<double, std::milli>(now - lastService).count();
+    lastService = now;
+    // after a stall the overdue probes are not sent in one burst, a server is never probed twice in a run
+    credit = std::min(credit + servers * elapsed / interval.count(), (double) servers);
+    for (size_t visited = 0; credit >= 1 && visited < servers; visited++) {
+        auto it = registry.mapa.upper_bound(cursor);
+        if (it == registry.mapa.end()) {
+            it = registry.mapa.begin();
+        }
+        cursor = it->first;
+        server_list_entry &e = it->second;
+        if (e.deleted) {
+            continue;
+        }
+        credit -= 1;
+        if (e.probeToken != 0 && e.answersProbes) {
+            e.probeMisses++;
+            stats.missed++;
+            if (e.probeMisses >= misses) {
+                unsigned long long latency = std::chrono::duration_cast<std::chrono::milliseconds>(now - e.lastAlive).count();
+                stats.evicted++;
+                stats.evictionLatencyMs += latency;
+                stats.maxEvictionLatencyMs = std::max(stats.maxEvictionLatencyMs, latency);
+                printf("server %s missed %u probes, evicted %llu ms after its last sign of life\n",
+                    hostToIPaddress(e.address, e.port).c_str(), (unsigned) e.probeMisses, latency);
+                e.probeToken = 0;
+                registry.evict(e);
+                continue;
+            }
+        }
+        probe(e, now);
+    }
+    if (servers == 0) {
+        credit = 0;
+    }
+    flush();
+}
+
+void liveness_prober::probe(server_list_entry &e, time_point now) {
+    masterserver::datagram *d = batch.next();
+    if (d == nullptr) {
+        flush();
+        d = batch.next();
+    }
+    do {
+        e.probeToken = random();
+    } while (e.probeToken == 0);
+    d->address.host = e.address;
+    d->address.port = e.port;
+    d->length = encodeLiveness(d->data, LIVENESS_KIND::PROBE, e.probeToken);
+    stats.sent++;
+}
+
+void liveness_prober::flush() {
+    if (batch.count == 0) {
+        return;
+    }
+    stats.batches++;
+    transport->send(batch);
+}
+
+bool liveness_prober::onDatagram(entryMap &registry, const ENetAddress &from, const unsigned char *data, size_t length,
+    time_point now) {
+    uint32_t token;
+    if (!parseLiveness(data, length, LIVENESS_KIND::ANSWER, token)) {
+        return false;
+    }
+    auto it = registry.mapa.find(std::make_tuple(from.host, from.port));
+    if (it == registry.mapa.end() || it->second.probeToken == 0 || it->second.probeToken != token) {
+        stats.unknownAnswers++;
+        return true;
+    }
+    server_list_entry &e = it->second;
+    e.probeToken = 0;
+    e.probeMisses = 0;
+    e.answersProbes = true;
+    e.lastAlive = now;
+    stats.answered++;
+    return true;
+}
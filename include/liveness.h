@@ -0,0 +1,116 @@
+/*
+ * liveness.h
+ *
+ * Active liveness probes of the registered servers. A crashed server used to stay listed
+ * until its registration expired (60 s after the last heartbeat); the master now sends
+ * every server a small connectionless probe once per `interval` and evicts a server that
+ * missed `misses` probes in a row, so the list is stale for seconds at most.
+ *
+ * The probes leave from the master's ENet socket: a server behind a NAT is reached through
+ * the mapping its heartbeats opened, and the answer arrives at the ENet host, where the
+ * intercept callback (handlers.cpp) takes it before ENet looks at it. On the game side the
+ * masterclient library answers probes from its intercept callback (masterclient::answerProbe).
+ * A probe starts like an ENet header addressed to no peer with the compressed flag set, a
+ * host without the callback drops it.
+ *
+ * The scheduler walks the registry round robin and sends as many probes as the time since
+ * its last run is worth (servers * elapsed / interval), so the probes are spread evenly
+ * over the interval instead of leaving in bursts; the probes of one run go out in a single
+ * batch (sendmmsg with the mmsg transport).
+ *
+ * Servers that never answered a probe (older game servers) are not evicted by it, their
+ * registration keeps expiring with the heartbeats.
+ */
+
+#ifndef INCLUDE_LIVENESS_H_
+#define INCLUDE_LIVENESS_H_
+
+#include <tuple>
+#include <memory>
+#include <random>
+#include <chrono>
+#include <cstring>
+#include <enet/enet.h>
+#include "protocol.h"
+#include "transport.h"
+
+#define LIVENESS_INTERVAL_MS 2000
+#define LIVENESS_MISSES 3
+#define LIVENESS_DATAGRAM_SIZE 9
+
+enum class LIVENESS_KIND : uint8_t {
+    PROBE = 1,
+    ANSWER = 2
+};
+
+// 0xff 0xff 'D' '6', the kind, the token (network order) - the answer echoes the token of the probe
+inline size_t encodeLiveness(unsigned char *out, LIVENESS_KIND kind, uint32_t token) {
+    out[0] = 0xff;
+    out[1] = 0xff;
+    out[2] = 'D';
+    out[3] = '6';
+    out[4] = static_cast<uint8_t>(kind);
+    token = ENET_HOST_TO_NET_32(token);
+    memcpy(out + 5, &token, sizeof(token));
+    return LIVENESS_DATAGRAM_SIZE;
+}
+
+inline bool parseLiveness(const unsigned char *data, size_t length, LIVENESS_KIND kind, uint32_t &token) {
+    if (length != LIVENESS_DATAGRAM_SIZE || data[0] != 0xff || data[1] != 0xff || data[2] != 'D' || data[3] != '6'
+        || data[4] != static_cast<uint8_t>(kind)) {
+        return false;
+    }
+    memcpy(&token, data + 5, sizeof(token));
+    token = ENET_NET_TO_HOST_32(token);
+    return true;
+}
+
+struct entryMap;
+struct server_list_entry;
+
+struct liveness_stats {
+    unsigned long long sent = 0;
+    unsigned long long answered = 0;
+    unsigned long long missed = 0;
+    unsigned long long unknownAnswers = 0; // from no registered server, or with the token of an older probe
+    unsigned long long evicted = 0;
+    unsigned long long evictionLatencyMs = 0; // sum over the evictions, from the last sign of life to the eviction
+    unsigned long long maxEvictionLatencyMs = 0;
+    unsigned long long batches = 0;
+};
+
+class liveness_prober {
+public:
+    typedef std::chrono::steady_clock::time_point time_point;
+
+    std::chrono::milliseconds interval { LIVENESS_INTERVAL_MS }; // between two probes of a server
+    unsigned misses = LIVENESS_MISSES;
+    liveness_stats stats;
+
+    // probes leave from `socket`, the master's ENet socket (not owned)
+    bool open(ENetSocket socket, masterserver::TRANSPORT_BACKEND backend);
+    // probes leave through `transport` (the simulator's in-memory network)
+    bool open(std::unique_ptr<masterserver::udp_transport> transport);
+    bool isOpen() const {
+        return transport != nullptr;
+    }
+
+    // sends the probes due since the last call, evicts the servers that missed too many
+    void service(entryMap &registry, time_point now);
+    // from the intercept callback, true when the datagram was a probe answer (it is then not for ENet)
+    bool onDatagram(entryMap &registry, const ENetAddress &from, const unsigned char *data, size_t length, time_point now);
+
+private:
+    std::unique_ptr<masterserver::udp_transport> transport;
+    masterserver::datagram_batch batch;
+    std::tuple<address_t, port_t> cursor { 0, 0 }; // the last server probed, the next run continues after it
+    double credit = 0;                             // probes due, the fraction carries over to the next run
+    time_point lastService;
+    bool started = false;
+    std::minstd_rand random;
+
+    void probe(server_list_entry &e, time_point now);
+    void flush();
+};
+
+#endif /* INCLUDE_LIVENESS_H_ */
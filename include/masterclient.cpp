@@ -0,0 +1,513 @@
+#include <algorithm>
+#include "masterclient.h"
+#include "liveness.h"
+
+namespace masterclient {
+
+    template<typename T>
+    static std::vector<unsigned char> encode(PACKET_TYPE type, T &body) {
+        packetHeader header;
+        header.type = type;
+        masterserver::sizer sizer;
+        sizer << header;
+        sizer << body;
+        std::vector<unsigned char> data(sizer.size);
+        masterserver::buffer_serializer s(data.data(), data.size());
+        s << header;
+        s << body;
+        return data;
+    }
+
+    // FNV-1a of the list as the master sent it
+    static uint64_t contentHash(const ENetPacket *packet) {
+        uint64_t hash = 14695981039346656037ull;
+        for (size_t i = 0; i < packet->dataLength; i++) {
+            hash = (hash ^ packet->data[i]) * 1099511628211ull;
+        }
+        return hash;
+    }
+
+    static int ENET_CALLBACK interceptProbes(ENetHost *host, ENetEvent *event) {
+        return client::answerProbe(host) ? 1 : 0;
+    }
+
+    bool client::answerProbe(ENetHost *host) {
+        uint32_t token;
+        if (!parseLiveness(host->receivedData, host->receivedDataLength, LIVENESS_KIND::PROBE, token)) {
+            return false;
+        }
+        // as large as the probe, nothing to amplify
+        unsigned char answer[LIVENESS_DATAGRAM_SIZE];
+        ENetBuffer buffer;
+        buffer.data = answer;
+        buffer.dataLength = encodeLiveness(answer, LIVENESS_KIND::ANSWER, token);
+        enet_socket_send(host->socket, &host->receivedAddress, &buffer, 1);
+        return true;
+    }
+
+    client::client(const std::vector<ENetAddress> &masters, port_t localPort, size_t peers)
+        : masters(masters),
+          ownHost(true),
+          random(std::chrono::steady_clock::now().time_since_epoch().count()) {
+        ENetAddress address;
+        address.host = ENET_HOST_ANY;
+        address.port = localPort;
+        host = enet_host_create(&address, peers, 1, 0, 0);
+        if (host != nullptr) {
+            host->intercept = interceptProbes;
+        }
+    }
+
+    client::client(const std::vector<ENetAddress> &masters, ENetHost *host)
+        : masters(masters),
+          host(host),
+          random(std::chrono::steady_clock::now().time_since_epoch().count()) {
+    }
+
+    client::~client() {
+        for (auto &l : links) {
+            enet_peer_disconnect_now(l.first, 0);
+        }
+        if (ownHost && host != nullptr) {
+            enet_host_flush(host);
+            enet_host_destroy(host);
+        }
+    }
+
+    void client::fetchList(list_callback done) {
+        auto now = std::chrono::steady_clock::now();
+        if (cached.generation != 0 && (subscription != nullptr || now - cached.fetchedAt < listTtl)) {
+            stats.cacheHits++;
+            done(RESULT::OK, cached);
+            return;
+        }
+        listWaiters.push_back(done);
+        if (listWaiters.size() > 1) {
+            stats.joined++;
+            return;
+        }
+        auto req = std::make_shared<request>();
+        req->mode = MODE::RACE;
+        req->type = REQUEST_TYPE::CLIENT_REQUEST_SERVERLIST;
+        req->timeout = attemptTimeout;
+        req->onPacket = [this](const ENetPacket *packet, const link &l) {
+            return onList(packet, l);
+        };
+        req->finish = [this](RESULT result) {
+            std::vector<list_callback> waiters;
+            waiters.swap(listWaiters);
+            for (auto &w : waiters) {
+                w(result, cached);
+            }
+        };
+        start(req);
+    }
+
+    bool client::onList(const ENetPacket *packet, const link &l) {
+        masterserver::deserializer d(packet->data, packet->dataLength);
+        packetHeader header;
+        if (!(d >> header) || header.type != PACKET_TYPE::SERVER_LIST) {
+            return false;
+        }
+        packet_serverlist list;
+        if (!(d >> list)) {
+            return false;
+        }
+        uint64_t hash = contentHash(packet);
+        if (cached.generation == 0 || hash != cachedHash) {
+            cached.generation++;
+            cachedHash = hash;
+        }
+        cached.servers = std::move(list.servers);
+        cached.from = l.master;
+        cached.fetchedAt = std::chrono::steady_clock::now();
+        return true;
+    }
+
+    void client::subscribe(list_callback changed) {
+        subscriber = changed;
+        if (subscription == nullptr && !subscribing && !resubscribe) {
+            startSubscription();
+        }
+    }
+
+    void client::unsubscribe() {
+        subscriber = nullptr;
+        resubscribe = false;
+        if (subscription != nullptr) {
+            links.erase(subscription);
+            enet_peer_disconnect(subscription, 0);
+            subscription = nullptr;
+        }
+    }
+
+    void client::startSubscription() {
+        auto req = std::make_shared<request>();
+        req->mode = MODE::RACE;
+        req->type = REQUEST_TYPE::CLIENT_SUBSCRIBE_SERVERLIST;
+        req->timeout = attemptTimeout;
+        req->keepOpen = true;
+        req->onPacket = [this](const ENetPacket *packet, const link &l) {
+            return onList(packet, l);
+        };
+        subscribing = true;
+        req->finish = [this](RESULT result) {
+            subscribing = false;
+            if (subscriber) {
+                subscriber(result, cached);
+            }
+        };
+        start(req);
+    }
+
+    void client::onDelta(const ENetPacket *packet) {
+        masterserver::deserializer d(packet->data, packet->dataLength);
+        packetHeader header;
+        packet_serverlist_delta delta;
+        if (!(d >> header) || header.type != PACKET_TYPE::SERVER_LIST_DELTA || !(d >> delta)) {
+            return;
+        }
+        auto &servers = cached.servers;
+        for (auto &key : delta.removed) {
+            servers.erase(std::remove_if(servers.begin(), servers.end(), [&key](const packet_serverlist::_serverlist_server &s) {
+                return s.address == key.address && s.port == key.port;
+            }), servers.end());
+        }
+        for (auto &server : delta.upserted) {
+            auto it = std::find_if(servers.begin(), servers.end(), [&server](const packet_serverlist::_serverlist_server &s) {
+                return s.address == server.address && s.port == server.port;
+            });
+            if (it != servers.end()) {
+                *it = std::move(server);
+            } else {
+                servers.push_back(std::move(server));
+            }
+        }
+        // no longer the list as a master sends it, the next fetched one counts as changed
+        cachedHash = 0;
+        cached.generation++;
+        cached.fetchedAt = std::chrono::steady_clock::now();
+        if (subscriber) {
+            subscriber(RESULT::OK, cached);
+        }
+    }
+
+    void client::heartbeat(const packet_update &update, done_callback done) {
+        packet_update body = update;
+        auto req = std::make_shared<request>();
+        req->mode = MODE::ALL;
+        req->type = REQUEST_TYPE::SERVER_UPDATE;
+        req->timeout = attemptTimeout;
+        req->payload = encode(PACKET_TYPE::SERVER_UPDATE, body);
+        req->answerExpected = false;
+        req->finish = done;
+        start(req);
+    }
+
+    void client::heartbeat(const packet_update_partial &update, done_callback done) {
+        packet_update_partial body = update;
+        auto req = std::make_shared<request>();
+        req->mode = MODE::ALL;
+        req->type = REQUEST_TYPE::SERVER_UPDATE;
+        req->timeout = attemptTimeout;
+        req->payload = encode(PACKET_TYPE::SERVER_UPDATE_PARTIAL, body);
+        req->answerExpected = false;
+        req->finish = done;
+        start(req);
+    }
+
+    void client::pollNatPeers(done_callback done) {
+        auto req = std::make_shared<request>();
+        req->mode = MODE::ALL;
+        req->type = REQUEST_TYPE::SERVER_NAT_GET_PEERS;
+        req->timeout = attemptTimeout;
+        // the master answers and disconnects, the link is done with the disconnect
+        req->onPacket = [this](const ENetPacket *packet, const link&) {
+            onServerPacket(packet);
+            return true;
+        };
+        req->finish = done;
+        start(req);
+    }
+
+    void client::requestPunch(address_t address, port_t port, address_t localAddress, port_t localPort, punch_callback done) {
+        packet_nat_punch punch;
+        punch.address = address;
+        punch.port = port;
+        punch.clientLocalNetworkAddress = localAddress;
+        punch.clientLocalNetworkPort = localPort;
+        auto schedule = std::make_shared<packet_punch_schedule>();
+        auto req = std::make_shared<request>();
+        req->mode = MODE::RACE;
+        req->type = REQUEST_TYPE::CLIENT_NAT_CONNECT_TO_SERVER;
+        req->timeout = punchTimeout;
+        req->payload = encode(PACKET_TYPE::CLIENT_NAT_PUNCH, punch);
+        req->onPacket = [schedule](const ENetPacket *packet, const link &l) {
+            masterserver::deserializer d(packet->data, packet->dataLength);
+            packetHeader header;
+            if (!(d >> header)) {
+                return false;
+            }
+            if (header.type == PACKET_TYPE::NAT_PUNCH_SCHEDULE) {
+                return bool(d >> *schedule);
+            }
+            packet_punch_busy busy;
+            if (header.type == PACKET_TYPE::NAT_PUNCH_BUSY && d >> busy) {
+                // the master disconnects right after, the attempt fails once the other masters did too
+                l.req->busyFor = std::max(l.req->busyFor, std::chrono::milliseconds(busy.retryAfterMs));
+            }
+            return false;
+        };
+        req->finish = [schedule, done](RESULT result) {
+            done(result, *schedule);
+        };
+        start(req);
+    }
+
+    void client::onServerPacket(const ENetPacket *packet) {
+        masterserver::deserializer d(packet->data, packet->dataLength);
+        packetHeader header;
+        if (!(d >> header)) {
+            return;
+        }
+        switch (header.type) {
+        case PACKET_TYPE::SERVER_NAT_PEERS: {
+            packet_nat_peers p;
+            if (d >> p && natPeers) {
+                natPeers(p);
+            }
+            break;
+        }
+        case PACKET_TYPE::NAT_PUNCH_SCHEDULE: {
+            packet_punch_schedule s;
+            if (d >> s && punchSchedule) {
+                punchSchedule(s);
+            }
+            break;
+        }
+        default:
+            break;
+        }
+    }
+
+    void client::start(std::shared_ptr<request> req) {
+        stats.requests++;
+        requests.push_back(req);
+        attempt(req, std::chrono::steady_clock::now());
+    }
+
+    void client::attempt(std::shared_ptr<request> req, time_point now) {
+        if (host == nullptr) {
+            complete(req, RESULT::FAILED);
+            return;
+        }
+        req->attempt++;
+        req->busyFor = std::chrono::milliseconds(0);
+        req->attemptDeadline = now + req->timeout;
+        stats.attempts++;
+        for (const ENetAddress &master : masters) {
+            ENetPeer *peer = enet_host_connect(host, &master, 1, static_cast<enet_uint32>(req->type));
+            if (peer == nullptr) {
+                continue;
+            }
+            stats.connections++;
+            link &l = links[peer];
+            l.req = req;
+            l.master = master;
+            l.connected = false;
+            req->peers.push_back(peer);
+        }
+        if (req->peers.empty()) {
+            attemptFailed(req, now);
+        }
+    }
+
+    void client::attemptFailed(std::shared_ptr<request> req, time_point now) {
+        closeLinks(*req);
+        if (req->succeeded) {
+            complete(req, RESULT::OK);
+            return;
+        }
+        if (req->attempt >= attempts) {
+            complete(req, req->busyFor.count() > 0 ? RESULT::BUSY : RESULT::FAILED);
+            return;
+        }
+        std::chrono::milliseconds delay = req->busyFor;
+        if (delay.count() == 0) {
+            // 75 - 125 % of the doubled backoff, clients that failed together do not retry together
+            delay = backoff * (1 << (req->attempt - 1));
+            delay = delay * (75 + random() % 51) / 100;
+        }
+        req->nextAttemptAt = now + delay;
+    }
+
+    void client::complete(std::shared_ptr<request> req, RESULT result) {
+        if (req->done) {
+            return;
+        }
+        req->done = true;
+        if (result == RESULT::OK && req->mode == MODE::RACE) {
+            stats.raceLosers += req->peers.size();
+        }
+        closeLinks(*req);
+        if (result != RESULT::OK) {
+            stats.failed++;
+        }
+        if (req->finish) {
+            req->finish(result);
+        }
+    }
+
+    // the link of peer has nothing more to do for req
+    void client::linkDone(std::shared_ptr<request> req, ENetPeer *peer, time_point now) {
+        req->peers.erase(std::remove(req->peers.begin(), req->peers.end(), peer), req->peers.end());
+        if (req->done || !req->peers.empty()) {
+            return;
+        }
+        if (req->succeeded) {
+            complete(req, RESULT::OK);
+        } else {
+            attemptFailed(req, now);
+        }
+    }
+
+    void client::closeLinks(request &req) {
+        for (ENetPeer *peer : req.peers) {
+            links.erase(peer);
+            enet_peer_disconnect_now(peer, 0);
+        }
+        req.peers.clear();
+    }
+
+    bool client::handle(const ENetEvent &event) {
+        auto now = std::chrono::steady_clock::now();
+        auto it = links.find(event.peer);
+        if (it == links.end()) {
+            // a master calling back to push NAT peers (REQUEST_TYPE::MASTER_PUSH_NAT_PEERS_TO_SERVER)
+            if (event.type != ENET_EVENT_TYPE_CONNECT
+                || event.data != static_cast<enet_uint32>(REQUEST_TYPE::MASTER_PUSH_NAT_PEERS_TO_SERVER)) {
+                return false;
+            }
+            bool fromMaster = std::any_of(masters.begin(), masters.end(), [&event](const ENetAddress &m) {
+                return m.host == event.peer->address.host;
+            });
+            if (!fromMaster) {
+                return false;
+            }
+            link &l = links[event.peer];
+            l.master = event.peer->address;
+            l.connected = true;
+            return true;
+        }
+        std::shared_ptr<request> req = it->second.req;
+        switch (event.type) {
+        case ENET_EVENT_TYPE_CONNECT: {
+            it->second.connected = true;
+            if (req == nullptr) {
+                break;
+            }
+            if (!req->payload.empty()) {
+                ENetPacket *packet = enet_packet_create(req->payload.data(), req->payload.size(), ENET_PACKET_FLAG_RELIABLE);
+                enet_peer_send(event.peer, 0, packet);
+            }
+            if (!req->answerExpected) {
+                // delivered reliably before the disconnect completes
+                req->succeeded = true;
+                it->second.req = nullptr;
+                enet_peer_disconnect_later(event.peer, 0);
+                linkDone(req, event.peer, now);
+            }
+            break;
+        }
+        case ENET_EVENT_TYPE_RECEIVE: {
+            if (event.peer == subscription) {
+                onDelta(event.packet);
+            } else if (req == nullptr) {
+                onServerPacket(event.packet);
+            } else if (!req->done && req->onPacket(event.packet, it->second)) {
+                req->succeeded = true;
+                if (req->mode == MODE::RACE) {
+                    // the links still in the request lost the race
+                    req->peers.erase(std::remove(req->peers.begin(), req->peers.end(), event.peer), req->peers.end());
+                    if (req->keepOpen && subscriber) {
+                        it->second.req = nullptr;
+                        subscription = event.peer;
+                    } else {
+                        links.erase(it);
+                        enet_peer_disconnect_now(event.peer, 0);
+                    }
+                    complete(req, RESULT::OK);
+                }
+            }
+            enet_packet_destroy(event.packet);
+            break;
+        }
+        case ENET_EVENT_TYPE_DISCONNECT: {
+            links.erase(it);
+            if (event.peer == subscription) {
+                // a master over its subscriber limit answers with the list and disconnects, no point in asking right away
+                subscription = nullptr;
+                resubscribe = true;
+                resubscribeAt = now + listTtl * (75 + random() % 51) / 100;
+                break;
+            }
+            if (req != nullptr && !req->done) {
+                linkDone(req, event.peer, now);
+            }
+            break;
+        }
+        case ENET_EVENT_TYPE_NONE:
+            break;
+        }
+        return true;
+    }
+
+    void client::tick() {
+        auto now = std::chrono::steady_clock::now();
+        if (resubscribe && now >= resubscribeAt) {
+            resubscribe = false;
+            if (subscriber) {
+                startSubscription();
+            }
+        }
+        // callbacks may start requests, they are appended and looked at in the next tick
+        std::vector<std::shared_ptr<request>> current = requests;
+        for (auto &req : current) {
+            if (req->done) {
+                continue;
+            }
+            if (!req->peers.empty()) {
+                if (now >= req->attemptDeadline) {
+                    attemptFailed(req, now);
+                }
+            } else if (now >= req->nextAttemptAt) {
+                attempt(req, now);
+            }
+        }
+        requests.erase(std::remove_if(requests.begin(), requests.end(), [](const std::shared_ptr<request> &r) {
+            return r->done;
+        }), requests.end());
+    }
+
+    void client::service(enet_uint32 timeoutMs) {
+        tick();
+        if (host == nullptr) {
+            return;
+        }
+        ENetEvent event;
+        if (enet_host_service(host, &event, timeoutMs) > 0) {
+            do {
+                if (!handle(event) && event.type == ENET_EVENT_TYPE_RECEIVE) {
+                    enet_packet_destroy(event.packet);
+                }
+            } while (enet_host_check_events(host, &event) > 0);
+        }
+        tick();
+    }
+
+    bool client::idle() const {
+        return std::all_of(requests.begin(), requests.end(), [](const std::shared_ptr<request> &r) {
+            return r->done;
+        });
+    }
+}
@@ -0,0 +1,197 @@
+/*
+ * masterclient.h
+ *
+ * Client side of the master protocol for game clients and servers (the masterclient library).
+ *
+ * Nothing blocks: a request is started with a completion callback and progresses in
+ * service() with an own ENet host, or in handle() and tick() when the client shares the
+ * game's host. Every attempt goes to all configured masters at once:
+ *  - server lists and punch requests race, the first valid answer wins and the other
+ *    connections are dropped,
+ *  - heartbeats and NAT peer polls go to every master (each master keeps its own registry)
+ *    and succeed when at least one master took them.
+ * An attempt no master answered is retried after a backoff doubling from `backoff` with
+ * some jitter; a NAT_PUNCH_BUSY answer replaces the backoff by the delay the master asked for.
+ *
+ * Fetched lists are cached for `listTtl` and fetches started meanwhile join the one in
+ * flight. server_list::generation only changes with the content of the list, a browser
+ * can skip redrawing a list it already shows.
+ *
+ * A browser that stays open subscribes instead of polling: the session to the master that
+ * answered first is kept, the list arrives once and then only its changes (subscription.h
+ * on the master side). Meanwhile fetchList() is served from the subscribed list.
+ *
+ * Masters probe registered servers (liveness.h) and delist one that stops answering. A client
+ * with its own host answers the probes by itself, a game server sharing its host calls
+ * answerProbe() from the host's intercept callback.
+ */
+
+#ifndef INCLUDE_MASTERCLIENT_H_
+#define INCLUDE_MASTERCLIENT_H_
+
+#include <map>
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <random>
+#include <functional>
+#include <enet/enet.h>
+#include "protocol.h"
+
+#define MASTERCLIENT_ATTEMPT_TIMEOUT_MS 1500
+#define MASTERCLIENT_PUNCH_TIMEOUT_MS 10000 // the server polls for waiting clients or the master pushes them
+#define MASTERCLIENT_ATTEMPTS 4
+#define MASTERCLIENT_BACKOFF_MS 250
+#define MASTERCLIENT_LIST_TTL_MS 5000
+
+namespace masterclient {
+
+    enum class RESULT {
+        OK,
+        BUSY,  // the master asked to come back later and the attempts ran out
+        FAILED // no master answered
+    };
+
+    struct server_list {
+        uint64_t generation = 0; // 0 = never fetched
+        std::vector<packet_serverlist::_serverlist_server> servers;
+        ENetAddress from { 0, 0 }; // the master that answered first
+        std::chrono::steady_clock::time_point fetchedAt;
+    };
+
+    typedef std::function<void(RESULT, const server_list&)> list_callback;
+    typedef std::function<void(RESULT, const packet_punch_schedule&)> punch_callback;
+    typedef std::function<void(RESULT)> done_callback;
+
+    struct client_stats {
+        unsigned long long requests = 0;
+        unsigned long long attempts = 0;
+        unsigned long long connections = 0;
+        unsigned long long raceLosers = 0; // connections dropped because another master answered first
+        unsigned long long cacheHits = 0;
+        unsigned long long joined = 0;     // fetches that joined the one in flight
+        unsigned long long failed = 0;
+    };
+
+    class client {
+    public:
+        typedef std::chrono::steady_clock::time_point time_point;
+
+        std::vector<ENetAddress> masters;
+        std::chrono::milliseconds attemptTimeout { MASTERCLIENT_ATTEMPT_TIMEOUT_MS };
+        std::chrono::milliseconds punchTimeout { MASTERCLIENT_PUNCH_TIMEOUT_MS };
+        unsigned attempts = MASTERCLIENT_ATTEMPTS;
+        std::chrono::milliseconds backoff { MASTERCLIENT_BACKOFF_MS };
+        std::chrono::milliseconds listTtl { MASTERCLIENT_LIST_TTL_MS }; // 0 = no caching
+        client_stats stats;
+
+        // game server side: NAT peers and punch schedules from polls and from masters pushing them
+        std::function<void(const packet_nat_peers&)> natPeers;
+        std::function<void(const packet_punch_schedule&)> punchSchedule;
+
+        // own host on localPort (0 = any) with room for `peers` connections, enetHost() is null when it could not be created
+        explicit client(const std::vector<ENetAddress> &masters, port_t localPort = 0, size_t peers = 32);
+        // on the game's host, its events go through handle() and tick() has to be called regularly
+        client(const std::vector<ENetAddress> &masters, ENetHost *host);
+        ~client();
+
+        client(const client&) = delete;
+        client& operator=(const client&) = delete;
+
+        // server list, from the cache when it is younger than listTtl (then `done` runs before this returns);
+        // a failed fetch passes the last list fetched
+        void fetchList(list_callback done);
+        // keeps a session to one master: `changed` gets the list when it arrived and after every change; a lost
+        // session is opened again after about listTtl (FAILED is passed when no master answered, the list then
+        // stays as it was)
+        void subscribe(list_callback changed);
+        void unsubscribe();
+        bool subscribed() const {
+            return subscription != nullptr;
+        }
+
+        // registers / refreshes the server with all masters
+        void heartbeat(const packet_update &update, done_callback done);
+        void heartbeat(const packet_update_partial &update, done_callback done);
+        // asks all masters for the clients waiting to punch through to this server, they arrive in natPeers / punchSchedule
+        void pollNatPeers(done_callback done);
+        // client side of a punch through to the server at address:port
+        void requestPunch(address_t address, port_t port, address_t localAddress, port_t localPort, punch_callback done);
+
+        // services the own host for up to timeoutMs
+        void service(enet_uint32 timeoutMs);
+        // returns false when the event is not the client's, a received packet of the client is destroyed
+        bool handle(const ENetEvent &event);
+        // attempt timeouts and retries
+        void tick();
+        // no request in flight
+        bool idle() const;
+
+        ENetHost* enetHost() const {
+            return host;
+        }
+
+        // true when the datagram `host` just received was a master's liveness probe, it was answered
+        // and the intercept callback should return 1
+        static bool answerProbe(ENetHost *host);
+
+    private:
+        enum class MODE {
+            RACE, // first answer wins
+            ALL   // every master, succeeds when one took it
+        };
+
+        struct request;
+        struct link {
+            std::shared_ptr<request> req; // null once the link is done with its request, or for a master push
+            ENetAddress master;
+            bool connected = false;
+        };
+
+        struct request {
+            MODE mode;
+            REQUEST_TYPE type;
+            std::chrono::milliseconds timeout;
+            std::vector<unsigned char> payload; // sent once connected
+            bool answerExpected = true;         // else the link is done once the payload is sent
+            bool keepOpen = false;              // RACE: the winning link stays connected
+            // true when the packet answered the request
+            std::function<bool(const ENetPacket*, const link&)> onPacket;
+            std::function<void(RESULT)> finish;
+            unsigned attempt = 0;
+            time_point nextAttemptAt;
+            time_point attemptDeadline;
+            std::vector<ENetPeer*> peers; // links of the current attempt
+            bool succeeded = false;
+            bool done = false;
+            std::chrono::milliseconds busyFor { 0 }; // longest retry delay asked for in this attempt
+        };
+
+        ENetHost *host = nullptr;
+        bool ownHost = false;
+        std::map<ENetPeer*, link> links;
+        std::vector<std::shared_ptr<request>> requests;
+        std::minstd_rand random;
+        server_list cached;
+        uint64_t cachedHash = 0;
+        std::vector<list_callback> listWaiters;
+        list_callback subscriber;
+        ENetPeer *subscription = nullptr; // the kept link, its packets are deltas
+        bool subscribing = false; // the request for a subscription is under way
+        bool resubscribe = false;
+        time_point resubscribeAt;
+
+        void start(std::shared_ptr<request> req);
+        void attempt(std::shared_ptr<request> req, time_point now);
+        void attemptFailed(std::shared_ptr<request> req, time_point now);
+        void complete(std::shared_ptr<request> req, RESULT result);
+        void linkDone(std::shared_ptr<request> req, ENetPeer *peer, time_point now);
+        void closeLinks(request &req);
+        bool onList(const ENetPacket *packet, const link &l);
+        void startSubscription();
+        void onDelta(const ENetPacket *packet);
+        void onServerPacket(const ENetPacket *packet);
+    };
+}
+
+#endif /* INCLUDE_MASTERCLIENT_H_ */
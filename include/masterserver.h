@@ -2,35 +2,67 @@
 #define DUEL_MASTERSERVER_H
 
 #include <tuple>
+#include <map>
+#include <list>
 #include <deque>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
 #include <chrono>
 #include <functional>
 
 #include <enet/enet.h>
 #include "protocol.h"
 #include "serialize.h"
+#include "profile.h"
 
 extern std::chrono::steady_clock::time_point now;
 
 typedef std::tuple<address_t, port_t> server_address_t;
 typedef std::tuple<address_t, port_t, address_t, port_t> peer_address_t;
-typedef std::map<peer_address_t, std::chrono::steady_clock::time_point> peer_nat_map_t;
 
 enum class PEER_MODE {
     NONE,
     SERVER,
     CLIENT,
-    MASTER_TO_SERVER
+    MASTER_TO_SERVER,
+    SUBSCRIBER // server list subscription, see subscription.h
 };
 
+// ordered by admission priority, see admission.h
+enum class PEER_ROLE {
+    SERVER,
+    BROWSER,
+    NAT_CLIENT,
+    OTHER
+};
+#define PEER_ROLES_COUNT 4
+
 struct peer_entry {
     PEER_MODE mode = PEER_MODE::NONE;
+    PEER_ROLE role = PEER_ROLE::OTHER;
     std::chrono::steady_clock::time_point validUntil;
     std::function<void(ENetPeer *)> connectedCallback;
     peer_entry(PEER_MODE mode, std::chrono::steady_clock::time_point validUntil)
         : mode(mode),
           validUntil(validUntil) {
     }
+    // every connection gets an entry, deleted ones are kept on a free list for the next connections
+    // (at most as many as there were peers at once)
+    inline static void *freeEntries = nullptr;
+    static void* operator new(size_t size) {
+        if (freeEntries == nullptr) {
+            return ::operator new(size);
+        }
+        void *p = freeEntries;
+        freeEntries = *static_cast<void**>(p);
+        return p;
+    }
+    static void operator delete(void *p) {
+        *static_cast<void**>(p) = freeEntries;
+        freeEntries = p;
+    }
     void onConnected(ENetPeer * peer){
         if(connectedCallback){
             connectedCallback(peer);
@@ -38,6 +70,155 @@ struct peer_entry {
     }
 };
 
+// frees the slot right away, ENet does not report DISCONNECT for it so the entry is deleted here (handlers.cpp)
+void releasePeer(ENetPeer *peer);
+
+// server description stored inline, onPacketReceived caps descriptions at 100 bytes
+struct server_description {
+    static constexpr size_t CAPACITY = 100;
+    char data[CAPACITY];
+    uint8_t length = 0;
+    uint64_t hash = 0;
+
+    server_description(const char *s) {
+        assign(s, strlen(s));
+    }
+
+    static uint64_t hashOf(const char *s, size_t len) {
+        uint64_t h = 14695981039346656037ull; // FNV-1a
+        for (size_t i = 0; i < len; i++) {
+            h = (h ^ (unsigned char) s[i]) * 1099511628211ull;
+        }
+        return h;
+    }
+
+    // returns false when the description did not change
+    bool assign(const char *s, size_t len) {
+        len = std::min(len, CAPACITY);
+        uint64_t h = hashOf(s, len);
+        if (h == hash && len == length && memcmp(data, s, len) == 0) {
+            return false;
+        }
+        memcpy(data, s, len);
+        length = len;
+        hash = h;
+        return true;
+    }
+
+    bool assign(const std::string &s) {
+        return assign(s.data(), s.length());
+    }
+
+    std::string str() const {
+        return std::string(data, length);
+    }
+};
+
+#define NAT_WAITERS_CAPACITY 12
+#define NAT_WAITER_TTL_S 50
+
+// clients waiting for their punch until the master reaches the server, stored inline in the entry:
+// a fixed ring in arrival order. A client asking again is found by a linear scan over at most
+// NAT_WAITERS_CAPACITY slots, comparing a one byte hash of its address before the slot itself.
+struct nat_waiters {
+    struct waiter {
+        address_t address;
+        address_t localAddress;
+        port_t port;
+        port_t localPort;
+        uint32_t validUntil; // steady clock seconds, see secondsOf()
+    };
+
+    enum class ADDED {
+        QUEUED,
+        REFRESHED, // already waiting, the local address and the expiry were updated
+        FULL
+    };
+
+    waiter slots[NAT_WAITERS_CAPACITY];
+    uint8_t tags[NAT_WAITERS_CAPACITY]; // hash of the slot's client, compared before the slot itself
+    uint8_t head = 0;
+    uint8_t count = 0;
+    uint32_t nextExpiry = UINT32_MAX; // no slot expires before, purge() has nothing to do until then
+
+    static uint32_t secondsOf(std::chrono::steady_clock::time_point t) {
+        return std::chrono::duration_cast<std::chrono::seconds>(t.time_since_epoch()).count();
+    }
+
+    static uint8_t tagOf(address_t address, port_t port) {
+        uint32_t h = (address ^ port * 0x9e3779b1u) * 0x85ebca6bu;
+        return h >> 24;
+    }
+
+    bool full() const {
+        return count == NAT_WAITERS_CAPACITY;
+    }
+
+    ADDED add(address_t address, port_t port, address_t localAddress, port_t localPort) {
+        uint32_t validUntil = secondsOf(now) + NAT_WAITER_TTL_S;
+        uint8_t tag = tagOf(address, port);
+        for (size_t i = 0; i < count; i++) {
+            size_t slot = (head + i) % NAT_WAITERS_CAPACITY;
+            if (tags[slot] == tag && slots[slot].address == address && slots[slot].port == port) {
+                slots[slot].localAddress = localAddress;
+                slots[slot].localPort = localPort;
+                slots[slot].validUntil = validUntil;
+                return ADDED::REFRESHED;
+            }
+        }
+        if (full()) {
+            return ADDED::FULL;
+        }
+        size_t slot = (head + count) % NAT_WAITERS_CAPACITY;
+        slots[slot] = { address, localAddress, port, localPort, validUntil };
+        tags[slot] = tag;
+        count++;
+        nextExpiry = std::min(nextExpiry, validUntil);
+        return ADDED::QUEUED;
+    }
+
+    // hands out the waiting clients oldest first into result (cleared first) and empties the ring
+    void drain(std::vector<peer_address_t> &result) {
+        result.clear();
+        for (size_t i = 0; i < count; i++) {
+            const waiter &w = slots[(head + i) % NAT_WAITERS_CAPACITY];
+            result.emplace_back(w.address, w.port, w.localAddress, w.localPort);
+        }
+        head = 0;
+        count = 0;
+        nextExpiry = UINT32_MAX;
+    }
+
+    // runs only once a slot expired. Expired slots at the head just leave; a refreshed client can
+    // expire after the ones behind it, then the rest of the ring is compacted
+    void purge() {
+        uint32_t seconds = secondsOf(now);
+        if (nextExpiry >= seconds) {
+            return;
+        }
+        while (count > 0 && slots[head].validUntil < seconds) {
+            head = (head + 1) % NAT_WAITERS_CAPACITY;
+            count--;
+        }
+        size_t kept = 0;
+        nextExpiry = UINT32_MAX;
+        for (size_t i = 0; i < count; i++) {
+            size_t from = (head + i) % NAT_WAITERS_CAPACITY;
+            if (slots[from].validUntil < seconds) {
+                continue;
+            }
+            size_t to = (head + kept) % NAT_WAITERS_CAPACITY;
+            if (to != from) {
+                slots[to] = slots[from];
+                tags[to] = tags[from];
+            }
+            nextExpiry = std::min(nextExpiry, slots[to].validUntil);
+            kept++;
+        }
+        count = kept;
+    }
+};
+
 struct server_list_entry {
     address_t address = 0;
     port_t port = 0;
@@ -46,47 +227,164 @@ struct server_list_entry {
     address_t publicIPAddress = 0;
     port_t publicPort = 0;
     bool needsNAT = false;
-    std::string descr = "some description";
+    server_description descr = "some description";
 
-    peer_nat_map_t natClients;
+    nat_waiters natClients;
+    std::vector<std::pair<packet_relay_offer, std::chrono::steady_clock::time_point>> relayOffers; // sent with the NAT peers
     std::chrono::steady_clock::time_point validUntil;
 
     bool deleted = true;
+    bool described = false; // a full update arrived, partial ones only make sense on top of it
+    enet_uint32 rtt = 0; // smoothed round trip time between the master and the server (ms), 0 = not measured yet
+    std::vector<unsigned char> encoded; // the entry as a _serverlist_server record, empty when it has to be encoded again
 
-    void registerNatClient(address_t a, port_t p, address_t localAddress, port_t localPort) {
-        if(natClients.size() > 10){
-            return;
+    // liveness probes (liveness.h)
+    uint32_t probeToken = 0;   // of the probe in flight, 0 = none
+    uint8_t probeMisses = 0;   // probes in a row without an answer
+    bool answersProbes = false; // only servers that answered one are evicted for missing them
+    std::chrono::steady_clock::time_point lastAlive; // last probe answer or heartbeat
+
+    const std::vector<unsigned char>& wire() {
+        if (encoded.empty()) {
+            packet_serverlist::_serverlist_server server;
+            server.address = address;
+            server.port = port;
+            server.localNetworkAddress = localNetworkAddress;
+            server.localNetworkPort = localNetworkPort;
+            server.publicIPAddress = publicIPAddress;
+            server.publicPort = publicPort;
+            server.needsNAT = needsNAT;
+            server.descr = descr.str();
+            masterserver::sizer sizer;
+            sizer << server;
+            encoded.resize(sizer.size);
+            masterserver::buffer_serializer s(encoded.data(), encoded.size());
+            s << server;
         }
-        auto x = now + std::chrono::seconds(50);
-        auto k = std::make_tuple(a, p, localAddress, localPort);
-        natClients[k] = x;
+        return encoded;
     }
-    std::vector<peer_address_t> scrubNATClients(){
-        std::vector<peer_address_t> result;
-        result.reserve(natClients.size());
-        for(auto & e : natClients){
-            result.push_back(e.first);
-        }
-        natClients.clear();
-        return result;
+
+    // returns false when the smoothed rtt stayed the same
+    bool sampleRtt(enet_uint32 sample) {
+        enet_uint32 previous = rtt;
+        rtt = rtt == 0 ? sample : (7 * rtt + sample) / 8;
+        return rtt != previous;
+    }
+
+    nat_waiters::ADDED registerNatClient(address_t a, port_t p, address_t localAddress, port_t localPort) {
+        return natClients.add(a, p, localAddress, localPort);
+    }
+    void scrubNATClients(std::vector<peer_address_t> &result){
+        natClients.drain(result);
     }
 };
 
+struct update_stats {
+    unsigned long long full = 0;
+    unsigned long long partial = 0;
+    unsigned long long unchanged = 0;  // updates that changed nothing, the encoded entry and the lists were kept
+    unsigned long long beforeFull = 0; // partial updates to an entry that never got a full one
+    unsigned long long bytes = 0;      // of all update packets
+    unsigned long long bytesSaved = 0; // partial updates against full ones leading to the same entry
+};
+
 struct entryMap {
     std::map<server_address_t, server_list_entry> mapa;
+    uint64_t generation = 0; // bumped whenever a server list built from the map would change
+    size_t listLimit = SERVER_LIST_MAX_SERVERS; // servers in one SERVER_LIST, the nearest ones (--list-limit)
+
+    // proximity index for getValidHostsNear(): all entries by rtt, and by network bucket.
+    // Rebuilt lazily when entries come or go, rtt changes are picked up at most once a second;
+    // the generation moves only when the order changed (the rtt shown by servers.json and the
+    // shm list is refreshed with the next generation)
+    std::vector<server_list_entry*> byRtt;
+    std::vector<server_list_entry*> previousByRtt; // the order before the rebuild, kept for its capacity
+    std::map<address_t, std::vector<server_list_entry*>> byBucket;
+    bool membershipChanged = true;
+    bool rttChanged = false;
+    std::chrono::steady_clock::time_point indexBuiltAt;
+
+    // NAT classifications from the flare probes by (public address, local port of the prober),
+    // kept apart from the entries so a server probing before it registers is covered too
+    struct nat_record {
+        NAT_TYPE type;
+        int32_t portDelta;
+        uint16_t observations; // consecutive classifications that agreed on type and delta
+        std::chrono::steady_clock::time_point classifiedAt;
+        std::chrono::steady_clock::time_point predictedAt; // last port window sent for the prober, see predictionFailed()
+    };
+    std::map<server_address_t, nat_record> natTypes;
+    static constexpr size_t MAX_NAT_RECORDS = 4096;
 
-    void update(address_t address, port_t port, const std::string &descr,
+    // coarse network locality of an address: its /16 prefix
+    static address_t bucketOf(address_t a) {
+        hostAddress h;
+        h.address = a;
+        h.a[2] = 0;
+        h.a[3] = 0;
+        return h.address;
+    }
+
+    // returns false when nothing changed
+    bool update(address_t address, port_t port, const std::string &descr,
                 address_t localAddress, port_t localPort,
                 address_t publicIPAddress, port_t publicPort,
                 bool needsNAT) {
-        server_address_t k = std::make_tuple(address, port);
-        server_list_entry &e = mapa[k];
-        e.descr = descr;
-        e.localNetworkAddress = localAddress;
-        e.localNetworkPort = localPort;
-        e.publicIPAddress = publicIPAddress;
-        e.publicPort = publicPort;
-        e.needsNAT = needsNAT;
+        server_list_entry &e = get(address, port);
+        e.described = true;
+        bool changed = e.descr.assign(descr);
+        if (e.localNetworkAddress != localAddress || e.localNetworkPort != localPort
+            || e.publicIPAddress != publicIPAddress || e.publicPort != publicPort || e.needsNAT != needsNAT) {
+            e.localNetworkAddress = localAddress;
+            e.localNetworkPort = localPort;
+            e.publicIPAddress = publicIPAddress;
+            e.publicPort = publicPort;
+            e.needsNAT = needsNAT;
+            changed = true;
+        }
+        if (changed) {
+            modified(e);
+        }
+        return changed;
+    }
+
+    // applies the fields present in the update, the entry (and the lists) are encoded again only when one of them changed
+    bool updatePartial(address_t address, port_t port, const packet_update_partial &u) {
+        server_list_entry &e = get(address, port);
+        bool changed = false;
+        if (u.fields & UPDATE_DESCRIPTION) {
+            changed = e.descr.assign(u.descr) || changed;
+        }
+        if ((u.fields & UPDATE_LOCAL_ADDRESS)
+            && (e.localNetworkAddress != u.localNetworkAddress || e.localNetworkPort != u.localNetworkPort)) {
+            e.localNetworkAddress = u.localNetworkAddress;
+            e.localNetworkPort = u.localNetworkPort;
+            changed = true;
+        }
+        if ((u.fields & UPDATE_PUBLIC_ADDRESS) && (e.publicIPAddress != u.publicIPAddress || e.publicPort != u.publicPort)) {
+            e.publicIPAddress = u.publicIPAddress;
+            e.publicPort = u.publicPort;
+            changed = true;
+        }
+        if ((u.fields & UPDATE_NEEDS_NAT) && e.needsNAT != u.needsNAT) {
+            e.needsNAT = u.needsNAT;
+            changed = true;
+        }
+        if ((u.fields & UPDATE_ALL) == UPDATE_ALL) {
+            e.described = true;
+        }
+        if (changed) {
+            modified(e);
+        }
+        return changed;
+    }
+
+    // the entry has to be encoded again, lists change only when it is listed
+    void modified(server_list_entry &e) {
+        e.encoded.clear();
+        if (!e.deleted) {
+            generation++;
+        }
     }
 
     bool has(address_t address, port_t port) {
@@ -96,54 +394,203 @@ struct entryMap {
 
     server_list_entry& get(address_t address, port_t port) {
         server_address_t k = std::make_tuple(address, port);
-        return mapa[k];
+        size_t size = mapa.size();
+        server_list_entry &e = mapa[k];
+        if (mapa.size() != size) {
+            membershipChanged = true;
+        }
+        return e;
+    }
+
+    bool hasBucket(address_t bucket) {
+        updateIndex();
+        return byBucket.count(bucket) > 0;
+    }
+
+    void sampleRtt(address_t address, port_t port, enet_uint32 sample) {
+        auto it = mapa.find(std::make_tuple(address, port));
+        if (it != mapa.end() && sample > 0 && it->second.sampleRtt(sample)) {
+            rttChanged = true;
+        }
     }
 
     void refresh(address_t address, port_t port) {
         server_list_entry &e = get(address, port);
         e.validUntil = now + std::chrono::seconds(60);
-        e.deleted = false;
-        e.address = address;
-        e.port = port;
+        e.lastAlive = now;
+        e.probeMisses = 0;
+        if (e.deleted || e.address != address || e.port != port) {
+            e.deleted = false;
+            e.address = address;
+            e.port = port;
+            modified(e);
+        }
     }
 
     void refresh(address_t address, port_t port, bool nat) {
         refresh(address, port);
         server_list_entry &e = get(address, port);
-        e.needsNAT = nat;
+        if (e.needsNAT != nat) {
+            e.needsNAT = nat;
+            modified(e);
+        }
+    }
+
+    // the server stopped answering: delisted now, erased by the next purgeOld()
+    void evict(server_list_entry &e) {
+        e.validUntil = now;
+        if (!e.deleted) {
+            e.deleted = true;
+            generation++;
+        }
     }
 
     void purgeOld() {
+        PROFILE_SCOPE("purgeOld");
         for (auto it = mapa.begin(); it != mapa.end();){
-            auto & natClients = it->second.natClients;
-            for(auto natit = natClients.cbegin(); natit != natClients.cend();){
-                if (natit->second < now){
-                    natit = it->second.natClients.erase(natit);
-                } else {
-                    natit++;
-                }
-            }
+            it->second.natClients.purge();
+            auto &offers = it->second.relayOffers;
+            offers.erase(std::remove_if(offers.begin(), offers.end(), [](const auto &o) { return o.second < now; }), offers.end());
             if (it->second.validUntil < now) {
+                if (!it->second.deleted) {
+                    generation++;
+                }
                 it = mapa.erase(it);
+                membershipChanged = true;
             }
             else {
                 ++it;
             }
         }
+        for (auto it = natTypes.begin(); it != natTypes.end();) {
+            if (it->second.classifiedAt + std::chrono::minutes(30) < now) {
+                it = natTypes.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    void classifyNat(address_t address, port_t localPort, NAT_TYPE type, int32_t portDelta) {
+        server_address_t k = std::make_tuple(address, localPort);
+        if (natTypes.size() >= MAX_NAT_RECORDS && natTypes.count(k) == 0) {
+            return;
+        }
+        auto it = natTypes.find(k);
+        uint16_t observations = 1;
+        if (it != natTypes.end() && it->second.type == type && it->second.portDelta == portDelta) {
+            observations = std::min(it->second.observations + 1, UINT16_MAX);
+        }
+        std::chrono::steady_clock::time_point predictedAt = it != natTypes.end() ? it->second.predictedAt
+            : std::chrono::steady_clock::time_point();
+        natTypes[k] = nat_record { type, portDelta, observations, now, predictedAt };
+    }
 
+    void predicted(address_t address, port_t localPort) {
+        auto it = natTypes.find(std::make_tuple(address, localPort));
+        if (it != natTypes.end()) {
+            it->second.predictedAt = now;
+        }
+    }
+
+    // the prober asks for a relay: true, once, when it got a port window within `within`
+    bool predictionFailed(address_t address, port_t localPort, std::chrono::steady_clock::duration within) {
+        auto it = natTypes.find(std::make_tuple(address, localPort));
+        if (it == natTypes.end() || it->second.predictedAt == std::chrono::steady_clock::time_point()
+            || it->second.predictedAt + within < now) {
+            return false;
+        }
+        it->second.predictedAt = std::chrono::steady_clock::time_point();
+        return true;
+    }
+
+    // any prober, servers and clients alike; nullptr when it was not classified
+    const nat_record* natRecord(address_t address, port_t localPort) {
+        auto it = natTypes.find(std::make_tuple(address, localPort));
+        return it != natTypes.end() ? &it->second : nullptr;
+    }
+
+    NAT_TYPE natTypeOf(const server_list_entry &e) {
+        const nat_record *r = natRecord(e.address, e.localNetworkPort);
+        if (r == nullptr) {
+            return NAT_TYPE::UNKNOWN;
+        }
+        if (e.localNetworkAddress == e.address && r->type != NAT_TYPE::SYMMETRIC) {
+            return NAT_TYPE::OPEN;
+        }
+        return r->type;
+    }
+
+    bool isValid(server_list_entry &e) {
+        if (!e.deleted && e.validUntil < now) {
+            e.deleted = true;
+            generation++;
+        }
+        return !e.deleted;
     }
 
     void getValidHosts(std::list<server_list_entry*> &result) {
         for (auto &e : mapa) {
-            if (!e.second.deleted) {
-                if (e.second.validUntil < now) {
-                    e.second.deleted = true;
-                } else {
-                    result.push_back(&e.second);
-                }
+            if (isValid(e.second)) {
+                result.push_back(&e.second);
             }
         }
 
     }
+
+    void updateIndex() {
+        if (!membershipChanged && !(rttChanged && now - indexBuiltAt >= std::chrono::seconds(1))) {
+            return;
+        }
+        byRtt.swap(previousByRtt);
+        byRtt.clear();
+        for (auto &e : mapa) {
+            byRtt.push_back(&e.second);
+        }
+        // servers without a measurement go last, stable sort keeps the map order among equals
+        std::stable_sort(byRtt.begin(), byRtt.end(), [](const server_list_entry *a, const server_list_entry *b) {
+            return (a->rtt == 0 ? UINT32_MAX : a->rtt) < (b->rtt == 0 ? UINT32_MAX : b->rtt);
+        });
+        // the same entries in the same order leave the buckets and the built lists as they are
+        if (membershipChanged || byRtt != previousByRtt) {
+            byBucket.clear();
+            for (server_list_entry *e : byRtt) {
+                byBucket[bucketOf(e->address)].push_back(e);
+            }
+            generation++;
+        }
+        membershipChanged = false;
+        rttChanged = false;
+        indexBuiltAt = now;
+    }
+
+    // valid hosts ordered by estimated proximity to `client`: servers in its bucket first, then the rest, both by rtt;
+    // the nearest `limit` ones
+    void getValidHostsNear(address_t client, std::list<server_list_entry*> &result, size_t limit = SIZE_MAX) {
+        updateIndex();
+        address_t bucket = bucketOf(client);
+        size_t listed = 0;
+        auto near = byBucket.find(bucket);
+        if (near != byBucket.end()) {
+            for (server_list_entry *e : near->second) {
+                if (listed == limit) {
+                    return;
+                }
+                if (isValid(*e)) {
+                    result.push_back(e);
+                    listed++;
+                }
+            }
+        }
+        for (server_list_entry *e : byRtt) {
+            if (listed == limit) {
+                return;
+            }
+            if (bucketOf(e->address) != bucket && isValid(*e)) {
+                result.push_back(e);
+                listed++;
+            }
+        }
+    }
 };
 #endif
@@ -0,0 +1,79 @@
+/*
+ * network.h
+ *
+ * Everything the master handlers do to ENet peers goes through master_network, so that
+ * the same handlers can run on a real ENetHost or inside the simulator (source/simulate.cpp)
+ * on an in-memory network.
+ *
+ * Peers are still ENetPeer records owned by an ENetHost (a real one, or a plain struct
+ * with a peers array in the simulator) - admission control and housekeeping look at
+ * their state directly.
+ */
+
+#ifndef INCLUDE_NETWORK_H_
+#define INCLUDE_NETWORK_H_
+
+#include <vector>
+#include <enet/enet.h>
+
+struct master_network {
+    virtual ~master_network() {
+    }
+
+    // outgoing connection, nullptr when there is no free peer
+    virtual ENetPeer* connect(const ENetAddress &address, enet_uint32 data) = 0;
+    virtual void timeout(ENetPeer *peer, enet_uint32 limit, enet_uint32 minimum, enet_uint32 maximum) = 0;
+    // takes ownership of the packet
+    virtual void send(ENetPeer *peer, ENetPacket *packet) = 0;
+    // the same packet to every peer, takes ownership of it; copies it for each peer unless the network can share it
+    virtual void broadcast(const std::vector<ENetPeer*> &peers, ENetPacket *packet) {
+        for (ENetPeer *peer : peers) {
+            send(peer, enet_packet_create(packet->data, packet->dataLength, packet->flags));
+        }
+        enet_packet_destroy(packet);
+    }
+    virtual void disconnect(ENetPeer *peer, enet_uint32 data) = 0;
+    virtual void disconnectLater(ENetPeer *peer, enet_uint32 data) = 0;
+    // frees the slot right away, no DISCONNECT event follows
+    virtual void disconnectNow(ENetPeer *peer, enet_uint32 data) = 0;
+};
+
+struct enet_network: public master_network {
+    ENetHost *host;
+
+    enet_network(ENetHost *host)
+        : host(host) {
+    }
+
+    ENetPeer* connect(const ENetAddress &address, enet_uint32 data) override {
+        return enet_host_connect(host, &address, 1, data);
+    }
+    void timeout(ENetPeer *peer, enet_uint32 limit, enet_uint32 minimum, enet_uint32 maximum) override {
+        enet_peer_timeout(peer, limit, minimum, maximum);
+    }
+    void send(ENetPeer *peer, ENetPacket *packet) override {
+        if (enet_peer_send(peer, 0, packet) < 0 && packet->referenceCount == 0) {
+            enet_packet_destroy(packet);
+        }
+    }
+    // one packet referenced by the queues of all peers, like enet_host_broadcast()
+    void broadcast(const std::vector<ENetPeer*> &peers, ENetPacket *packet) override {
+        for (ENetPeer *peer : peers) {
+            enet_peer_send(peer, 0, packet);
+        }
+        if (packet->referenceCount == 0) {
+            enet_packet_destroy(packet);
+        }
+    }
+    void disconnect(ENetPeer *peer, enet_uint32 data) override {
+        enet_peer_disconnect(peer, data);
+    }
+    void disconnectLater(ENetPeer *peer, enet_uint32 data) override {
+        enet_peer_disconnect_later(peer, data);
+    }
+    void disconnectNow(ENetPeer *peer, enet_uint32 data) override {
+        enet_peer_disconnect_now(peer, data);
+    }
+};
+
+#endif /* INCLUDE_NETWORK_H_ */
@@ -0,0 +1,72 @@
+#include <cstdio>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "profile.h"
+
+namespace profile {
+
+    std::atomic<bool> recording { false };
+
+    static const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    struct thread_ring {
+        uint32_t thread;
+        std::atomic<uint64_t> written { 0 };
+        std::vector<event> events;
+
+        thread_ring(uint32_t thread)
+            : thread(thread), events(PROFILE_RING_SIZE) {
+        }
+    };
+
+    // rings outlive their threads, a dump still shows what a finished thread did
+    static std::mutex ringsMutex;
+    static std::vector<std::unique_ptr<thread_ring>> rings;
+
+    static thread_ring& ownRing() {
+        thread_local thread_ring *ring = nullptr;
+        if (ring == nullptr) {
+            std::lock_guard<std::mutex> lock(ringsMutex);
+            rings.push_back(std::make_unique<thread_ring>(rings.size() + 1));
+            ring = rings.back().get();
+        }
+        return *ring;
+    }
+
+    uint64_t nowNs() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    void record(const char *name, uint64_t beginNs, uint64_t endNs) {
+        thread_ring &ring = ownRing();
+        uint64_t n = ring.written.load(std::memory_order_relaxed);
+        ring.events[n % PROFILE_RING_SIZE] = { name, beginNs, endNs };
+        ring.written.store(n + 1, std::memory_order_release);
+    }
+
+    // a ring written to during the dump may show a torn event, the master dumps from its own thread
+    size_t writeChromeJson(const std::string &path) {
+        FILE *file = fopen(path.c_str(), "w");
+        if (file == nullptr) {
+            return 0;
+        }
+        size_t count = 0;
+        fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+        std::lock_guard<std::mutex> lock(ringsMutex);
+        for (auto &ring : rings) {
+            uint64_t written = ring->written.load(std::memory_order_acquire);
+            uint64_t first = written > PROFILE_RING_SIZE ? written - PROFILE_RING_SIZE : 0;
+            for (uint64_t i = first; i < written; i++) {
+                const event &e = ring->events[i % PROFILE_RING_SIZE];
+                fprintf(file, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+                    count > 0 ? "," : "", e.name, ring->thread, e.beginNs / 1000.0, (e.endNs - e.beginNs) / 1000.0);
+                count++;
+            }
+        }
+        fprintf(file, "\n]}\n");
+        fclose(file);
+        return count;
+    }
+}
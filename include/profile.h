@@ -0,0 +1,73 @@
+/*
+ * profile.h
+ *
+ * Scope profiler of the master: where the time of a stalled loop went.
+ *
+ * PROFILE_SCOPE("name") marks the rest of the enclosing block. While recording is on
+ * every marked scope leaves a complete event (begin, duration) in a ring buffer of the
+ * thread it ran on; the oldest events are overwritten. writeChromeJson() dumps all rings
+ * in the Chrome trace event format, open it in chrome://tracing or ui.perfetto.dev.
+ *
+ * Compiled in with D6R_PROFILE (the CMake option of the same name, on by default),
+ * without it PROFILE_SCOPE expands to nothing. Compiled in but not recording, a scope
+ * costs one relaxed atomic load (see `loadgen profile`).
+ *
+ * The master starts recording with --profile=file or on the first SIGUSR1, every
+ * further SIGUSR1 writes the file.
+ */
+
+#ifndef INCLUDE_PROFILE_H_
+#define INCLUDE_PROFILE_H_
+
+#include <atomic>
+#include <string>
+#include <cstdint>
+
+#define PROFILE_RING_SIZE 65536 // events per thread
+
+namespace profile {
+
+    struct event {
+        const char *name; // string literal
+        uint64_t beginNs; // since the start of the process
+        uint64_t endNs;
+    };
+
+    extern std::atomic<bool> recording;
+
+    uint64_t nowNs();
+    void record(const char *name, uint64_t beginNs, uint64_t endNs);
+    // events of all threads, oldest first per thread; returns the number of events written
+    size_t writeChromeJson(const std::string &path);
+
+    struct scope {
+        const char *name = nullptr;
+        uint64_t beginNs = 0;
+
+        explicit scope(const char *name) {
+            if (recording.load(std::memory_order_relaxed)) {
+                this->name = name;
+                beginNs = nowNs();
+            }
+        }
+
+        ~scope() {
+            if (name != nullptr) {
+                record(name, beginNs, nowNs());
+            }
+        }
+
+        scope(const scope&) = delete;
+        scope& operator=(const scope&) = delete;
+    };
+}
+
+#ifdef D6R_PROFILE
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+#define PROFILE_SCOPE(name) profile::scope PROFILE_CONCAT(profileScope, __LINE__)(name)
+#else
+#define PROFILE_SCOPE(name)
+#endif
+
+#endif /* INCLUDE_PROFILE_H_ */
@@ -1,4 +1,5 @@
 #include <sstream>
+#include <cstdio>
 #include "protocol.h"
 std::string addressToStr(address_t a){
     std::ostringstream is;
@@ -15,10 +16,11 @@ std::string addressToStr(address_t a){
     return is.str();
 }
 
-std::string hostToIPaddress(address_t a, port_t p){
-    std::ostringstream is;
-    is << addressToStr(a);
-    is << ":";
-    is << p;
-    return is.str();
+address_text hostToIPaddress(address_t a, port_t p){
+    address_text result;
+    hostAddress hostAddress;
+    hostAddress.address = a;
+    snprintf(result.text, sizeof(result.text), "%u.%u.%u.%u:%u", hostAddress.a[0], hostAddress.a[1], hostAddress.a[2],
+        hostAddress.a[3], p);
+    return result;
 }
\ No newline at end of file
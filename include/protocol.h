@@ -12,6 +12,7 @@
 #include <vector>
 #include <sstream>
 #include <enet/enet.h>
+#include "serialize.h"
 
 typedef enet_uint32 address_t;
 typedef enet_uint16 port_t;
@@ -31,6 +32,7 @@ enum class REQUEST_TYPE {
     GAME_CONNECTION, // temporary workaround
 
     MASTER_PUSH_NAT_PEERS_TO_SERVER, // experimental - master server will call back to the server and push any peers requesting connection through the NAT
+    CLIENT_SUBSCRIBE_SERVERLIST, // peer keeps the session open: a SERVER_LIST first, then a SERVER_LIST_DELTA whenever the list changed
     COUNT
 };
 
@@ -41,14 +43,37 @@ enum PACKET_TYPE {
     SERVER_NAT_PEERS,
     CLIENT_NAT_PUNCH,
 
+    NAT_PUNCH_SCHEDULE, // master -> client and server, see punch.h
+
+    CLIENT_RELAY_REQUEST, // the punch timed out, packet_nat_punch names the server (see relay.h)
+    RELAY_OFFER,          // master -> client and server
+
+    NAT_PUNCH_BUSY, // master -> client, the server has too many clients waiting, see packet_punch_busy
+
+    SERVER_UPDATE_PARTIAL, // only the fields of packet_update that changed, see packet_update_partial
+
+    SERVER_LIST_DELTA, // master -> subscribed client, see packet_serverlist_delta
+
     PACKETS_COUNT
 };
 
+// NAT behaviour of a server, classified by the flare probes (see flare.h)
+enum class NAT_TYPE : enet_uint8 {
+    UNKNOWN,
+    OPEN,            // the public address is the local one
+    CONE,            // one mapping for every destination, unsolicited packets get through
+    PORT_RESTRICTED, // one mapping for every destination, only replies get through
+    SYMMETRIC        // a new mapping for every destination
+};
+
 struct packetHeader {
     enet_uint8 type;
+    static constexpr auto fields() {
+        return masterserver::fields(&packetHeader::type);
+    }
     template<typename Stream>
     bool serialize(Stream &s) {
-        return s & type;
+        return masterserver::serializeFields(s, *this);
     }
 };
 
@@ -62,14 +87,47 @@ struct packet_update {
     template<typename Stream>
     bool serialize(Stream &s) {
         return s & descr
-            && s & localNetworkAddress
+            && s & masterserver::raw(localNetworkAddress)
             && s & localNetworkPort
-            && s & publicIPAddress
+            && s & masterserver::raw(publicIPAddress)
             && s & publicPort
             && s & needsNAT;
     }
 };
 
+// fields present in a packet_update_partial
+enum UPDATE_FIELD : uint8_t {
+    UPDATE_DESCRIPTION = 1,
+    UPDATE_LOCAL_ADDRESS = 2,  // localNetworkAddress and localNetworkPort
+    UPDATE_PUBLIC_ADDRESS = 4, // publicIPAddress and publicPort
+    UPDATE_NEEDS_NAT = 8,
+    UPDATE_ALL = 15
+};
+
+// packet_update with a mask of the fields that follow, the master keeps the others as they are;
+// the server sends a full update when it (re)registers
+struct packet_update_partial {
+    uint8_t fields = 0;
+    std::string descr;
+    address_t localNetworkAddress = 0;
+    port_t localNetworkPort = 0;
+    address_t publicIPAddress = 0;
+    port_t publicPort = 0;
+    bool needsNAT = false;
+    template<typename Stream>
+    bool serialize(Stream &s) {
+        return s & fields
+            && (!(fields & UPDATE_DESCRIPTION) || s & descr)
+            && (!(fields & UPDATE_LOCAL_ADDRESS) || (s & masterserver::raw(localNetworkAddress) && s & localNetworkPort))
+            && (!(fields & UPDATE_PUBLIC_ADDRESS) || (s & masterserver::raw(publicIPAddress) && s & publicPort))
+            && (!(fields & UPDATE_NEEDS_NAT) || s & needsNAT);
+    }
+};
+
+// servers in one SERVER_LIST or in either part of one SERVER_LIST_DELTA, clients reject longer lists. The master lists the
+// servers nearest to the client; a subscriber gets the rest as SERVER_LIST_DELTA upserts right after its SERVER_LIST
+#define SERVER_LIST_MAX_SERVERS VECTOR_MAX_SIZE
+
 struct packet_serverlist {
     struct _serverlist_server {
         address_t address = 0;
@@ -83,18 +141,18 @@ struct packet_serverlist {
 
         template<typename Stream>
         bool serialize(Stream &s) {
-            return s & address // @suppress("Suggested parenthesis around expression")
+            return s & masterserver::raw(address) // @suppress("Suggested parenthesis around expression")
                 && s & port
-                && s & localNetworkAddress
+                && s & masterserver::raw(localNetworkAddress)
                 && s & localNetworkPort
-                && s & publicIPAddress
+                && s & masterserver::raw(publicIPAddress)
                 && s & publicPort
                 && s & descr
                 && s & needsNAT;
         }
     };
 
-    size_t serverCount;
+    uint64_t serverCount;
     std::vector<packet_serverlist::_serverlist_server> servers;
 
     template<typename Stream>
@@ -104,18 +162,72 @@ struct packet_serverlist {
     }
 };
 
+// packet_serverlist as the master sends it, the servers are pre-encoded _serverlist_server records
+struct packet_serverlist_encoded {
+    uint64_t serverCount;
+    std::vector<masterserver::encoded_bytes> servers;
+
+    template<typename Stream>
+    bool serialize(Stream &s) {
+        return s & serverCount
+            && s & servers;
+    }
+};
+
+// changes of the server list since the previous delta, or since the SERVER_LIST a subscription started with.
+// Both parts are idempotent - an upserted server replaces the one listed with its address and port (or is added),
+// a removed server that is not listed is ignored - so a delta applies to any list taken after the previous delta
+struct packet_serverlist_delta {
+    struct _server_key {
+        address_t address = 0;
+        port_t port = 0;
+        static constexpr auto fields() {
+            return masterserver::fields(masterserver::rawField(&_server_key::address),
+                &_server_key::port);
+        }
+        template<typename Stream>
+        bool serialize(Stream &s) {
+            return masterserver::serializeFields(s, *this);
+        }
+    };
+
+    std::vector<_server_key> removed;
+    std::vector<packet_serverlist::_serverlist_server> upserted;
+
+    template<typename Stream>
+    bool serialize(Stream &s) {
+        return s & removed
+            && s & upserted;
+    }
+};
+
+// packet_serverlist_delta as the master sends it, the upserted servers are pre-encoded _serverlist_server records
+struct packet_serverlist_delta_encoded {
+    std::vector<packet_serverlist_delta::_server_key> removed;
+    std::vector<masterserver::encoded_bytes> upserted;
+
+    template<typename Stream>
+    bool serialize(Stream &s) {
+        return s & removed
+            && s & upserted;
+    }
+};
+
 struct packet_nat_punch {
     // address of the server - must match some server stored in the list, otherwise this packet will have no effect.
     address_t address = 0;
     port_t port = 0;
     address_t clientLocalNetworkAddress = 0;
     port_t clientLocalNetworkPort = 0;
+    static constexpr auto fields() {
+        return masterserver::fields(masterserver::rawField(&packet_nat_punch::address),
+            &packet_nat_punch::port,
+            masterserver::rawField(&packet_nat_punch::clientLocalNetworkAddress),
+            &packet_nat_punch::clientLocalNetworkPort);
+    }
     template<typename Stream>
     bool serialize(Stream &s) {
-        return s & address
-            && s & port
-            && s & clientLocalNetworkAddress
-            && s & clientLocalNetworkPort;
+        return masterserver::serializeFields(s, *this);
     }
 };
 
@@ -125,12 +237,31 @@ struct packet_nat_peers {
         port_t port = 0;
         address_t localNetworkAddress = 0;
         port_t localNetworkPort = 0;
+        static constexpr auto fields() {
+            return masterserver::fields(masterserver::rawField(&_peer::address),
+                &_peer::port,
+                masterserver::rawField(&_peer::localNetworkAddress),
+                &_peer::localNetworkPort);
+        }
         template<typename Stream>
         bool serialize(Stream &s) {
-            return s & address
-                && s & port
-                && s & localNetworkAddress
-                && s & localNetworkPort;
+            return masterserver::serializeFields(s, *this);
+        }
+    };
+
+    // ports a symmetric NAT of the peer is expected to map its next connection to: count ports from firstPort, step apart
+    struct _port_window {
+        port_t firstPort = 0;
+        uint16_t count = 0; // 0 = no prediction, punch the peer's port only
+        int16_t step = 0;
+        static constexpr auto fields() {
+            return masterserver::fields(&_port_window::firstPort,
+                &_port_window::count,
+                &_port_window::step);
+        }
+        template<typename Stream>
+        bool serialize(Stream &s) {
+            return masterserver::serializeFields(s, *this);
         }
     };
 
@@ -139,19 +270,128 @@ struct packet_nat_peers {
 
     uint16_t peerCount = 0;
     std::vector<_peer> peers;
+    std::vector<_port_window> predictions; // one per peer, trailing - not sent by older masters
     template<typename Stream>
     bool serialize(Stream &s) {
-        return s & yourPublicAddress
+        if constexpr (Stream::isSerializer()) {
+            // clients pair the windows with the peers by index
+            if (predictions.size() != peers.size()) {
+                return false;
+            }
+        }
+        if (!(s & masterserver::raw(yourPublicAddress)
             && s & yourPublicPort
             && s & peerCount
-            && s & peers;
+            && s & peers)) {
+            return false;
+        }
+        if constexpr (Stream::isDeserializer()) {
+            if (s.atEnd()) {
+                predictions.assign(peers.size(), _port_window());
+                return true;
+            }
+        }
+        return (s & predictions) && predictions.size() == peers.size();
     }
 };
 
+// punch the peer at T = receipt + startInMs, with burstCount packets every burstIntervalMs centered on T
+struct packet_punch_schedule {
+    address_t peerAddress = 0;
+    port_t peerPort = 0;
+    address_t peerLocalNetworkAddress = 0;
+    port_t peerLocalNetworkPort = 0;
+    uint32_t startInMs = 0;
+    uint16_t burstCount = 0;
+    uint16_t burstIntervalMs = 0;
+    static constexpr auto fields() {
+        return masterserver::fields(masterserver::rawField(&packet_punch_schedule::peerAddress),
+            &packet_punch_schedule::peerPort,
+            masterserver::rawField(&packet_punch_schedule::peerLocalNetworkAddress),
+            &packet_punch_schedule::peerLocalNetworkPort,
+            &packet_punch_schedule::startInMs,
+            &packet_punch_schedule::burstCount,
+            &packet_punch_schedule::burstIntervalMs);
+    }
+    template<typename Stream>
+    bool serialize(Stream &s) {
+        return masterserver::serializeFields(s, *this);
+    }
+};
+
+// the punch request was not queued, ask again in retryAfterMs
+struct packet_punch_busy {
+    address_t serverAddress = 0;
+    port_t serverPort = 0;
+    uint16_t retryAfterMs = 0;
+    static constexpr auto fields() {
+        return masterserver::fields(masterserver::rawField(&packet_punch_busy::serverAddress),
+            &packet_punch_busy::serverPort,
+            &packet_punch_busy::retryAfterMs);
+    }
+    template<typename Stream>
+    bool serialize(Stream &s) {
+        return masterserver::serializeFields(s, *this);
+    }
+};
+
+// relay session credentials for one end, the relay checks the MAC (relay.h)
+struct packet_relay_offer {
+    address_t relayAddress = 0; // 0 = the master's address
+    port_t relayPort = 0;       // the relay's bind port
+    address_t peerAddress = 0;  // the other end
+    port_t peerPort = 0;
+    uint64_t session = 0;
+    uint32_t expires = 0;
+    uint64_t mac = 0;
+    uint8_t role = 0;           // relay::ROLE of the receiver
+    static constexpr auto fields() {
+        return masterserver::fields(masterserver::rawField(&packet_relay_offer::relayAddress),
+            &packet_relay_offer::relayPort,
+            masterserver::rawField(&packet_relay_offer::peerAddress),
+            &packet_relay_offer::peerPort,
+            &packet_relay_offer::session,
+            &packet_relay_offer::expires,
+            &packet_relay_offer::mac,
+            &packet_relay_offer::role);
+    }
+    template<typename Stream>
+    bool serialize(Stream &s) {
+        return masterserver::serializeFields(s, *this);
+    }
+};
+
+// sizes the parts first, then serializes them straight into the data of a single ENetPacket;
+// NULL when a part cannot be serialized (e.g. a list over its limit) or ENet is out of memory
+template<typename ... Ts>
+ENetPacket* buildPacket(enet_uint32 flags, Ts &... parts) {
+    masterserver::sizer sizer;
+    if (!((sizer << parts) && ...)) {
+        return NULL;
+    }
+    ENetPacket *packet = enet_packet_create(NULL, sizer.size, flags);
+    if (packet == NULL) {
+        return NULL;
+    }
+    masterserver::buffer_serializer s(packet->data, packet->dataLength);
+    if (!((s << parts) && ...) || !s.good() || s.length != packet->dataLength) {
+        enet_packet_destroy(packet);
+        return NULL;
+    }
+    return packet;
+}
+
 union hostAddress {
     address_t address;
     uint8_t a[4];
 };
 std::string addressToStr(address_t a);
-std::string hostToIPaddress(address_t a, port_t p);
+// "a.b.c.d:port" for log lines, formatted into the struct without allocating
+struct address_text {
+    char text[sizeof("255.255.255.255:65535")];
+    const char* c_str() const {
+        return text;
+    }
+};
+address_text hostToIPaddress(address_t a, port_t p);
 #endif /* INCLUDE_PROTOCOL_H_ */
@@ -0,0 +1,132 @@
+/*
+ * punch.h
+ *
+ * Coordinated NAT punch. Instead of letting the client and the server start punching
+ * whenever their own message arrives, the master sends both of them a schedule: punch
+ * at instant T. Both schedules leave the master at the same moment, so each side gets
+ * its delay to T shortened by its own one way latency (half of the round trip time ENet
+ * measured). Bursts of punch packets are centered on T to absorb the estimation error.
+ *
+ * An unsolicited packet that reaches a NAT before its outbound hole exists is dropped,
+ * and some NATs then map the later outbound packet to another port - the punch fails
+ * and has to be retried through the master. With both sides starting at T, neither side's
+ * packets can arrive much earlier than the other side's first packet leaves.
+ *
+ * When the flare probes classified the server's NAT (flare.h) the schedule follows it:
+ * a cone or open server accepts the client's packets at any time, so the client starts
+ * right away; a symmetric server maps its punch packets to a port the client cannot know,
+ * so the server goes first and the client answers once those packets could have arrived.
+ *
+ * A client behind a symmetric NAT gets a new public port for the game server, not the one
+ * the master saw. When its flare probes showed a constant allocation step, the server is
+ * sent a window of predicted ports after the one seen by the master and sprays its punch
+ * bursts over all of them. The window is narrower once repeated probes confirmed the step;
+ * random allocation gets no window.
+ */
+
+#ifndef INCLUDE_PUNCH_H_
+#define INCLUDE_PUNCH_H_
+
+#include <algorithm>
+#include <enet/enet.h>
+#include "protocol.h"
+
+#define PUNCH_MARGIN_MS 30
+#define PUNCH_BURST_COUNT 5
+#define PUNCH_BURST_INTERVAL_MS 20
+#define PUNCH_PREDICTION_WINDOW 8           // predicted ports for a step seen once
+#define PUNCH_PREDICTION_WINDOW_CONFIRMED 4 // for a step confirmed by repeated probes
+#define PUNCH_PREDICTION_RELAY_S 60         // a relay request this soon after a port window: the predicted punch failed
+#define PUNCH_BUSY_RETRY_MIN_MS 250
+#define PUNCH_BUSY_RETRY_MAX_MS 5000
+
+struct punch_stats {
+    unsigned long long scheduled = 0;  // both sides got a schedule
+    unsigned long long serverOnly = 0; // the client was gone when the server was reached
+    unsigned long long totalDelayMs = 0; // sum of the time to T over scheduled punches
+    unsigned long long byStrategy[3] = { }; // indexed by PUNCH_STRATEGY
+    unsigned long long predicted = 0;     // symmetric clients sent with a port window
+    unsigned long long unpredictable = 0; // symmetric clients with random allocation
+    unsigned long long predictedPorts = 0; // extra punch packets the windows cost the servers
+    unsigned long long predictedRelays = 0; // relay requests of clients that got a port window, predicted punches that failed
+    unsigned long long relayOffered = 0;  // punches that timed out and got relay credentials
+    unsigned long long relayRefused = 0;  // no relay configured, unknown server or too many pending offers
+    unsigned long long queued = 0;    // clients added to a server's waiting ring
+    unsigned long long refreshed = 0; // clients that asked again while still waiting
+    unsigned long long busy = 0;      // turned away with NAT_PUNCH_BUSY, the ring was full
+};
+
+enum class PUNCH_STRATEGY {
+    SIMULTANEOUS,
+    CLIENT_FIRST,
+    SERVER_FIRST
+};
+
+inline PUNCH_STRATEGY punchStrategy(NAT_TYPE server) {
+    switch (server) {
+    case NAT_TYPE::OPEN:
+    case NAT_TYPE::CONE:
+        return PUNCH_STRATEGY::CLIENT_FIRST;
+    case NAT_TYPE::SYMMETRIC:
+        return PUNCH_STRATEGY::SERVER_FIRST;
+    default:
+        return PUNCH_STRATEGY::SIMULTANEOUS;
+    }
+}
+
+struct punch_timing {
+    enet_uint32 serverDelay; // ms from the receipt of the schedule to T
+    enet_uint32 clientDelay;
+};
+
+// round trip time to a peer: the heartbeat estimate of the registry when there is one, else ENet's own;
+// the lowest sample is used so a short session is not skewed by ENet's 500 ms initial estimate
+inline enet_uint32 punchRtt(const ENetPeer *peer, enet_uint32 smoothedRtt = 0) {
+    if (smoothedRtt > 0) {
+        return smoothedRtt;
+    }
+    return std::min(peer->roundTripTime, peer->lowestRoundTripTime);
+}
+
+inline punch_timing schedulePunch(enet_uint32 serverRtt, enet_uint32 clientRtt, enet_uint32 variance,
+    PUNCH_STRATEGY strategy = PUNCH_STRATEGY::SIMULTANEOUS) {
+    enet_uint32 serverOneWay = serverRtt / 2;
+    enet_uint32 clientOneWay = clientRtt / 2;
+    enet_uint32 t = std::max(serverOneWay, clientOneWay) + PUNCH_MARGIN_MS + variance;
+    switch (strategy) {
+    case PUNCH_STRATEGY::CLIENT_FIRST:
+        return punch_timing { t - serverOneWay, 0 };
+    case PUNCH_STRATEGY::SERVER_FIRST:
+        // the server's packets need about the sum of both one way latencies to reach the client
+        return punch_timing { t - serverOneWay, t + serverOneWay };
+    default:
+        return punch_timing { t - serverOneWay, t - clientOneWay };
+    }
+}
+
+// a full waiting ring empties once the master's push reaches the server: a connect and a round trip
+inline uint16_t busyRetryAfter(enet_uint32 serverRtt) {
+    enet_uint32 rtt = serverRtt > 0 ? serverRtt : PUNCH_BUSY_RETRY_MIN_MS;
+    return std::max<enet_uint32>(PUNCH_BUSY_RETRY_MIN_MS, std::min<enet_uint32>(4 * rtt, PUNCH_BUSY_RETRY_MAX_MS));
+}
+
+// window for the next mapping of a symmetric NAT whose last mapping is `lastPort`, count 0 = no prediction
+inline packet_nat_peers::_port_window predictPorts(port_t lastPort, int32_t step, unsigned observations) {
+    packet_nat_peers::_port_window w;
+    if (step == 0 || step < INT16_MIN || step > INT16_MAX) {
+        return w;
+    }
+    int32_t count = observations > 1 ? PUNCH_PREDICTION_WINDOW_CONFIRMED : PUNCH_PREDICTION_WINDOW;
+    // stay within the port range
+    int32_t room = step > 0 ? (65535 - lastPort) / step : (lastPort - 1024) / -step;
+    count = std::max(0, std::min(count, room));
+    if (count == 0) {
+        return w;
+    }
+    w.firstPort = lastPort + step;
+    w.count = count;
+    w.step = step;
+    return w;
+}
+
+#endif /* INCLUDE_PUNCH_H_ */
@@ -0,0 +1,170 @@
+/*
+ * ratelimit.h
+ *
+ * Token bucket rate limiting of incoming connection requests, keyed by source
+ * address and by its /24 prefix. Applied from the ENet intercept callback, i.e.
+ * before ENet allocates a peer for the request.
+ */
+
+#ifndef INCLUDE_RATELIMIT_H_
+#define INCLUDE_RATELIMIT_H_
+
+#include <array>
+#include <cstdint>
+#include <enet/enet.h>
+#include "protocol.h"
+
+struct token_budget {
+    float ratePerSecond = 1;
+    float burst = 1;
+};
+
+struct request_budget {
+    token_budget address;
+    token_budget prefix;
+};
+
+struct rate_limiter_stats {
+    unsigned long long allowed = 0;
+    unsigned long long droppedByAddress = 0;
+    unsigned long long droppedByPrefix = 0;
+    unsigned long long evictions = 0; // live bucket replaced because all probed slots were taken (table under pressure)
+};
+
+struct rate_limiter {
+    static constexpr size_t SLOTS = 16384; // power of two
+    static constexpr size_t PROBES = 4;
+    static constexpr size_t BUDGETS = static_cast<size_t>(REQUEST_TYPE::COUNT) + 1; // last one is for invalid request types
+
+    struct slot {
+        uint64_t key = 0; // 0 = empty
+        enet_uint32 lastRefill = 0; // ms
+        float tokens = 0;
+    };
+
+    std::array<slot, SLOTS> slots;
+    std::array<request_budget, BUDGETS> budgets;
+    std::array<rate_limiter_stats, BUDGETS> stats;
+
+    rate_limiter() {
+        for (auto &b : budgets) {
+            b = { { 1, 3 }, { 5, 15 } };
+        }
+        budget(REQUEST_TYPE::SERVER_REGISTER) = { { 1, 5 }, { 10, 50 } };
+        budget(REQUEST_TYPE::SERVER_UPDATE) = { { 1, 5 }, { 10, 50 } };
+        budget(REQUEST_TYPE::CLIENT_REQUEST_SERVERLIST) = { { 2, 10 }, { 20, 100 } };
+        budget(REQUEST_TYPE::SERVER_NAT_GET_PEERS) = { { 2, 10 }, { 20, 100 } };
+        budget(REQUEST_TYPE::CLIENT_NAT_CONNECT_TO_SERVER) = { { 0.5, 4 }, { 5, 20 } };
+    }
+
+    static size_t budgetIndex(enet_uint32 requestData) {
+        return requestData < static_cast<enet_uint32>(REQUEST_TYPE::COUNT) ? requestData : BUDGETS - 1;
+    }
+
+    request_budget& budget(REQUEST_TYPE rt) {
+        return budgets[static_cast<size_t>(rt)];
+    }
+
+    static address_t prefix24(address_t a) {
+        hostAddress h;
+        h.address = a;
+        h.a[3] = 0;
+        return h.address;
+    }
+
+    // returns true when the connection request should be let through to ENet
+    bool allow(address_t address, enet_uint32 requestData, enet_uint32 nowMs) {
+        size_t index = budgetIndex(requestData);
+        const request_budget &b = budgets[index];
+        rate_limiter_stats &s = stats[index];
+        // both buckets are always charged so that a prefix cannot be drained by rotating addresses
+        bool addressOk = take(makeKey(index, false, address), b.address, nowMs, s);
+        bool prefixOk = take(makeKey(index, true, prefix24(address)), b.prefix, nowMs, s);
+        if (!addressOk) {
+            s.droppedByAddress++;
+            return false;
+        }
+        if (!prefixOk) {
+            s.droppedByPrefix++;
+            return false;
+        }
+        s.allowed++;
+        return true;
+    }
+
+    rate_limiter_stats total() const {
+        rate_limiter_stats result;
+        for (auto &s : stats) {
+            result.allowed += s.allowed;
+            result.droppedByAddress += s.droppedByAddress;
+            result.droppedByPrefix += s.droppedByPrefix;
+            result.evictions += s.evictions;
+        }
+        return result;
+    }
+
+private:
+    static uint64_t makeKey(size_t index, bool prefix, address_t address) {
+        return (uint64_t(index + 1) << 33) | (uint64_t(prefix) << 32) | address;
+    }
+
+    const token_budget& budgetOf(uint64_t key) const {
+        const request_budget &b = budgets[(key >> 33) - 1];
+        return (key >> 32) & 1 ? b.prefix : b.address;
+    }
+
+    static size_t hash(uint64_t key) {
+        key ^= key >> 29;
+        key *= 0xbf58476d1ce4e5b9ULL;
+        key ^= key >> 32;
+        return key & (SLOTS - 1);
+    }
+
+    static float refilled(const slot &e, const token_budget &b, enet_uint32 nowMs) {
+        float tokens = e.tokens + (enet_uint32) (nowMs - e.lastRefill) * b.ratePerSecond / 1000.0f;
+        return tokens < b.burst ? tokens : b.burst;
+    }
+
+    bool take(uint64_t key, const token_budget &b, enet_uint32 nowMs, rate_limiter_stats &s) {
+        size_t h = hash(key);
+        slot *victim = nullptr;
+        for (size_t i = 0; i < PROBES; i++) {
+            slot &e = slots[(h + i) & (SLOTS - 1)];
+            if (e.key == key) {
+                e.tokens = refilled(e, b, nowMs);
+                e.lastRefill = nowMs;
+                if (e.tokens < 1) {
+                    return false;
+                }
+                e.tokens -= 1;
+                return true;
+            }
+            // a bucket that refilled completely carries no information and can be reused (this is the decay)
+            bool reusable = e.key == 0 || refilled(e, budgetOf(e.key), nowMs) >= budgetOf(e.key).burst;
+            if (reusable && (victim == nullptr || victim->key != 0)) {
+                victim = &e;
+            }
+        }
+        if (victim == nullptr) {
+            victim = &slots[h];
+            for (size_t i = 1; i < PROBES; i++) {
+                slot &e = slots[(h + i) & (SLOTS - 1)];
+                if ((enet_uint32) (nowMs - e.lastRefill) > (enet_uint32) (nowMs - victim->lastRefill)) {
+                    victim = &e;
+                }
+            }
+            s.evictions++;
+            // under pressure (e.g. flood from rotating addresses) new sources start with an empty bucket
+            victim->key = key;
+            victim->lastRefill = nowMs;
+            victim->tokens = 0;
+            return false;
+        }
+        victim->key = key;
+        victim->lastRefill = nowMs;
+        victim->tokens = b.burst - 1;
+        return true;
+    }
+};
+
+#endif /* INCLUDE_RATELIMIT_H_ */
@@ -0,0 +1,268 @@
+#include <cstring>
+#include <random>
+#include <algorithm>
+#include "relay.h"
+
+namespace relay {
+
+    static inline uint64_t rotl(uint64_t x, int b) {
+        return (x << b) | (x >> (64 - b));
+    }
+
+    static inline void sipRound(uint64_t &v0, uint64_t &v1, uint64_t &v2, uint64_t &v3) {
+        v0 += v1; v1 = rotl(v1, 13); v1 ^= v0; v0 = rotl(v0, 32);
+        v2 += v3; v3 = rotl(v3, 16); v3 ^= v2;
+        v0 += v3; v3 = rotl(v3, 21); v3 ^= v0;
+        v2 += v1; v1 = rotl(v1, 17); v1 ^= v2; v2 = rotl(v2, 32);
+    }
+
+    // SipHash-2-4
+    uint64_t siphash(const secret_t &key, const uint8_t *data, size_t len) {
+        uint64_t k0 = masterserver::loadWire<uint64_t>(key.data());
+        uint64_t k1 = masterserver::loadWire<uint64_t>(key.data() + 8);
+        uint64_t v0 = 0x736f6d6570736575ull ^ k0;
+        uint64_t v1 = 0x646f72616e646f6dull ^ k1;
+        uint64_t v2 = 0x6c7967656e657261ull ^ k0;
+        uint64_t v3 = 0x7465646279746573ull ^ k1;
+        size_t blocks = len / 8;
+        for (size_t i = 0; i < blocks; i++) {
+            uint64_t m = masterserver::loadWire<uint64_t>(data + 8 * i);
+            v3 ^= m;
+            sipRound(v0, v1, v2, v3);
+            sipRound(v0, v1, v2, v3);
+            v0 ^= m;
+        }
+        uint64_t last = (uint64_t) len << 56;
+        for (size_t i = 0; i < len % 8; i++) {
+            last |= (uint64_t) data[8 * blocks + i] << (8 * i);
+        }
+        v3 ^= last;
+        sipRound(v0, v1, v2, v3);
+        sipRound(v0, v1, v2, v3);
+        v0 ^= last;
+        v2 ^= 0xff;
+        for (int i = 0; i < 4; i++) {
+            sipRound(v0, v1, v2, v3);
+        }
+        return v0 ^ v1 ^ v2 ^ v3;
+    }
+
+    secret_t secretFromString(const std::string &secret) {
+        secret_t zero { };
+        secret_t key;
+        uint64_t a = siphash(zero, (const uint8_t*) secret.data(), secret.size());
+        zero[0] = 1;
+        uint64_t b = siphash(zero, (const uint8_t*) secret.data(), secret.size());
+        masterserver::storeWire(key.data(), a);
+        masterserver::storeWire(key.data() + 8, b);
+        return key;
+    }
+
+    uint64_t macOf(const secret_t &key, uint64_t session, uint32_t expires, ROLE role, address_t host) {
+        uint8_t data[17];
+        masterserver::storeWire(data, session);
+        masterserver::storeWire(data + 8, expires);
+        data[12] = role;
+        // network order as on the wire
+        memcpy(data + 13, &host, sizeof(host));
+        return siphash(key, data, sizeof(data));
+    }
+
+    uint32_t unixTime() {
+        return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    issuer::issuer()
+        : nextSession(std::random_device()() | (uint64_t) std::random_device()() << 32) {
+    }
+
+    std::array<credentials, 2> issuer::issue(address_t serverHost, address_t clientHost) {
+        std::array<credentials, 2> ends;
+        // unpredictable is not needed, the MAC is what cannot be forged
+        ends[SERVER].session = nextSession++;
+        ends[SERVER].expires = unixTime() + RELAY_CREDENTIALS_TTL_S;
+        ends[CLIENT] = ends[SERVER];
+        ends[SERVER].mac = macOf(secret, ends[SERVER].session, ends[SERVER].expires, SERVER, serverHost);
+        ends[CLIENT].mac = macOf(secret, ends[CLIENT].session, ends[CLIENT].expires, CLIENT, clientHost);
+        return ends;
+    }
+
+    relay_service::~relay_service() {
+        transports.clear();
+        bindTransport.reset();
+        for (ENetSocket socket : sockets) {
+            enet_socket_destroy(socket);
+        }
+        if (bindSocket != ENET_SOCKET_NULL) {
+            enet_socket_destroy(bindSocket);
+        }
+    }
+
+    bool relay_service::open(address_t host, port_t bindPort, port_t firstPort, size_t pairs, const secret_t &secret,
+        masterserver::TRANSPORT_BACKEND backend) {
+        this->secret = secret;
+        this->firstPort = firstPort;
+        bindSocket = masterserver::openDatagramSocket(host, bindPort);
+        if (bindSocket == ENET_SOCKET_NULL) {
+            return false;
+        }
+        bindTransport = masterserver::createTransport(backend, bindSocket);
+        for (size_t i = 0; i < 2 * pairs; i++) {
+            ENetSocket socket = masterserver::openDatagramSocket(host, firstPort + i);
+            if (socket == ENET_SOCKET_NULL) {
+                return false;
+            }
+            sockets.push_back(socket);
+            transports.push_back(masterserver::createTransport(backend, socket));
+        }
+        sessions.resize(pairs);
+        return true;
+    }
+
+    void relay_service::activeSockets(std::vector<ENetSocket> &result) const {
+        result.push_back(bindSocket);
+        for (size_t i = 0; i < sessions.size(); i++) {
+            if (sessions[i].active) {
+                result.push_back(sockets[2 * i]);
+                result.push_back(sockets[2 * i + 1]);
+            }
+        }
+    }
+
+    void relay_service::close(session &s) {
+        byId.erase(s.id);
+        s = session();
+        stats.closed++;
+    }
+
+    void relay_service::handleBinds(time_point now) {
+        while (bindTransport->receive(batch) > 0) {
+            size_t received = batch.count;
+            size_t responses = 0;
+            uint32_t unixNow = unixTime();
+            for (size_t i = 0; i < received; i++) {
+                masterserver::datagram &d = batch[i];
+                masterserver::deserializer in(d.data, d.length);
+                bind_request request;
+                if (!(in >> request) || request.magic != RELAY_BIND_MAGIC || request.role > CLIENT) {
+                    continue;
+                }
+                bind_response response;
+                response.status = BOUND;
+                // credentials of the other end, or from another host than the master saw the end at
+                if (request.creds.mac != macOf(secret, request.creds.session, request.creds.expires, (ROLE) request.role,
+                    d.address.host)) {
+                    response.status = BAD_CREDENTIALS;
+                } else {
+                    auto it = byId.find(request.creds.session);
+                    if (it == byId.end() && request.creds.expires < unixNow) {
+                        response.status = EXPIRED;
+                    } else if (it == byId.end()) {
+                        auto free = std::find_if(sessions.begin(), sessions.end(), [](const session &s) { return !s.active; });
+                        if (free == sessions.end()) {
+                            response.status = NO_FREE_PAIR;
+                        } else {
+                            free->active = true;
+                            free->id = request.creds.session;
+                            free->tokens = burst;
+                            free->lastRefill = now;
+                            free->lastActivity = now;
+                            it = byId.emplace(free->id, free - sessions.begin()).first;
+                            stats.sessions++;
+                        }
+                    }
+                    if (response.status == BOUND) {
+                        session &s = sessions[it->second];
+                        end &e = s.ends[request.role];
+                        // a repeated bind (lost answer) is answered again, the end can move before its first datagram
+                        if (!e.known) {
+                            e.boundHost = d.address.host;
+                            e.bound = true;
+                        }
+                        response.port = firstPort + 2 * it->second + request.role;
+                    }
+                }
+                if (response.status == BOUND) {
+                    stats.binds++;
+                } else {
+                    stats.rejectedBinds++;
+                }
+                masterserver::buffer_serializer out(d.data, sizeof(d.data));
+                out << response;
+                d.length = out.getDataLen();
+                if (responses != i) {
+                    batch[responses] = d;
+                }
+                responses++;
+            }
+            batch.count = responses;
+            bindTransport->send(batch);
+            if (received < DATAGRAM_BATCH_SIZE) {
+                break;
+            }
+        }
+    }
+
+    void relay_service::forward(session &s, size_t from, time_point now) {
+        size_t index = &s - sessions.data();
+        masterserver::udp_transport &in = *transports[2 * index + from];
+        masterserver::udp_transport &out = *transports[2 * index + 1 - from];
+        end &source = s.ends[from];
+        end &target = s.ends[1 - from];
+        while (in.receive(batch) > 0) {
+            size_t received = batch.count;
+            if (rate > 0) {
+                s.tokens = std::min(burst, s.tokens + rate * std::chrono::duration<float>(now - s.lastRefill).count());
+                s.lastRefill = now;
+            }
+            size_t forwarded = 0;
+            for (size_t i = 0; i < received; i++) {
+                masterserver::datagram &d = batch[i];
+                if (!source.known && source.bound && d.address.host == source.boundHost) {
+                    source.address = d.address;
+                    source.known = true;
+                }
+                if (!source.known || d.address.host != source.address.host || d.address.port != source.address.port
+                    || !target.known) {
+                    stats.droppedUnknown++;
+                    continue;
+                }
+                if (rate > 0) {
+                    if (s.tokens < d.length) {
+                        stats.droppedOverRate++;
+                        continue;
+                    }
+                    s.tokens -= d.length;
+                }
+                d.address = target.address;
+                stats.forwardedBytes += d.length;
+                if (forwarded != i) {
+                    batch[forwarded] = d;
+                }
+                forwarded++;
+            }
+            if (forwarded > 0) {
+                s.lastActivity = now;
+            }
+            batch.count = forwarded;
+            stats.forwardedPackets += out.send(batch);
+            if (received < DATAGRAM_BATCH_SIZE) {
+                break;
+            }
+        }
+    }
+
+    void relay_service::service(time_point now) {
+        handleBinds(now);
+        for (session &s : sessions) {
+            if (!s.active) {
+                continue;
+            }
+            forward(s, SERVER, now);
+            forward(s, CLIENT, now);
+            if (now - s.lastActivity > idleTimeout) {
+                close(s);
+            }
+        }
+    }
+}
@@ -0,0 +1,185 @@
+/*
+ * relay.h
+ *
+ * Relay fallback for pairs that cannot be hole punched.
+ *
+ * When a client's punch times out it asks the master for a relay (CLIENT_RELAY_REQUEST), the
+ * master sends both ends a RELAY_OFFER with credentials for the same session: the session id,
+ * an expiry and a MAC keyed with the secret shared by the master and the relay. Each end's MAC
+ * also covers its role and the public host the master saw it at, so credentials that leak to
+ * another host bind nothing. The relay does not need to hear from the master - each end sends
+ * its credentials to the relay's bind port, the relay checks the MAC against the role and the
+ * host the request came from (not the port, a NAT may map the flow to the relay to another
+ * one), allocates a forwarding port pair for the session on the first bind and answers each
+ * end with its port of the pair. Datagrams an end sends to its port leave through the other
+ * port to the other end.
+ *
+ * Forwarding works in place in a datagram_batch (no per-packet allocation), one batch per
+ * recvmmsg/sendmmsg. Sessions are capped by a token bucket (bytes/s) and closed when idle.
+ * The relay runs inside the master (--relay) or as duel6r-relay (source/relay.cpp).
+ */
+
+#ifndef INCLUDE_RELAY_H_
+#define INCLUDE_RELAY_H_
+
+#include <array>
+#include <map>
+#include <vector>
+#include <memory>
+#include <string>
+#include <chrono>
+#include <cstdint>
+#include <enet/enet.h>
+#include "protocol.h"
+#include "transport.h"
+
+#define RELAY_BIND_MAGIC 0x42523644       // "D6RB"
+#define RELAY_BOUND_MAGIC 0x41523644      // "D6RA"
+#define RELAY_CREDENTIALS_TTL_S 120       // an offer has to be bound within this time
+#define RELAY_IDLE_TIMEOUT_MS 30000
+#define RELAY_DEFAULT_RATE (256 * 1024)   // bytes per second and session, both directions together
+#define RELAY_DEFAULT_BURST (64 * 1024)
+
+namespace relay {
+
+    typedef std::array<uint8_t, 16> secret_t;
+
+    enum ROLE : uint8_t {
+        SERVER,
+        CLIENT
+    };
+
+    enum BIND_STATUS : uint8_t {
+        BOUND,
+        BAD_CREDENTIALS,
+        EXPIRED,
+        NO_FREE_PAIR
+    };
+
+    struct credentials {
+        uint64_t session = 0;
+        uint32_t expires = 0; // unix time (s), the master and the relay need roughly synchronized clocks
+        uint64_t mac = 0;
+        static constexpr auto fields() {
+            return masterserver::fields(&credentials::session,
+                &credentials::expires,
+                &credentials::mac);
+        }
+        template<typename Stream>
+        bool serialize(Stream &s) {
+            return masterserver::serializeFields(s, *this);
+        }
+    };
+
+    // datagram to the bind port
+    struct bind_request {
+        uint32_t magic = RELAY_BIND_MAGIC;
+        credentials creds;
+        uint8_t role = SERVER;
+        template<typename Stream>
+        bool serialize(Stream &s) {
+            return s & magic
+                && s & creds
+                && s & role;
+        }
+    };
+
+    // answer from the bind port
+    struct bind_response {
+        uint32_t magic = RELAY_BOUND_MAGIC;
+        uint8_t status = BOUND;
+        port_t port = 0; // the end's port of the pair
+        static constexpr auto fields() {
+            return masterserver::fields(&bind_response::magic,
+                &bind_response::status,
+                &bind_response::port);
+        }
+        template<typename Stream>
+        bool serialize(Stream &s) {
+            return masterserver::serializeFields(s, *this);
+        }
+    };
+
+    secret_t secretFromString(const std::string &secret);
+    uint64_t siphash(const secret_t &key, const uint8_t *data, size_t len);
+    uint64_t macOf(const secret_t &key, uint64_t session, uint32_t expires, ROLE role, address_t host);
+    uint32_t unixTime();
+
+    // the master's side: mints credentials for a relay
+    struct issuer {
+        address_t address = 0; // 0 = the master's own address
+        port_t port = 0;        // bind port, 0 = no relay configured
+        secret_t secret { };
+        uint64_t nextSession;
+
+        issuer();
+
+        bool enabled() const {
+            return port != 0;
+        }
+
+        // both ends of a new session, indexed by ROLE
+        std::array<credentials, 2> issue(address_t serverHost, address_t clientHost);
+    };
+
+    struct relay_stats {
+        unsigned long long binds = 0;
+        unsigned long long rejectedBinds = 0;
+        unsigned long long sessions = 0;
+        unsigned long long closed = 0;
+        unsigned long long forwardedPackets = 0;
+        unsigned long long forwardedBytes = 0;
+        unsigned long long droppedOverRate = 0;
+        unsigned long long droppedUnknown = 0; // from an address that did not bind, or before the other end bound
+    };
+
+    struct relay_service {
+        typedef std::chrono::steady_clock::time_point time_point;
+
+        struct end {
+            address_t boundHost = 0; // host the credentials came from, the first datagram from it fixes the address
+            ENetAddress address { 0, 0 };
+            bool bound = false;
+            bool known = false;
+        };
+
+        struct session {
+            uint64_t id = 0;
+            bool active = false;
+            end ends[2];
+            float tokens = 0;
+            time_point lastRefill;
+            time_point lastActivity;
+        };
+
+        ENetSocket bindSocket = ENET_SOCKET_NULL;
+        std::unique_ptr<masterserver::udp_transport> bindTransport;
+        std::vector<ENetSocket> sockets; // two per session, SERVER end first
+        std::vector<std::unique_ptr<masterserver::udp_transport>> transports;
+        std::vector<session> sessions;
+        std::map<uint64_t, size_t> byId;
+        masterserver::datagram_batch batch;
+        secret_t secret { };
+        port_t firstPort = 0;
+        float rate = RELAY_DEFAULT_RATE; // 0 = unlimited
+        float burst = RELAY_DEFAULT_BURST;
+        std::chrono::milliseconds idleTimeout { RELAY_IDLE_TIMEOUT_MS };
+        relay_stats stats;
+
+        ~relay_service();
+
+        // pairs are firstPort + 2i (server end) and firstPort + 2i + 1 (client end)
+        bool open(address_t host, port_t bindPort, port_t firstPort, size_t pairs, const secret_t &secret,
+            masterserver::TRANSPORT_BACKEND backend);
+        void service(time_point now);
+        // the bind socket and the sockets of active sessions, for the event loop's select
+        void activeSockets(std::vector<ENetSocket> &result) const;
+
+    private:
+        void handleBinds(time_point now);
+        void forward(session &s, size_t from, time_point now);
+        void close(session &s);
+    };
+}
+
+#endif /* INCLUDE_RELAY_H_ */
@@ -10,21 +10,215 @@
 
 #include <vector>
 #include <sstream>
+#include <tuple>
+#include <cstring>
 #include <type_traits>
+#include "endian.h"
 
 namespace masterserver {
 
 #define SIZEBYTES_LIMIT 4
 #define UINT24_MAX ((1 << 24) - 1)
+#define FIXED_ARRAY_CHUNK 64
+// longest vector on the wire, readers reject longer ones and writers refuse them: lists that can grow
+// past it are sent truncated or split over several packets (see SERVER_LIST_MAX_SERVERS)
+#define VECTOR_MAX_SIZE 1000
+
+    template<typename Stream>
+    void writeSize(Stream &s, uint32_t size);
+    template<typename Stream>
+    uint32_t readSize(Stream &s);
+
+    /*
+     * Fixed layout packets (only integral fields) declare their fields as a constexpr list of member pointers:
+     *
+     *     static constexpr auto fields() {
+     *         return masterserver::fields(&packet::a, &packet::b);
+     *     }
+     *
+     * and serialize them with serializeFields(). The wire size is known at compile time, so the whole
+     * packet is packed into one block and written (or read) at once. Vectors of such packets are copied
+     * in bulk. The wire format is the same as serializing the fields one by one.
+     *
+     * Integers are little-endian on the wire (endian.h). Fields that already have a defined byte order
+     * (address_t is in network order) are wrapped in rawField() here and in raw() in serialize().
+     */
+    template<typename ... Ps>
+    constexpr std::tuple<Ps...> fields(Ps ... ps) {
+        return std::tuple<Ps...>(ps...);
+    }
+
+    // member copied as raw bytes, see rawField()
+    template<typename P>
+    struct raw_member {
+        P member;
+    };
+
+    template<typename P>
+    constexpr raw_member<P> rawField(P member) {
+        return raw_member<P> { member };
+    }
+
+    template<typename P>
+    struct member_type;
+
+    template<typename C, typename M>
+    struct member_type<M C::*> {
+        typedef M type;
+    };
+
+    template<typename P>
+    struct member_type<raw_member<P>> : member_type<P> {
+    };
+
+    template<typename T, typename P>
+    constexpr auto& memberOf(T &t, P p) {
+        return t.*p;
+    }
+
+    template<typename T, typename P>
+    constexpr auto& memberOf(T &t, raw_member<P> p) {
+        return t.*(p.member);
+    }
+
+    template<typename P>
+    struct is_raw_member: std::false_type {
+    };
+
+    template<typename P>
+    struct is_raw_member<raw_member<P>> : std::true_type {
+    };
+
+    template<typename T, typename = void>
+    struct is_fixed_layout: std::false_type {
+    };
+
+    template<typename T>
+    struct is_fixed_layout<T, std::void_t<decltype(T::fields())>> : std::true_type {
+    };
+
+    template<typename ... Ps>
+    constexpr size_t fieldsWireSize(const std::tuple<Ps...>&) {
+        static_assert((std::is_integral<typename member_type<Ps>::type>::value && ...), "fixed layout fields must be integral");
+        return (sizeof(typename member_type<Ps>::type) + ... + 0);
+    }
+
+    template<typename T>
+    constexpr size_t fixedWireSize() {
+        return fieldsWireSize(T::fields());
+    }
+
+    template<typename T, size_t I = 0>
+    void packFields(const T &t, unsigned char *dst) {
+        constexpr auto f = T::fields();
+        if constexpr (I < std::tuple_size<decltype(f)>::value) {
+            const auto &m = memberOf(t, std::get<I>(f));
+            if constexpr (is_raw_member<typename std::tuple_element<I, decltype(f)>::type>::value) {
+                memcpy(dst, &m, sizeof(m));
+            } else {
+                storeWire(dst, m);
+            }
+            packFields<T, I + 1>(t, dst + sizeof(m));
+        }
+    }
+
+    template<typename T, size_t I = 0>
+    void unpackFields(T &t, const unsigned char *src) {
+        constexpr auto f = T::fields();
+        if constexpr (I < std::tuple_size<decltype(f)>::value) {
+            auto &m = memberOf(t, std::get<I>(f));
+            if constexpr (is_raw_member<typename std::tuple_element<I, decltype(f)>::type>::value) {
+                memcpy(&m, src, sizeof(m));
+            } else {
+                m = loadWire<typename std::remove_reference<decltype(m)>::type>(src);
+            }
+            unpackFields<T, I + 1>(t, src + sizeof(m));
+        }
+    }
+
+    template<typename Stream, typename T>
+    bool serializeFields(Stream &s, T &t) {
+        unsigned char block[fixedWireSize<T>()];
+        if constexpr (Stream::isSizer()) {
+            return s.write(nullptr, sizeof(block));
+        } else if constexpr (Stream::isDeserializer()) {
+            if (!s.read(block, sizeof(block))) {
+                return false;
+            }
+            unpackFields(t, block);
+            return true;
+        } else {
+            packFields(t, block);
+            return s.write(block, sizeof(block));
+        }
+    }
+
+    template<typename Stream, typename T>
+    bool writeFixedArray(Stream &s, const T *items, size_t count) {
+        constexpr size_t itemSize = fixedWireSize<T>();
+        if constexpr (Stream::isSizer()) {
+            return s.write(nullptr, count * itemSize);
+        }
+        unsigned char block[itemSize * FIXED_ARRAY_CHUNK];
+        for (size_t i = 0; i < count; i += FIXED_ARRAY_CHUNK) {
+            size_t chunk = count - i < FIXED_ARRAY_CHUNK ? count - i : FIXED_ARRAY_CHUNK;
+            for (size_t j = 0; j < chunk; j++) {
+                packFields(items[i + j], block + j * itemSize);
+            }
+            s.write(block, chunk * itemSize);
+        }
+        return s.good();
+    }
+
+    template<typename Stream, typename T>
+    bool readFixedArray(Stream &s, T *items, size_t count) {
+        constexpr size_t itemSize = fixedWireSize<T>();
+        unsigned char block[itemSize * FIXED_ARRAY_CHUNK];
+        for (size_t i = 0; i < count; i += FIXED_ARRAY_CHUNK) {
+            size_t chunk = count - i < FIXED_ARRAY_CHUNK ? count - i : FIXED_ARRAY_CHUNK;
+            if (!s.read(block, chunk * itemSize)) {
+                return false;
+            }
+            for (size_t j = 0; j < chunk; j++) {
+                unpackFields(items[i + j], block + j * itemSize);
+            }
+        }
+        return true;
+    }
 
     template<typename Stream, typename T, typename std::enable_if<std::is_integral<T>::value, int>::type = 0>
     bool operator <<(Stream &s, T t) {
+        t = toWire(t);
         return s.write((unsigned char*) &t, sizeof(T));
     }
 
     template<typename Stream, typename T, typename std::enable_if<std::is_integral<T>::value, int>::type = 0>
     bool operator >>(Stream &s, T &t) {
-        return s.read((unsigned char*) &t, sizeof(T));
+        if (!s.read((unsigned char*) &t, sizeof(T))) {
+            return false;
+        }
+        t = fromWire(t);
+        return true;
+    }
+
+    // value copied as raw bytes: `s & masterserver::raw(address)`
+    template<typename T>
+    struct raw_value {
+        T &value;
+
+        template<typename Stream>
+        bool serialize(Stream &s) const {
+            if constexpr (Stream::isDeserializer()) {
+                return s.read((unsigned char*) &value, sizeof(T));
+            } else {
+                return s.write((const unsigned char*) &value, sizeof(T));
+            }
+        }
+    };
+
+    template<typename T>
+    raw_value<T> raw(T &value) {
+        return raw_value<T> { value };
     }
     template<typename Stream, typename T, typename std::enable_if<std::is_class<T>::value, int>::type = 0>
     bool operator <<(Stream &stream, T &t) {
@@ -35,6 +229,17 @@ namespace masterserver {
         return t.serialize(stream);
     }
 
+    // bytes that were encoded earlier, written verbatim (write only)
+    struct encoded_bytes {
+        const unsigned char *data = nullptr;
+        size_t length = 0;
+
+        template<typename Stream>
+        bool serialize(Stream &s) {
+            return s.write(data, length);
+        }
+    };
+
     template<typename Stream>
     bool operator <<(Stream &s, std::string &t) {
         uint32_t size = t.length();
@@ -58,20 +263,36 @@ namespace masterserver {
 
     template<typename Stream, typename ... Ts>
     bool operator <<(Stream &s, std::vector<Ts...> &t) {
+        if (t.size() > VECTOR_MAX_SIZE) {
+            return false;
+        }
         uint32_t size = t.size();
         writeSize(s, size);
+        if constexpr (is_fixed_layout<typename std::vector<Ts...>::value_type>::value) {
+            return writeFixedArray(s, t.data(), size);
+        }
         for (auto &e : t) {
-            s << e;
+            if (!(s << e)) {
+                return false;
+            }
         }
         return s.good();
     }
 
     template<typename Stream, typename ... Ts>
     bool operator <<(Stream &s, const std::vector<Ts...> &t) {
+        if (t.size() > VECTOR_MAX_SIZE) {
+            return false;
+        }
         uint32_t size = t.size();
         writeSize(s, size);
+        if constexpr (is_fixed_layout<typename std::vector<Ts...>::value_type>::value) {
+            return writeFixedArray(s, t.data(), size);
+        }
         for (auto &e : t) {
-            s << e;
+            if (!(s << e)) {
+                return false;
+            }
         }
         return s.good();
     }
@@ -79,10 +300,14 @@ namespace masterserver {
     template<typename Stream, typename T>
     bool operator >>(Stream &s, std::vector<T> &t) {
         uint32_t size = readSize(s);
-        if(size > 1000){
+        if (size > VECTOR_MAX_SIZE) {
             return false;
         }
         t.clear();
+        if constexpr (is_fixed_layout<T>::value) {
+            t.resize(size);
+            return readFixedArray(s, t.data(), size);
+        }
         t.reserve(size);
         for (size_t i = 0; i < size; i++) {
             T item;
@@ -131,25 +356,27 @@ namespace masterserver {
         if (size > UINT24_MAX) {
             sizeBytes = 4;
         }
+        unsigned char sizeLE[4];
+        storeWire(sizeLE, size);
         if (sizeBytes > 0) {
             uint8_t sizeByte = sizeBytes + UINT8_MAX - 4;
             s.write((unsigned char*) &sizeByte, 1);
-            s.write((unsigned char*) &size, sizeBytes);
+            s.write(sizeLE, sizeBytes);
         } else {
-            s.write((unsigned char*) &size, 1);
+            s.write(sizeLE, 1);
         }
     }
     template<typename Stream>
     //TODO return error state
     uint32_t readSize(Stream &s) {
-        uint32_t size = 0;
-        uint8_t sizeBytes = 0;
-        s.read((unsigned char*) &size, 1);    //TODO add good() check
-        if (size > UINT8_MAX - 4) {
-            sizeBytes = size - (UINT8_MAX - 4);
-            s.read((unsigned char*) &size, sizeBytes);    //TODO add good() check
+        unsigned char sizeLE[4] = { 0 };
+        s.read(sizeLE, 1);    //TODO add good() check
+        if (sizeLE[0] > UINT8_MAX - 4) {
+            uint8_t sizeBytes = sizeLE[0] - (UINT8_MAX - 4);
+            sizeLE[0] = 0;
+            s.read(sizeLE, sizeBytes);    //TODO add good() check
         }
-        return size;
+        return loadWire<uint32_t>(sizeLE);
     }
 
     struct serializer {
@@ -176,7 +403,7 @@ namespace masterserver {
             return serialize(*this, m);
         }
 
-        bool write(unsigned char *src, size_t len) {
+        bool write(const unsigned char *src, size_t len) {
             os.write(src, len);
             return os.good();
         }
@@ -190,32 +417,135 @@ namespace masterserver {
         constexpr static bool isDeserializer() {
             return false;
         }
+        constexpr static bool isSizer() {
+            return false;
+        }
+    };
+
+    // runs the same serialize() code as serializer but only counts the bytes that would be written
+    struct sizer {
+        size_t size = 0;
+
+        template<typename M>
+        bool operator &(const M &m) {
+            return serialize(*this, m);
+        }
+        template<typename M>
+        bool operator &(M &m) {
+            return serialize(*this, m);
+        }
+
+        bool write(const unsigned char *src, size_t len) {
+            size += len;
+            return true;
+        }
+
+        bool good() {
+            return true;
+        }
+        constexpr static bool isSerializer() {
+            return true;
+        }
+        constexpr static bool isDeserializer() {
+            return false;
+        }
+        constexpr static bool isSizer() {
+            return true;
+        }
+    };
+
+    // serializes into a preallocated buffer (e.g. ENetPacket::data sized by the sizer)
+    struct buffer_serializer {
+        unsigned char *data;
+        size_t capacity;
+        size_t length = 0;
+        bool ok = true;
+
+        buffer_serializer(unsigned char *data, size_t capacity)
+            : data(data),
+              capacity(capacity) {
+        }
+
+        long getDataLen() {
+            return length;
+        }
+
+        template<typename M>
+        bool operator &(const M &m) {
+            return serialize(*this, m);
+        }
+        template<typename M>
+        bool operator &(M &m) {
+            return serialize(*this, m);
+        }
+
+        bool write(const unsigned char *src, size_t len) {
+            if (!ok || length + len > capacity) {
+                ok = false;
+                return false;
+            }
+            memcpy(data + length, src, len);
+            length += len;
+            return true;
+        }
+
+        bool good() {
+            return ok;
+        }
+        constexpr static bool isSerializer() {
+            return true;
+        }
+        constexpr static bool isDeserializer() {
+            return false;
+        }
+        constexpr static bool isSizer() {
+            return false;
+        }
     };
 
+    // reads in place from the packet's buffer, the buffer has to outlive the deserializer
     struct deserializer {
-        std::basic_istringstream<unsigned char> is;
-        typedef std::basic_istringstream<unsigned char>::__string_type string_type;
+        typedef std::basic_string<unsigned char> string_type;
+        string_type owned; // a copy only for the string_type constructor
+        const unsigned char *data;
+        size_t length;
+        size_t position = 0;
+        bool ok = true;
 
         deserializer(const string_type &s)
-            : is(s) {
+            : owned(s),
+              data(owned.data()),
+              length(owned.size()) {
         }
 
-        deserializer(unsigned char *data, size_t datalen)
-            : is(std::basic_string(data, datalen)) {
+        deserializer(const unsigned char *data, size_t datalen)
+            : data(data),
+              length(datalen) {
         }
+        deserializer(const deserializer&) = delete;
 
         template<typename M>
-        bool operator &(M &m) {
+        bool operator &(M &&m) {
             return *this >> m;
         }
 
         bool read(unsigned char *dst, size_t len) {
-            is.read(dst, len);
-            return is.good();
+            if (!ok || len > length - position) {
+                ok = false;
+                return false;
+            }
+            memcpy(dst, data + position, len);
+            position += len;
+            return true;
         }
 
         bool good() {
-            return is.good();
+            return ok;
+        }
+
+        // all data consumed, trailing fields added by later protocol versions are optional
+        bool atEnd() {
+            return position >= length;
         }
         constexpr static bool isSerializer() {
             return false;
@@ -223,6 +553,9 @@ namespace masterserver {
         constexpr static bool isDeserializer() {
             return true;
         }
+        constexpr static bool isSizer() {
+            return false;
+        }
     };
 }
 #endif /* INCLUDE_MASTER_H_ */
@@ -0,0 +1,251 @@
+#include <chrono>
+#include <cstring>
+#include <algorithm>
+#include "shmlist.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+namespace shm {
+
+    static uint64_t steadyNs() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    static size_t regionSize(uint32_t capacity) {
+        return sizeof(shm_header) + size_t(capacity) * sizeof(shm_server);
+    }
+
+    static shm_server* recordsOf(shm_header *header) {
+        return reinterpret_cast<shm_server*>(reinterpret_cast<unsigned char*>(header) + sizeof(shm_header));
+    }
+
+    static const shm_server* recordsOf(const shm_header *header) {
+        return reinterpret_cast<const shm_server*>(reinterpret_cast<const unsigned char*>(header) + sizeof(shm_header));
+    }
+
+    writer::~writer() {
+        close();
+    }
+
+#ifndef _WIN32
+    // a region of another size is left to its readers and unlinked, shrinking it would pull pages from under them
+    static int retire(int fd, const std::string &name, size_t oldSize) {
+        if (oldSize >= sizeof(shm_header)) {
+            void *memory = mmap(nullptr, sizeof(shm_header), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (memory != MAP_FAILED) {
+                static_cast<shm_header*>(memory)->recordSize = 0;
+                std::atomic_thread_fence(std::memory_order_release);
+                munmap(memory, sizeof(shm_header));
+            }
+        }
+        ::close(fd);
+        shm_unlink(name.c_str());
+        return shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+    }
+
+    bool writer::open(const std::string &name, uint32_t capacity) {
+        close();
+        int fd = shm_open(name.c_str(), O_CREAT | O_RDWR, 0644);
+        if (fd < 0) {
+            return false;
+        }
+        size_t bytes = regionSize(capacity);
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size != 0 && size_t(st.st_size) != bytes) {
+            fd = retire(fd, name, st.st_size);
+            if (fd < 0) {
+                return false;
+            }
+        }
+        if (ftruncate(fd, bytes) != 0) {
+            ::close(fd);
+            return false;
+        }
+        void *memory = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (memory == MAP_FAILED) {
+            return false;
+        }
+        this->name = name;
+        size = bytes;
+        header = static_cast<shm_header*>(memory);
+        // a region left behind by an earlier master keeps its sequence, readers mapping it stay consistent
+        sequence = header->sequence.load(std::memory_order_relaxed) & ~uint64_t(1);
+        header->sequence.store(sequence + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        header->magic = SHM_LIST_MAGIC;
+        header->version = SHM_LIST_VERSION;
+        header->capacity = capacity;
+        header->recordSize = sizeof(shm_server);
+        writeStartedNs = steadyNs();
+        commit(0, 0, 0);
+        return true;
+    }
+
+    void writer::close() {
+        if (header == nullptr) {
+            return;
+        }
+        munmap(header, size);
+        shm_unlink(name.c_str());
+        header = nullptr;
+    }
+#else
+    bool writer::open(const std::string &name, uint32_t capacity) {
+        return false;
+    }
+
+    void writer::close() {
+    }
+#endif
+
+    shm_server* writer::begin() {
+        writeStartedNs = steadyNs();
+        sequence = header->sequence.load(std::memory_order_relaxed);
+        header->sequence.store(sequence + 1, std::memory_order_relaxed);
+        // the odd sequence is visible before any record changes
+        std::atomic_thread_fence(std::memory_order_release);
+        return recordsOf(header);
+    }
+
+    void writer::commit(uint32_t count, uint32_t total, uint64_t generation) {
+        header->count = std::min(count, header->capacity);
+        header->total = total;
+        header->generation = generation;
+        header->publishedAtMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        header->sequence.store(sequence + 2, std::memory_order_release);
+        sequence += 2;
+        stats.publishes++;
+        if (total > count) {
+            stats.truncated++;
+        }
+        stats.lastWriteNs = steadyNs() - writeStartedNs;
+        stats.maxWriteNs = std::max(stats.maxWriteNs, stats.lastWriteNs);
+    }
+
+    void writer::fill(shm_server &record, uint32_t address, uint16_t port, uint32_t localNetworkAddress,
+        uint16_t localNetworkPort, uint32_t publicIPAddress, uint16_t publicPort, bool needsNAT, uint32_t rtt,
+        const char *descr, size_t descrLength) {
+        record.address = address;
+        record.localNetworkAddress = localNetworkAddress;
+        record.publicIPAddress = publicIPAddress;
+        record.port = port;
+        record.localNetworkPort = localNetworkPort;
+        record.publicPort = publicPort;
+        record.needsNAT = needsNAT ? 1 : 0;
+        record.rtt = rtt;
+        record.descrLength = std::min<size_t>(descrLength, SHM_DESCR_SIZE);
+        memcpy(record.descr, descr, record.descrLength);
+    }
+
+    reader::~reader() {
+        close();
+    }
+
+#ifndef _WIN32
+    bool reader::open(const std::string &name) {
+        close();
+        int fd = shm_open(name.c_str(), O_RDONLY, 0);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(shm_header)) {
+            ::close(fd);
+            return false;
+        }
+        void *memory = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (memory == MAP_FAILED) {
+            return false;
+        }
+        header = static_cast<const shm_header*>(memory);
+        size = st.st_size;
+        if (header->magic != SHM_LIST_MAGIC || header->version != SHM_LIST_VERSION || header->recordSize != sizeof(shm_server)
+            || regionSize(header->capacity) > size) {
+            close();
+            return false;
+        }
+        this->name = name;
+        capacity = header->capacity;
+        return true;
+    }
+
+    void reader::close() {
+        if (header == nullptr) {
+            return;
+        }
+        munmap(const_cast<shm_header*>(header), size);
+        header = nullptr;
+    }
+#else
+    bool reader::open(const std::string &name) {
+        return false;
+    }
+
+    void reader::close() {
+    }
+#endif
+
+    bool reader::read(snapshot &out) {
+        stats.reads++;
+        for (int attempt = 0; attempt < SHM_READ_ATTEMPTS; attempt++) {
+            if (header == nullptr || layoutChanged()) {
+                // recreated by a master with another capacity, open() closes the old mapping
+                if (name.empty() || !open(std::string(name))) {
+                    break;
+                }
+            }
+            out.servers.reserve(capacity);
+            uint64_t before = header->sequence.load(std::memory_order_acquire);
+            if (before == 0) {
+                break;
+            }
+            if (before & 1) {
+                stats.retries++;
+                continue;
+            }
+            uint32_t count = std::min(header->count, capacity);
+            out.generation = header->generation;
+            out.publishedAtMs = header->publishedAtMs;
+            out.total = header->total;
+            out.servers.resize(count);
+            memcpy(out.servers.data(), recordsOf(header), count * sizeof(shm_server));
+            // the copy completes before the sequence is looked at again
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (header->sequence.load(std::memory_order_relaxed) == before) {
+                return true;
+            }
+            stats.retries++;
+        }
+        stats.failed++;
+        return false;
+    }
+
+    uint64_t reader::generation() const {
+        if (header == nullptr || layoutChanged()) {
+            return 0;
+        }
+        for (int attempt = 0; attempt < SHM_READ_ATTEMPTS; attempt++) {
+            uint64_t before = header->sequence.load(std::memory_order_acquire);
+            if (before == 0) {
+                return 0;
+            }
+            if (before & 1) {
+                continue;
+            }
+            uint64_t generation = header->generation;
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (header->sequence.load(std::memory_order_relaxed) == before) {
+                return generation;
+            }
+        }
+        return 0;
+    }
+}
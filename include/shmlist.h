@@ -0,0 +1,156 @@
+/*
+ * shmlist.h
+ *
+ * Server list in POSIX shared memory for local readers (website, bots) that should not
+ * take a peer slot and a handshake of the master for every look at the list.
+ *
+ * The region is a shm_header followed by `capacity` fixed size shm_server records. The
+ * master (--shm=name) rewrites it when the registry generation changed, at most every
+ * SHM_PUBLISH_INTERVAL_MS. It is guarded by a seqlock: the writer makes the sequence odd,
+ * writes the records and makes it even again; a reader copies the region and keeps the
+ * copy only when it saw the same even sequence before and after. The writer never waits
+ * for readers and readers take no locks and make no syscalls - a reader that raced the
+ * writer copies again (see `duel6r-shmdump bench`).
+ *
+ * A master restarted with another capacity does not resize the region in place (a reader
+ * copying past the new end would get SIGBUS): it retires the old region (recordSize 0) and
+ * creates a new one under the same name. A reader copies only as many records as it mapped
+ * and opens the region again once its capacity or record size changed.
+ *
+ * Link the shmlist library and use shm::reader, or read the layout below directly.
+ */
+
+#ifndef INCLUDE_SHMLIST_H_
+#define INCLUDE_SHMLIST_H_
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+#define SHM_LIST_MAGIC 0x4c533644 // "D6SL"
+#define SHM_LIST_VERSION 1
+#define SHM_DESCR_SIZE 104
+#define SHM_DEFAULT_NAME "/duel6r-servers"
+#define SHM_DEFAULT_CAPACITY 4096
+#define SHM_PUBLISH_INTERVAL_MS 100
+#define SHM_READ_ATTEMPTS 1000 // copies a reader makes before it gives up on a writer that keeps writing
+
+namespace shm {
+
+    // one listed server, addresses in network order as in the protocol
+    struct shm_server {
+        uint32_t address;
+        uint32_t localNetworkAddress;
+        uint32_t publicIPAddress;
+        uint16_t port;
+        uint16_t localNetworkPort;
+        uint16_t publicPort;
+        uint8_t needsNAT;
+        uint8_t descrLength;
+        uint32_t rtt;                // smoothed master <-> server round trip (ms), 0 = not measured
+        char descr[SHM_DESCR_SIZE];  // descrLength bytes, not terminated
+    };
+    static_assert(sizeof(shm_server) == 128, "shm_server is part of the shared layout");
+
+    struct shm_header {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t capacity;   // records in the region
+        uint32_t recordSize;
+        std::atomic<uint64_t> sequence; // odd while the master writes, 0 = nothing published yet
+        // guarded by the sequence
+        uint64_t generation;    // registry generation the records were taken from
+        uint64_t publishedAtMs; // system clock, a reader can tell a region its master left behind
+        uint32_t count;         // records valid
+        uint32_t total;         // servers listed, more than count when the region is too small
+        uint8_t reserved[16];
+    };
+    static_assert(sizeof(shm_header) == 64, "shm_header is part of the shared layout");
+    static_assert(std::atomic<uint64_t>::is_always_lock_free, "the sequence has to be lock free to be shared");
+
+    struct snapshot {
+        uint64_t generation = 0;
+        uint64_t publishedAtMs = 0;
+        uint32_t total = 0;
+        std::vector<shm_server> servers;
+    };
+
+    struct writer_stats {
+        unsigned long long publishes = 0;
+        unsigned long long truncated = 0; // publishes that did not fit all servers
+        uint64_t lastWriteNs = 0;
+        uint64_t maxWriteNs = 0;
+    };
+
+    struct reader_stats {
+        unsigned long long reads = 0;
+        unsigned long long retries = 0; // copies thrown away because the writer was at work
+        unsigned long long failed = 0;
+    };
+
+    // the master's side, creates the region and removes it again in close()
+    class writer {
+    public:
+        writer_stats stats;
+
+        ~writer();
+        bool open(const std::string &name, uint32_t capacity);
+        void close();
+        bool isOpen() const {
+            return header != nullptr;
+        }
+        uint32_t capacity() const {
+            return header != nullptr ? header->capacity : 0;
+        }
+
+        // records to fill, up to capacity(); readers see them after commit()
+        shm_server* begin();
+        void commit(uint32_t count, uint32_t total, uint64_t generation);
+
+        static void fill(shm_server &record, uint32_t address, uint16_t port, uint32_t localNetworkAddress,
+            uint16_t localNetworkPort, uint32_t publicIPAddress, uint16_t publicPort, bool needsNAT, uint32_t rtt,
+            const char *descr, size_t descrLength);
+
+    private:
+        std::string name;
+        shm_header *header = nullptr;
+        size_t size = 0;
+        uint64_t sequence = 0;
+        uint64_t writeStartedNs = 0;
+    };
+
+    class reader {
+    public:
+        reader_stats stats;
+
+        ~reader();
+        bool open(const std::string &name);
+        void close();
+        bool isOpen() const {
+            return header != nullptr;
+        }
+        // consistent copy of the list, opens a region the master recreated again; false when nothing was
+        // published yet, the writer never paused or the region is gone
+        bool read(snapshot &out);
+        // generation without copying the records, 0 when nothing was published yet or the region was recreated
+        uint64_t generation() const;
+
+    private:
+        std::string name;
+        const shm_header *header = nullptr;
+        size_t size = 0;
+        uint32_t capacity = 0; // records mapped by open()
+
+        bool layoutChanged() const {
+            return header->recordSize != sizeof(shm_server) || header->capacity != capacity;
+        }
+    };
+
+    inline std::string description(const shm_server &s) {
+        return std::string(s.descr, s.descrLength);
+    }
+}
+
+#endif /* INCLUDE_SHMLIST_H_ */
@@ -44,35 +44,27 @@ namespace stun {
         size_t remaining = len - read;
         size_t attr = read;
         while (remaining >= sizeof(addressAttribute)) {
-            read = 0;
             enet_uint16 nameN;
             enet_uint16 lengthN;
-            enet_uint8 protocolFamilyN;
+            enet_uint16 protocolFamilyN;
             enet_uint16 portN;
             enet_uint32 addressN;
 
+            memcpy(&nameN, src + attr, 2);
+            memcpy(&lengthN, src + attr + 2, 2);
+            memcpy(&protocolFamilyN, src + attr + 4, 2);
+            memcpy(&portN, src + attr + 6, 2);
+            memcpy(&addressN, src + attr + 8, 4);
+            attr += sizeof(addressAttribute);
+            remaining -= sizeof(addressAttribute);
+
             attribute_t name = (attribute_t) fromBigEndian(nameN);
             addressAttribute &tgt = (name == MAPPED_ADDRESS) ? mappedAddress : sourceAdrress;
-
-            memcpy(&nameN, src + attr + read, 2);
-            read += 2;
-            memcpy(&lengthN, src + attr + read, 2);
-            read += 2;
-            memcpy(&protocolFamilyN, src + attr + read, 1);
-            read += 1;
-            memcpy(&portN, src + attr + read, 2);
-            read += 2;
-            memcpy(&addressN, src + attr + read, 4);
-            read += 4;
-
-            attr += read;
-            remaining = remaining - read;
-
             tgt.name = name;
             tgt.length = fromBigEndian(lengthN);
             tgt.protocolFamily = fromBigEndian(protocolFamilyN);
             tgt.port = fromBigEndian(portN);
-            tgt.address = fromBigEndian(addressN);
+            tgt.address = addressN; // stays in network byte order like ENetAddress::host
 
             attributes.push_back(tgt);
         }
@@ -110,4 +102,152 @@ namespace stun {
         return result;
     }
 
+    static enet_uint16 get16(const unsigned char *p) {
+        return masterserver::loadBigEndian<enet_uint16>(p);
+    }
+    static enet_uint32 get32(const unsigned char *p) {
+        return masterserver::loadBigEndian<enet_uint32>(p);
+    }
+    static unsigned char* put16(unsigned char *p, enet_uint16 v) {
+        masterserver::storeBigEndian(p, v);
+        return p + 2;
+    }
+    static unsigned char* put32(unsigned char *p, enet_uint32 v) {
+        masterserver::storeBigEndian(p, v);
+        return p + 4;
+    }
+
+    bool isBindingRequest(const unsigned char *data, size_t len) {
+        if (len < STUN_HEADER_SIZE || get16(data) != BINDING_REQUEST) {
+            return false;
+        }
+        size_t length = get16(data + 2);
+        return length % 4 == 0 && length == len - STUN_HEADER_SIZE;
+    }
+
+    bool hasMagicCookie(const unsigned char *data, size_t len) {
+        return len >= STUN_HEADER_SIZE && get32(data + 4) == STUN_MAGIC_COOKIE;
+    }
+
+    size_t respondInPlace(unsigned char *data, size_t len, size_t capacity, const ENetAddress &from) {
+        if (!isBindingRequest(data, len) || capacity < STUN_BINDING_RESPONSE_SIZE) {
+            return 0;
+        }
+        // the transaction id (bytes 4-19, including the cookie) is kept, the attributes are replaced
+        bool xorMapped = hasMagicCookie(data, len);
+        const unsigned char *address = (const unsigned char*) &from.host;
+        unsigned char *p = data;
+        p = put16(p, BINDING_RESPONSE);
+        p = put16(p, xorMapped ? 24 : 12);
+        p += 16;
+
+        p = put16(p, MAPPED_ADDRESS);
+        p = put16(p, 8);
+        p = put16(p, 0x0001); // reserved + IPv4
+        p = put16(p, from.port);
+        memcpy(p, address, 4);
+        p += 4;
+
+        if (xorMapped) {
+            p = put16(p, XOR_MAPPED_ADDRESS);
+            p = put16(p, 8);
+            p = put16(p, 0x0001);
+            p = put16(p, from.port ^ (STUN_MAGIC_COOKIE >> 16));
+            for (size_t i = 0; i < 4; i++) {
+                p[i] = address[i] ^ data[4 + i];
+            }
+            p += 4;
+        }
+        return p - data;
+    }
+
+    size_t buildBindingRequest(unsigned char *dst, size_t capacity, const unsigned char transaction[STUN_TRANSACTION_SIZE]) {
+        if (capacity < STUN_HEADER_SIZE) {
+            return 0;
+        }
+        unsigned char *p = dst;
+        p = put16(p, BINDING_REQUEST);
+        p = put16(p, 0);
+        p = put32(p, STUN_MAGIC_COOKIE);
+        memcpy(p, transaction, STUN_TRANSACTION_SIZE);
+        return STUN_HEADER_SIZE;
+    }
+
+    bool parseBindingResponse(const unsigned char *data, size_t len, const unsigned char transaction[STUN_TRANSACTION_SIZE],
+        ENetAddress &mapped) {
+        if (len < STUN_HEADER_SIZE || get16(data) != BINDING_RESPONSE || !hasMagicCookie(data, len)
+            || memcmp(data + 8, transaction, STUN_TRANSACTION_SIZE) != 0) {
+            return false;
+        }
+        size_t length = get16(data + 2);
+        if (length % 4 != 0 || length > len - STUN_HEADER_SIZE) {
+            return false;
+        }
+        bool found = false;
+        const unsigned char *p = data + STUN_HEADER_SIZE;
+        const unsigned char *end = p + length;
+        while (end - p >= 4) {
+            enet_uint16 type = get16(p);
+            size_t attributeLength = get16(p + 2);
+            p += 4;
+            if ((size_t) (end - p) < attributeLength) {
+                return false;
+            }
+            if ((type == MAPPED_ADDRESS || type == XOR_MAPPED_ADDRESS) && attributeLength == 8 && p[1] == 0x01) {
+                ENetAddress a;
+                a.port = get16(p + 2);
+                memcpy(&a.host, p + 4, 4);
+                if (type == XOR_MAPPED_ADDRESS) {
+                    a.port ^= STUN_MAGIC_COOKIE >> 16;
+                    unsigned char *host = (unsigned char*) &a.host;
+                    for (size_t i = 0; i < 4; i++) {
+                        host[i] ^= data[4 + i];
+                    }
+                }
+                if (!found || type == XOR_MAPPED_ADDRESS) {
+                    mapped = a;
+                    found = true;
+                }
+            }
+            p += (attributeLength + 3) & ~(size_t) 3;
+        }
+        return found;
+    }
+
+    size_t responder::service(size_t maxBatches) {
+        size_t sent = 0;
+        for (size_t b = 0; b < maxBatches; b++) {
+            size_t received = transport->receive(batch);
+            if (received == 0) {
+                break;
+            }
+            stats.requests += received;
+            // responses are written over the requests, anything else is dropped from the batch
+            size_t responses = 0;
+            for (size_t i = 0; i < received; i++) {
+                masterserver::datagram &d = batch[i];
+                if (observer) {
+                    observer(d);
+                }
+                size_t length = respondInPlace(d.data, d.length, sizeof(d.data), d.address);
+                if (length == 0) {
+                    stats.ignored++;
+                    continue;
+                }
+                d.length = length;
+                if (responses != i) {
+                    batch[responses] = d;
+                }
+                responses++;
+            }
+            batch.count = responses;
+            size_t n = transport->send(batch);
+            stats.responses += n;
+            sent += n;
+            if (received < DATAGRAM_BATCH_SIZE) {
+                break;
+            }
+        }
+        return sent;
+    }
 }
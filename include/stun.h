@@ -3,8 +3,10 @@
  *
  * STUN protocol (binding request/response)
  *
- * This is not used currently in the NAT traversal process (it was a blind development path)
- * but the utility function for conversion to big endian might come handy later
+ * `message` is the original RFC 3489 style codec (a blind development path, not used in the NAT traversal).
+ * The binding responder below works directly in the datagram buffers of a udp_transport batch and answers
+ * RFC 5389 requests with XOR-MAPPED-ADDRESS (and MAPPED-ADDRESS for RFC 3489 clients), so game servers
+ * can learn their public mapping without an ENet session to the master.
  *
  *  Created on: Sep 18, 2020
  *      Author: fanick
@@ -16,43 +18,22 @@
 
 #include <sstream>
 #include <vector>
+#include <memory>
+#include <functional>
 #include <enet/enet.h>
+#include "endian.h"
+#include "transport.h"
 
-namespace stun {
-
-    template <typename T>
-    T toBigEndian(T u){
-        union
-        {
-            T u;
-            unsigned char u8[sizeof(T)];
-        } source;
-        source.u = u;
-
-        T result = 0;
-
-        for (size_t k = 0; k < sizeof(T); k++)
-            result |= (source.u8[sizeof(T) - k - 1] << (k * 8));
-
-        return result;
-    }
-    template <typename T>
-    T fromBigEndian(T u){
-        union
-        {
-            T u;
-            unsigned char u8[sizeof(T)];
-        } source;
-        source.u = u;
-
-        T result = 0;
+#define STUN_HEADER_SIZE 20
+#define STUN_MAGIC_COOKIE 0x2112A442
+#define STUN_TRANSACTION_SIZE 12
+// header + MAPPED-ADDRESS + XOR-MAPPED-ADDRESS
+#define STUN_BINDING_RESPONSE_SIZE (STUN_HEADER_SIZE + 12 + 12)
 
-        for (size_t k = 0; k < sizeof(T); k++)
-            result |= (source.u8[k] << (k * 8));
-
-        return result;
-    }
+namespace stun {
 
+    using masterserver::toBigEndian;
+    using masterserver::fromBigEndian;
 
     #pragma pack(push, 1)
     enum type_t: enet_uint16 {
@@ -63,7 +44,8 @@ namespace stun {
     enum attribute_t: enet_uint16{
         MAPPED_ADDRESS = 0x0001,
         CHANGE_REQUEST = 0x0003,
-        SOURCE_ADDRESS = 0x0004
+        SOURCE_ADDRESS = 0x0004,
+        XOR_MAPPED_ADDRESS = 0x0020
     };
 
     enum flags_t: enet_uint32 {
@@ -100,99 +82,43 @@ namespace stun {
     };
     #pragma pack(pop)
 
-    bool message::read(char * src, size_t len) {
-        if(len < headersSize || len > headersSize + 2 * sizeof (addressAttribute)){
-            return false;
-        }
+    // in-place codec, all functions check bounds and never read past `len`
+
+    // header of a binding request: message type, length matching the datagram, 4 byte aligned attributes
+    bool isBindingRequest(const unsigned char *data, size_t len);
+    // RFC 5389 request (magic cookie present) as opposed to the RFC 3489 one
+    bool hasMagicCookie(const unsigned char *data, size_t len);
+    // rewrites the binding request in `data` to a success response for `from`, returns the response length
+    // or 0 when `data` is not a binding request
+    size_t respondInPlace(unsigned char *data, size_t len, size_t capacity, const ENetAddress &from);
+    // RFC 5389 binding request without attributes, returns the request length (0 when it does not fit)
+    size_t buildBindingRequest(unsigned char *dst, size_t capacity, const unsigned char transaction[STUN_TRANSACTION_SIZE]);
+    // mapped address from a binding response to the request with `transaction`, XOR-MAPPED-ADDRESS is preferred
+    bool parseBindingResponse(const unsigned char *data, size_t len, const unsigned char transaction[STUN_TRANSACTION_SIZE],
+        ENetAddress &mapped);
+
+    struct responder_stats {
+        unsigned long long requests = 0;
+        unsigned long long responses = 0;
+        unsigned long long ignored = 0;
+    };
 
-        enet_uint16 typeN;
-        enet_uint16 lengthN;
-        enet_uint8 tranId[16];
-        attributes.clear();
-        attributes.reserve(4);
-
-        size_t read = 0;
-        memcpy(&typeN, src, 2);
-        read += 2;
-        memcpy(&lengthN, src + read, 2);
-        read += 2;
-        memcpy(&tranId, src + read, 16);
-        read += 16;
-
-        type = (type_t)fromBigEndian(typeN);
-        length = fromBigEndian(lengthN);
-
-        size_t remaining = len - read;
-        size_t attr = read;
-        while (remaining >= sizeof(addressAttribute)){
-            read = 0;
-            enet_uint16 nameN;
-            enet_uint16 lengthN;
-            enet_uint8 protocolFamilyN;
-            enet_uint16 portN;
-            enet_uint32 addressN;
-
-            attribute_t name = (attribute_t)fromBigEndian(nameN);
-            addressAttribute & tgt = (name == MAPPED_ADDRESS) ? mappedAddress : sourceAdrress;
-
-            memcpy(&nameN, src + attr + read, 2);
-            read += 2;
-            memcpy(&lengthN, src + attr + read, 2);
-            read += 2;
-            memcpy(&protocolFamilyN, src + attr + read, 1);
-            read += 1;
-            memcpy(&portN, src + attr + read, 2);
-            read += 2;
-            memcpy(&addressN, src + attr + read, 4);
-            read += 4;
-
-            attr += read;
-            remaining = remaining - read;
-
-            tgt.name = name;
-            tgt.length = fromBigEndian(lengthN);
-            tgt.protocolFamily = fromBigEndian(protocolFamilyN);
-            tgt.port = fromBigEndian(portN);
-            tgt.address = fromBigEndian(addressN);
-
-            attributes.push_back(tgt);
-        }
+    // stateless binding responder on a datagram socket, serviced from the master's event loop
+    struct responder {
+        std::unique_ptr<masterserver::udp_transport> transport;
+        masterserver::datagram_batch batch;
+        responder_stats stats;
+        // sees every received datagram before it is answered (the NAT classification of flare.h)
+        std::function<void(const masterserver::datagram&)> observer;
 
-        return true;
-    }
-
-    size_t message::send(char **memblockPtr) {
-        size_t attributesSize = sizeof(addressAttribute) * attributes.size();
-        size_t result = headersSize + attributesSize;
-        char *dst = (char*) malloc(result);
-        (*memblockPtr) = dst;
-        memset(dst, 0, result);
-        length = attributesSize;
-        enet_uint16 typeN = toBigEndian((enet_uint16)type);
-        enet_uint16 lengthN = toBigEndian(length);
-        memcpy(dst, &typeN, 2);
-        memcpy(dst + 2, &lengthN, 2);
-        memcpy(dst + 4, &tranId, 16);
-
-        addressAttribute *attributesPtr = (addressAttribute *) (dst + ((char*) &attributes - (char*) this));
-        for (size_t i = 0; i < attributes.size(); i++) {
-            addressAttribute & a = attributes[i];
-            addressAttribute * adst = &(attributesPtr[i]);
-            enet_uint16 nameN = toBigEndian((enet_uint16)a.name);
-            enet_uint16 lengthN = toBigEndian(a.length);
-            enet_uint16 protocolFamilyN = toBigEndian(a.protocolFamily);
-            enet_uint16 portN = toBigEndian(a.port);
-            enet_uint32 addressN = a.address;
-
-            memcpy((char*)adst + 0, &nameN, 2);
-            memcpy((char*)adst + 2, &lengthN, 2);
-            memcpy((char*)adst + 4, &protocolFamilyN, 2);
-            memcpy((char*)adst + 6, &portN, 2);
-            memcpy((char*)adst + 8, &addressN, 4);
+        responder(std::unique_ptr<masterserver::udp_transport> transport)
+            : transport(std::move(transport)) {
         }
-        return result;
-    }
 
+        // answers pending requests a batch at a time, at most `maxBatches` so ENet is not starved;
+        // returns the number of responses sent
+        size_t service(size_t maxBatches = 16);
+    };
 }
 
 #endif /* INCLUDE_STUN_H_ */
@@ -0,0 +1,150 @@
+#include <algorithm>
+#include "subscription.h"
+
+static uint64_t nanosSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+bool list_subscriptions::subscribe(ENetPeer *peer, entryMap &registry, master_network &network, time_point now) {
+    if (subscribers.size() >= maxSubscribers) {
+        stats.refused++;
+        return false;
+    }
+    if (subscribers.empty()) {
+        // nobody followed the registry, the snapshot the subscriber gets now is what the first delta changes
+        published.clear();
+        diff(registry, nullptr);
+    } else {
+        // the published state has to be the snapshot the new subscriber gets now
+        publish(registry, network, now);
+    }
+    subscribers.push_back( { peer, peer->connectID });
+    stats.subscribed++;
+    stats.peakSubscribers = std::max(stats.peakSubscribers, subscribers.size());
+    return true;
+}
+
+void list_subscriptions::unsubscribe(ENetPeer *peer) {
+    auto it = std::find_if(subscribers.begin(), subscribers.end(), [peer](const subscriber &s) {
+        return s.peer == peer;
+    });
+    if (it == subscribers.end()) {
+        return;
+    }
+    subscribers.erase(it);
+    stats.unsubscribed++;
+}
+
+void list_subscriptions::service(entryMap &registry, master_network &network, time_point now) {
+    if (subscribers.empty() || now < nextDelta) {
+        return;
+    }
+    publish(registry, network, now);
+}
+
+void list_subscriptions::publish(entryMap &registry, master_network &network, time_point now) {
+    if (registry.generation == publishedGeneration && now < nextExpiry) {
+        return;
+    }
+    PROFILE_SCOPE("subscriptions");
+    auto started = std::chrono::steady_clock::now();
+    packet_serverlist_delta_encoded delta;
+    diff(registry, &delta);
+    stats.diffNs += nanosSince(started);
+    if (delta.upserted.empty() && delta.removed.empty()) {
+        // a new generation for the proximity order only, the subscribers order the list themselves
+        return;
+    }
+    nextDelta = now + interval;
+
+    recipients.clear();
+    subscribers.erase(std::remove_if(subscribers.begin(), subscribers.end(), [](const subscriber &s) {
+        return s.peer->state != ENET_PEER_STATE_CONNECTED || s.peer->connectID != s.connectID;
+    }), subscribers.end());
+    for (const subscriber &s : subscribers) {
+        recipients.push_back(s.peer);
+    }
+    sendPages(recipients, delta, network);
+}
+
+void list_subscriptions::sendRemainder(ENetPeer *peer, entryMap &registry, master_network &network) {
+    remainder.clear();
+    // the same order the SERVER_LIST was cut from
+    registry.getValidHostsNear(peer->address.host, remainder);
+    if (remainder.size() <= registry.listLimit) {
+        return;
+    }
+    packet_serverlist_delta_encoded delta;
+    for (auto it = std::next(remainder.begin(), registry.listLimit); it != remainder.end(); ++it) {
+        const std::vector<unsigned char> &wire = (*it)->wire();
+        delta.upserted.push_back( { wire.data(), wire.size() });
+    }
+    recipients.assign(1, peer);
+    sendPages(recipients, delta, network);
+    stats.remainders++;
+}
+
+bool list_subscriptions::sendPages(const std::vector<ENetPeer*> &to, const packet_serverlist_delta_encoded &delta, master_network &network) {
+    packetHeader header;
+    header.type = PACKET_TYPE::SERVER_LIST_DELTA;
+    size_t removed = 0;
+    size_t upserted = 0;
+    do {
+        auto started = std::chrono::steady_clock::now();
+        size_t r = std::min(delta.removed.size() - removed, (size_t) SERVER_LIST_MAX_SERVERS);
+        size_t u = std::min(delta.upserted.size() - upserted, (size_t) SERVER_LIST_MAX_SERVERS);
+        page.removed.assign(delta.removed.begin() + removed, delta.removed.begin() + removed + r);
+        page.upserted.assign(delta.upserted.begin() + upserted, delta.upserted.begin() + upserted + u);
+        removed += r;
+        upserted += u;
+        ENetPacket *packet = buildPacket(ENET_PACKET_FLAG_RELIABLE, header, page);
+        stats.encodeNs += nanosSince(started);
+        if (packet == nullptr) {
+            return false;
+        }
+        stats.deltas++;
+        stats.deltaBytes += packet->dataLength;
+
+        started = std::chrono::steady_clock::now();
+        stats.fannedOut += to.size();
+        network.broadcast(to, packet);
+        stats.fanOutNs += nanosSince(started);
+    } while (removed < delta.removed.size() || upserted < delta.upserted.size());
+    return true;
+}
+
+// compares the listed servers with the published ones, the differences go to `delta` (when given) and become the published state
+void list_subscriptions::diff(entryMap &registry, packet_serverlist_delta_encoded *delta) {
+    std::map<server_address_t, uint64_t> current;
+    time_point expiry = time_point::max();
+    for (auto &entry : registry.mapa) {
+        server_list_entry &e = entry.second;
+        if (!registry.isValid(e)) {
+            continue;
+        }
+        const std::vector<unsigned char> &wire = e.wire();
+        uint64_t hash = server_description::hashOf((const char*) wire.data(), wire.size());
+        current.emplace_hint(current.end(), entry.first, hash);
+        expiry = std::min(expiry, e.validUntil);
+        auto was = published.find(entry.first);
+        if (was == published.end() || was->second != hash) {
+            if (delta != nullptr) {
+                delta->upserted.push_back( { wire.data(), wire.size() });
+                (was == published.end() ? stats.added : stats.updated)++;
+            }
+        }
+    }
+    for (auto &p : published) {
+        if (delta != nullptr && current.count(p.first) == 0) {
+            packet_serverlist_delta::_server_key key;
+            key.address = std::get<0>(p.first);
+            key.port = std::get<1>(p.first);
+            delta->removed.push_back(key);
+            stats.removed++;
+        }
+    }
+    published.swap(current);
+    // isValid() may have retired expired servers, they are in this delta already
+    publishedGeneration = registry.generation;
+    nextExpiry = expiry;
+}
@@ -0,0 +1,101 @@
+/*
+ * subscription.h
+ *
+ * Server list subscriptions (REQUEST_TYPE::CLIENT_SUBSCRIBE_SERVERLIST). Instead of polling,
+ * a browser keeps one session with the master: it gets the usual SERVER_LIST right away and
+ * then a SERVER_LIST_DELTA whenever the list changed, at most one per `interval`.
+ *
+ * Changes are not logged as they happen. service() compares the registry with the state the
+ * last delta left the subscribers in (a content hash per listed server) once the interval
+ * passed and the generation moved or a listed server expired, so everything that happened
+ * within an interval is coalesced - a server that came and went never shows up, ten updates
+ * of one server are a single upsert. The delta is encoded once and the same ENet packet is
+ * queued for every subscriber (master_network::broadcast). A delta with more than
+ * SERVER_LIST_MAX_SERVERS servers in either part is split over several packets.
+ *
+ * Subscribers follow the whole registry: the servers past the SERVER_LIST limit follow the
+ * SERVER_LIST as upserts (sendRemainder). A new subscriber's SERVER_LIST is the registry as
+ * it is now, so the changes still pending for the others are sent to them right away - the
+ * next delta then applies to the old subscribers and the new one alike.
+ *
+ * A subscriber holds its peer slot for good; subscriptions have the lowest admission
+ * priority and at most `maxSubscribers` are taken, the rest get a SERVER_LIST and are
+ * disconnected like a plain list request.
+ */
+
+#ifndef INCLUDE_SUBSCRIPTION_H_
+#define INCLUDE_SUBSCRIPTION_H_
+
+#include <map>
+#include <list>
+#include <vector>
+#include <chrono>
+#include <enet/enet.h>
+#include "masterserver.h"
+#include "network.h"
+
+#define SUBSCRIPTION_INTERVAL_MS 1000
+#define SUBSCRIPTION_MAX_SUBSCRIBERS 16
+
+struct subscription_stats {
+    unsigned long long subscribed = 0;
+    unsigned long long refused = 0;       // over maxSubscribers
+    unsigned long long unsubscribed = 0;
+    unsigned long long deltas = 0;        // delta packets, each encoded once
+    unsigned long long deltaBytes = 0;    // encoded size, once per delta
+    unsigned long long fannedOut = 0;     // delta packets queued, deltas x subscribers
+    unsigned long long added = 0;
+    unsigned long long updated = 0;
+    unsigned long long removed = 0;
+    unsigned long long remainders = 0;    // subscribers that got more servers than their SERVER_LIST held
+    unsigned long long diffNs = 0;        // comparing the registry with the published state
+    unsigned long long encodeNs = 0;
+    unsigned long long fanOutNs = 0;      // queueing the delta for all subscribers
+    size_t peakSubscribers = 0;
+};
+
+class list_subscriptions {
+public:
+    typedef std::chrono::steady_clock::time_point time_point;
+
+    std::chrono::milliseconds interval { SUBSCRIPTION_INTERVAL_MS };
+    size_t maxSubscribers = SUBSCRIPTION_MAX_SUBSCRIBERS;
+    subscription_stats stats;
+
+    // false when there are maxSubscribers already; the caller sends the snapshot either way
+    bool subscribe(ENetPeer *peer, entryMap &registry, master_network &network, time_point now);
+    // the session ended, from the DISCONNECT event or when the slot is released
+    void unsubscribe(ENetPeer *peer);
+    size_t count() const {
+        return subscribers.size();
+    }
+
+    // the servers a new subscriber's SERVER_LIST left out (past the registry's listLimit) as upserts
+    void sendRemainder(ENetPeer *peer, entryMap &registry, master_network &network);
+
+    // sends the changes of `registry` since the last delta when the interval passed
+    void service(entryMap &registry, master_network &network, time_point now);
+
+private:
+    struct subscriber {
+        ENetPeer *peer;
+        enet_uint32 connectID; // the slot may be reused by another session
+    };
+
+    std::vector<subscriber> subscribers;
+    std::vector<ENetPeer*> recipients;
+    std::list<server_list_entry*> remainder;
+    packet_serverlist_delta_encoded page;
+    std::map<server_address_t, uint64_t> published; // content hash of every server the subscribers list
+    uint64_t publishedGeneration = 0;
+    time_point nextExpiry = time_point::max();       // of the published servers, ends their listing without a new generation
+    time_point nextDelta;
+
+    // sends what changed since the last delta, if anything
+    void publish(entryMap &registry, master_network &network, time_point now);
+    void diff(entryMap &registry, packet_serverlist_delta_encoded *delta);
+    // false when a packet cannot be built
+    bool sendPages(const std::vector<ENetPeer*> &to, const packet_serverlist_delta_encoded &delta, master_network &network);
+};
+
+#endif /* INCLUDE_SUBSCRIPTION_H_ */
@@ -0,0 +1,101 @@
+#include <cstring>
+#include "trace.h"
+
+trace_writer::~trace_writer() {
+    close();
+}
+
+bool trace_writer::open(const std::string &path, std::chrono::steady_clock::time_point start, size_t peerCount) {
+    close();
+    file = fopen(path.c_str(), "wb");
+    if (file == nullptr) {
+        return false;
+    }
+    setvbuf(file, nullptr, _IOFBF, 1 << 20);
+    this->start = start;
+    unsigned char header[7] = { TRACE_MAGIC[0], TRACE_MAGIC[1], TRACE_MAGIC[2], TRACE_MAGIC[3], TRACE_VERSION,
+        (unsigned char) (peerCount & 0xff), (unsigned char) (peerCount >> 8) };
+    fwrite(header, sizeof(header), 1, file);
+    return true;
+}
+
+void trace_writer::record(std::chrono::steady_clock::time_point now, const ENetHost *host, const ENetEvent &event) {
+    if (file == nullptr || event.type == ENET_EVENT_TYPE_NONE) {
+        return;
+    }
+    trace_record r;
+    r.timestamp = std::chrono::duration_cast<std::chrono::microseconds>(now - start).count();
+    r.type = event.type;
+    r.peer = event.peer - host->peers;
+    r.data = event.data;
+    r.host = event.peer->address.host;
+    r.port = event.peer->address.port;
+    if (event.type == ENET_EVENT_TYPE_RECEIVE && event.packet != nullptr) {
+        r.length = event.packet->dataLength;
+    }
+
+    unsigned char block[masterserver::fixedWireSize<trace_record>()];
+    masterserver::buffer_serializer s(block, sizeof(block));
+    s << r;
+    fwrite(block, sizeof(block), 1, file);
+    if (r.length > 0) {
+        fwrite(event.packet->data, r.length, 1, file);
+    }
+    records++;
+}
+
+void trace_writer::flush() {
+    if (file != nullptr) {
+        fflush(file);
+    }
+}
+
+void trace_writer::close() {
+    if (file != nullptr) {
+        fclose(file);
+        file = nullptr;
+    }
+}
+
+trace_reader::~trace_reader() {
+    close();
+}
+
+bool trace_reader::open(const std::string &path) {
+    close();
+    file = fopen(path.c_str(), "rb");
+    if (file == nullptr) {
+        return false;
+    }
+    unsigned char header[7];
+    if (fread(header, sizeof(header), 1, file) != 1 || memcmp(header, TRACE_MAGIC, 4) != 0 || header[4] != TRACE_VERSION) {
+        close();
+        return false;
+    }
+    peerCount = header[5] | header[6] << 8;
+    return true;
+}
+
+bool trace_reader::next(trace_record &record, std::vector<unsigned char> &payload) {
+    unsigned char block[masterserver::fixedWireSize<trace_record>()];
+    if (file != nullptr && fread(block, sizeof(block), 1, file) == 1) {
+        masterserver::deserializer d(block, sizeof(block));
+        d >> record;
+        if (record.length > TRACE_MAX_PACKET) {
+            return false;
+        }
+        payload.resize(record.length);
+        if (record.length > 0 && fread(payload.data(), record.length, 1, file) != 1) {
+            return false;
+        }
+        return true;
+    }
+    return false;
+}
+
+void trace_reader::close() {
+    if (file != nullptr) {
+        fclose(file);
+        file = nullptr;
+    }
+}
@@ -0,0 +1,80 @@
+/*
+ * trace.h
+ *
+ * Binary trace of the ENet events handled by the master (--record=file) and
+ * a reader for offline replay.
+ *
+ * File layout: "D6MT" + version byte + the host's peer count (uint16, little-endian; replay
+ * creates its host with as many slots, admission control depends on it), followed by
+ * records. Each record is a
+ * trace_record (fixed layout, serialized by serialize.h) followed by `length`
+ * bytes of packet data for RECEIVE events.
+ */
+
+#ifndef INCLUDE_TRACE_H_
+#define INCLUDE_TRACE_H_
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <enet/enet.h>
+#include "serialize.h"
+
+#define TRACE_MAGIC "D6MT"
+#define TRACE_VERSION 2
+#define TRACE_MAX_PACKET (1024 * 1024)
+
+struct trace_record {
+    uint64_t timestamp = 0; // us since the start of the recording
+    uint8_t type = ENET_EVENT_TYPE_NONE;
+    uint16_t peer = 0; // index of the peer slot in the host
+    uint32_t data = 0; // event.data
+    uint32_t host = 0;
+    uint16_t port = 0;
+    uint32_t length = 0; // packet bytes following the record
+
+    static constexpr auto fields() {
+        return masterserver::fields(&trace_record::timestamp,
+            &trace_record::type,
+            &trace_record::peer,
+            &trace_record::data,
+            masterserver::rawField(&trace_record::host),
+            &trace_record::port,
+            &trace_record::length);
+    }
+    template<typename Stream>
+    bool serialize(Stream &s) {
+        return masterserver::serializeFields(s, *this);
+    }
+};
+
+struct trace_writer {
+    FILE *file = nullptr;
+    std::chrono::steady_clock::time_point start;
+    unsigned long long records = 0;
+
+    ~trace_writer();
+
+    bool open(const std::string &path, std::chrono::steady_clock::time_point start, size_t peerCount);
+    bool isOpen() const {
+        return file != nullptr;
+    }
+    void record(std::chrono::steady_clock::time_point now, const ENetHost *host, const ENetEvent &event);
+    void flush();
+    void close();
+};
+
+struct trace_reader {
+    FILE *file = nullptr;
+    size_t peerCount = 0; // of the recording host
+
+    ~trace_reader();
+
+    bool open(const std::string &path);
+    // packet data of RECEIVE events is returned in `payload`
+    bool next(trace_record &record, std::vector<unsigned char> &payload);
+    void close();
+};
+
+#endif /* INCLUDE_TRACE_H_ */
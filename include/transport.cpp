@@ -0,0 +1,194 @@
+#include <cstring>
+#include "transport.h"
+
+#ifdef __linux__
+#include <sys/socket.h>
+#include <netinet/in.h>
+#endif
+
+namespace masterserver {
+
+    bool parseTransportBackend(const std::string &name, TRANSPORT_BACKEND &backend) {
+        if (name == "basic") {
+            backend = TRANSPORT_BACKEND::BASIC;
+            return true;
+        }
+        if (name == "mmsg") {
+            backend = TRANSPORT_BACKEND::MMSG;
+            return true;
+        }
+        return false;
+    }
+
+    const char* transportBackendName(TRANSPORT_BACKEND backend) {
+        switch (backend) {
+        case TRANSPORT_BACKEND::BASIC:
+            return "basic";
+        case TRANSPORT_BACKEND::MMSG:
+            return "mmsg";
+        }
+        return "unknown";
+    }
+
+    struct basic_transport: public udp_transport {
+        basic_transport(ENetSocket socket)
+            : udp_transport(socket) {
+        }
+
+        size_t receive(datagram_batch &batch) override {
+            batch.clear();
+            // bounded like one recvmmsg call, a socket that keeps failing does not spin here
+            for (size_t calls = 0; calls < DATAGRAM_BATCH_SIZE && !batch.full(); calls++) {
+                datagram &d = batch.datagrams[batch.count];
+                ENetBuffer buffer;
+                buffer.data = d.data;
+                buffer.dataLength = sizeof(d.data);
+                stats.syscalls++;
+                int len = enet_socket_receive(socket, &d.address, &buffer, 1);
+                if (len == 0) {
+                    // would block
+                    break;
+                }
+                if (len < 0) {
+                    // truncated datagram (or an ICMP error reported on the socket), the next one may be fine
+                    stats.droppedDatagrams++;
+                    continue;
+                }
+                d.length = len;
+                batch.count++;
+            }
+            stats.receivedDatagrams += batch.count;
+            return batch.count;
+        }
+
+        size_t send(datagram_batch &batch) override {
+            size_t sent = 0;
+            for (size_t i = 0; i < batch.count; i++) {
+                datagram &d = batch[i];
+                ENetBuffer buffer;
+                buffer.data = d.data;
+                buffer.dataLength = d.length;
+                stats.syscalls++;
+                if (enet_socket_send(socket, &d.address, &buffer, 1) > 0) {
+                    sent++;
+                } else {
+                    stats.droppedDatagrams++;
+                }
+            }
+            stats.sentDatagrams += sent;
+            batch.clear();
+            return sent;
+        }
+
+        TRANSPORT_BACKEND backend() const override {
+            return TRANSPORT_BACKEND::BASIC;
+        }
+    };
+
+#ifdef __linux__
+    struct mmsg_transport: public udp_transport {
+        std::array<mmsghdr, DATAGRAM_BATCH_SIZE> headers;
+        std::array<iovec, DATAGRAM_BATCH_SIZE> iovecs;
+        std::array<sockaddr_in, DATAGRAM_BATCH_SIZE> addresses;
+
+        mmsg_transport(ENetSocket socket)
+            : udp_transport(socket) {
+        }
+
+        void prepare(datagram_batch &batch, size_t count, bool incoming) {
+            for (size_t i = 0; i < count; i++) {
+                datagram &d = batch[i];
+                iovecs[i].iov_base = d.data;
+                iovecs[i].iov_len = incoming ? sizeof(d.data) : d.length;
+                msghdr &h = headers[i].msg_hdr;
+                memset(&h, 0, sizeof(h));
+                h.msg_name = &addresses[i];
+                h.msg_namelen = sizeof(sockaddr_in);
+                h.msg_iov = &iovecs[i];
+                h.msg_iovlen = 1;
+                headers[i].msg_len = 0;
+                if (!incoming) {
+                    memset(&addresses[i], 0, sizeof(sockaddr_in));
+                    addresses[i].sin_family = AF_INET;
+                    addresses[i].sin_addr.s_addr = d.address.host;
+                    addresses[i].sin_port = ENET_HOST_TO_NET_16(d.address.port);
+                }
+            }
+        }
+
+        size_t receive(datagram_batch &batch) override {
+            batch.clear();
+            prepare(batch, DATAGRAM_BATCH_SIZE, true);
+            stats.syscalls++;
+            int received = recvmmsg(socket, headers.data(), DATAGRAM_BATCH_SIZE, MSG_DONTWAIT, nullptr);
+            if (received <= 0) {
+                return 0;
+            }
+            for (int i = 0; i < received; i++) {
+                if (headers[i].msg_hdr.msg_flags & MSG_TRUNC) {
+                    stats.droppedDatagrams++;
+                    continue;
+                }
+                datagram &d = batch[batch.count++];
+                if (&d != &batch[i]) {
+                    memcpy(d.data, batch[i].data, headers[i].msg_len);
+                }
+                d.length = headers[i].msg_len;
+                d.address.host = addresses[i].sin_addr.s_addr;
+                d.address.port = ENET_NET_TO_HOST_16(addresses[i].sin_port);
+            }
+            stats.receivedDatagrams += batch.count;
+            return batch.count;
+        }
+
+        size_t send(datagram_batch &batch) override {
+            prepare(batch, batch.count, false);
+            size_t sent = 0;
+            while (sent < batch.count) {
+                stats.syscalls++;
+                int result = sendmmsg(socket, headers.data() + sent, batch.count - sent, MSG_DONTWAIT);
+                if (result <= 0) {
+                    // socket buffer is full, the rest of the batch is lost like any other UDP datagram
+                    stats.droppedDatagrams += batch.count - sent;
+                    break;
+                }
+                sent += result;
+            }
+            stats.sentDatagrams += sent;
+            batch.clear();
+            return sent;
+        }
+
+        TRANSPORT_BACKEND backend() const override {
+            return TRANSPORT_BACKEND::MMSG;
+        }
+    };
+#endif
+
+    std::unique_ptr<udp_transport> createTransport(TRANSPORT_BACKEND backend, ENetSocket socket) {
+#ifdef __linux__
+        if (backend == TRANSPORT_BACKEND::MMSG) {
+            return std::make_unique<mmsg_transport>(socket);
+        }
+#endif
+        return std::make_unique<basic_transport>(socket);
+    }
+
+    ENetSocket openDatagramSocket(address_t host, port_t port) {
+        ENetSocket socket = enet_socket_create(ENET_SOCKET_TYPE_DATAGRAM);
+        if (socket == ENET_SOCKET_NULL) {
+            return ENET_SOCKET_NULL;
+        }
+        ENetAddress address;
+        address.host = host;
+        address.port = port;
+        if (enet_socket_bind(socket, &address) < 0) {
+            enet_socket_destroy(socket);
+            return ENET_SOCKET_NULL;
+        }
+        enet_socket_set_option(socket, ENET_SOCKOPT_NONBLOCK, 1);
+        enet_socket_set_option(socket, ENET_SOCKOPT_RCVBUF, 4 * 1024 * 1024);
+        enet_socket_set_option(socket, ENET_SOCKOPT_SNDBUF, 4 * 1024 * 1024);
+        return socket;
+    }
+}
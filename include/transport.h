@@ -0,0 +1,102 @@
+/*
+ * transport.h
+ *
+ * Batched datagram I/O for the connectionless sockets serviced by the master
+ * (STUN, probes, relay ...).
+ *
+ * ENet does not expose a way to inject datagrams into an ENetHost, so the ENet
+ * host itself keeps using the stock one-syscall-per-datagram path. Everything
+ * the master reads or writes on its own goes through udp_transport, which can
+ * move a whole batch of datagrams with a single recvmmsg/sendmmsg call.
+ *
+ * BASIC is the default. On loopback (loadgen sink / blast, single core) MMSG needed a tenth
+ * of the syscalls but did not move measurably more datagrams per second, and none of the
+ * sockets above carries the master's request traffic - that stays on ENet's own path.
+ */
+
+#ifndef INCLUDE_TRANSPORT_H_
+#define INCLUDE_TRANSPORT_H_
+
+#include <array>
+#include <memory>
+#include <string>
+#include <enet/enet.h>
+#include "protocol.h"
+
+namespace masterserver {
+
+#define DATAGRAM_MAX_SIZE 1500
+#define DATAGRAM_BATCH_SIZE 64
+
+    enum class TRANSPORT_BACKEND {
+        BASIC, // enet_socket_receive / enet_socket_send, one syscall per datagram
+        MMSG   // recvmmsg / sendmmsg, one syscall per batch (linux only, falls back to BASIC elsewhere)
+    };
+
+    bool parseTransportBackend(const std::string &name, TRANSPORT_BACKEND &backend);
+    const char* transportBackendName(TRANSPORT_BACKEND backend);
+
+    struct datagram {
+        ENetAddress address;
+        size_t length = 0;
+        unsigned char data[DATAGRAM_MAX_SIZE];
+    };
+
+    struct datagram_batch {
+        std::array<datagram, DATAGRAM_BATCH_SIZE> datagrams;
+        size_t count = 0;
+
+        // returns free slot for an outgoing datagram or nullptr when the batch is full
+        datagram* next() {
+            if (count == datagrams.size()) {
+                return nullptr;
+            }
+            return &datagrams[count++];
+        }
+
+        bool full() const {
+            return count == datagrams.size();
+        }
+
+        void clear() {
+            count = 0;
+        }
+
+        datagram& operator [](size_t i) {
+            return datagrams[i];
+        }
+    };
+
+    struct transport_stats {
+        unsigned long long receivedDatagrams = 0;
+        unsigned long long sentDatagrams = 0;
+        unsigned long long droppedDatagrams = 0;
+        unsigned long long syscalls = 0;
+    };
+
+    struct udp_transport {
+        ENetSocket socket;
+        transport_stats stats;
+
+        udp_transport(ENetSocket socket)
+            : socket(socket) {
+        }
+        virtual ~udp_transport() {
+        }
+
+        // non-blocking, replaces the content of the batch, returns number of datagrams received
+        virtual size_t receive(datagram_batch &batch) = 0;
+        // sends all datagrams in the batch and clears it, returns number of datagrams sent
+        virtual size_t send(datagram_batch &batch) = 0;
+
+        virtual TRANSPORT_BACKEND backend() const = 0;
+    };
+
+    // does not take ownership of the socket
+    std::unique_ptr<udp_transport> createTransport(TRANSPORT_BACKEND backend, ENetSocket socket);
+
+    // non-blocking datagram socket bound to given port, ENET_SOCKET_NULL on failure
+    ENetSocket openDatagramSocket(address_t host, port_t port);
+}
+
+#endif /* INCLUDE_TRANSPORT_H_ */
@@ -0,0 +1,340 @@
+/**
+ * heap allocations of the master's request handlers
+ *
+ * Replaces the global operator new / delete with counting ones and drives every request type
+ * through the handlers (handlers.cpp) on an offline host, like the replay tool: the registry is
+ * filled and each request is repeated until the caches are warm, then the allocations of the
+ * following requests are counted. ENet packets (one per packet the master sends) are counted
+ * apart, they are allocated by ENet and not by operator new.
+ *
+ * usage: ./duel6r-masterserver-allocs [--servers=N] [--iterations=N] [--verbose]
+ *
+ * exit code is 1 when a request type allocates more than its budget. ctest runs it (handler-allocs),
+ * so an allocation added to a hot path fails the tests. The handlers reuse their buffers and
+ * pool the peer entries, every budget is 0
+ */
+
+#include <iostream>
+#include <string>
+#include <cstdint>
+#include <cstdlib>
+#include <chrono>
+#include <vector>
+#include <functional>
+#include <algorithm>
+#include <new>
+#include <cstring>
+#include <enet/enet.h>
+#include "../include/masterserver.h"
+#include "../include/handlers.h"
+#include "../include/network.h"
+#include "../include/clock.h"
+
+static bool counting = false;
+static unsigned long long allocations = 0;
+static unsigned long long allocatedBytes = 0;
+
+static void* countedAlloc(size_t size) {
+    if (counting) {
+        allocations++;
+        allocatedBytes += size;
+    }
+    void *p = malloc(size == 0 ? 1 : size);
+    if (p == nullptr) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+static void* countedAlignedAlloc(size_t size, std::align_val_t alignment) {
+    if (counting) {
+        allocations++;
+        allocatedBytes += size;
+    }
+    size_t a = static_cast<size_t>(alignment);
+    void *p = aligned_alloc(a, (size + a - 1) / a * a);
+    if (p == nullptr) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void* operator new(size_t size) {
+    return countedAlloc(size);
+}
+void* operator new[](size_t size) {
+    return countedAlloc(size);
+}
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    try {
+        return countedAlloc(size);
+    } catch (...) {
+        return nullptr;
+    }
+}
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+    try {
+        return countedAlloc(size);
+    } catch (...) {
+        return nullptr;
+    }
+}
+void* operator new(size_t size, std::align_val_t alignment) {
+    return countedAlignedAlloc(size, alignment);
+}
+void* operator new[](size_t size, std::align_val_t alignment) {
+    return countedAlignedAlloc(size, alignment);
+}
+void operator delete(void *p) noexcept {
+    free(p);
+}
+void operator delete[](void *p) noexcept {
+    free(p);
+}
+void operator delete(void *p, size_t) noexcept {
+    free(p);
+}
+void operator delete[](void *p, size_t) noexcept {
+    free(p);
+}
+void operator delete(void *p, std::align_val_t) noexcept {
+    free(p);
+}
+void operator delete[](void *p, std::align_val_t) noexcept {
+    free(p);
+}
+void operator delete(void *p, size_t, std::align_val_t) noexcept {
+    free(p);
+}
+void operator delete[](void *p, size_t, std::align_val_t) noexcept {
+    free(p);
+}
+
+// the master's outgoing side without sockets: packets are counted and dropped
+struct counting_network: public enet_network {
+    unsigned long long packets = 0;
+
+    counting_network(ENetHost *host)
+        : enet_network(host) {
+    }
+
+    void send(ENetPeer *peer, ENetPacket *packet) override {
+        packets++;
+        enet_packet_destroy(packet);
+    }
+};
+
+static counting_network *sink = nullptr;
+static const address_t CLIENT = 0x0a01a8c0;  // 192.168.1.10
+static const address_t SERVERS = 0x0001000a; // 10.0.1.0 + n in the last byte
+static const port_t GAME_PORT = 5910;
+
+static address_t serverAddress(size_t n) {
+    hostAddress h;
+    h.address = SERVERS;
+    h.a[2] = 1 + n / 250;
+    h.a[3] = 1 + n % 250;
+    return h.address;
+}
+
+static ENetPeer* connect(address_t address, port_t port, REQUEST_TYPE type) {
+    ENetAddress a;
+    a.host = address;
+    a.port = port;
+    ENetPeer *peer = enet_host_connect(server, &a, 1, static_cast<enet_uint32>(type));
+    if (peer == nullptr) {
+        fprintf(stderr, "no free peer\n");
+        exit(1);
+    }
+    peer->state = ENET_PEER_STATE_CONNECTED;
+    peer->roundTripTime = 40;
+    peer->lowestRoundTripTime = 40;
+    ENetEvent event;
+    memset(&event, 0, sizeof(event));
+    event.type = ENET_EVENT_TYPE_CONNECT;
+    event.peer = peer;
+    event.data = static_cast<enet_uint32>(type);
+    handleConnect(event);
+    return peer;
+}
+
+static void receive(ENetPeer *peer, ENetPacket *packet) {
+    ENetEvent event;
+    memset(&event, 0, sizeof(event));
+    event.type = ENET_EVENT_TYPE_RECEIVE;
+    event.peer = peer;
+    event.packet = packet;
+    handleReceive(event);
+}
+
+static void disconnect(ENetPeer *peer) {
+    ENetEvent event;
+    memset(&event, 0, sizeof(event));
+    event.type = ENET_EVENT_TYPE_DISCONNECT;
+    event.peer = peer;
+    handleDisconnect(event);
+    enet_peer_reset(peer);
+}
+
+// every peer the master left behind (its own outgoing connections too)
+static void disconnectAll() {
+    for (size_t i = 0; i < server->peerCount; i++) {
+        if (server->peers[i].state != ENET_PEER_STATE_DISCONNECTED) {
+            disconnect(&server->peers[i]);
+        }
+    }
+}
+
+struct request_kind {
+    const char *name;
+    unsigned long long allocationBudget; // per request
+    std::function<void()> run;
+    unsigned long long allocations = 0;
+    unsigned long long bytes = 0;
+    unsigned long long packets = 0;
+};
+
+int main(int argc, char *argv[]) {
+    size_t servers = 50;
+    size_t iterations = 1000;
+    bool verbose = false;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg.rfind("--servers=", 0) == 0) {
+            servers = std::stoul(arg.substr(strlen("--servers=")));
+        } else if (arg.rfind("--iterations=", 0) == 0) {
+            iterations = std::stoul(arg.substr(strlen("--iterations=")));
+        } else if (arg == "--verbose") {
+            verbose = true;
+        } else {
+            fprintf(stderr, "usage: %s [--servers=N] [--iterations=N] [--verbose]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    server = enet_host_create(NULL, 32, 1, 0, 0);
+    if (server == NULL) {
+        fprintf(stderr, "An error occurred while trying to create an ENet host.\n");
+        return 1;
+    }
+    enet_socket_destroy(server->socket);
+    server->socket = ENET_SOCKET_NULL;
+    counting_network countingNetwork(server);
+    sink = &countingNetwork;
+    network = &countingNetwork;
+    if (!verbose && freopen("/dev/null", "w", stdout) == nullptr) {
+        fprintf(stderr, "Cannot silence handler output\n");
+    }
+    virtual_clock clock(std::chrono::steady_clock::now());
+    now = clock.time();
+    auto nextHousekeeping = now;
+
+    // client packets arrive in ENet's buffers, they are built once
+    packetHeader header;
+    header.type = PACKET_TYPE::SERVER_UPDATE;
+    packet_update update;
+    update.descr = "CTF on a map with a typical name [8/16]";
+    update.localNetworkAddress = 0x0200a8c0;
+    update.localNetworkPort = GAME_PORT;
+    std::vector<ENetPacket*> updates;
+    for (size_t n = 0; n < servers; n++) {
+        updates.push_back(buildPacket(ENET_PACKET_FLAG_RELIABLE, header, update));
+    }
+    header.type = PACKET_TYPE::SERVER_UPDATE_PARTIAL;
+    packet_update_partial partial;
+    partial.fields = UPDATE_DESCRIPTION;
+    partial.descr = update.descr;
+    ENetPacket *partialPacket = buildPacket(ENET_PACKET_FLAG_RELIABLE, header, partial);
+    header.type = PACKET_TYPE::CLIENT_NAT_PUNCH;
+    packet_nat_punch punch;
+    punch.address = serverAddress(0);
+    punch.port = GAME_PORT;
+    punch.clientLocalNetworkAddress = 0x0300a8c0;
+    punch.clientLocalNetworkPort = 41000;
+    ENetPacket *punchPacket = buildPacket(ENET_PACKET_FLAG_RELIABLE, header, punch);
+    if (partialPacket == nullptr || punchPacket == nullptr
+        || std::find(updates.begin(), updates.end(), nullptr) != updates.end()) {
+        fprintf(stderr, "Cannot build the request packets\n");
+        return 1;
+    }
+
+    for (size_t n = 0; n < servers; n++) {
+        ENetPeer *peer = connect(serverAddress(n), GAME_PORT, REQUEST_TYPE::SERVER_UPDATE);
+        receive(peer, updates[n]);
+        disconnect(peer);
+    }
+
+    size_t next = 0;
+    std::vector<request_kind> kinds = {
+        { "server list", 0, []() {
+            disconnect(connect(CLIENT, 40000, REQUEST_TYPE::CLIENT_REQUEST_SERVERLIST));
+        } },
+        { "register", 0, [&]() {
+            disconnect(connect(serverAddress(next++ % servers), GAME_PORT, REQUEST_TYPE::SERVER_REGISTER));
+        } },
+        { "full update", 0, [&]() {
+            size_t n = next++ % servers;
+            ENetPeer *peer = connect(serverAddress(n), GAME_PORT, REQUEST_TYPE::SERVER_UPDATE);
+            receive(peer, updates[n]);
+            disconnect(peer);
+        } },
+        { "partial update", 0, [&]() {
+            ENetPeer *peer = connect(serverAddress(next++ % servers), GAME_PORT, REQUEST_TYPE::SERVER_UPDATE);
+            receive(peer, partialPacket);
+            disconnect(peer);
+        } },
+        { "NAT peers poll", 0, [&]() {
+            disconnect(connect(serverAddress(next++ % servers), GAME_PORT, REQUEST_TYPE::SERVER_NAT_GET_PEERS));
+        } },
+        // the client asks, the master calls the server back and sends both ends the schedule
+        { "NAT punch", 0, [&]() {
+            ENetPeer *client = connect(CLIENT, 40001, REQUEST_TYPE::CLIENT_NAT_CONNECT_TO_SERVER);
+            receive(client, punchPacket);
+            for (size_t i = 0; i < server->peerCount; i++) {
+                ENetPeer *push = &server->peers[i];
+                if (push->state == ENET_PEER_STATE_CONNECTING) {
+                    push->state = ENET_PEER_STATE_CONNECTED;
+                    ENetEvent event;
+                    memset(&event, 0, sizeof(event));
+                    event.type = ENET_EVENT_TYPE_CONNECT;
+                    event.peer = push;
+                    handleConnect(event);
+                }
+            }
+            disconnectAll();
+        } },
+    };
+
+    bool overBudget = false;
+    fprintf(stderr, "%zu servers registered, %zu requests of each type after warming up\n", hostList.mapa.size(), iterations);
+    fprintf(stderr, "%-16s %12s %12s %10s %8s\n", "request", "allocations", "bytes", "packets", "budget");
+    for (request_kind &k : kinds) {
+        for (size_t i = 0; i < 100; i++) {
+            k.run();
+        }
+        unsigned long long packetsBefore = sink->packets;
+        allocations = 0;
+        allocatedBytes = 0;
+        for (size_t i = 0; i < iterations; i++) {
+            clock.advanceTo(clock.time() + std::chrono::milliseconds(1));
+            now = clock.time();
+            if (now >= nextHousekeeping) {
+                // periodic work is not part of any request
+                housekeeping();
+                nextHousekeeping = now + std::chrono::milliseconds(100);
+            }
+            counting = true;
+            k.run();
+            counting = false;
+        }
+        k.allocations = allocations;
+        k.bytes = allocatedBytes;
+        k.packets = sink->packets - packetsBefore;
+        double perRequest = (double) k.allocations / iterations;
+        bool over = perRequest > k.allocationBudget;
+        overBudget = overBudget || over;
+        fprintf(stderr, "%-16s %12.2f %12.1f %10.2f %8llu%s\n", k.name, perRequest, (double) k.bytes / iterations,
+            (double) k.packets / iterations, k.allocationBudget, over ? "  OVER BUDGET" : "");
+    }
+    return overBudget ? 1 : 0;
+}
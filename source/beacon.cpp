@@ -1,5 +1,11 @@
 /**
  * dev tool (client side) for figuring out the NAT intricacies
+ *
+ * Probes the NAT classification service of a master started with --flare (see flare.h):
+ * one binding request from the local socket to every probe port at once, answers to the
+ * master's unsolicited probe, and the verdict the master will record for this local port.
+ *
+ * usage: ./beacon host [p1,p2,...] [local port]   (defaults: probe ports 5902,15903,25904, local port 5902)
  */
 
 #include <iostream>
@@ -7,112 +13,129 @@
 #include <string>
 #include <cstdint>
 #include <chrono>
-#include <ctime>
-#include <map>
-#include <tuple>
-#include <list>
+#include <random>
+#include <algorithm>
+#include <vector>
 #include <cstring>
 #include <enet/enet.h>
+#include "../include/protocol.h"
+#include "../include/transport.h"
+#include "../include/stun.h"
+#include "../include/flare.h"
 
-std::string addressToStr(enet_uint32 a) {
-    union hostAddress {
-        enet_uint32 address;
-        uint8_t a[4];
-    };
-    std::ostringstream is;
-    hostAddress hostAddress;
-    hostAddress.address = a;
-
-    is << (uint16_t) hostAddress.a[0];
-    is << ".";
-    is << (uint16_t) hostAddress.a[1];
-    is << ".";
-    is << (uint16_t) hostAddress.a[2];
-    is << ".";
-    is << (uint16_t) hostAddress.a[3];
-    return is.str();
-}
+using namespace masterserver;
 
 int main(int argc, char *argv[]) {
     std::string flareHost = "example.com";
+    std::vector<port_t> probePorts = { 5902, 15903, 25904 };
+    port_t localPort = 5902;
 
     if (argc > 1) {
         flareHost = std::string(argv[1]);
     }
+    if (argc > 2) {
+        probePorts.clear();
+        std::istringstream ports(argv[2]);
+        std::string port;
+        while (std::getline(ports, port, ',')) {
+            probePorts.push_back(std::stoi(port));
+        }
+    }
+    if (argc > 3) {
+        localPort = std::stoi(argv[3]);
+    }
+    if (enet_initialize() != 0) {
+        fprintf(stderr, "An error occurred while initializing ENet.\n");
+        return EXIT_FAILURE;
+    }
 
-    ENetAddress address;
-
-    /* Bind the server to the default localhost.     */
-    address.host = ENET_HOST_ANY;
-
-    for (size_t currentPort = 5902; currentPort < 6000; currentPort++) {
-
-        address.port = currentPort;
+    ENetAddress flareAddress;
+    if (enet_address_set_host(&flareAddress, flareHost.c_str()) != 0) {
+        fprintf(stderr, "Cannot resolve %s\n", flareHost.c_str());
+        return EXIT_FAILURE;
+    }
+    ENetSocket socket = openDatagramSocket(ENET_HOST_ANY, localPort);
+    if (socket == ENET_SOCKET_NULL) {
+        fprintf(stderr, "Cannot bind local port %u\n", localPort);
+        return EXIT_FAILURE;
+    }
+    std::unique_ptr<udp_transport> transport = createTransport(TRANSPORT_BACKEND::BASIC, socket);
+    datagram_batch batch;
 
-        ENetHost *server;
+    flare::transaction_t transaction = flare::makeTransaction(localPort, std::random_device()());
+    std::vector<port_t> mapped(probePorts.size(), 0);
+    bool reached = false;
 
-        server = enet_host_create(&address /* create a server host */,
-            10,
-            1 /* allow up 2 channels to be used, 0 and 1 */,
-            0 /* assume any amount of incoming bandwidth */,
-            0 /* assume any amount of outgoing bandwidth */);
-        if (server == NULL)
-        {
-            fprintf(stderr,
-                "An error occurred while trying to create an ENet client host.\n");
-            exit(EXIT_FAILURE);
+    auto start = std::chrono::steady_clock::now();
+    auto lastSent = start - std::chrono::seconds(1);
+    auto allMappedAt = start;
+    for (;;) {
+        auto now = std::chrono::steady_clock::now();
+        bool allMapped = std::find(mapped.begin(), mapped.end(), 0) == mapped.end();
+        if (now - start >= std::chrono::milliseconds(FLARE_DEADLINE_MS)
+            || (allMapped && (reached || now - allMappedAt >= std::chrono::milliseconds(FLARE_FILTER_WAIT_MS)))) {
+            break;
         }
-        ENetEvent event;
-
-        ENetAddress flareAddress;
-        flareAddress.port = 5902;
-        enet_address_set_host(&flareAddress, flareHost.c_str());
-        ENetAddress flareAddress2;
-        flareAddress2.port = 15903;
-        enet_address_set_host(&flareAddress2, flareHost.c_str());
-        ENetAddress flareAddress3;
-        flareAddress3.port = 25904;
-        enet_address_set_host(&flareAddress3, flareHost.c_str());
-        ENetPeer *peer1 = enet_host_connect(server, &flareAddress, 1, currentPort);
-        ENetPeer *peer2 = enet_host_connect(server, &flareAddress2, 1, currentPort);
-        ENetPeer *peer3 = enet_host_connect(server, &flareAddress3, 1, currentPort);
-        bool dis1 = true, dis2 = true, dis3 = true;
-        bool con1 = false, con2 = false, con3 = false;
-        while (dis1 || dis2 || dis3) {
-            if (con1 && con2 && con3) {
-                enet_peer_disconnect(peer1, 0);
-                enet_peer_disconnect(peer2, 0);
-                enet_peer_disconnect(peer3, 0);
-            }
-            while (enet_host_service(server, &event, 0) > 0) {
-                switch (event.type)
-                {
-                case ENET_EVENT_TYPE_NONE:
-                    break;
-                case ENET_EVENT_TYPE_CONNECT: {
-                    printf("Connected\n");
-                    if (event.peer == peer1) con1 = true;
-                    if (event.peer == peer2) con2 = true;
-                    if (event.peer == peer3) con3 = true;
-                    break;
-                }
-                case ENET_EVENT_TYPE_DISCONNECT: {
-                    printf("Disconnected... .\n");
-                    if (event.peer == peer1) dis1 = false;
-                    if (event.peer == peer2) dis2 = false;
-                    if (event.peer == peer3) dis3 = false;
-                    break;
+        // all probe ports at once, repeated for the ones that did not answer yet
+        if (now - lastSent >= std::chrono::milliseconds(100)) {
+            batch.clear();
+            for (size_t i = 0; i < probePorts.size(); i++) {
+                if (mapped[i] == 0) {
+                    datagram *d = batch.next();
+                    d->address = flareAddress;
+                    d->address.port = probePorts[i];
+                    d->length = stun::buildBindingRequest(d->data, sizeof(d->data), transaction.data());
                 }
-                case ENET_EVENT_TYPE_RECEIVE: {
-                    enet_packet_destroy(event.packet);
+            }
+            transport->send(batch);
+            lastSent = now;
+        }
 
-                    break;
-                }
+        enet_uint32 condition = ENET_SOCKET_WAIT_RECEIVE;
+        enet_socket_wait(socket, &condition, 10);
+        if (transport->receive(batch) == 0) {
+            continue;
+        }
+        size_t answers = 0;
+        for (size_t i = 0; i < batch.count; i++) {
+            datagram &d = batch[i];
+            ENetAddress m;
+            if (stun::parseBindingResponse(d.data, d.length, transaction.data(), m)) {
+                for (size_t p = 0; p < probePorts.size(); p++) {
+                    if (probePorts[p] == d.address.port && mapped[p] == 0) {
+                        mapped[p] = m.port;
+                        allMappedAt = std::chrono::steady_clock::now();
+                        printf("probe port %5u: mapped to %s (%.1f ms)\n", probePorts[p], hostToIPaddress(m.host, m.port).c_str(),
+                            std::chrono::duration<double, std::milli>(allMappedAt - start).count());
+                    }
                 }
+                continue;
+            }
+            // the master's unsolicited probe made it through the NAT
+            size_t length = stun::respondInPlace(d.data, d.length, sizeof(d.data), d.address);
+            if (length > 0) {
+                printf("unsolicited probe from port %u got through\n", d.address.port);
+                reached = true;
+                d.length = length;
+                batch[answers++] = d;
             }
         }
-        enet_host_destroy(server);
+        batch.count = answers;
+        transport->send(batch);
     }
+    double elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
 
-    return 0;
+    int32_t portDelta = 0;
+    NAT_TYPE type = flare::classify(mapped, reached, portDelta);
+    if (std::count_if(mapped.begin(), mapped.end(), [](port_t p) { return p != 0; }) < 2) {
+        type = NAT_TYPE::UNKNOWN;
+    }
+    printf("local port %u: %s NAT", localPort, flare::natTypeName(type));
+    if (type == NAT_TYPE::SYMMETRIC) {
+        printf(", port delta %d", portDelta);
+    }
+    printf(" (%.0f ms)\n", elapsed);
+    enet_socket_destroy(socket);
+    enet_deinitialize();
+    return type == NAT_TYPE::UNKNOWN ? EXIT_FAILURE : EXIT_SUCCESS;
 }
@@ -0,0 +1,629 @@
+/**
+ * load generator / datagram throughput meter for the masterserver transports
+ *
+ * usage: ./loadgen sink [port] [seconds] [basic|mmsg]
+ *        ./loadgen blast host port [seconds] [basic|mmsg] [datagram size]
+ *        ./loadgen limiter [sources] [requests]
+ *        ./loadgen serialize [peers] [iterations]
+ *        ./loadgen stun [iterations]
+ *        ./loadgen stun-blast host port [seconds] [basic|mmsg]
+ *        ./loadgen egress [clients] [link KiB/s] [list bytes]
+ *        ./loadgen profile [iterations]
+ *        ./loadgen lists host:port[,host:port...] [clients] [seconds]
+ *
+ * run `sink` and `blast` on loopback with the same backend to get datagrams per second per core,
+ * `stun-blast` against a master started with --stun=port measures answered binding requests per second,
+ * `egress` replays a burst of list requests with punch traffic through the egress scheduler into a link model,
+ * `lists` keeps clients fetching server lists through the masterclient library, racing all masters given
+ */
+
+#include <iostream>
+#include <string>
+#include <cstdint>
+#include <chrono>
+#include <cstring>
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <sstream>
+#include <memory>
+#include <functional>
+#include <enet/enet.h>
+#include "../include/protocol.h"
+#include "../include/transport.h"
+#include "../include/ratelimit.h"
+#include "../include/stun.h"
+#include "../include/egress.h"
+#include "../include/profile.h"
+#include "../include/masterclient.h"
+
+using namespace masterserver;
+
+int sink(port_t port, int seconds, TRANSPORT_BACKEND backend) {
+    ENetSocket socket = openDatagramSocket(ENET_HOST_ANY, port);
+    if (socket == ENET_SOCKET_NULL) {
+        fprintf(stderr, "Cannot bind port %u\n", port);
+        return 1;
+    }
+    auto transport = createTransport(backend, socket);
+    datagram_batch batch;
+
+    printf("sink on port %u using %s backend\n", port, transportBackendName(transport->backend()));
+    auto start = std::chrono::steady_clock::now();
+    auto end = start + std::chrono::seconds(seconds);
+    auto lastReport = start;
+    unsigned long long lastReceived = 0;
+    unsigned long long lastSyscalls = 0;
+    while (std::chrono::steady_clock::now() < end) {
+        if (transport->receive(batch) == 0) {
+            enet_uint32 condition = ENET_SOCKET_WAIT_RECEIVE;
+            enet_socket_wait(socket, &condition, 10);
+        }
+        auto t = std::chrono::steady_clock::now();
+        if (t - lastReport >= std::chrono::seconds(1)) {
+            double elapsed = std::chrono::duration<double>(t - lastReport).count();
+            unsigned long long received = transport->stats.receivedDatagrams - lastReceived;
+            unsigned long long syscalls = transport->stats.syscalls - lastSyscalls;
+            printf("%10.0f datagrams/s  %8.2f datagrams/syscall\n", received / elapsed,
+                syscalls > 0 ? (double) received / syscalls : 0.0);
+            lastReport = t;
+            lastReceived = transport->stats.receivedDatagrams;
+            lastSyscalls = transport->stats.syscalls;
+        }
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("total: %llu datagrams, %llu syscalls, %.0f datagrams/s\n", transport->stats.receivedDatagrams,
+        transport->stats.syscalls, transport->stats.receivedDatagrams / elapsed);
+    enet_socket_destroy(socket);
+    return 0;
+}
+
+int blast(const std::string &host, port_t port, int seconds, TRANSPORT_BACKEND backend, size_t size) {
+    ENetSocket socket = openDatagramSocket(ENET_HOST_ANY, ENET_PORT_ANY);
+    if (socket == ENET_SOCKET_NULL) {
+        fprintf(stderr, "Cannot create socket\n");
+        return 1;
+    }
+    ENetAddress target;
+    enet_address_set_host(&target, host.c_str());
+    target.port = port;
+    if (size > DATAGRAM_MAX_SIZE) {
+        size = DATAGRAM_MAX_SIZE;
+    }
+
+    auto transport = createTransport(backend, socket);
+    datagram_batch batch;
+    printf("blasting %s using %s backend\n", hostToIPaddress(target.host, target.port).c_str(),
+        transportBackendName(transport->backend()));
+
+    auto start = std::chrono::steady_clock::now();
+    auto end = start + std::chrono::seconds(seconds);
+    enet_uint32 sequence = 0;
+    while (std::chrono::steady_clock::now() < end) {
+        while (datagram *d = batch.next()) {
+            d->address = target;
+            d->length = size;
+            memset(d->data, 0, size);
+            memcpy(d->data, &sequence, sizeof(sequence) < size ? sizeof(sequence) : size);
+            sequence++;
+        }
+        if (transport->send(batch) == 0) {
+            enet_uint32 condition = ENET_SOCKET_WAIT_SEND;
+            enet_socket_wait(socket, &condition, 1);
+        }
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("total: %llu datagrams sent (%llu dropped), %llu syscalls, %.0f datagrams/s\n", transport->stats.sentDatagrams,
+        transport->stats.droppedDatagrams, transport->stats.syscalls, transport->stats.sentDatagrams / elapsed);
+    enet_socket_destroy(socket);
+    return 0;
+}
+
+// cost of one connection request going through the pre-handshake rate limiter
+int limiter(size_t sources, size_t requests) {
+    rate_limiter connectLimiter;
+    std::vector<address_t> addresses(sources);
+    enet_uint32 x = 2463534242u;
+    for (auto &a : addresses) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        a = x;
+    }
+    size_t allowed = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < requests; i++) {
+        enet_uint32 requestType = i % static_cast<size_t>(REQUEST_TYPE::COUNT);
+        allowed += connectLimiter.allow(addresses[i % sources], requestType, i / 1000);
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    rate_limiter_stats total = connectLimiter.total();
+    printf("%zu requests from %zu sources: %.1f ns/request, allowed %zu, dropped %llu/%llu, evictions %llu\n", requests, sources,
+        elapsed * 1e9 / requests, allowed, total.droppedByAddress, total.droppedByPrefix, total.evictions);
+    return 0;
+}
+
+// field by field encoding of packet_nat_peers, as it was before the fixed layout fast path
+struct legacy_nat_peers {
+    struct _peer {
+        address_t address = 0;
+        port_t port = 0;
+        address_t localNetworkAddress = 0;
+        port_t localNetworkPort = 0;
+        template<typename Stream>
+        bool serialize(Stream &s) {
+            return s & raw(address)
+                && s & port
+                && s & raw(localNetworkAddress)
+                && s & localNetworkPort;
+        }
+    };
+    struct _port_window {
+        port_t firstPort = 0;
+        uint16_t count = 0;
+        int16_t step = 0;
+        template<typename Stream>
+        bool serialize(Stream &s) {
+            return s & firstPort
+                && s & count
+                && s & step;
+        }
+    };
+    address_t yourPublicAddress = 0;
+    port_t yourPublicPort = 0;
+    uint16_t peerCount = 0;
+    std::vector<_peer> peers;
+    std::vector<_port_window> predictions;
+    template<typename Stream>
+    bool serialize(Stream &s) {
+        return s & raw(yourPublicAddress)
+            && s & yourPublicPort
+            && s & peerCount
+            && s & peers
+            && s & predictions;
+    }
+};
+
+// encodes packet_nat_peers with the fixed layout fast path and field by field; the round trips of every field
+// are checked by the tests (source/tests.cpp), here only that both encodings produce the same bytes
+int serializeBench(size_t peers, size_t iterations) {
+    packet_nat_peers p;
+    legacy_nat_peers l;
+    p.yourPublicAddress = l.yourPublicAddress = 0x0100007f;
+    p.yourPublicPort = l.yourPublicPort = 25900;
+    for (size_t i = 0; i < peers; i++) {
+        packet_nat_peers::_peer peer;
+        peer.address = 0x0a000000 + i;
+        peer.port = 5900 + i;
+        peer.localNetworkAddress = 0xc0a80000 + i;
+        peer.localNetworkPort = 6000 + i;
+        p.peers.push_back(peer);
+        legacy_nat_peers::_peer lpeer;
+        lpeer.address = peer.address;
+        lpeer.port = peer.port;
+        lpeer.localNetworkAddress = peer.localNetworkAddress;
+        lpeer.localNetworkPort = peer.localNetworkPort;
+        l.peers.push_back(lpeer);
+        packet_nat_peers::_port_window window;
+        window.firstPort = peer.port + 1;
+        window.count = i % 3 == 0 ? 8 : 0;
+        window.step = 1;
+        p.predictions.push_back(window);
+        legacy_nat_peers::_port_window lwindow;
+        lwindow.firstPort = window.firstPort;
+        lwindow.count = window.count;
+        lwindow.step = window.step;
+        l.predictions.push_back(lwindow);
+    }
+    p.peerCount = l.peerCount = peers;
+
+    auto encode = [](auto &packet) {
+        serializer s;
+        packetHeader header;
+        header.type = PACKET_TYPE::SERVER_NAT_PEERS;
+        s << header;
+        s << packet;
+        return s.getData();
+    };
+    auto fast = encode(p);
+    auto legacy = encode(l);
+    if (fast != legacy) {
+        fprintf(stderr, "encoded packets differ (%zu vs %zu bytes)\n", fast.size(), legacy.size());
+        return 1;
+    }
+    packetHeader header;
+
+    auto measure = [iterations](const char *name, auto &&f) {
+        auto start = std::chrono::steady_clock::now();
+        size_t bytes = 0;
+        for (size_t i = 0; i < iterations; i++) {
+            bytes += f();
+        }
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        printf("%-20s %8.1f ns/packet (%zu bytes)\n", name, elapsed * 1e9 / iterations, bytes / iterations);
+    };
+    measure("encode field by field", [&]() { return encode(l).size(); });
+    measure("encode fixed layout", [&]() { return encode(p).size(); });
+    measure("decode field by field", [&]() {
+        deserializer d(legacy);
+        legacy_nat_peers x;
+        d >> header;
+        d >> x;
+        return legacy.size();
+    });
+    measure("decode fixed layout", [&]() {
+        deserializer d(fast);
+        packet_nat_peers x;
+        d >> header;
+        d >> x;
+        return fast.size();
+    });
+    return 0;
+}
+
+// in-buffer binding responder: responses per second (its correctness is the "stun" group of tests.cpp)
+int stunBench(size_t iterations) {
+    unsigned char transaction[STUN_TRANSACTION_SIZE] = { 0 };
+    unsigned char data[DATAGRAM_MAX_SIZE];
+    ENetAddress from;
+    enet_address_set_host(&from, "192.0.2.1");
+    from.port = 25900;
+    size_t requestLength = stun::buildBindingRequest(data, sizeof(data), transaction);
+    unsigned char request[STUN_HEADER_SIZE];
+    memcpy(request, data, requestLength);
+    auto start = std::chrono::steady_clock::now();
+    size_t total = 0;
+    for (size_t i = 0; i < iterations; i++) {
+        memcpy(data, request, requestLength);
+        from.port = i;
+        total += stun::respondInPlace(data, requestLength, sizeof(data), from);
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("respondInPlace: %.0f responses/s (%zu bytes)\n", iterations / elapsed, total);
+    return 0;
+}
+
+int stunBlast(const std::string &host, port_t port, int seconds, TRANSPORT_BACKEND backend) {
+    ENetSocket socket = openDatagramSocket(ENET_HOST_ANY, ENET_PORT_ANY);
+    if (socket == ENET_SOCKET_NULL) {
+        fprintf(stderr, "Cannot create socket\n");
+        return 1;
+    }
+    ENetAddress target;
+    enet_address_set_host(&target, host.c_str());
+    target.port = port;
+    auto transport = createTransport(backend, socket);
+    datagram_batch batch;
+    unsigned char transaction[STUN_TRANSACTION_SIZE] = { 0 };
+    printf("sending binding requests to %s using %s backend\n", hostToIPaddress(target.host, target.port).c_str(),
+        transportBackendName(transport->backend()));
+
+    unsigned long long answered = 0;
+    size_t inFlight = 0;
+    auto start = std::chrono::steady_clock::now();
+    auto end = start + std::chrono::seconds(seconds);
+    enet_uint32 sequence = 0;
+    while (std::chrono::steady_clock::now() < end) {
+        // keep a bounded number of requests in flight so the responder is measured and not the socket buffers
+        if (inFlight < 4 * DATAGRAM_BATCH_SIZE) {
+            while (datagram *d = batch.next()) {
+                d->address = target;
+                memcpy(transaction, &sequence, sizeof(sequence));
+                sequence++;
+                d->length = stun::buildBindingRequest(d->data, sizeof(d->data), transaction);
+            }
+            inFlight += transport->send(batch);
+        }
+        size_t received = transport->receive(batch);
+        for (size_t i = 0; i < received; i++) {
+            ENetAddress mapped;
+            // transaction ids carry our sequence number, anything we did not send yet is not counted
+            const unsigned char *id = batch[i].data + 8;
+            if (batch[i].length < STUN_HEADER_SIZE || !stun::parseBindingResponse(batch[i].data, batch[i].length, id, mapped)) {
+                continue;
+            }
+            enet_uint32 answeredSequence;
+            memcpy(&answeredSequence, id, sizeof(answeredSequence));
+            if (answeredSequence < sequence) {
+                answered++;
+                inFlight = inFlight > 0 ? inFlight - 1 : 0;
+            }
+        }
+        batch.clear();
+        if (received == 0) {
+            enet_uint32 condition = ENET_SOCKET_WAIT_RECEIVE;
+            enet_socket_wait(socket, &condition, 1);
+            if (condition == 0) {
+                // nothing came back for a while, the rest was lost and must not stall the window
+                inFlight = 0;
+            }
+        }
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("total: %llu requests sent, %llu responses, %.0f responses/s\n", transport->stats.sentDatagrams, answered,
+        answered / elapsed);
+    enet_socket_destroy(socket);
+    return 0;
+}
+
+// bottleneck link of the master: packets leave one after another at `rate` bytes per second
+struct link_model: public master_network {
+    const std::chrono::steady_clock::time_point &clock;
+    double rate;
+    std::chrono::steady_clock::time_point free;
+    std::vector<double> delayMs[EGRESS_CLASSES_COUNT]; // from the handler's send to the last byte on the wire
+    std::vector<std::chrono::steady_clock::time_point> sentAt; // by handler call, see egressBench
+
+    link_model(const std::chrono::steady_clock::time_point &clock, double rate)
+        : clock(clock), rate(rate), free(clock) {
+    }
+
+    ENetPeer* connect(const ENetAddress &address, enet_uint32 data) override {
+        return nullptr;
+    }
+    void timeout(ENetPeer *peer, enet_uint32 limit, enet_uint32 minimum, enet_uint32 maximum) override {
+    }
+    void send(ENetPeer *peer, ENetPacket *packet) override {
+        free = std::max(free, clock) + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double>(packet->dataLength / rate));
+        // the handler's send time travels in the packet
+        size_t call;
+        memcpy(&call, packet->data + 1, sizeof(call));
+        delayMs[static_cast<int>(egress_network::classOf(packet))].push_back(
+            std::chrono::duration<double, std::milli>(free - sentAt[call]).count());
+        enet_packet_destroy(packet);
+    }
+    void disconnect(ENetPeer *peer, enet_uint32 data) override {
+    }
+    void disconnectLater(ENetPeer *peer, enet_uint32 data) override {
+    }
+    void disconnectNow(ENetPeer *peer, enet_uint32 data) override {
+    }
+};
+
+static void printDelays(const char *what, std::vector<double> &ms) {
+    if (ms.empty()) {
+        return;
+    }
+    std::sort(ms.begin(), ms.end());
+    double sum = 0;
+    for (double m : ms) {
+        sum += m;
+    }
+    printf("  %-6s %6zu packets: avg %8.1f ms, p50 %8.1f ms, p99 %8.1f ms, max %8.1f ms\n", what, ms.size(), sum / ms.size(),
+        ms[ms.size() / 2], ms[ms.size() * 99 / 100], ms.back());
+}
+
+// `clients` list requests within one second while punch schedules go out every 10 ms for two seconds, once straight into
+// the link (as without the scheduler) and once paced to 90% of the link rate
+int egressBench(size_t clients, double linkRate, size_t listBytes) {
+    const size_t natBytes = 24;
+    for (int paced = 0; paced < 2; paced++) {
+        std::chrono::steady_clock::time_point clock;
+        link_model link(clock, linkRate);
+        egress_network egress(link);
+        egress.rate = paced ? 0.9 * linkRate : 0;
+        std::vector<ENetPeer> peers(clients + 1);
+        for (size_t i = 0; i < peers.size(); i++) {
+            memset(&peers[i], 0, sizeof(peers[i]));
+            peers[i].state = ENET_PEER_STATE_CONNECTED;
+            peers[i].connectID = i + 1;
+        }
+        auto send = [&](ENetPeer &peer, PACKET_TYPE type, size_t bytes) {
+            ENetPacket *packet = enet_packet_create(nullptr, bytes, ENET_PACKET_FLAG_RELIABLE);
+            memset(packet->data, 0, bytes);
+            packet->data[0] = type;
+            size_t call = link.sentAt.size();
+            memcpy(packet->data + 1, &call, sizeof(call));
+            link.sentAt.push_back(clock);
+            egress.send(&peer, packet);
+        };
+        size_t nextClient = 0;
+        auto start = clock;
+        for (size_t ms = 0; ms < 60000 && (nextClient < clients || egress.pending() || ms < 2000); ms++) {
+            clock = start + std::chrono::milliseconds(ms);
+            egress.flush(clock);
+            while (nextClient < clients && nextClient * 1000 / clients <= ms) {
+                send(peers[nextClient++], PACKET_TYPE::SERVER_LIST, listBytes);
+            }
+            if (ms % 10 == 0 && ms < 2000) {
+                send(peers[clients], PACKET_TYPE::NAT_PUNCH_SCHEDULE, natBytes);
+            }
+        }
+        double drained = std::chrono::duration<double>(link.free - start).count();
+        printf("%s: %zu lists of %zu bytes in 1 s over a %.0f KiB/s link, all sent after %.2f s\n",
+            paced ? "egress scheduler (90% of the link)" : "straight to ENet", clients, listBytes, linkRate / 1024, drained);
+        printDelays("NAT", link.delayMs[static_cast<int>(EGRESS_CLASS::NAT)]);
+        printDelays("lists", link.delayMs[static_cast<int>(EGRESS_CLASS::BULK)]);
+        if (paced) {
+            printf("  peak queue %zu bytes, %llu lists paced\n", egress.stats.peakQueuedBytes, egress.stats.deferred);
+        }
+    }
+    return 0;
+}
+
+// cost of a profiler scope around a trivial body: none, compiled in but not recording, recording
+int profileBench(size_t iterations) {
+    volatile uint64_t sink = 0;
+    auto measure = [&](int variant) {
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < iterations; i++) {
+            if (variant == 0) {
+                sink = sink + i;
+            } else {
+                profile::scope scope("bench");
+                sink = sink + i;
+            }
+        }
+        return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / iterations;
+    };
+    measure(0); // warm up
+    double none = measure(0);
+    profile::recording = false;
+    double idle = measure(1);
+    profile::recording = true;
+    double recording = measure(1);
+    profile::recording = false;
+#ifndef D6R_PROFILE
+    printf("note: built without D6R_PROFILE, PROFILE_SCOPE compiles to nothing in the master\n");
+#endif
+    printf("%zu iterations: no scope %.2f ns, scope not recording %.2f ns (+%.2f), recording %.2f ns (+%.2f)\n", iterations,
+        none, idle, idle - none, recording, recording - none);
+    return 0;
+}
+
+// clients fetching lists back to back (no cache) over one ENet host, each fetch races all masters
+int listsBench(const std::string &masterList, size_t clients, int seconds) {
+    if (enet_initialize() != 0) {
+        fprintf(stderr, "An error occurred while initializing ENet.\n");
+        return 1;
+    }
+    std::vector<ENetAddress> masters;
+    std::stringstream ss(masterList);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        size_t colon = item.rfind(':');
+        ENetAddress address;
+        if (colon == std::string::npos || enet_address_set_host(&address, item.substr(0, colon).c_str()) != 0) {
+            fprintf(stderr, "Cannot resolve %s\n", item.c_str());
+            return 1;
+        }
+        address.port = std::stoi(item.substr(colon + 1));
+        masters.push_back(address);
+    }
+    ENetHost *host = enet_host_create(NULL, clients * masters.size(), 1, 0, 0);
+    if (host == NULL) {
+        fprintf(stderr, "Cannot create an ENet host for %zu peers\n", clients * masters.size());
+        return 1;
+    }
+    std::vector<std::unique_ptr<masterclient::client>> fetchers;
+    std::vector<double> latencies;
+    unsigned long long failed = 0;
+    auto end = std::chrono::steady_clock::now() + std::chrono::seconds(seconds);
+    std::function<void(masterclient::client&)> fetch = [&](masterclient::client &c) {
+        auto started = std::chrono::steady_clock::now();
+        c.fetchList([&, started](masterclient::RESULT result, const masterclient::server_list&) {
+            auto t = std::chrono::steady_clock::now();
+            if (result == masterclient::RESULT::OK) {
+                latencies.push_back(std::chrono::duration<double, std::milli>(t - started).count());
+            } else {
+                failed++;
+            }
+            if (t < end) {
+                fetch(c);
+            }
+        });
+    };
+    for (size_t i = 0; i < clients; i++) {
+        fetchers.push_back(std::make_unique<masterclient::client>(masters, host));
+        fetchers.back()->listTtl = std::chrono::milliseconds(0);
+        fetch(*fetchers.back());
+    }
+    auto start = std::chrono::steady_clock::now();
+    bool busy = true;
+    while (busy) {
+        ENetEvent event;
+        if (enet_host_service(host, &event, 1) > 0) {
+            do {
+                bool handled = false;
+                for (auto &f : fetchers) {
+                    if (f->handle(event)) {
+                        handled = true;
+                        break;
+                    }
+                }
+                if (!handled && event.type == ENET_EVENT_TYPE_RECEIVE) {
+                    enet_packet_destroy(event.packet);
+                }
+            } while (enet_host_check_events(host, &event) > 0);
+        }
+        busy = false;
+        for (auto &f : fetchers) {
+            f->tick();
+            busy = busy || !f->idle();
+        }
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    unsigned long long losers = 0, attempts = 0;
+    for (auto &f : fetchers) {
+        losers += f->stats.raceLosers;
+        attempts += f->stats.attempts;
+    }
+    printf("%zu clients, %zu masters: %zu lists in %.1f s (%.0f lists/s), %llu failed, %llu attempts, %llu race losers dropped\n",
+        clients, masters.size(), latencies.size(), elapsed, latencies.size() / elapsed, failed, attempts, losers);
+    printDelays("list", latencies);
+    fetchers.clear();
+    enet_host_destroy(host);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    std::string mode = argc > 1 ? argv[1] : "";
+    TRANSPORT_BACKEND backend = TRANSPORT_BACKEND::MMSG;
+
+    if (mode == "sink") {
+        port_t port = argc > 2 ? std::stoi(argv[2]) : 25999;
+        int seconds = argc > 3 ? std::stoi(argv[3]) : 10;
+        if (argc > 4 && !parseTransportBackend(argv[4], backend)) {
+            fprintf(stderr, "Unknown transport backend %s\n", argv[4]);
+            return 1;
+        }
+        return sink(port, seconds, backend);
+    }
+    if (mode == "blast" && argc > 3) {
+        int seconds = argc > 4 ? std::stoi(argv[4]) : 10;
+        if (argc > 5 && !parseTransportBackend(argv[5], backend)) {
+            fprintf(stderr, "Unknown transport backend %s\n", argv[5]);
+            return 1;
+        }
+        size_t size = argc > 6 ? std::stoi(argv[6]) : 64;
+        return blast(argv[2], std::stoi(argv[3]), seconds, backend, size);
+    }
+    if (mode == "limiter") {
+        size_t sources = argc > 2 ? std::stoul(argv[2]) : 1000;
+        size_t requests = argc > 3 ? std::stoul(argv[3]) : 10000000;
+        return limiter(sources, requests);
+    }
+    if (mode == "serialize") {
+        size_t peers = argc > 2 ? std::stoul(argv[2]) : 10;
+        size_t iterations = argc > 3 ? std::stoul(argv[3]) : 100000;
+        return serializeBench(peers, iterations);
+    }
+    if (mode == "stun") {
+        size_t iterations = argc > 2 ? std::stoul(argv[2]) : 10000000;
+        return stunBench(iterations);
+    }
+    if (mode == "stun-blast" && argc > 3) {
+        int seconds = argc > 4 ? std::stoi(argv[4]) : 10;
+        if (argc > 5 && !parseTransportBackend(argv[5], backend)) {
+            fprintf(stderr, "Unknown transport backend %s\n", argv[5]);
+            return 1;
+        }
+        return stunBlast(argv[2], std::stoi(argv[3]), seconds, backend);
+    }
+    if (mode == "egress") {
+        size_t clients = argc > 2 ? std::stoul(argv[2]) : 500;
+        double linkRate = (argc > 3 ? std::stod(argv[3]) : 1024) * 1024;
+        size_t listBytes = argc > 4 ? std::stoul(argv[4]) : 6000;
+        return egressBench(clients, linkRate, listBytes);
+    }
+    if (mode == "profile") {
+        size_t iterations = argc > 2 ? std::stoul(argv[2]) : 100000000;
+        return profileBench(iterations);
+    }
+    if (mode == "lists" && argc > 2) {
+        size_t clients = argc > 3 ? std::stoul(argv[3]) : 50;
+        int seconds = argc > 4 ? std::stoi(argv[4]) : 10;
+        return listsBench(argv[2], clients, seconds);
+    }
+    fprintf(stderr, "usage: %s sink [port] [seconds] [basic|mmsg]\n", argv[0]);
+    fprintf(stderr, "       %s blast host port [seconds] [basic|mmsg] [datagram size]\n", argv[0]);
+    fprintf(stderr, "       %s limiter [sources] [requests]\n", argv[0]);
+    fprintf(stderr, "       %s serialize [peers] [iterations]\n", argv[0]);
+    fprintf(stderr, "       %s stun [iterations]\n", argv[0]);
+    fprintf(stderr, "       %s stun-blast host port [seconds] [basic|mmsg]\n", argv[0]);
+    fprintf(stderr, "       %s egress [clients] [link KiB/s] [list bytes]\n", argv[0]);
+    fprintf(stderr, "       %s profile [iterations]\n", argv[0]);
+    fprintf(stderr, "       %s lists host:port[,host:port...] [clients] [seconds]\n", argv[0]);
+    return 1;
+}
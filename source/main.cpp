@@ -1,4 +1,5 @@
 #include <iostream>
+#include <sstream>
 #include <string>
 #include <cstdint>
 #include <chrono>
@@ -6,176 +7,417 @@
 #include <map>
 #include <tuple>
 #include <list>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <random>
 #include <cstring>
+#include <csignal>
 #include <enet/enet.h>
 #include "../include/masterserver.h"
+#include "../include/handlers.h"
+#include "../include/trace.h"
+#include "../include/clock.h"
+#include "../include/stun.h"
+#include "../include/flare.h"
+#include "../include/relay.h"
+#include "../include/egress.h"
+#include "../include/profile.h"
+#include "../include/shmlist.h"
+#include "../include/http.h"
 
-std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
-ENetHost *server;
+trace_writer recorder;
 
-entryMap hostList;
+void printLimiterStats() {
+    static rate_limiter_stats last;
+    rate_limiter_stats total = connectLimiter.total();
+    if (total.droppedByAddress == last.droppedByAddress && total.droppedByPrefix == last.droppedByPrefix) {
+        return;
+    }
+    printf("rate limiter: allowed %llu, dropped %llu by address, %llu by /24 prefix (total since start)\n",
+        total.allowed, total.droppedByAddress, total.droppedByPrefix);
+    for (size_t i = 0; i < rate_limiter::BUDGETS; i++) {
+        const rate_limiter_stats &s = connectLimiter.stats[i];
+        if (s.droppedByAddress + s.droppedByPrefix > 0) {
+            printf("  request type %zu: allowed %llu, dropped %llu/%llu\n", i, s.allowed, s.droppedByAddress, s.droppedByPrefix);
+        }
+    }
+    last = total;
+}
 
-void sendWaitingNATPeersToServer(ENetPeer *server);
+void printPunchStats() {
+    static punch_stats last;
+    if (punchStats.scheduled == last.scheduled && punchStats.serverOnly == last.serverOnly && punchStats.queued == last.queued
+        && punchStats.busy == last.busy) {
+        return;
+    }
+    printf("NAT punch: %llu scheduled (avg %.0f ms to T; %llu simultaneous, %llu client first, %llu server first), %llu server only"
+        " (total since start)\n", punchStats.scheduled,
+        punchStats.scheduled > 0 ? (double) punchStats.totalDelayMs / punchStats.scheduled : 0.0,
+        punchStats.byStrategy[static_cast<int>(PUNCH_STRATEGY::SIMULTANEOUS)],
+        punchStats.byStrategy[static_cast<int>(PUNCH_STRATEGY::CLIENT_FIRST)],
+        punchStats.byStrategy[static_cast<int>(PUNCH_STRATEGY::SERVER_FIRST)], punchStats.serverOnly);
+    size_t waiting = 0, servers = 0, full = 0;
+    for (auto &e : hostList.mapa) {
+        waiting += e.second.natClients.count;
+        servers += e.second.natClients.count > 0;
+        full += e.second.natClients.full();
+    }
+    printf("  waiting clients: %zu at %zu servers, %zu rings full; %llu queued, %llu asked again, %llu busy\n", waiting, servers,
+        full, punchStats.queued, punchStats.refreshed, punchStats.busy);
+    if (punchStats.relayOffered + punchStats.relayRefused > 0) {
+        printf("  timed out: %llu got a relay offer, %llu refused\n", punchStats.relayOffered, punchStats.relayRefused);
+    }
+    if (punchStats.predicted + punchStats.unpredictable > 0) {
+        printf("  symmetric clients: %llu with a port window (%llu extra punch packets), %llu unpredictable; %llu asked for a"
+            " relay after a window (%.1f%% of predicted punches did not need one)\n", punchStats.predicted, punchStats.predictedPorts,
+            punchStats.unpredictable, punchStats.predictedRelays,
+            punchStats.predicted > 0 ? 100.0 * (punchStats.predicted - std::min(punchStats.predictedRelays, punchStats.predicted))
+                / punchStats.predicted : 0.0);
+    }
+    last = punchStats;
+}
 
-void pushNATPeersToServer(server_list_entry &e);
+void printStunStats(const stun::responder &responder) {
+    static stun::responder_stats last;
+    if (responder.stats.requests == last.requests) {
+        return;
+    }
+    printf("stun: %llu requests, %llu responses, %llu ignored (total since start)\n",
+        responder.stats.requests, responder.stats.responses, responder.stats.ignored);
+    last = responder.stats;
+}
 
-void addNATPeer(ENetPeer *peer, address_t address, port_t port, address_t clientLocalNetworkAddress, port_t clientLocalNetworkPort) {
-    if (!hostList.has(address, port)) {
-        printf("The NAT punch request refers to unknown server %s !\n", hostToIPaddress(address, port).c_str());
+void printFlareStats(const flare::flare_service &flare) {
+    static flare::flare_stats last;
+    if (flare.stats.sessions == last.sessions) {
         return;
     }
-    server_list_entry &e = hostList.get(address, port);
-    if (!e.needsNAT) {
-        // should not happen
-        printf("server does not support NAT punch\n");
+    printf("flare: %llu sessions, %llu classified, %llu incomplete, %llu dropped (total since start)\n",
+        flare.stats.sessions, flare.stats.classified, flare.stats.incomplete, flare.stats.dropped);
+    last = flare.stats;
+}
+
+void printRelayStats(const relay::relay_service &relay) {
+    static relay::relay_stats last;
+    if (relay.stats.binds == last.binds && relay.stats.forwardedPackets == last.forwardedPackets) {
         return;
     }
-    e.registerNatClient(peer->address.host, peer->address.port, clientLocalNetworkAddress, clientLocalNetworkPort);
-    pushNATPeersToServer(e);
+    printf("relay: %llu sessions (%llu closed), %llu binds, %llu rejected, %llu packets / %llu bytes forwarded, "
+        "dropped %llu over rate, %llu unknown (total since start)\n", relay.stats.sessions, relay.stats.closed, relay.stats.binds,
+        relay.stats.rejectedBinds, relay.stats.forwardedPackets, relay.stats.forwardedBytes, relay.stats.droppedOverRate,
+        relay.stats.droppedUnknown);
+    last = relay.stats;
 }
 
-void pushNATPeersToServer(server_list_entry &e) {
-    printf("Pushing peers back to the server ... connecting\n");
-    ENetAddress address;
-    address.host = e.address;
-    address.port = e.port;
-    ENetPeer *peer = enet_host_connect(server, &address, 1, static_cast<enet_uint32>(REQUEST_TYPE::MASTER_PUSH_NAT_PEERS_TO_SERVER));
-    enet_peer_timeout(peer, 100, 100, 1000);
-    peer_entry *pe = new peer_entry(PEER_MODE::MASTER_TO_SERVER, now + std::chrono::seconds(2));
-    peer->data = (void*) pe;
-    pe->connectedCallback = [](ENetPeer *peer) {
-        printf("Pushing peers back to the server ... connected\n");
-        sendWaitingNATPeersToServer(peer);
-    };
+void printEgressStats(const egress_network &egress) {
+    static egress_stats last;
+    const egress_stats &s = egress.stats;
+    if (s.packets[static_cast<int>(EGRESS_CLASS::BULK)] == last.packets[static_cast<int>(EGRESS_CLASS::BULK)]) {
+        return;
+    }
+    printf("egress: control %llu packets / %llu bytes, NAT %llu / %llu, lists %llu / %llu; %llu lists paced (avg wait %.0f ms), "
+        "%llu dropped, peak queue %zu bytes (total since start)\n",
+        s.packets[static_cast<int>(EGRESS_CLASS::CONTROL)], s.bytes[static_cast<int>(EGRESS_CLASS::CONTROL)],
+        s.packets[static_cast<int>(EGRESS_CLASS::NAT)], s.bytes[static_cast<int>(EGRESS_CLASS::NAT)],
+        s.packets[static_cast<int>(EGRESS_CLASS::BULK)], s.bytes[static_cast<int>(EGRESS_CLASS::BULK)], s.deferred,
+        s.deferred > 0 ? (double) s.totalWaitMs / s.deferred : 0.0, s.dropped, s.peakQueuedBytes);
+    last = s;
 }
 
-void sendWaitingNATPeersToServer(ENetPeer *server) {
-    server_list_entry &e = hostList.get(server->address.host, server->address.port);
-    masterserver::serializer s;
-    packetHeader header;
-    header.type = PACKET_TYPE::SERVER_NAT_PEERS;
-    s << header;
-
-    packet_nat_peers p;
-    p.yourPublicAddress = e.publicIPAddress != 0 ? e.publicIPAddress : e.address;
-    p.yourPublicPort = e.publicPort != 0 ? e.publicPort : e.port;
-
-    std::vector<peer_address_t> addresses = e.scrubNATClients();
-    for (auto &c : addresses) {
-        packet_nat_peers::_peer peer;
-        peer.address = std::get<0>(c);
-        peer.port = std::get<1>(c);
-        peer.localNetworkAddress = std::get<2>(c);
-        peer.localNetworkPort = std::get<3>(c);
-        p.peers.push_back(peer);
-    }
-    p.peerCount = p.peers.size();
-
-    s << p;
-    ENetPacket *enetPacket = enet_packet_create(s.getData().c_str(), s.getDataLen(), ENET_PACKET_FLAG_RELIABLE);
-    enet_peer_send(server, 0, enetPacket);
+void printUpdateStats() {
+    static update_stats last;
+    if (updateStats.full == last.full && updateStats.partial == last.partial) {
+        return;
+    }
+    printf("updates: %llu full, %llu partial (%llu before a full one), %llu changed nothing; %llu bytes, %llu saved by partial"
+        " updates (total since start)\n", updateStats.full, updateStats.partial, updateStats.beforeFull, updateStats.unchanged,
+        updateStats.bytes, updateStats.bytesSaved);
+    last = updateStats;
 }
 
-void sendHostsToPeer(ENetPeer *peer) {
-    static std::list<server_list_entry*> validHosts;
-    validHosts.clear();
-    hostList.getValidHosts(validHosts);
-    auto serverCount = validHosts.size();
-
-    masterserver::serializer s;
-    packetHeader header;
-    header.type = PACKET_TYPE::SERVER_LIST;
-    s << header;
-    packet_serverlist p;
-
-    p.serverCount = serverCount;
-    p.servers.reserve(serverCount);
-
-    for (server_list_entry *e : validHosts) {
-        packet_serverlist::_serverlist_server server;
-        server.address = e->address;
-        server.port = e->port;
-        server.localNetworkAddress = e->localNetworkAddress;
-        server.localNetworkPort = e->localNetworkPort;
-        server.publicIPAddress = e->publicIPAddress;
-        server.publicPort = e->publicPort;
-        server.needsNAT = e->needsNAT;
-        server.descr = e->descr;
-        p.servers.push_back(server);
-    }
-    s << p;
-    long dataLen = s.getDataLen();
-    ENetPacket *enetPacket = enet_packet_create(s.getData().c_str(), dataLen, ENET_PACKET_FLAG_RELIABLE);
-
-    enet_peer_send(peer, 0, enetPacket);
+// the listed servers into the shared region, the same ones a client would get (see shmlist.h)
+void publishRegistry(shm::writer &shmWriter) {
+    PROFILE_SCOPE("shm publish");
+    shm::shm_server *records = shmWriter.begin();
+    uint32_t count = 0, total = 0;
+    for (auto &entry : hostList.mapa) {
+        server_list_entry &e = entry.second;
+        if (!hostList.isValid(e)) {
+            continue;
+        }
+        total++;
+        if (count < shmWriter.capacity()) {
+            shm::writer::fill(records[count++], e.address, e.port, e.localNetworkAddress, e.localNetworkPort, e.publicIPAddress,
+                e.publicPort, e.needsNAT, e.rtt, e.descr.data, e.descr.length);
+        }
+    }
+    shmWriter.commit(count, total, hostList.generation);
 }
 
-void onPacketReceived(ENetPeer *peer, ENetPacket *p) {
-    masterserver::deserializer d(p->data, p->dataLength);
-    packetHeader header;
-    d >> header;
-
-    switch (header.type) {
-    case PACKET_TYPE::SERVER_UPDATE: {
-        packet_update s;
-        d >> s;
-        printf("server %s: update `%s` %s/pub:%s\n",
-            hostToIPaddress(peer->address.host, peer->address.port).c_str(), s.descr.c_str(),
-            hostToIPaddress(s.localNetworkAddress, s.localNetworkPort).c_str(),
-            hostToIPaddress(s.publicIPAddress, s.publicPort).c_str());
-        if (s.descr.length() > 100) {
-            s.descr = "long PP";
+// GET /servers.json, rendered once per registry generation (see http.h)
+void renderServersJson(std::string &body) {
+    PROFILE_SCOPE("render servers.json");
+    body.reserve(256 + hostList.mapa.size() * 256);
+    body += "{\"generation\":";
+    body += std::to_string(hostList.generation);
+    body += ",\"servers\":[";
+    bool first = true;
+    for (auto &entry : hostList.mapa) {
+        server_list_entry &e = entry.second;
+        if (!hostList.isValid(e)) {
+            continue;
         }
-        hostList.update(peer->address.host, peer->address.port,
-            s.descr,
-            s.localNetworkAddress, s.localNetworkPort,
-            s.publicIPAddress, s.publicPort,
-            s.needsNAT);
-        break;
+        body += first ? "\n{\"address\":\"" : ",\n{\"address\":\"";
+        first = false;
+        body += addressToStr(e.address);
+        body += "\",\"port\":";
+        body += std::to_string(e.port);
+        body += ",\"localAddress\":\"";
+        body += addressToStr(e.localNetworkAddress);
+        body += "\",\"localPort\":";
+        body += std::to_string(e.localNetworkPort);
+        body += ",\"publicAddress\":\"";
+        body += addressToStr(e.publicIPAddress);
+        body += "\",\"publicPort\":";
+        body += std::to_string(e.publicPort);
+        body += ",\"needsNAT\":";
+        body += e.needsNAT ? "true" : "false";
+        body += ",\"rtt\":";
+        body += std::to_string(e.rtt);
+        body += ",\"description\":";
+        http::appendJsonString(body, e.descr.data, e.descr.length);
+        body += "}";
+    }
+    body += "\n]}\n";
+}
+
+// GET /health
+void renderHealthJson(std::string &body, std::chrono::steady_clock::time_point startedAt) {
+    size_t servers = 0;
+    for (auto &entry : hostList.mapa) {
+        servers += hostList.isValid(entry.second);
+    }
+    size_t peers = 0;
+    for (size_t i = 0; i < server->peerCount; i++) {
+        peers += server->peers[i].state != ENET_PEER_STATE_DISCONNECTED;
+    }
+    body = "{\"status\":\"ok\",\"servers\":" + std::to_string(servers) + ",\"generation\":"
+        + std::to_string(hostList.generation) + ",\"peers\":" + std::to_string(peers) + ",\"uptimeSeconds\":"
+        + std::to_string(std::chrono::duration_cast<std::chrono::seconds>(now - startedAt).count()) + ",\"subscribers\":" + std::to_string(subscriptions.count())
+        + ",\"probes\":{\"sent\":"
+        + std::to_string(liveness.stats.sent) + ",\"answered\":" + std::to_string(liveness.stats.answered) + ",\"missed\":"
+        + std::to_string(liveness.stats.missed) + ",\"evicted\":" + std::to_string(liveness.stats.evicted)
+        + ",\"evictionLatencyMsTotal\":" + std::to_string(liveness.stats.evictionLatencyMs) + ",\"evictionLatencyMsMax\":"
+        + std::to_string(liveness.stats.maxEvictionLatencyMs) + "}}\n";
+}
+
+void printHttpStats(const http::http_service &http) {
+    static http::http_stats last;
+    const http::http_stats &s = http.stats;
+    if (s.requests == last.requests && s.accepted == last.accepted) {
+        return;
     }
-    default:
-        break;
+    printf("http: %llu requests (%llu not modified, %llu not found, %llu bad), %llu list renders, %llu bytes sent; "
+        "%llu connections accepted, %llu rejected, %llu closed idle, %zu open (total since start)\n", s.requests,
+        s.notModified, s.notFound, s.badRequests, s.renders, s.bytesSent, s.accepted, s.rejected, s.closedIdle,
+        http.connectionCount());
+    last = s;
+}
+
+// probe rate over the last report period, eviction latency from the last sign of life of the server
+void printLivenessStats(std::chrono::steady_clock::time_point now) {
+    static liveness_stats last;
+    static std::chrono::steady_clock::time_point lastAt = now;
+    const liveness_stats &s = liveness.stats;
+    double seconds = std::chrono::duration<double>(now - lastAt).count();
+    if (s.sent == last.sent || seconds <= 0) {
+        return;
     }
+    printf("liveness: %.1f probes/s in %.1f batches/s, %llu answered, %llu missed, %llu unknown answers; %llu evicted "
+        "(avg %.0f ms, max %llu ms after the last sign of life) (total since start)\n", (s.sent - last.sent) / seconds,
+        (s.batches - last.batches) / seconds, s.answered, s.missed, s.unknownAnswers, s.evicted,
+        s.evicted > 0 ? (double) s.evictionLatencyMs / s.evicted : 0.0, s.maxEvictionLatencyMs);
+    last = s;
+    lastAt = now;
 }
 
-void onPeerPacketReceived(ENetPeer *peer, ENetPacket *p) {
-    masterserver::deserializer d(p->data, p->dataLength);
-    packetHeader header;
-    d >> header;
+void printSubscriptionStats() {
+    static subscription_stats last;
+    const subscription_stats &s = subscriptions.stats;
+    if (s.deltas == last.deltas && s.subscribed == last.subscribed && s.unsubscribed == last.unsubscribed) {
+        return;
+    }
+    unsigned long long deltas = s.deltas - last.deltas;
+    unsigned long long fannedOut = s.fannedOut - last.fannedOut;
+    printf("subscriptions: %zu subscribers (peak %zu; %llu subscribed, %llu refused, %llu ended); %llu delta packets (%llu added, "
+        "%llu updated, %llu removed; %llu list remainders), %llu bytes encoded, %llu packets fanned out (total since start)\n",
+        subscriptions.count(), s.peakSubscribers, s.subscribed, s.refused, s.unsubscribed, s.deltas, s.added, s.updated, s.removed,
+        s.remainders, s.deltaBytes, s.fannedOut);
+    if (deltas > 0) {
+        printf("  last period: per delta %.1f us diff, %.1f us encode, %.1f us fan-out (%.0f ns per subscriber)\n",
+            (s.diffNs - last.diffNs) / 1000.0 / deltas, (s.encodeNs - last.encodeNs) / 1000.0 / deltas,
+            (s.fanOutNs - last.fanOutNs) / 1000.0 / deltas, fannedOut > 0 ? (double) (s.fanOutNs - last.fanOutNs) / fannedOut : 0.0);
+    }
+    last = s;
+}
+
+void printShmStats(const shm::writer &shmWriter) {
+    static shm::writer_stats last;
+    if (shmWriter.stats.publishes == last.publishes) {
+        return;
+    }
+    printf("shm: %llu publishes (%llu truncated), last took %.1f us, slowest %.1f us (total since start)\n",
+        shmWriter.stats.publishes, shmWriter.stats.truncated, shmWriter.stats.lastWriteNs / 1000.0,
+        shmWriter.stats.maxWriteNs / 1000.0);
+    last = shmWriter.stats;
+}
+
+static volatile std::sig_atomic_t profileRequested = 0;
+
+void onProfileSignal(int) {
+    profileRequested = 1;
+}
 
-    switch (header.type) {
-    case PACKET_TYPE::CLIENT_NAT_PUNCH: {
-        printf("It's a NAT punch request!\n");
-        packet_nat_punch s;
-        d >> s;
-        addNATPeer(peer, s.address, s.port, s.clientLocalNetworkAddress, s.clientLocalNetworkPort);
-        enet_peer_disconnect_later(peer, 0);
-        break;
+// the first request starts recording, every further one writes the rings
+void serviceProfileRequest(const std::string &path) {
+    if (!profileRequested) {
+        return;
+    }
+    profileRequested = 0;
+    if (!profile::recording) {
+        profile::recording = true;
+        printf("profile: recording, the next SIGUSR1 writes %s\n", path.c_str());
+        return;
     }
+    size_t events = profile::writeChromeJson(path);
+    printf("profile: %zu events written to %s\n", events, path.c_str());
+}
 
-    default:
-        break;
+void printAdmissionStats() {
+    static admission_stats last;
+    admission_stats total = admission.total();
+    if (total.rejected == last.rejected && total.evicted == last.evicted && total.deferred == last.deferred) {
+        return;
     }
+    printf("admission: admitted %llu, rejected %llu, deferred %llu, evicted %llu, recycled %llu (total since start)\n",
+        total.admitted, total.rejected, total.deferred, total.evicted, total.recycled);
+    last = total;
 }
+
 // usage: ./duel6t-masterserver 0.0.0.0 25900   <-- local port (default is 25900)
 //                                 ^--------------- local ip address
+// options:
+//   --record=file   write every handled ENet event to a binary trace (see trace.h, replay with duel6r-masterserver-replay)
+//   --stun=port     answer STUN binding requests on this UDP port (see stun.h)
+//   --flare=p1,p2,...,reserve   NAT classification: probe ports and the reserve port (see flare.h)
+//   --relay=bind,first,pairs   run the relay fallback: bind port, first port of the forwarding pairs, number of pairs (see relay.h)
+//   --relay-at=host:port   offer the duel6r-relay listening on this bind port instead
+//   --relay-secret=text    secret shared with the relay (random for the built-in one)
+//   --transport=basic|mmsg   datagram I/O of the STUN, flare and relay ports and of the liveness probes (default basic,
+//                    see transport.h)
+//   --profile=file   record scopes from the start, SIGUSR1 writes them as Chrome trace JSON (see profile.h,
+//                    without it the first SIGUSR1 starts recording to duel6r-masterserver-profile.json)
+//   --egress-rate=KiB/s   pace the server lists to this rate, NAT and control traffic first (see egress.h, default off)
+//   --shm=name      publish the server list in this POSIX shared memory region for local readers (see shmlist.h,
+//                   e.g. --shm=/duel6r-servers, dump it with duel6r-shmdump)
+//   --shm-capacity=servers   records in the region (default 4096)
+//   --http=port     serve GET /servers.json and /health over HTTP on this TCP port (see http.h)
+//   --probe-interval=ms   probe every registered server this often, 0 = off (see liveness.h, default 2000)
+//   --probe-misses=n      evict a server after this many probes in a row went unanswered (default 3)
+//   --subscribe-interval=ms   list subscribers get the changes at most this often (see subscription.h, default 1000)
+//   --max-subscribers=n   list subscriptions held at once, further subscribers get one list (default 16)
+//   --list-limit=n  servers in one server list, the nearest ones (default and at most SERVER_LIST_MAX_SERVERS)
+//   --peers=n       ENet peer slots, incoming sessions and the master's own connections (default 32, see admission.h)
 int main(int argc, char *argv[]) {
     ENetAddress address;
     address.host = ENET_HOST_ANY;
     address.port = 25900; // use high value for the port (NAT traversal might not work with lower ports in netbox.cz network)
 
-    if (argc > 1) {
-        std::string addressStr = std::string(argv[1]);
+    std::vector<std::string> positional;
+    std::string recordPath;
+    port_t stunPort = 0;
+    std::vector<port_t> flarePorts;
+    std::vector<port_t> relayPorts;
+    std::string relayAt;
+    std::string relaySecret;
+    float egressRate = 0;
+    std::string profilePath = "duel6r-masterserver-profile.json";
+    std::string shmName;
+    uint32_t shmCapacity = SHM_DEFAULT_CAPACITY;
+    port_t httpPort = 0;
+    long probeInterval = LIVENESS_INTERVAL_MS;
+    unsigned probeMisses = LIVENESS_MISSES;
+    size_t peerCount = 32;
+    masterserver::TRANSPORT_BACKEND backend = masterserver::TRANSPORT_BACKEND::BASIC;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg.rfind("--record=", 0) == 0) {
+            recordPath = arg.substr(strlen("--record="));
+        } else if (arg.rfind("--stun=", 0) == 0) {
+            stunPort = std::stoi(arg.substr(strlen("--stun=")));
+        } else if (arg.rfind("--flare=", 0) == 0) {
+            std::istringstream ports(arg.substr(strlen("--flare=")));
+            std::string port;
+            while (std::getline(ports, port, ',')) {
+                flarePorts.push_back(std::stoi(port));
+            }
+        } else if (arg.rfind("--relay=", 0) == 0) {
+            std::istringstream ports(arg.substr(strlen("--relay=")));
+            std::string port;
+            while (std::getline(ports, port, ',')) {
+                relayPorts.push_back(std::stoi(port));
+            }
+        } else if (arg.rfind("--relay-at=", 0) == 0) {
+            relayAt = arg.substr(strlen("--relay-at="));
+        } else if (arg.rfind("--relay-secret=", 0) == 0) {
+            relaySecret = arg.substr(strlen("--relay-secret="));
+        } else if (arg.rfind("--profile=", 0) == 0) {
+            profilePath = arg.substr(strlen("--profile="));
+            profile::recording = true;
+        } else if (arg.rfind("--egress-rate=", 0) == 0) {
+            egressRate = std::stof(arg.substr(strlen("--egress-rate="))) * 1024;
+        } else if (arg.rfind("--shm=", 0) == 0) {
+            shmName = arg.substr(strlen("--shm="));
+        } else if (arg.rfind("--shm-capacity=", 0) == 0) {
+            shmCapacity = std::stoul(arg.substr(strlen("--shm-capacity=")));
+        } else if (arg.rfind("--http=", 0) == 0) {
+            httpPort = std::stoi(arg.substr(strlen("--http=")));
+        } else if (arg.rfind("--probe-interval=", 0) == 0) {
+            probeInterval = std::stol(arg.substr(strlen("--probe-interval=")));
+        } else if (arg.rfind("--probe-misses=", 0) == 0) {
+            probeMisses = std::max(1ul, std::stoul(arg.substr(strlen("--probe-misses="))));
+        } else if (arg.rfind("--subscribe-interval=", 0) == 0) {
+            subscriptions.interval = std::chrono::milliseconds(std::stol(arg.substr(strlen("--subscribe-interval="))));
+        } else if (arg.rfind("--max-subscribers=", 0) == 0) {
+            subscriptions.maxSubscribers = std::stoul(arg.substr(strlen("--max-subscribers=")));
+        } else if (arg.rfind("--list-limit=", 0) == 0) {
+            hostList.listLimit = std::min(std::max(1ul, std::stoul(arg.substr(strlen("--list-limit=")))),
+                (unsigned long) SERVER_LIST_MAX_SERVERS);
+        } else if (arg.rfind("--peers=", 0) == 0) {
+            peerCount = std::min(std::max(1ul, std::stoul(arg.substr(strlen("--peers=")))), (unsigned long) ENET_PROTOCOL_MAXIMUM_PEER_ID);
+        } else if (arg.rfind("--transport=", 0) == 0) {
+            if (!masterserver::parseTransportBackend(arg.substr(strlen("--transport=")), backend)) {
+                std::cerr << "Unknown transport backend " << arg << "\n";
+                exit(EXIT_FAILURE);
+            }
+        } else {
+            positional.push_back(arg);
+        }
+    }
+
+    if (positional.size() > 0) {
+        std::string addressStr = positional[0];
         enet_address_set_host(&address, addressStr.c_str());
     }
 
-    if (argc > 2) {
-        std::string portStr = std::string(argv[2]);
+    if (positional.size() > 1) {
+        std::string portStr = positional[1];
         address.port = std::stoi(portStr);
     }
 
     server = enet_host_create(&address /* the address to bind the server host to */,
-        32 /* allow up to 32 clients and/or outgoing connections */,
+        peerCount /* clients and/or outgoing connections */,
         1 /* allow up to 1 channels to be used, 0 */,
         0 /* assume any amount of incoming bandwidth */,
         0 /* assume any amount of outgoing bandwidth */);
@@ -185,117 +427,255 @@ int main(int argc, char *argv[]) {
         exit(EXIT_FAILURE);
     }
 
-    std::cout << "Master local address: " << hostToIPaddress(server->address.host, server->address.port) << "\n";
+    server->intercept = interceptPacket;
+    enet_network enetNetwork(server);
+    egress_network egress(enetNetwork);
+    egress.rate = egressRate;
+    network = &egress;
+    steady_master_clock clock;
+
+    if (!recordPath.empty()) {
+        if (!recorder.open(recordPath, clock.time(), server->peerCount)) {
+            std::cerr << "Cannot open trace file " << recordPath << "\n";
+            exit(EXIT_FAILURE);
+        }
+        std::cout << "Recording events to " << recordPath << "\n";
+    }
+
+    std::unique_ptr<stun::responder> stunResponder;
+    ENetSocket stunSocket = ENET_SOCKET_NULL;
+    if (stunPort != 0) {
+        stunSocket = masterserver::openDatagramSocket(address.host, stunPort);
+        if (stunSocket == ENET_SOCKET_NULL) {
+            std::cerr << "Cannot bind STUN port " << stunPort << "\n";
+            exit(EXIT_FAILURE);
+        }
+        stunResponder = std::make_unique<stun::responder>(masterserver::createTransport(backend, stunSocket));
+        std::cout << "STUN responder on port " << stunPort << " ("
+            << masterserver::transportBackendName(stunResponder->transport->backend()) << ")\n";
+    }
+
+    flare::flare_service flare;
+    if (!flarePorts.empty()) {
+        if (!flare.open(address.host, flarePorts, backend)) {
+            std::cerr << "Cannot open flare ports (at least two probe ports and the reserve port are needed)\n";
+            exit(EXIT_FAILURE);
+        }
+        flare.classified = onNatClassified;
+        std::cout << "NAT classification on " << flarePorts.size() - 1 << " probe ports, reserve port " << flarePorts.back() << "\n";
+    }
+
+    relay::relay_service relay;
+    if (!relayPorts.empty()) {
+        if (relayPorts.size() != 3) {
+            std::cerr << "--relay needs the bind port, the first forwarding port and the number of pairs\n";
+            exit(EXIT_FAILURE);
+        }
+        if (relaySecret.empty()) {
+            relaySecret = std::to_string(std::random_device()()) + std::to_string(std::random_device()());
+        }
+        if (!relay.open(address.host, relayPorts[0], relayPorts[1], relayPorts[2], relay::secretFromString(relaySecret), backend)) {
+            std::cerr << "Cannot open relay ports\n";
+            exit(EXIT_FAILURE);
+        }
+        relayIssuer.port = relayPorts[0];
+        std::cout << "Relay on port " << relayPorts[0] << " with " << relayPorts[2] << " forwarding pairs\n";
+    } else if (!relayAt.empty()) {
+        ENetAddress relayAddress;
+        size_t colon = relayAt.rfind(':');
+        if (colon == std::string::npos || enet_address_set_host(&relayAddress, relayAt.substr(0, colon).c_str()) != 0
+            || relaySecret.empty()) {
+            std::cerr << "--relay-at needs host:port and --relay-secret\n";
+            exit(EXIT_FAILURE);
+        }
+        relayIssuer.address = relayAddress.host;
+        relayIssuer.port = std::stoi(relayAt.substr(colon + 1));
+    }
+    relayIssuer.secret = relay::secretFromString(relaySecret);
+
+    shm::writer shmWriter;
+    if (!shmName.empty()) {
+        if (!shmWriter.open(shmName, shmCapacity)) {
+            std::cerr << "Cannot create shared memory region " << shmName << "\n";
+            exit(EXIT_FAILURE);
+        }
+        std::cout << "Server list published in shared memory " << shmName << " (" << shmCapacity << " servers)\n";
+    }
+    uint64_t shmGeneration = 0;
+    auto nextShmPublish = now;
+
+    http::http_service http;
+    if (httpPort != 0) {
+        if (!http.open(address.host, httpPort)) {
+            std::cerr << "Cannot listen on HTTP port " << httpPort << "\n";
+            exit(EXIT_FAILURE);
+        }
+        auto startedAt = clock.time();
+        http.generation = []() {
+            return hostList.generation;
+        };
+        http.renderList = renderServersJson;
+        http.renderHealth = [startedAt](std::string &body) {
+            renderHealthJson(body, startedAt);
+        };
+        std::cout << "HTTP server list on port " << httpPort << " (/servers.json, /health)\n";
+    }
+    if (probeInterval > 0) {
+        liveness.interval = std::chrono::milliseconds(probeInterval);
+        liveness.misses = probeMisses;
+        liveness.open(server->socket, backend);
+        std::cout << "Liveness probes every " << probeInterval << " ms, eviction after " << probeMisses << " misses\n";
+    }
+    ENetSocketSet readable, writable;
+
+    // sockets the loop waits on besides the ENet one
+    std::vector<ENetSocket> datagramSockets;
+
+#ifdef SIGUSR1
+    signal(SIGUSR1, onProfileSignal);
+#endif
+#ifndef D6R_PROFILE
+    if (profile::recording) {
+        std::cerr << "Built without D6R_PROFILE, --profile records nothing\n";
+    }
+#endif
+
+    std::cout << "Master local address: " << hostToIPaddress(server->address.host, server->address.port).c_str() << "\n";
     ENetEvent event;
+    auto nextStatsReport = now;
 
     for (;;) {
-        now = std::chrono::steady_clock::now();
-        hostList.purgeOld();
-        for (size_t i = 0; i < server->peerCount; i++) {
-            ENetPeer *p = &server->peers[i];
-            peer_entry *pe = (peer_entry*) p->data;
-            if (p->state == ENetPeerState::ENET_PEER_STATE_CONNECTED && pe->validUntil < now) {
-                enet_peer_disconnect_later(p, 0);
+        now = clock.time();
+        serviceProfileRequest(profilePath);
+        if (now > nextStatsReport) {
+            PROFILE_SCOPE("print stats");
+            printLimiterStats();
+            printAdmissionStats();
+            printPunchStats();
+            printUpdateStats();
+            if (stunResponder) {
+                printStunStats(*stunResponder);
+            }
+            if (!flarePorts.empty()) {
+                printFlareStats(flare);
+            }
+            if (!relayPorts.empty()) {
+                printRelayStats(relay);
+            }
+            if (egressRate > 0) {
+                printEgressStats(egress);
+            }
+            if (shmWriter.isOpen()) {
+                printShmStats(shmWriter);
+            }
+            if (http.isOpen()) {
+                printHttpStats(http);
+            }
+            if (liveness.isOpen()) {
+                printLivenessStats(now);
             }
+            printSubscriptionStats();
+            nextStatsReport = now + std::chrono::seconds(10);
+        }
+        housekeeping();
+        if (liveness.isOpen()) {
+            PROFILE_SCOPE("liveness probes");
+            liveness.service(hostList, now);
+        }
+        subscriptions.service(hostList, *network, now);
+        if (shmWriter.isOpen() && hostList.generation != shmGeneration && now >= nextShmPublish) {
+            publishRegistry(shmWriter);
+            shmGeneration = hostList.generation;
+            nextShmPublish = now + std::chrono::milliseconds(SHM_PUBLISH_INTERVAL_MS);
+        }
+        {
+            PROFILE_SCOPE("recorder flush");
+            recorder.flush();
         }
 
-        while (enet_host_service(server, &event, 100) > 0) {
-            switch (event.type) {
-            case ENET_EVENT_TYPE_NONE:
-                break;
-            case ENET_EVENT_TYPE_CONNECT: {
-                REQUEST_TYPE rt = REQUEST_TYPE::NONE;
-                if (event.data < static_cast<int>(REQUEST_TYPE::COUNT)) {
-                    rt = static_cast<REQUEST_TYPE>(event.data);
-                } else {
-                    enet_peer_disconnect(event.peer, 255);
-                    continue;
-                }
-                switch (rt) {
-                case REQUEST_TYPE::SERVER_REGISTER: {
-                    printf("server %s connected\n", hostToIPaddress(event.peer->address.host, event.peer->address.port).c_str());
-                    event.peer->data = (void*) new peer_entry(PEER_MODE::SERVER, now + std::chrono::seconds(5));
-                    hostList.refresh(event.peer->address.host, event.peer->address.port);
-                    enet_peer_disconnect(event.peer, 0);
-                    break;
-                }
-                case REQUEST_TYPE::SERVER_UPDATE: {
-                    printf("server %s connected [update]\n", hostToIPaddress(event.peer->address.host, event.peer->address.port).c_str());
-                    event.peer->data = (void*) new peer_entry(PEER_MODE::SERVER, now + std::chrono::seconds(5));
-                    hostList.refresh(event.peer->address.host, event.peer->address.port);
-                    break;
-                }
-                case REQUEST_TYPE::CLIENT_REQUEST_SERVERLIST: {
-                    printf("peer %s requesting server list \n", hostToIPaddress(event.peer->address.host, event.peer->address.port).c_str());
-                    event.peer->data = (void*) new peer_entry(PEER_MODE::CLIENT, now + std::chrono::seconds(1));
-                    sendHostsToPeer(event.peer);
-                    enet_peer_disconnect_later(event.peer, 0);
-                    break;
-                }
-                case REQUEST_TYPE::SERVER_NAT_GET_PEERS: {
-                    printf("server %s requesting peers for NAT punch through \n",
-                        hostToIPaddress(event.peer->address.host, event.peer->address.port).c_str());
-                    event.peer->data = (void*) new peer_entry(PEER_MODE::SERVER, now + std::chrono::seconds(5));
-                    hostList.refresh(event.peer->address.host, event.peer->address.port, true);
-                    sendWaitingNATPeersToServer(event.peer);
-                    enet_peer_disconnect_later(event.peer, 0);
-                    break;
-                }
-                case REQUEST_TYPE::CLIENT_NAT_CONNECT_TO_SERVER: {
-                    printf("peer %s requesting NAT punch\n", hostToIPaddress(event.peer->address.host, event.peer->address.port).c_str());
-                    event.peer->data = (void*) new peer_entry(PEER_MODE::CLIENT, now + std::chrono::seconds(5));
-                    break;
-                }
-
-                case REQUEST_TYPE::NONE:
-                // possibly outgoing request
-                if (event.peer->data != nullptr) {
-                    peer_entry *pe = (peer_entry*) event.peer->data;
-                    if (pe->mode == PEER_MODE::MASTER_TO_SERVER) {
-                        printf("server %s picked up connection to push peers waiting for NAT punch\n",
-                            hostToIPaddress(event.peer->address.host, event.peer->address.port).c_str());
-                        pe->onConnected(event.peer);
-                    }
-                }
-                //fall through
-                case REQUEST_TYPE::COUNT:
-
-                default:
-                enet_peer_disconnect_later(event.peer, 0);
-                    break;
-                }
+        enet_uint32 timeout = 100;
+        {
+            PROFILE_SCOPE("egress flush");
+            egress.flush(now);
+        }
+        if (egress.pending()) {
+            // the next list is due once the budget refilled
+            timeout = 1;
+        }
+        if (liveness.isOpen() && !hostList.mapa.empty()) {
+            // probes are due every interval / servers, waking up at least every 10 ms keeps them spread out
+            timeout = std::min<enet_uint32>(timeout, std::max<long>(1, std::min<long>(10, probeInterval / hostList.mapa.size())));
+        }
+        if (stunResponder) {
+            PROFILE_SCOPE("stun service");
+            stunResponder->service();
+        }
+        if (!flarePorts.empty()) {
+            PROFILE_SCOPE("flare service");
+            flare.service(now);
+            // pending sessions are finished by time, not only by traffic
+            if (!flare.sessions.empty()) {
+                timeout = std::min<enet_uint32>(timeout, FLARE_FILTER_WAIT_MS / 5);
+            }
+        }
+        datagramSockets = flare.sockets;
+        if (stunSocket != ENET_SOCKET_NULL) {
+            datagramSockets.push_back(stunSocket);
+        }
+        if (!relayPorts.empty()) {
+            PROFILE_SCOPE("relay service");
+            relay.service(now);
+            relay.activeSockets(datagramSockets);
+        }
+        ENET_SOCKETSET_EMPTY(readable);
+        ENET_SOCKETSET_EMPTY(writable);
+        if (!datagramSockets.empty() || http.isOpen()) {
+            // wake up for whichever socket gets data first, ENet is then serviced without blocking
+            ENET_SOCKETSET_ADD(readable, server->socket);
+            ENetSocket highest = server->socket;
+            for (ENetSocket socket : datagramSockets) {
+                ENET_SOCKETSET_ADD(readable, socket);
+                highest = std::max(highest, socket);
+            }
+            http.addSockets(readable, writable, highest);
+            PROFILE_SCOPE("wait");
+            enet_socketset_select(highest, &readable, &writable, timeout);
+            timeout = 0;
+        }
 
-                break;
+        for (;;) {
+            int serviced;
+            {
+                // includes the wait when there are no other sockets to select on
+                PROFILE_SCOPE("enet_host_service");
+                serviced = enet_host_service(server, &event, timeout);
             }
-            case ENET_EVENT_TYPE_DISCONNECT:
-            delete ((peer_entry*) event.peer->data);
-            event.peer->data = NULL;
-                break;
-            case ENET_EVENT_TYPE_RECEIVE:
-            peer_entry *pe = (peer_entry*) event.peer->data;
-            switch (pe->mode) {
-            case PEER_MODE::NONE: {
+            if (serviced <= 0) {
                 break;
             }
-            case PEER_MODE::SERVER: {
-                onPacketReceived(event.peer, event.packet);
+            recorder.record(clock.time(), server, event);
+            switch (event.type) {
+            case ENET_EVENT_TYPE_NONE:
                 break;
-            }
-            case PEER_MODE::CLIENT: {
-                onPeerPacketReceived(event.peer, event.packet);
+            case ENET_EVENT_TYPE_CONNECT:
+                handleConnect(event);
                 break;
-            }
-            case PEER_MODE::MASTER_TO_SERVER: {
+            case ENET_EVENT_TYPE_DISCONNECT:
+                handleDisconnect(event);
                 break;
-            }
-            }
-            /* Clean up the packet now that we're done using it. */
-            enet_packet_destroy(event.packet);
+            case ENET_EVENT_TYPE_RECEIVE:
+                handleReceive(event);
+                /* Clean up the packet now that we're done using it. */
+                enet_packet_destroy(event.packet);
                 break;
             }
         }
+        if (http.isOpen()) {
+            // after the ENet events, a burst of HTTP requests does not hold up the UDP path
+            PROFILE_SCOPE("http service");
+            http.service(readable, writable, now);
+        }
     }
 
     return 0;
 }
-
@@ -0,0 +1,214 @@
+/**
+ * standalone relay fallback (see relay.h), the master offers it with --relay-at=host:bind --relay-secret=text
+ *
+ * usage: ./duel6r-relay bind first pairs secret [basic|mmsg]   run the relay
+ *        ./duel6r-relay bench [seconds] [basic|mmsg]           loopback latency and throughput of the forwarding path
+ */
+
+#include <iostream>
+#include <string>
+#include <cstdint>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <enet/enet.h>
+#include "../include/protocol.h"
+#include "../include/transport.h"
+#include "../include/relay.h"
+
+using namespace masterserver;
+
+static const address_t LOOPBACK = 0x0100007f; // 127.0.0.1 in network order on little-endian hosts
+
+int runRelay(port_t bindPort, port_t firstPort, size_t pairs, const std::string &secret, TRANSPORT_BACKEND backend) {
+    relay::relay_service relay;
+    if (!relay.open(ENET_HOST_ANY, bindPort, firstPort, pairs, relay::secretFromString(secret), backend)) {
+        fprintf(stderr, "Cannot open relay ports\n");
+        return EXIT_FAILURE;
+    }
+    printf("relay on port %u, %zu forwarding pairs from port %u\n", bindPort, pairs, firstPort);
+    auto nextReport = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    std::vector<ENetSocket> sockets;
+    for (;;) {
+        auto now = std::chrono::steady_clock::now();
+        relay.service(now);
+        if (now > nextReport) {
+            printf("%llu sessions (%llu closed), %llu binds, %llu rejected, %llu packets / %llu bytes forwarded, "
+                "dropped %llu over rate, %llu unknown\n", relay.stats.sessions, relay.stats.closed, relay.stats.binds,
+                relay.stats.rejectedBinds, relay.stats.forwardedPackets, relay.stats.forwardedBytes,
+                relay.stats.droppedOverRate, relay.stats.droppedUnknown);
+            fflush(stdout);
+            nextReport = now + std::chrono::seconds(10);
+        }
+        sockets.clear();
+        relay.activeSockets(sockets);
+        ENetSocketSet readable;
+        ENET_SOCKETSET_EMPTY(readable);
+        ENetSocket highest = sockets.front();
+        for (ENetSocket socket : sockets) {
+            ENET_SOCKETSET_ADD(readable, socket);
+            highest = std::max(highest, socket);
+        }
+        enet_socketset_select(highest, &readable, NULL, 100);
+    }
+    return 0;
+}
+
+// one end of a benchmark session
+struct bench_end {
+    ENetSocket socket;
+    std::unique_ptr<udp_transport> transport;
+    datagram_batch batch;
+    ENetAddress relayPort;
+};
+
+static bool bindEnd(relay::relay_service &relay, bench_end &e, port_t bindPort, const relay::credentials &c, relay::ROLE role) {
+    relay::bind_request request;
+    request.creds = c;
+    request.role = role;
+    e.batch.clear();
+    datagram *d = e.batch.next();
+    d->address.host = LOOPBACK;
+    d->address.port = bindPort;
+    buffer_serializer out(d->data, sizeof(d->data));
+    out << request;
+    d->length = out.getDataLen();
+    e.transport->send(e.batch);
+    relay.service(std::chrono::steady_clock::now());
+    enet_uint32 condition = ENET_SOCKET_WAIT_RECEIVE;
+    enet_socket_wait(e.socket, &condition, 100);
+    if (e.transport->receive(e.batch) == 0) {
+        return false;
+    }
+    deserializer in(e.batch[0].data, e.batch[0].length);
+    relay::bind_response response;
+    if (!(in >> response) || response.status != relay::BOUND) {
+        return false;
+    }
+    e.relayPort.host = LOOPBACK;
+    e.relayPort.port = response.port;
+    return true;
+}
+
+static size_t sendBurst(bench_end &e, size_t count, size_t size, uint64_t stamp) {
+    e.batch.clear();
+    for (size_t i = 0; i < count; i++) {
+        datagram *d = e.batch.next();
+        d->address = e.relayPort;
+        d->length = size;
+        memcpy(d->data, &stamp, sizeof(stamp));
+    }
+    return e.transport->send(e.batch);
+}
+
+int bench(double seconds, TRANSPORT_BACKEND backend) {
+    const port_t bindPort = 27100;
+    relay::relay_service relay;
+    relay.rate = 0; // measure the forwarding path, not the cap
+    relay::secret_t secret = relay::secretFromString("bench");
+    if (!relay.open(LOOPBACK, bindPort, bindPort + 1, 1, secret, backend)) {
+        fprintf(stderr, "Cannot open relay ports\n");
+        return 1;
+    }
+    bench_end ends[2];
+    for (bench_end &e : ends) {
+        e.socket = openDatagramSocket(LOOPBACK, 0);
+        e.transport = createTransport(backend, e.socket);
+    }
+    relay::issuer issuer;
+    issuer.port = bindPort;
+    issuer.secret = secret;
+    std::array<relay::credentials, 2> c = issuer.issue(LOOPBACK, LOOPBACK);
+    if (!bindEnd(relay, ends[0], bindPort, c[relay::SERVER], relay::SERVER)
+        || !bindEnd(relay, ends[1], bindPort, c[relay::CLIENT], relay::CLIENT)) {
+        fprintf(stderr, "bind failed\n");
+        return 1;
+    }
+    // the first datagram of each end fixes its address at the relay
+    for (bench_end &e : ends) {
+        sendBurst(e, 1, 16, 0);
+        relay.service(std::chrono::steady_clock::now());
+        for (bench_end &x : ends) {
+            x.transport->receive(x.batch);
+        }
+    }
+
+    // latency: one datagram in flight, server end -> relay -> client end -> relay -> server end
+    std::vector<double> rtts;
+    auto start = std::chrono::steady_clock::now();
+    while (std::chrono::steady_clock::now() - start < std::chrono::duration<double>(seconds / 2)) {
+        auto sent = std::chrono::steady_clock::now();
+        sendBurst(ends[0], 1, 64, 1);
+        bool back = false;
+        for (int spin = 0; spin < 100000 && !back; spin++) {
+            relay.service(std::chrono::steady_clock::now());
+            if (ends[1].transport->receive(ends[1].batch) > 0) {
+                sendBurst(ends[1], 1, 64, 1);
+            }
+            back = ends[0].transport->receive(ends[0].batch) > 0;
+        }
+        if (!back) {
+            fprintf(stderr, "datagram lost\n");
+            return 1;
+        }
+        rtts.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - sent).count());
+    }
+    std::sort(rtts.begin(), rtts.end());
+    double sum = 0;
+    for (double r : rtts) {
+        sum += r;
+    }
+    printf("round trip through the relay: avg %.1f us, p50 %.1f us, p99 %.1f us (%zu samples, %s)\n", sum / rtts.size(),
+        rtts[rtts.size() / 2], rtts[rtts.size() * 99 / 100], rtts.size(), transportBackendName(ends[0].transport->backend()));
+
+    // throughput: batches of game sized datagrams one way
+    const size_t size = 1200;
+    unsigned long long sentPackets = 0, receivedPackets = 0;
+    unsigned long long forwardedBefore = relay.stats.forwardedPackets;
+    start = std::chrono::steady_clock::now();
+    while (std::chrono::steady_clock::now() - start < std::chrono::duration<double>(seconds / 2)) {
+        sentPackets += sendBurst(ends[0], DATAGRAM_BATCH_SIZE, size, 2);
+        relay.service(std::chrono::steady_clock::now());
+        size_t received;
+        while ((received = ends[1].transport->receive(ends[1].batch)) > 0) {
+            receivedPackets += received;
+        }
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("throughput: %.0f packets/s, %.1f MB/s forwarded (%llu sent, %llu forwarded, %llu received)\n",
+        (relay.stats.forwardedPackets - forwardedBefore) / elapsed,
+        (relay.stats.forwardedPackets - forwardedBefore) * size / elapsed / 1e6, sentPackets,
+        relay.stats.forwardedPackets - forwardedBefore, receivedPackets);
+    for (bench_end &e : ends) {
+        enet_socket_destroy(e.socket);
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    if (enet_initialize() != 0) {
+        fprintf(stderr, "An error occurred while initializing ENet.\n");
+        return EXIT_FAILURE;
+    }
+    std::string mode = argc > 1 ? argv[1] : "";
+    TRANSPORT_BACKEND backend = TRANSPORT_BACKEND::BASIC;
+    if (mode == "bench") {
+        double seconds = argc > 2 ? std::stod(argv[2]) : 4;
+        if (argc > 3 && !parseTransportBackend(argv[3], backend)) {
+            fprintf(stderr, "Unknown transport backend %s\n", argv[3]);
+            return EXIT_FAILURE;
+        }
+        return bench(seconds, backend);
+    }
+    if (argc > 4) {
+        if (argc > 5 && !parseTransportBackend(argv[5], backend)) {
+            fprintf(stderr, "Unknown transport backend %s\n", argv[5]);
+            return EXIT_FAILURE;
+        }
+        return runRelay(std::stoi(argv[1]), std::stoi(argv[2]), std::stoul(argv[3]), argv[4], backend);
+    }
+    fprintf(stderr, "usage: %s bind first pairs secret [basic|mmsg]\n", argv[0]);
+    fprintf(stderr, "       %s bench [seconds] [basic|mmsg]\n", argv[0]);
+    return EXIT_FAILURE;
+}
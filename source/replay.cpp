@@ -0,0 +1,227 @@
+/**
+ * offline replay of a trace recorded by the master (--record=file)
+ *
+ * Feeds the recorded events through the same handlers the master uses, as fast as possible
+ * and with a virtual clock taken from the trace. The ENet host is never serviced and its
+ * socket is closed, so nothing is sent or received: packets the handlers send are counted
+ * and dropped instead of piling up in the peer queues, slots are freed by the recorded
+ * DISCONNECT events and by the handlers (releasePeer), as on the master.
+ *
+ * An event that cannot be replayed (no free slot for a CONNECT, a RECEIVE or DISCONNECT
+ * for a session the replay does not have) is counted; the exit code is 1 if there was any.
+ *
+ * The host gets as many peer slots as the recording master had (admission control depends on
+ * them), --peers=n overrides it.
+ *
+ * usage: ./duel6r-masterserver-replay trace.bin [--peers=n] [--verbose]
+ */
+
+#include <iostream>
+#include <string>
+#include <cstdint>
+#include <chrono>
+#include <map>
+#include <vector>
+#include <cstring>
+#include <algorithm>
+#include <enet/enet.h>
+#include "../include/masterserver.h"
+#include "../include/handlers.h"
+#include "../include/trace.h"
+#include "../include/clock.h"
+
+// the master's outgoing side on the offline host: packets are counted and dropped
+struct replay_network: public enet_network {
+    unsigned long long packets = 0;
+
+    replay_network(ENetHost *host)
+        : enet_network(host) {
+    }
+
+    void send(ENetPeer *peer, ENetPacket *packet) override {
+        packets++;
+        enet_packet_destroy(packet);
+    }
+    void broadcast(const std::vector<ENetPeer*> &peers, ENetPacket *packet) override {
+        packets += peers.size();
+        enet_packet_destroy(packet);
+    }
+};
+
+// a recorded peer slot and the session the replay runs in it; the handlers may release the slot
+// (releasePeer, admission) and a later connect may reuse it
+struct replay_session {
+    ENetPeer *peer;
+    enet_uint32 connectID;
+
+    bool live() const {
+        return peer->state != ENET_PEER_STATE_DISCONNECTED && peer->connectID == connectID;
+    }
+};
+
+// an outgoing connection of the master that was never established
+ENetPeer* connectingPeer(const trace_record &r) {
+    for (size_t i = 0; i < server->peerCount; i++) {
+        ENetPeer *peer = &server->peers[i];
+        if (peer->state == ENET_PEER_STATE_CONNECTING && peer->address.host == r.host && peer->address.port == r.port) {
+            return peer;
+        }
+    }
+    return nullptr;
+}
+
+// outgoing connections of the master show up as CONNECTING peers, incoming ones get a fresh slot
+ENetPeer* peerForConnect(const trace_record &r) {
+    ENetPeer *outgoing = connectingPeer(r);
+    if (outgoing != nullptr) {
+        return outgoing;
+    }
+    ENetAddress address;
+    address.host = r.host;
+    address.port = r.port;
+    // allocates the slot with its channel, the queued connect command is never sent
+    return enet_host_connect(server, &address, 1, r.data);
+}
+
+int main(int argc, char *argv[]) {
+    std::string tracePath;
+    bool verbose = false;
+    size_t peerCount = 0; // 0 = as recorded
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--verbose") {
+            verbose = true;
+        } else if (arg.rfind("--peers=", 0) == 0) {
+            peerCount = std::min(std::max(1ul, std::stoul(arg.substr(strlen("--peers=")))), (unsigned long) ENET_PROTOCOL_MAXIMUM_PEER_ID);
+        } else {
+            tracePath = arg;
+        }
+    }
+    if (tracePath.empty()) {
+        fprintf(stderr, "usage: %s trace.bin [--peers=n] [--verbose]\n", argv[0]);
+        return 1;
+    }
+
+    trace_reader reader;
+    if (!reader.open(tracePath)) {
+        fprintf(stderr, "Cannot read trace %s\n", tracePath.c_str());
+        return 1;
+    }
+
+    if (peerCount == 0) {
+        peerCount = reader.peerCount;
+    }
+    server = enet_host_create(NULL, peerCount, 1, 0, 0);
+    if (server == NULL) {
+        fprintf(stderr, "An error occurred while trying to create an ENet host.\n");
+        return 1;
+    }
+    enet_socket_destroy(server->socket);
+    server->socket = ENET_SOCKET_NULL;
+    replay_network replayNetwork(server);
+    network = &replayNetwork;
+
+    if (!verbose) {
+        // handlers log every request, that would dominate the measurement
+        if (freopen("/dev/null", "w", stdout) == nullptr) {
+            fprintf(stderr, "Cannot silence handler output\n");
+        }
+    }
+
+    std::map<uint16_t, replay_session> peers;
+    // the session recorded in the slot, if the handlers did not release it
+    auto sessionOf = [&peers](const trace_record &r) -> ENetPeer* {
+        auto it = peers.find(r.peer);
+        if (it == peers.end()) {
+            return nullptr;
+        }
+        if (!it->second.live()) {
+            peers.erase(it);
+            return nullptr;
+        }
+        return it->second.peer;
+    };
+    unsigned long long counts[4] = { 0, 0, 0, 0 };
+    unsigned long long dropped[4] = { 0, 0, 0, 0 };
+    unsigned long long bytes = 0;
+    trace_record r;
+    std::vector<unsigned char> payload;
+
+    virtual_clock clock(std::chrono::steady_clock::now());
+    auto clockBase = clock.time();
+    auto nextHousekeeping = clockBase;
+    auto start = std::chrono::steady_clock::now();
+    while (reader.next(r, payload)) {
+        clock.advanceTo(clockBase + std::chrono::microseconds(r.timestamp));
+        now = clock.time();
+        if (now >= nextHousekeeping) {
+            housekeeping();
+            nextHousekeeping = now + std::chrono::milliseconds(100);
+        }
+        ENetEvent event;
+        memset(&event, 0, sizeof(event));
+        event.type = (ENetEventType) r.type;
+        event.data = r.data;
+
+        switch (event.type) {
+        case ENET_EVENT_TYPE_CONNECT: {
+            ENetPeer *peer = peerForConnect(r);
+            if (peer == nullptr) {
+                dropped[r.type]++;
+                continue;
+            }
+            peer->state = ENET_PEER_STATE_CONNECTED;
+            peers[r.peer] = { peer, peer->connectID };
+            event.peer = peer;
+            handleConnect(event);
+            break;
+        }
+        case ENET_EVENT_TYPE_DISCONNECT: {
+            event.peer = sessionOf(r);
+            if (event.peer == nullptr) {
+                // an outgoing connection that timed out never had a CONNECT
+                event.peer = connectingPeer(r);
+            }
+            if (event.peer == nullptr) {
+                dropped[r.type]++;
+                continue;
+            }
+            handleDisconnect(event);
+            enet_peer_reset(event.peer);
+            peers.erase(r.peer);
+            break;
+        }
+        case ENET_EVENT_TYPE_RECEIVE: {
+            event.peer = sessionOf(r);
+            if (event.peer == nullptr) {
+                dropped[r.type]++;
+                continue;
+            }
+            event.packet = enet_packet_create(payload.data(), payload.size(), ENET_PACKET_FLAG_RELIABLE);
+            handleReceive(event);
+            enet_packet_destroy(event.packet);
+            bytes += payload.size();
+            break;
+        }
+        default:
+            continue;
+        }
+        counts[r.type]++;
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    unsigned long long total = counts[ENET_EVENT_TYPE_CONNECT] + counts[ENET_EVENT_TYPE_DISCONNECT] + counts[ENET_EVENT_TYPE_RECEIVE];
+
+    fprintf(stderr, "replayed %llu events (%llu connects, %llu disconnects, %llu packets / %llu bytes) in %.3f s on %zu peer slots\n",
+        total, counts[ENET_EVENT_TYPE_CONNECT], counts[ENET_EVENT_TYPE_DISCONNECT], counts[ENET_EVENT_TYPE_RECEIVE], bytes, elapsed,
+        server->peerCount);
+    fprintf(stderr, "%.0f events/s, %zu servers registered at the end, %llu packets sent\n", elapsed > 0 ? total / elapsed : 0.0,
+        hostList.mapa.size(), replayNetwork.packets);
+    unsigned long long lost = dropped[ENET_EVENT_TYPE_CONNECT] + dropped[ENET_EVENT_TYPE_DISCONNECT] + dropped[ENET_EVENT_TYPE_RECEIVE];
+    if (lost > 0) {
+        fprintf(stderr, "%llu events could not be replayed (%llu connects without a free slot, %llu disconnects and %llu packets of"
+            " unknown sessions)\n", lost, dropped[ENET_EVENT_TYPE_CONNECT], dropped[ENET_EVENT_TYPE_DISCONNECT],
+            dropped[ENET_EVENT_TYPE_RECEIVE]);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,175 @@
+/**
+ * reader of the server list the master publishes in shared memory (--shm=name, see shmlist.h)
+ *
+ * usage: ./duel6r-shmdump [name]                 print the list once
+ *        ./duel6r-shmdump watch [name]           print the list whenever its generation changes
+ *        ./duel6r-shmdump bench [seconds] [servers] [readers] [publish interval us]
+ *
+ * `bench` runs a writer publishing `servers` records every interval in a private region, first
+ * alone and then next to `readers` threads copying snapshots as fast as they can; the writer's
+ * publish times stay the same because it never waits for a reader
+ */
+
+#include <iostream>
+#include <string>
+#include <cstdint>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <unistd.h>
+#include "../include/protocol.h"
+#include "../include/shmlist.h"
+
+static void printSnapshot(const shm::snapshot &s) {
+    uint64_t nowMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    printf("generation %llu, %zu of %u servers, published %.1f s ago\n", (unsigned long long) s.generation, s.servers.size(),
+        s.total, nowMs > s.publishedAtMs ? (nowMs - s.publishedAtMs) / 1000.0 : 0.0);
+    for (const shm::shm_server &server : s.servers) {
+        printf(" %-21s local %-21s public %-21s %s rtt %3u ms  %s\n", hostToIPaddress(server.address, server.port).c_str(),
+            hostToIPaddress(server.localNetworkAddress, server.localNetworkPort).c_str(),
+            hostToIPaddress(server.publicIPAddress, server.publicPort).c_str(), server.needsNAT ? "NAT" : "   ", server.rtt,
+            shm::description(server).c_str());
+    }
+}
+
+int dump(const std::string &name, bool watch) {
+    shm::reader reader;
+    if (!reader.open(name)) {
+        fprintf(stderr, "Cannot open shared memory region %s (is the master running with --shm=%s?)\n", name.c_str(),
+            name.c_str());
+        return 1;
+    }
+    shm::snapshot s;
+    bool first = true;
+    uint64_t shown = 0;
+    do {
+        if (first || reader.generation() != shown) {
+            if (!reader.read(s)) {
+                fprintf(stderr, "No consistent snapshot\n");
+                return 1;
+            }
+            printSnapshot(s);
+            fflush(stdout);
+            shown = s.generation;
+            first = false;
+        }
+        if (watch) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(SHM_PUBLISH_INTERVAL_MS));
+        }
+    } while (watch);
+    return 0;
+}
+
+struct publish_times {
+    std::vector<double> us;
+
+    void print(const char *what) {
+        std::sort(us.begin(), us.end());
+        double sum = 0;
+        for (double u : us) {
+            sum += u;
+        }
+        printf("  %-22s %6zu publishes: avg %6.1f us, p50 %6.1f us, p99 %6.1f us, max %6.1f us\n", what, us.size(),
+            sum / us.size(), us[us.size() / 2], us[us.size() * 99 / 100], us.back());
+    }
+};
+
+static publish_times runWriter(shm::writer &writer, uint32_t servers, double seconds, std::chrono::microseconds interval) {
+    publish_times times;
+    std::string descr = "bench server with a description of a typical length";
+    uint64_t generation = 0;
+    auto end = std::chrono::steady_clock::now() + std::chrono::duration<double>(seconds);
+    while (std::chrono::steady_clock::now() < end) {
+        shm::shm_server *records = writer.begin();
+        generation++;
+        for (uint32_t i = 0; i < servers; i++) {
+            shm::writer::fill(records[i], i, 25900, i, 25900, i, 25900, i % 2, uint32_t(generation), descr.data(), descr.size());
+        }
+        writer.commit(servers, servers, generation);
+        times.us.push_back(writer.stats.lastWriteNs / 1000.0);
+        std::this_thread::sleep_for(interval);
+    }
+    return times;
+}
+
+int bench(double seconds, uint32_t servers, size_t readers, std::chrono::microseconds interval) {
+    std::string name = "/duel6r-shmdump-bench-" + std::to_string(getpid());
+    shm::writer writer;
+    if (!writer.open(name, servers)) {
+        fprintf(stderr, "Cannot create shared memory region %s\n", name.c_str());
+        return 1;
+    }
+    printf("%u servers (%zu bytes) published every %lld us\n", servers, servers * sizeof(shm::shm_server),
+        (long long) interval.count());
+    publish_times alone = runWriter(writer, servers, seconds / 2, interval);
+
+    std::atomic<bool> stop { false };
+    std::vector<shm::reader_stats> stats(readers);
+    std::vector<unsigned long long> torn(readers, 0);
+    std::vector<std::thread> threads;
+    for (size_t r = 0; r < readers; r++) {
+        threads.emplace_back([&, r]() {
+            shm::reader reader;
+            if (!reader.open(name)) {
+                return;
+            }
+            shm::snapshot s;
+            while (!stop.load(std::memory_order_relaxed)) {
+                if (!reader.read(s)) {
+                    continue;
+                }
+                // every record of a consistent snapshot was written by the same publish
+                for (const shm::shm_server &server : s.servers) {
+                    if (server.rtt != uint32_t(s.generation)) {
+                        torn[r]++;
+                        break;
+                    }
+                }
+            }
+            stats[r] = reader.stats;
+        });
+    }
+    publish_times shared = runWriter(writer, servers, seconds / 2, interval);
+    stop = true;
+    for (std::thread &t : threads) {
+        t.join();
+    }
+
+    printf("writer:\n");
+    alone.print("alone");
+    shared.print(("next to " + std::to_string(readers) + " readers").c_str());
+    unsigned long long reads = 0, retries = 0, failed = 0, tornTotal = 0;
+    for (size_t r = 0; r < readers; r++) {
+        reads += stats[r].reads;
+        retries += stats[r].retries;
+        failed += stats[r].failed;
+        tornTotal += torn[r];
+    }
+    printf("readers: %.0f snapshots/s each, %.3f retries per snapshot, %llu gave up, %llu torn snapshots\n",
+        reads / (seconds / 2) / std::max<size_t>(readers, 1), reads > 0 ? (double) retries / reads : 0.0, failed, tornTotal);
+    return tornTotal == 0 ? 0 : 1;
+}
+
+int main(int argc, char *argv[]) {
+    std::string mode = argc > 1 ? argv[1] : "";
+    if (mode == "bench") {
+        double seconds = argc > 2 ? std::stod(argv[2]) : 4;
+        uint32_t servers = argc > 3 ? std::stoul(argv[3]) : 1000;
+        size_t readers = argc > 4 ? std::stoul(argv[4]) : 2;
+        std::chrono::microseconds interval(argc > 5 ? std::stol(argv[5]) : 1000);
+        return bench(seconds, servers, readers, interval);
+    }
+    if (mode == "watch") {
+        return dump(argc > 2 ? argv[2] : SHM_DEFAULT_NAME, true);
+    }
+    if (mode == "-h" || mode == "--help") {
+        fprintf(stderr, "usage: %s [name]\n", argv[0]);
+        fprintf(stderr, "       %s watch [name]\n", argv[0]);
+        fprintf(stderr, "       %s bench [seconds] [servers] [readers] [publish interval us]\n", argv[0]);
+        return 1;
+    }
+    return dump(argc > 1 ? argv[1] : SHM_DEFAULT_NAME, false);
+}
@@ -0,0 +1,1238 @@
+/**
+ * deterministic simulation of the master
+ *
+ * Runs the master handlers (handlers.cpp) with a virtual clock on an in-memory network.
+ * Simulated game servers register and heartbeat (some of them crash), simulated clients
+ * request server lists and NAT punches. Hours of traffic take seconds of wall time and the
+ * registry invariants are checked along the way.
+ *
+ * Both ends of a NAT punch sit behind an emulated NAT. Half of the NATs drop an unsolicited
+ * packet that arrives before their own outbound packet and then map the outbound to another
+ * port, which fails the attempt; the client retries through the master. The RTTs the master
+ * sees are off by up to --rtt-error percent. --legacy-punch makes both ends ignore the
+ * punch schedules and start punching as soon as they hear about each other.
+ *
+ * A quarter of the clients sit behind symmetric NATs (most of them allocating ports in
+ * constant steps) and run the flare probes before each punch. Their mapping toward the
+ * game server is a few steps past the one the master saw, a restrictive server NAT only
+ * lets them in when the server punched that port. --no-prediction makes the servers
+ * ignore the predicted port windows.
+ *
+ * The master has --peers slots (32 by default, as the master), server lists hold at most
+ * --list-limit of the listed servers (SERVER_LIST_MAX_SERVERS by default, as the master).
+ *
+ * The master probes the servers every --probe-interval ms (liveness.h, 0 = off). A quarter of
+ * the servers are older ones that ignore the probes: when they crash they stay listed until
+ * their registration expires. The others must be delisted within (misses + 1) probe intervals
+ * of their crash; now and then their answer arrives a second time, after a newer probe, and
+ * must be ignored.
+ *
+ * usage: ./duel6r-masterserver-sim [--servers=N] [--clients=N] [--hours=H] [--seed=S] [--rtt-error=PCT]
+ *                                  [--peers=N] [--list-limit=N] [--probe-interval=MS] [--legacy-punch]
+ *                                  [--no-prediction] [--verbose]
+ *
+ * exit code is 1 when any invariant was violated
+ */
+
+#include <iostream>
+#include <string>
+#include <cstdint>
+#include <chrono>
+#include <map>
+#include <unordered_map>
+#include <set>
+#include <tuple>
+#include <queue>
+#include <deque>
+#include <algorithm>
+#include <memory>
+#include <random>
+#include <vector>
+#include <functional>
+#include <cstring>
+#include <enet/enet.h>
+#include "../include/masterserver.h"
+#include "../include/handlers.h"
+#include "../include/clock.h"
+#include "../include/liveness.h"
+
+typedef std::chrono::steady_clock::time_point sim_time;
+typedef std::chrono::microseconds sim_duration;
+
+// a point in simulated time, events at the same time are ordered by their index
+struct sim_instant {
+    sim_time at;
+    uint64_t event = 0;
+};
+
+struct sim_scheduler {
+    struct item {
+        sim_time at;
+        uint64_t sequence;
+        std::function<void()> action;
+        bool operator >(const item &other) const {
+            return at != other.at ? at > other.at : sequence > other.sequence;
+        }
+    };
+    std::priority_queue<item, std::vector<item>, std::greater<item>> queue;
+    uint64_t sequence = 0;
+    uint64_t executed = 0;
+    virtual_clock &clock;
+
+    sim_scheduler(virtual_clock &clock)
+        : clock(clock) {
+    }
+
+    void at(sim_time t, std::function<void()> action) {
+        queue.push( { t, sequence++, std::move(action) });
+    }
+
+    void after(sim_duration d, std::function<void()> action) {
+        at(clock.time() + d, std::move(action));
+    }
+
+    bool runNext(sim_time until) {
+        if (queue.empty() || queue.top().at > until) {
+            return false;
+        }
+        // the top is popped right away, its action can be moved out
+        item i = std::move(const_cast<item&>(queue.top()));
+        queue.pop();
+        clock.advanceTo(i.at);
+        now = clock.time();
+        executed++;
+        i.action();
+        return true;
+    }
+};
+
+// remote end of a master peer slot
+struct sim_session {
+    std::function<void(ENetPeer*)> connected;
+    std::function<void(const unsigned char*, size_t)> received;
+    std::function<void()> disconnected;
+    std::function<void()> rejected;
+};
+
+struct sim_stats {
+    unsigned long long connects = 0;
+    unsigned long long rejectedConnects = 0; // after the last retransmission
+    unsigned long long connectRetries = 0;
+    unsigned long long packetsToMaster = 0;
+    unsigned long long packetsFromMaster = 0;
+    unsigned long long bytesFromMaster = 0;
+    unsigned long long listsValidated = 0;
+    unsigned long long natPushes = 0;
+    unsigned long long natPeersDelivered = 0;
+    unsigned long long punches = 0;
+    unsigned long long punchAttempts = 0;
+    unsigned long long punchFirstAttempt = 0;
+    unsigned long long punchConnected = 0;
+    unsigned long long punchGaveUp = 0;
+    unsigned long long punchBusy = 0; // NAT_PUNCH_BUSY answers, retried without counting an attempt
+    std::vector<double> punchConnectMs; // first request to connection
+    unsigned long long symmetricPunches = 0;
+    unsigned long long symmetricConnected = 0;
+    unsigned long long predictionPackets = 0; // punch packets sprayed over predicted ports
+    unsigned long long staleProbeAnswers = 0; // answers that arrived again after a newer probe
+    unsigned long long proberEvictions = 0;   // crashed servers delisted by the prober
+    double maxEvictionMs = 0;                 // from the crash
+    unsigned long long keptToTtl = 0;         // crashed servers without probe support, left to their registration
+    unsigned long long violations = 0;
+};
+
+sim_stats stats;
+bool verbose = false;
+bool legacyPunch = false;
+bool usePrediction = true;
+
+void violation(const char *what) {
+    stats.violations++;
+    if (stats.violations <= 20) {
+        fprintf(stderr, "invariant violated: %s\n", what);
+    }
+}
+
+// in-memory stand-in for the master's ENetHost, delivers packets after a per-peer latency
+struct sim_network: public master_network {
+    static constexpr unsigned CONNECT_ATTEMPTS = 4;
+
+    struct slot {
+        uint64_t generation = 0;
+        sim_duration latency = sim_duration(0);
+        std::shared_ptr<sim_session> session;
+    };
+
+    ENetHost host;
+    std::vector<ENetPeer> peers;
+    std::vector<slot> slots;
+    sim_scheduler &scheduler;
+    std::minstd_rand noise;
+    uint32_t rttErrorPercent = 0;
+    enet_uint32 connectIDs = 0;
+    // simulated endpoint accepting connections initiated by the master (nullptr = nobody answers)
+    std::function<std::shared_ptr<sim_session>(const ENetAddress&, sim_duration&)> acceptOutgoing;
+
+    sim_network(sim_scheduler &scheduler, size_t peerCount)
+        : peers(peerCount),
+          slots(peerCount),
+          scheduler(scheduler) {
+        memset(&host, 0, sizeof(host));
+        memset(peers.data(), 0, sizeof(ENetPeer) * peerCount);
+        host.peers = peers.data();
+        host.peerCount = peerCount;
+        for (size_t i = 0; i < peerCount; i++) {
+            peers[i].host = &host;
+            peers[i].incomingPeerID = i;
+        }
+    }
+
+    // what ENet would measure, off by up to rttErrorPercent
+    enet_uint32 measuredRtt(sim_duration latency) {
+        double rtt = 2.0 * std::chrono::duration_cast<std::chrono::microseconds>(latency).count() / 1000.0;
+        if (rttErrorPercent > 0) {
+            int error = std::uniform_int_distribution<int>(-(int) rttErrorPercent, rttErrorPercent)(noise);
+            rtt *= 1.0 + error / 100.0;
+        }
+        return (enet_uint32) rtt;
+    }
+
+    size_t index(ENetPeer *peer) {
+        return peer - peers.data();
+    }
+
+    ENetPeer* freePeer() {
+        for (auto &p : peers) {
+            if (p.state == ENET_PEER_STATE_DISCONNECTED) {
+                return &p;
+            }
+        }
+        return nullptr;
+    }
+
+    void syncTime() {
+        host.serviceTime = std::chrono::duration_cast<std::chrono::milliseconds>(scheduler.clock.time().time_since_epoch()).count();
+    }
+
+    void dispatch(ENetEventType type, ENetPeer *peer, enet_uint32 data, ENetPacket *packet = nullptr) {
+        ENetEvent event;
+        memset(&event, 0, sizeof(event));
+        event.type = type;
+        event.peer = peer;
+        event.data = data;
+        event.packet = packet;
+        syncTime();
+        switch (type) {
+        case ENET_EVENT_TYPE_CONNECT:
+            handleConnect(event);
+            break;
+        case ENET_EVENT_TYPE_DISCONNECT:
+            handleDisconnect(event);
+            break;
+        case ENET_EVENT_TYPE_RECEIVE:
+            handleReceive(event);
+            break;
+        default:
+            break;
+        }
+    }
+
+    // schedules an action on the slot that is dropped if the slot was reused in the meantime
+    void onSlot(ENetPeer *peer, sim_duration delay, std::function<void(slot&)> action) {
+        size_t i = index(peer);
+        uint64_t generation = slots[i].generation;
+        scheduler.after(delay, [this, i, generation, action = std::move(action)]() {
+            if (slots[i].generation == generation) {
+                action(slots[i]);
+            }
+        });
+    }
+
+    void close(ENetPeer *peer) {
+        slot &s = slots[index(peer)];
+        s.generation++;
+        peer->state = ENET_PEER_STATE_DISCONNECTED;
+        auto session = s.session;
+        s.session.reset();
+        if (session && session->disconnected) {
+            session->disconnected();
+        }
+    }
+
+    // remote side opens a connection to the master; like ENet, an unanswered connect is sent again
+    // after 500 ms, 1 s and 2 s before the remote side gives up
+    void open(const ENetAddress &from, enet_uint32 data, sim_duration latency, std::shared_ptr<sim_session> session, unsigned attempt = 0) {
+        scheduler.after(latency, [this, from, data, latency, session, attempt]() {
+            syncTime();
+            ENetPeer *peer = nullptr;
+            if (admitConnection(&host, from, data)) {
+                peer = freePeer();
+            }
+            if (peer == nullptr) {
+                if (attempt + 1 < CONNECT_ATTEMPTS) {
+                    stats.connectRetries++;
+                    scheduler.after(std::chrono::milliseconds(500 << attempt) - latency, [this, from, data, latency, session, attempt]() {
+                        open(from, data, latency, session, attempt + 1);
+                    });
+                    return;
+                }
+                stats.rejectedConnects++;
+                if (session->rejected) {
+                    session->rejected();
+                }
+                return;
+            }
+            stats.connects++;
+            peer->connectID = ++connectIDs;
+            peer->address = from;
+            peer->eventData = data;
+            peer->state = ENET_PEER_STATE_ACKNOWLEDGING_CONNECT;
+            peer->roundTripTime = measuredRtt(latency);
+            peer->lowestRoundTripTime = peer->roundTripTime;
+            slot &s = slots[index(peer)];
+            s.latency = latency;
+            s.session = session;
+            // verify connect goes back, the acknowledgement completes the handshake
+            onSlot(peer, 2 * latency, [this, peer, data](slot &s) {
+                peer->state = ENET_PEER_STATE_CONNECTED;
+                auto session = s.session;
+                dispatch(ENET_EVENT_TYPE_CONNECT, peer, data);
+                if (session->connected) {
+                    session->connected(peer);
+                }
+            });
+        });
+    }
+
+    // remote side sends a packet over an established connection
+    void remoteSend(ENetPeer *peer, const std::vector<unsigned char> &data) {
+        onSlot(peer, slots[index(peer)].latency, [this, peer, data](slot &s) {
+            if (peer->state != ENET_PEER_STATE_CONNECTED && peer->state != ENET_PEER_STATE_DISCONNECT_LATER) {
+                return;
+            }
+            stats.packetsToMaster++;
+            ENetPacket *packet = enet_packet_create(data.data(), data.size(), ENET_PACKET_FLAG_RELIABLE);
+            dispatch(ENET_EVENT_TYPE_RECEIVE, peer, 0, packet);
+            enet_packet_destroy(packet);
+        });
+    }
+
+    // remote side disconnects
+    void remoteDisconnect(ENetPeer *peer) {
+        onSlot(peer, slots[index(peer)].latency, [this, peer](slot &s) {
+            dispatch(ENET_EVENT_TYPE_DISCONNECT, peer, 0);
+            close(peer);
+        });
+    }
+
+    ENetPeer* connect(const ENetAddress &address, enet_uint32 data) override {
+        ENetPeer *peer = freePeer();
+        if (peer == nullptr) {
+            return nullptr;
+        }
+        peer->connectID = ++connectIDs;
+        peer->address = address;
+        peer->eventData = 0;
+        peer->state = ENET_PEER_STATE_CONNECTING;
+        sim_duration latency(0);
+        auto session = acceptOutgoing ? acceptOutgoing(address, latency) : nullptr;
+        slot &s = slots[index(peer)];
+        s.latency = latency;
+        s.session = session;
+        if (session == nullptr) {
+            // nobody answers, ENet gives up after the peer timeout
+            onSlot(peer, std::chrono::milliseconds(1000), [this, peer](slot &s) {
+                dispatch(ENET_EVENT_TYPE_DISCONNECT, peer, 0);
+                close(peer);
+            });
+            return peer;
+        }
+        onSlot(peer, 2 * latency, [this, peer](slot &s) {
+            peer->state = ENET_PEER_STATE_CONNECTED;
+            peer->roundTripTime = measuredRtt(s.latency);
+            peer->lowestRoundTripTime = peer->roundTripTime;
+            auto session = s.session;
+            if (session->connected) {
+                session->connected(peer);
+            }
+            dispatch(ENET_EVENT_TYPE_CONNECT, peer, 0);
+        });
+        return peer;
+    }
+
+    void timeout(ENetPeer *peer, enet_uint32 limit, enet_uint32 minimum, enet_uint32 maximum) override {
+    }
+
+    void send(ENetPeer *peer, ENetPacket *packet) override {
+        stats.packetsFromMaster++;
+        stats.bytesFromMaster += packet->dataLength;
+        // delivered as it is, server lists are large
+        std::shared_ptr<ENetPacket> data(packet, enet_packet_destroy);
+        onSlot(peer, slots[index(peer)].latency, [data](slot &s) {
+            if (s.session && s.session->received) {
+                s.session->received(data->data, data->dataLength);
+            }
+        });
+    }
+
+    void disconnect(ENetPeer *peer, enet_uint32 data) override {
+        if (peer->state == ENET_PEER_STATE_DISCONNECTED || peer->state == ENET_PEER_STATE_DISCONNECTING) {
+            return;
+        }
+        peer->state = ENET_PEER_STATE_DISCONNECTING;
+        onSlot(peer, 2 * slots[index(peer)].latency, [this, peer](slot &s) {
+            dispatch(ENET_EVENT_TYPE_DISCONNECT, peer, 0);
+            close(peer);
+        });
+    }
+
+    void disconnectLater(ENetPeer *peer, enet_uint32 data) override {
+        if (peer->state != ENET_PEER_STATE_CONNECTED) {
+            disconnect(peer, data);
+            return;
+        }
+        peer->state = ENET_PEER_STATE_DISCONNECT_LATER;
+        // queued data is delivered first (one way latency), then the disconnect goes out
+        onSlot(peer, slots[index(peer)].latency, [this, peer, data](slot &s) {
+            peer->state = ENET_PEER_STATE_CONNECTED;
+            disconnect(peer, data);
+        });
+    }
+
+    void disconnectNow(ENetPeer *peer, enet_uint32 data) override {
+        close(peer);
+    }
+};
+
+// the datagrams the master's liveness prober sends, handed to the simulation
+struct sim_probe_transport: public masterserver::udp_transport {
+    std::function<void(const masterserver::datagram&)> sent;
+
+    sim_probe_transport()
+        : udp_transport(ENET_SOCKET_NULL) {
+    }
+
+    size_t receive(masterserver::datagram_batch &batch) override {
+        batch.clear();
+        return 0;
+    }
+
+    size_t send(masterserver::datagram_batch &batch) override {
+        size_t count = batch.count;
+        for (size_t i = 0; i < count; i++) {
+            sent(batch[i]);
+        }
+        batch.clear();
+        return count;
+    }
+
+    masterserver::TRANSPORT_BACKEND backend() const override {
+        return masterserver::TRANSPORT_BACKEND::BASIC;
+    }
+};
+
+struct sim_server {
+    ENetAddress address;
+    sim_duration latency;
+    bool needsNAT = false;
+    bool natRemaps = false; // NAT drops early inbound packets and remaps the next outbound
+    bool alive = true;
+    bool answersProbes = true; // older servers ignore the liveness probes
+    bool evicted = false;      // by the prober after a crash, until the restart
+    sim_instant evictedAt;
+    unsigned heartbeats = 0; // since the last (re)start, the first one sends a full update
+    std::deque<sim_instant> refreshes; // when the master accepted the last heartbeats (ground truth for list checks)
+    bool listed = false; // counted in simulation::listedServers
+    bool describedInListing = false; // a full update was sent since the master last listed the server
+
+    void refreshed(sim_instant t) {
+        refreshes.push_back(t);
+        if (refreshes.size() > 4) {
+            refreshes.pop_front();
+        }
+    }
+
+    // a list built at `t` must contain the server when its heartbeat before `t` is within the TTL
+    bool listedAt(sim_instant t) const {
+        if (evicted && evictedAt.event <= t.event) {
+            return false;
+        }
+        for (auto it = refreshes.rbegin(); it != refreshes.rend(); ++it) {
+            if (it->event <= t.event) {
+                return it->at + std::chrono::seconds(60) >= t.at;
+            }
+        }
+        return false;
+    }
+};
+
+// a client punching to a NAT server, attempts are retried through the master
+struct sim_punch {
+    size_t client;
+    sim_server *target;
+    sim_time requestedAt;
+    int attempt = 0;
+    bool clientStarted = false;
+    bool serverStarted = false;
+    sim_time clientStart; // first punch packet of each side
+    sim_time serverStart;
+    port_t mappedPort = 0; // symmetric client: its public port toward the server in this attempt
+    packet_nat_peers::_port_window window;
+
+    static constexpr int MAX_ATTEMPTS = 3;
+};
+
+struct simulation {
+    virtual_clock clock;
+    sim_scheduler scheduler;
+    sim_network net;
+    std::mt19937_64 rng;
+    std::vector<std::unique_ptr<sim_server>> servers;
+    std::unordered_map<uint64_t, sim_server*> serversByAddress; // by endpointKey(), looked up for every listed server
+    std::vector<ENetAddress> clients;
+    std::vector<sim_duration> clientLatency;
+    std::vector<bool> clientNatRemaps;
+    std::vector<bool> clientSymmetric;
+    std::vector<int32_t> clientPortStep; // symmetric NAT allocation step, 0 = random
+    std::map<std::pair<address_t, port_t>, size_t> clientsByAddress;
+    std::vector<sim_server*> natServers;
+    std::map<std::pair<size_t, sim_server*>, std::shared_ptr<sim_punch>> punches;
+
+    // a crashed server the prober has to evict, or to leave to its registration's TTL when it never answered a probe
+    struct sim_crash {
+        sim_server *server;
+        ENetAddress address;
+        sim_time at;
+        bool evictable;
+        sim_time ttlEnd;
+    };
+    std::vector<sim_crash> crashes;
+
+    static uint64_t endpointKey(address_t address, port_t port) {
+        return (uint64_t) address << 16 | port;
+    }
+
+    // refreshes of the last TTL in time order, listedServers() is what listedAt() would count over all servers now
+    std::deque<std::pair<sim_time, sim_server*>> refreshLog;
+    size_t listedNow = 0;
+
+    simulation(uint64_t seed, size_t peers)
+        : clock(sim_time(std::chrono::hours(24))),
+          scheduler(clock),
+          net(scheduler, peers),
+          rng(seed) {
+        net.acceptOutgoing = [this](const ENetAddress &address, sim_duration &latency) -> std::shared_ptr<sim_session> {
+            auto it = serversByAddress.find(endpointKey(address.host, address.port));
+            if (it == serversByAddress.end() || !it->second->alive) {
+                return nullptr;
+            }
+            sim_server *s = it->second;
+            latency = s->latency;
+            auto session = std::make_shared<sim_session>();
+            session->received = [this, s](const unsigned char *data, size_t len) {
+                onServerPacket(*s, data, len);
+            };
+            stats.natPushes++;
+            return session;
+        };
+    }
+
+    sim_instant instant() {
+        return sim_instant { clock.time(), scheduler.executed };
+    }
+
+    void refreshed(sim_server &s) {
+        expireRefreshes();
+        s.refreshed(instant());
+        refreshLog.emplace_back(clock.time(), &s);
+        if (!s.listed) {
+            s.listed = true;
+            listedNow++;
+        }
+    }
+
+    size_t listedServers() {
+        expireRefreshes();
+        return listedNow;
+    }
+
+    void expireRefreshes() {
+        while (!refreshLog.empty() && refreshLog.front().first + std::chrono::seconds(60) < clock.time()) {
+            sim_server *s = refreshLog.front().second;
+            // only the last refresh of a server ends its listing
+            if (s->listed && s->refreshes.back().at == refreshLog.front().first) {
+                // the master forgets the entry, the next partial update creates an undescribed one
+                s->listed = false;
+                s->describedInListing = false;
+                listedNow--;
+            }
+            refreshLog.pop_front();
+        }
+    }
+
+    uint32_t random(uint32_t below) {
+        return std::uniform_int_distribution<uint32_t>(0, below - 1)(rng);
+    }
+
+    sim_duration randomLatency() {
+        return std::chrono::milliseconds(5 + random(75));
+    }
+
+    ENetAddress randomAddress() {
+        ENetAddress a;
+        a.host = (address_t) rng();
+        a.port = 1024 + random(60000);
+        return a;
+    }
+
+    void addServer(bool nat) {
+        auto s = std::make_unique<sim_server>();
+        s->address = randomAddress();
+        s->latency = randomLatency();
+        s->needsNAT = nat;
+        s->natRemaps = random(2) == 0;
+        s->answersProbes = random(4) != 0;
+        serversByAddress[endpointKey(s->address.host, s->address.port)] = s.get();
+        if (nat) {
+            natServers.push_back(s.get());
+        }
+        sim_server *server = s.get();
+        servers.push_back(std::move(s));
+        scheduler.after(std::chrono::milliseconds(random(30000)), [this, server]() {
+            heartbeat(*server);
+        });
+        if (nat) {
+            scheduler.after(std::chrono::milliseconds(random(10000)), [this, server]() {
+                pollNatPeers(*server);
+            });
+        }
+    }
+
+    void addClient() {
+        clients.push_back(randomAddress());
+        clientLatency.push_back(randomLatency());
+        clientNatRemaps.push_back(random(2) == 0);
+        clientSymmetric.push_back(random(4) == 0);
+        clientPortStep.push_back(random(3) == 0 ? 0 : 1 + random(2));
+        size_t c = clients.size() - 1;
+        clientsByAddress[ { clients[c].host, clients[c].port }] = c;
+        scheduler.after(std::chrono::milliseconds(random(60000)), [this, c]() {
+            requestList(c);
+        });
+    }
+
+    void heartbeat(sim_server &s) {
+        if (!s.alive) {
+            return;
+        }
+        // a few servers crash and come back later on a new port
+        if (random(1000) < 2) {
+            crashed(s);
+            s.alive = false;
+            scheduler.after(std::chrono::minutes(5 + random(30)), [this, &s]() {
+                serversByAddress.erase(endpointKey(s.address.host, s.address.port));
+                s.address.port = 1024 + random(60000);
+                s.heartbeats = 0;
+                s.evicted = false;
+                serversByAddress[endpointKey(s.address.host, s.address.port)] = &s;
+                s.alive = true;
+                heartbeat(s);
+            });
+            return;
+        }
+        sendHeartbeat(s);
+        scheduler.after(std::chrono::seconds(25 + random(10)), [this, &s]() {
+            heartbeat(s);
+        });
+    }
+
+    // one heartbeat, retried until the master takes it; the periodic ones stay on their schedule
+    void sendHeartbeat(sim_server &s) {
+        auto session = std::make_shared<sim_session>();
+        session->connected = [this, &s](ENetPeer *peer) {
+            refreshed(s);
+            packetHeader header;
+            std::string descr = "sim server " + std::to_string(s.address.port) + " players " + std::to_string(random(8));
+            // a full update now and then, in between only the player count in the description changes
+            if (s.heartbeats++ % 8 == 0) {
+                header.type = PACKET_TYPE::SERVER_UPDATE;
+                packet_update u;
+                u.descr = descr;
+                u.needsNAT = s.needsNAT;
+                sendToMaster(peer, header, u);
+                s.describedInListing = true;
+            } else {
+                header.type = PACKET_TYPE::SERVER_UPDATE_PARTIAL;
+                packet_update_partial u;
+                u.fields = UPDATE_DESCRIPTION;
+                u.descr = descr;
+                sendToMaster(peer, header, u);
+            }
+            net.remoteDisconnect(peer);
+        };
+        session->rejected = [this, &s]() {
+            scheduler.after(std::chrono::seconds(1), [this, &s]() {
+                if (s.alive) {
+                    sendHeartbeat(s);
+                }
+            });
+        };
+        net.open(s.address, static_cast<enet_uint32>(REQUEST_TYPE::SERVER_UPDATE), s.latency, session);
+    }
+
+    void pollNatPeers(sim_server &s) {
+        scheduler.after(std::chrono::seconds(10), [this, &s]() {
+            pollNatPeers(s);
+        });
+        if (!s.alive) {
+            return;
+        }
+        auto session = std::make_shared<sim_session>();
+        session->connected = [this, &s](ENetPeer *peer) {
+            refreshed(s);
+        };
+        session->received = [this, &s](const unsigned char *data, size_t len) {
+            onServerPacket(s, data, len);
+        };
+        net.open(s.address, static_cast<enet_uint32>(REQUEST_TYPE::SERVER_NAT_GET_PEERS), s.latency, session);
+    }
+
+    void onServerPacket(sim_server &s, const unsigned char *data, size_t len) {
+        masterserver::deserializer d((unsigned char*) data, len);
+        packetHeader header;
+        d >> header;
+        if (header.type == PACKET_TYPE::NAT_PUNCH_SCHEDULE) {
+            packet_punch_schedule p;
+            if (!(d >> p)) {
+                violation("malformed punch schedule");
+                return;
+            }
+            if (!legacyPunch) {
+                punchStarted(p.peerAddress, p.peerPort, s, scheduledStart(p), false);
+            }
+            return;
+        }
+        if (header.type != PACKET_TYPE::SERVER_NAT_PEERS) {
+            violation("server received unexpected packet");
+            return;
+        }
+        packet_nat_peers p;
+        if (!(d >> p) || p.peerCount != p.peers.size()) {
+            violation("malformed NAT peers packet");
+            return;
+        }
+        stats.natPeersDelivered += p.peers.size();
+        if (p.predictions.size() != p.peers.size()) {
+            violation("port windows do not match the NAT peers");
+            return;
+        }
+        for (size_t i = 0; i < p.peers.size(); i++) {
+            auto punch = findPunch(p.peers[i].address, p.peers[i].port, s);
+            if (punch != nullptr && usePrediction) {
+                punch->window = p.predictions[i];
+            }
+        }
+        if (legacyPunch) {
+            for (auto &peer : p.peers) {
+                punchStarted(peer.address, peer.port, s, clock.time(), false);
+            }
+        }
+    }
+
+    sim_punch* findPunch(address_t clientAddress, port_t clientPort, sim_server &s) {
+        auto c = clientsByAddress.find( { clientAddress, clientPort });
+        if (c == clientsByAddress.end()) {
+            return nullptr;
+        }
+        auto it = punches.find( { c->second, &s });
+        return it != punches.end() ? it->second.get() : nullptr;
+    }
+
+    // the first packet of a burst centered on T
+    sim_time scheduledStart(const packet_punch_schedule &p) {
+        return clock.time() + std::chrono::milliseconds(p.startInMs)
+            - std::chrono::milliseconds(p.burstCount / 2 * p.burstIntervalMs);
+    }
+
+    void punchStarted(address_t clientAddress, port_t clientPort, sim_server &s, sim_time at, bool byClient) {
+        auto c = clientsByAddress.find( { clientAddress, clientPort });
+        if (c == clientsByAddress.end()) {
+            violation("punch to an unknown client");
+            return;
+        }
+        auto it = punches.find( { c->second, &s });
+        if (it == punches.end()) {
+            return; // attempt already resolved
+        }
+        sim_punch &p = *it->second;
+        if (byClient ? p.clientStarted : p.serverStarted) {
+            return;
+        }
+        // the game loop picks the punch up on its next frame
+        (byClient ? p.clientStart : p.serverStart) = at + std::chrono::milliseconds(random(17));
+        (byClient ? p.clientStarted : p.serverStarted) = true;
+        if (p.clientStarted && p.serverStarted) {
+            resolvePunch(it->second);
+        }
+    }
+
+    // a packet reaching a NAT before that NAT's own first outbound packet is dropped, a remapping NAT then fails the attempt
+    void resolvePunch(std::shared_ptr<sim_punch> p) {
+        sim_duration pathLatency = clientLatency[p->client] + p->target->latency;
+        bool earlyAtServer = p->clientStart + pathLatency < p->serverStart;
+        bool earlyAtClient = p->serverStart + pathLatency < p->clientStart;
+        sim_time last = std::max(p->clientStart, p->serverStart);
+        bool reachable = true;
+        if (clientSymmetric[p->client]) {
+            // the server punches the port the master saw unless it got a window; a permissive server NAT
+            // lets the client's packets in anyway and the server answers their source port
+            const packet_nat_peers::_port_window &w = p->window;
+            bool predicted = false;
+            for (uint16_t i = 0; i < w.count; i++) {
+                predicted = predicted || (port_t) (w.firstPort + i * w.step) == p->mappedPort;
+            }
+            stats.predictionPackets += w.count * PUNCH_BURST_COUNT;
+            reachable = predicted || !p->target->natRemaps;
+        }
+        if (!reachable || (earlyAtServer && p->target->natRemaps) || (earlyAtClient && clientNatRemaps[p->client])) {
+            if (p->attempt >= sim_punch::MAX_ATTEMPTS) {
+                stats.punchGaveUp++;
+                punches.erase( { p->client, p->target });
+                return;
+            }
+            p->clientStarted = p->serverStarted = false;
+            // the client notices after its punch timeout and asks the master again
+            scheduler.at(std::max(last, clock.time()) + std::chrono::seconds(2), [this, p]() {
+                attemptPunch(p);
+            });
+            return;
+        }
+        sim_time connectedAt = last + 2 * pathLatency;
+        stats.punchConnected++;
+        if (clientSymmetric[p->client]) {
+            stats.symmetricConnected++;
+        }
+        if (p->attempt == 1) {
+            stats.punchFirstAttempt++;
+        }
+        stats.punchConnectMs.push_back(std::chrono::duration<double, std::milli>(connectedAt - p->requestedAt).count());
+        punches.erase( { p->client, p->target });
+    }
+
+    template<typename ... Ts>
+    void sendToMaster(ENetPeer *peer, Ts &... parts) {
+        masterserver::serializer s;
+        ((s << parts), ...);
+        auto data = s.getData();
+        net.remoteSend(peer, std::vector<unsigned char>(data.begin(), data.end()));
+    }
+
+    void requestList(size_t c) {
+        scheduler.after(std::chrono::seconds(50 + random(20)), [this, c]() {
+            requestList(c);
+        });
+        if (!natServers.empty() && random(10) == 0) {
+            requestPunch(c, *natServers[random(natServers.size())]);
+            return;
+        }
+        auto session = std::make_shared<sim_session>();
+        auto request = std::make_shared<std::pair<sim_instant, size_t>>();
+        session->connected = [this, request](ENetPeer *peer) {
+            // the list is built now, the nearest listLimit of the servers listed at this instant
+            *request = { instant(), std::min(listedServers(), hostList.listLimit) };
+        };
+        session->received = [this, request](const unsigned char *data, size_t len) {
+            validateList(request->first, request->second, data, len);
+        };
+        net.open(clients[c], static_cast<enet_uint32>(REQUEST_TYPE::CLIENT_REQUEST_SERVERLIST), clientLatency[c], session);
+    }
+
+    void requestPunch(size_t c, sim_server &target) {
+        if (!target.alive || punches.count( { c, &target }) > 0) {
+            return;
+        }
+        auto p = std::make_shared<sim_punch>();
+        p->client = c;
+        p->target = &target;
+        p->requestedAt = clock.time();
+        punches[ { c, &target }] = p;
+        stats.punches++;
+        if (clientSymmetric[c]) {
+            stats.symmetricPunches++;
+        }
+        attemptPunch(p);
+    }
+
+    void attemptPunch(std::shared_ptr<sim_punch> punch, bool afterBusy = false) {
+        if (!punch->target->alive) {
+            stats.punchGaveUp++;
+            punches.erase( { punch->client, punch->target });
+            return;
+        }
+        if (!afterBusy) {
+            punch->attempt++;
+            stats.punchAttempts++;
+        }
+        size_t c = punch->client;
+        punch->window = packet_nat_peers::_port_window();
+        if (clientSymmetric[c]) {
+            // the flare probes run before every punch (the master's flare service is not simulated, its result is fed in)
+            int32_t step = clientPortStep[c];
+            hostList.classifyNat(clients[c].host, clients[c].port, NAT_TYPE::SYMMETRIC, step);
+            punch->mappedPort = step != 0 ? clients[c].port + step * (1 + random(4)) : 1024 + random(60000);
+        }
+        sim_server &target = *punch->target;
+        int attempt = punch->attempt;
+        // nothing heard from the server side, give up on the attempt
+        scheduler.after(std::chrono::seconds(30), [this, punch, attempt]() {
+            auto it = punches.find( { punch->client, punch->target });
+            if (it != punches.end() && it->second == punch && punch->attempt == attempt) {
+                stats.punchGaveUp++;
+                punches.erase(it);
+            }
+        });
+        auto session = std::make_shared<sim_session>();
+        auto busy = std::make_shared<bool>(false);
+        session->received = [this, c, &target, punch, busy](const unsigned char *data, size_t len) {
+            masterserver::deserializer d((unsigned char*) data, len);
+            packetHeader header;
+            packet_punch_schedule p;
+            if ((d >> header) && header.type == PACKET_TYPE::NAT_PUNCH_BUSY) {
+                packet_punch_busy b;
+                if (!(d >> b) || b.serverAddress != target.address.host || b.serverPort != target.address.port
+                    || b.retryAfterMs < PUNCH_BUSY_RETRY_MIN_MS || b.retryAfterMs > PUNCH_BUSY_RETRY_MAX_MS) {
+                    violation("malformed busy answer");
+                    return;
+                }
+                stats.punchBusy++;
+                *busy = true;
+                scheduler.after(std::chrono::milliseconds(b.retryAfterMs), [this, punch]() {
+                    attemptPunch(punch, true);
+                });
+                return;
+            }
+            if (header.type != PACKET_TYPE::NAT_PUNCH_SCHEDULE || !(d >> p)) {
+                violation("client received unexpected packet");
+                return;
+            }
+            if (p.peerAddress != target.address.host || p.peerPort != target.address.port) {
+                violation("punch schedule for another server");
+            }
+            if (!legacyPunch) {
+                punchStarted(clients[c].host, clients[c].port, target, scheduledStart(p), true);
+            }
+        };
+        session->disconnected = [this, c, &target, busy]() {
+            if (*busy) {
+                return;
+            }
+            // without a schedule the client punches right away
+            punchStarted(clients[c].host, clients[c].port, target, clock.time(), true);
+        };
+        session->rejected = [this, punch]() {
+            scheduler.after(std::chrono::seconds(2), [this, punch]() {
+                attemptPunch(punch);
+            });
+        };
+        session->connected = [this, c, &target](ENetPeer *peer) {
+            if (legacyPunch) {
+                punchStarted(clients[c].host, clients[c].port, target, clock.time(), true);
+            }
+            packetHeader header;
+            header.type = PACKET_TYPE::CLIENT_NAT_PUNCH;
+            packet_nat_punch p;
+            p.address = target.address.host;
+            p.port = target.address.port;
+            p.clientLocalNetworkAddress = clients[c].host;
+            p.clientLocalNetworkPort = clients[c].port;
+            sendToMaster(peer, header, p);
+        };
+        net.open(clients[c], static_cast<enet_uint32>(REQUEST_TYPE::CLIENT_NAT_CONNECT_TO_SERVER), clientLatency[c], session);
+    }
+
+    // the list must contain only servers whose last heartbeat is not older than the 60 s TTL, and `expected` of them: all,
+    // or as many as the list may have
+    void validateList(sim_instant builtAt, size_t expected, const unsigned char *data, size_t len) {
+        masterserver::deserializer d((unsigned char*) data, len);
+        packetHeader header;
+        d >> header;
+        packet_serverlist list;
+        if (header.type != PACKET_TYPE::SERVER_LIST || !(d >> list) || list.serverCount != list.servers.size()) {
+            violation("malformed server list");
+            return;
+        }
+        stats.listsValidated++;
+        for (auto &e : list.servers) {
+            auto it = serversByAddress.find(endpointKey(e.address, e.port));
+            if (it == serversByAddress.end()) {
+                // crashed server restarted on another port, must have expired by now
+                violation("listed server is unknown");
+                continue;
+            }
+            if (!it->second->listedAt(builtAt)) {
+                violation("listed server is past its TTL");
+            }
+            // a full update arrived while the server stayed listed, partial ones must not have touched the flag
+            if (it->second->describedInListing && it->second->heartbeats > 1 && e.needsNAT != it->second->needsNAT) {
+                violation("partial update lost the NAT flag");
+            }
+        }
+        if (list.servers.size() != expected) {
+            violation("server list is missing live servers");
+        }
+    }
+
+    void checkRegistry() {
+        for (auto &e : hostList.mapa) {
+            const server_list_entry &entry = e.second;
+            if (entry.validUntil < now - std::chrono::seconds(1)) {
+                violation("expired entry was not purged");
+            }
+            const nat_waiters &w = entry.natClients;
+            if (w.count > NAT_WAITERS_CAPACITY) {
+                violation("NAT client queue over its bound");
+            }
+            for (size_t i = 0; i < w.count; i++) {
+                // validUntil is truncated to seconds
+                if (w.slots[(w.head + i) % NAT_WAITERS_CAPACITY].validUntil + 2 < nat_waiters::secondsOf(now)) {
+                    violation("expired NAT client was not purged");
+                }
+            }
+        }
+        for (size_t i = 0; i < net.peers.size(); i++) {
+            ENetPeer &p = net.peers[i];
+            if (p.state == ENET_PEER_STATE_DISCONNECTED && p.data != nullptr) {
+                violation("free peer slot still owns a peer_entry");
+            }
+        }
+    }
+
+    void crashed(sim_server &s) {
+        auto it = hostList.mapa.find(std::make_tuple(s.address.host, s.address.port));
+        if (!liveness.isOpen() || it == hostList.mapa.end() || it->second.deleted || s.refreshes.empty()) {
+            return;
+        }
+        if (it->second.answersProbes && !s.answersProbes) {
+            violation("server without probe support counted as answering");
+        }
+        crashes.push_back( { &s, s.address, clock.time(), it->second.answersProbes, s.refreshes.back().at + std::chrono::seconds(60) });
+    }
+
+    void startProbes() {
+        auto transport = std::make_unique<sim_probe_transport>();
+        transport->sent = [this](const masterserver::datagram &d) {
+            deliverProbe(d);
+        };
+        liveness.open(std::move(transport));
+        probeLoop();
+    }
+
+    void deliverProbe(const masterserver::datagram &d) {
+        uint32_t token;
+        auto it = serversByAddress.find(endpointKey(d.address.host, d.address.port));
+        if (it == serversByAddress.end() || !parseLiveness(d.data, d.length, LIVENESS_KIND::PROBE, token)) {
+            violation("probe to an unknown server");
+            return;
+        }
+        sim_server *s = it->second;
+        ENetAddress to = d.address;
+        scheduler.after(s->latency, [this, s, to, token]() {
+            if (!s->alive || !s->answersProbes || s->address.port != to.port) {
+                return;
+            }
+            answerProbe(to, token, s->latency, false);
+            if (random(20) == 0) {
+                answerProbe(to, token, s->latency + 2 * liveness.interval, true);
+            }
+        });
+    }
+
+    void answerProbe(const ENetAddress &from, uint32_t token, sim_duration delay, bool stale) {
+        scheduler.after(delay, [this, from, token, stale]() {
+            unsigned char answer[LIVENESS_DATAGRAM_SIZE];
+            size_t length = encodeLiveness(answer, LIVENESS_KIND::ANSWER, token);
+            unsigned long long answered = liveness.stats.answered;
+            if (!liveness.onDatagram(hostList, from, answer, length, now)) {
+                violation("probe answer not recognized");
+            }
+            if (stale) {
+                stats.staleProbeAnswers++;
+                if (liveness.stats.answered != answered) {
+                    violation("answer to an older probe was taken");
+                }
+            }
+        });
+    }
+
+    void probeLoop() {
+        unsigned long long evicted = liveness.stats.evicted;
+        liveness.service(hostList, now);
+        checkCrashes(liveness.stats.evicted - evicted);
+        scheduler.after(std::chrono::milliseconds(100), [this]() {
+            probeLoop();
+        });
+    }
+
+    // right after the prober ran, so an eviction is seen at the instant it happened
+    void checkCrashes(unsigned long long evictions) {
+        sim_duration bound = liveness.interval * (liveness.misses + 1) + std::chrono::milliseconds(500);
+        unsigned long long seen = 0;
+        for (auto it = crashes.begin(); it != crashes.end();) {
+            auto e = hostList.mapa.find(std::make_tuple(it->address.host, it->address.port));
+            bool delisted = e == hostList.mapa.end() || e->second.deleted;
+            if (it->evictable && delisted) {
+                seen++;
+                stats.proberEvictions++;
+                stats.maxEvictionMs = std::max(stats.maxEvictionMs,
+                    std::chrono::duration<double, std::milli>(clock.time() - it->at).count());
+                sim_server &s = *it->server;
+                s.evicted = true;
+                s.evictedAt = instant();
+                if (s.listed) {
+                    s.listed = false;
+                    s.describedInListing = false;
+                    listedNow--;
+                }
+                it = crashes.erase(it);
+                continue;
+            }
+            if (clock.time() >= it->at + bound) {
+                if (it->evictable) {
+                    violation("crashed server was not evicted by the prober");
+                } else if (delisted && clock.time() < it->ttlEnd) {
+                    violation("server without probe support delisted before its TTL");
+                } else {
+                    stats.keptToTtl++;
+                }
+                it = crashes.erase(it);
+                continue;
+            }
+            ++it;
+        }
+        if (seen != evictions) {
+            violation("prober evicted a live server");
+        }
+    }
+
+    void housekeepingLoop() {
+        net.syncTime();
+        housekeeping();
+        checkRegistry();
+        scheduler.after(std::chrono::milliseconds(100), [this]() {
+            housekeepingLoop();
+        });
+    }
+};
+
+int main(int argc, char *argv[]) {
+    size_t serverCount = 200;
+    size_t clientCount = 100;
+    double hours = 1;
+    uint64_t seed = 1;
+    uint32_t rttError = 25;
+    size_t peers = 32;
+    unsigned long probeInterval = LIVENESS_INTERVAL_MS;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg.rfind("--servers=", 0) == 0) {
+            serverCount = std::stoul(arg.substr(strlen("--servers=")));
+        } else if (arg.rfind("--clients=", 0) == 0) {
+            clientCount = std::stoul(arg.substr(strlen("--clients=")));
+        } else if (arg.rfind("--hours=", 0) == 0) {
+            hours = std::stod(arg.substr(strlen("--hours=")));
+        } else if (arg.rfind("--seed=", 0) == 0) {
+            seed = std::stoull(arg.substr(strlen("--seed=")));
+        } else if (arg.rfind("--rtt-error=", 0) == 0) {
+            rttError = std::stoul(arg.substr(strlen("--rtt-error=")));
+        } else if (arg.rfind("--peers=", 0) == 0) {
+            peers = std::max<size_t>(1, std::stoul(arg.substr(strlen("--peers="))));
+        } else if (arg.rfind("--list-limit=", 0) == 0) {
+            hostList.listLimit = std::min<size_t>(std::max<size_t>(1, std::stoul(arg.substr(strlen("--list-limit=")))),
+                SERVER_LIST_MAX_SERVERS);
+        } else if (arg.rfind("--probe-interval=", 0) == 0) {
+            probeInterval = std::stoul(arg.substr(strlen("--probe-interval=")));
+        } else if (arg == "--legacy-punch") {
+            legacyPunch = true;
+        } else if (arg == "--no-prediction") {
+            usePrediction = false;
+        } else if (arg == "--verbose") {
+            verbose = true;
+        } else {
+            fprintf(stderr, "usage: %s [--servers=N] [--clients=N] [--hours=H] [--seed=S] [--rtt-error=PCT] [--peers=N] [--list-limit=N]"
+                " [--probe-interval=MS] [--legacy-punch] [--no-prediction] [--verbose]\n",
+                argv[0]);
+            return 1;
+        }
+    }
+    if (!verbose) {
+        // handlers log every request
+        if (freopen("/dev/null", "w", stdout) == nullptr) {
+            fprintf(stderr, "Cannot silence handler output\n");
+        }
+    }
+
+    simulation sim(seed, peers);
+    sim.net.noise.seed(seed);
+    sim.net.rttErrorPercent = rttError;
+    server = &sim.net.host;
+    network = &sim.net;
+    now = sim.clock.time();
+
+    for (size_t i = 0; i < serverCount; i++) {
+        sim.addServer(i % 4 == 0);
+    }
+    for (size_t i = 0; i < clientCount; i++) {
+        sim.addClient();
+    }
+    sim.housekeepingLoop();
+    if (probeInterval > 0) {
+        liveness.interval = std::chrono::milliseconds(probeInterval);
+        sim.startProbes();
+    }
+
+    sim_time end = sim.clock.time() + std::chrono::duration_cast<sim_duration>(std::chrono::duration<double, std::ratio<3600>>(hours));
+    auto start = std::chrono::steady_clock::now();
+    unsigned long long events = 0;
+    while (sim.scheduler.runNext(end)) {
+        events++;
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    fprintf(stderr, "simulated %.2f h with %zu servers and %zu clients in %.2f s (%llu events)\n", hours, serverCount, clientCount,
+        elapsed, events);
+    fprintf(stderr, "connects %llu (rejected %llu, retransmitted %llu), packets to master %llu, from master %llu (%llu bytes)\n",
+        stats.connects, stats.rejectedConnects, stats.connectRetries, stats.packetsToMaster, stats.packetsFromMaster,
+        stats.bytesFromMaster);
+    admission_stats admitted = admission.total();
+    fprintf(stderr, "sessions served %.1f/s (simulated), admission: rejected %llu, deferred %llu, evicted %llu, recycled %llu\n",
+        stats.connects / (hours * 3600), admitted.rejected, admitted.deferred, admitted.evicted, admitted.recycled);
+    fprintf(stderr, "lists validated %llu, NAT pushes %llu, NAT peers delivered %llu, registry size %zu\n", stats.listsValidated,
+        stats.natPushes, stats.natPeersDelivered, hostList.mapa.size());
+    std::vector<double> &ms = stats.punchConnectMs;
+    std::sort(ms.begin(), ms.end());
+    double avg = 0;
+    for (double m : ms) {
+        avg += m;
+    }
+    fprintf(stderr, "%s punches %llu (%llu attempts): %.1f%% connected on the first attempt, %.1f%% overall, %llu gave up\n",
+        legacyPunch ? "legacy" : "scheduled", stats.punches, stats.punchAttempts,
+        stats.punches > 0 ? 100.0 * stats.punchFirstAttempt / stats.punches : 0.0,
+        stats.punches > 0 ? 100.0 * stats.punchConnected / stats.punches : 0.0, stats.punchGaveUp);
+    if (stats.punchBusy > 0) {
+        fprintf(stderr, "busy answers %llu (retried after the advertised delay)\n", stats.punchBusy);
+    }
+    fprintf(stderr, "time to connect: avg %.0f ms, p95 %.0f ms\n", ms.empty() ? 0.0 : avg / ms.size(),
+        ms.empty() ? 0.0 : ms[std::min(ms.size() - 1, ms.size() * 95 / 100)]);
+    fprintf(stderr, "symmetric clients (%s): %llu punches, %.1f%% connected, %llu extra punch packets for predicted ports\n",
+        usePrediction ? "port prediction" : "no prediction", stats.symmetricPunches,
+        stats.symmetricPunches > 0 ? 100.0 * stats.symmetricConnected / stats.symmetricPunches : 0.0, stats.predictionPackets);
+    fprintf(stderr, "updates: %llu full, %llu partial, %llu bytes, %llu saved by partial updates\n", updateStats.full,
+        updateStats.partial, updateStats.bytes, updateStats.bytesSaved);
+    if (liveness.isOpen()) {
+        fprintf(stderr, "liveness: %llu probes, %llu answered, %llu stale answers ignored; %llu crashed servers evicted (at most"
+            " %.0f ms after the crash), %llu without probe support left to their TTL\n", liveness.stats.sent, liveness.stats.answered,
+            stats.staleProbeAnswers, stats.proberEvictions, stats.maxEvictionMs, stats.keptToTtl);
+    }
+    fprintf(stderr, "invariant violations: %llu\n", stats.violations);
+    return stats.violations > 0 ? 1 : 0;
+}
@@ -0,0 +1,721 @@
+/**
+ * correctness checks of the master's wire formats and components, run by ctest
+ *
+ * usage: ./duel6r-masterserver-tests [group...]
+ *
+ * without arguments all groups run; the exit code is the number of failed checks (capped)
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <functional>
+#include <new>
+#include <cstdlib>
+#include <enet/enet.h>
+#include "../include/protocol.h"
+#include "../include/stun.h"
+#include "../include/transport.h"
+#include "../include/relay.h"
+#include "../include/egress.h"
+#include "../include/shmlist.h"
+#include "../include/subscription.h"
+
+using namespace masterserver;
+
+static size_t failures = 0;
+
+// operator new and ENet's allocator are counted while `counting` is set
+static bool counting = false;
+static size_t newCalls = 0;
+static size_t enetMallocs = 0;
+static size_t enetFrees = 0;
+
+static void* countedNew(size_t size) {
+    if (counting) {
+        newCalls++;
+    }
+    void *p = malloc(size == 0 ? 1 : size);
+    if (p == nullptr) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void* operator new(size_t size) {
+    return countedNew(size);
+}
+void* operator new[](size_t size) {
+    return countedNew(size);
+}
+void operator delete(void *p) noexcept {
+    free(p);
+}
+void operator delete[](void *p) noexcept {
+    free(p);
+}
+void operator delete(void *p, size_t) noexcept {
+    free(p);
+}
+void operator delete[](void *p, size_t) noexcept {
+    free(p);
+}
+
+static void* ENET_CALLBACK countedEnetMalloc(size_t size) {
+    if (counting) {
+        enetMallocs++;
+    }
+    return malloc(size);
+}
+
+static void ENET_CALLBACK countedEnetFree(void *memory) {
+    if (counting) {
+        enetFrees++;
+    }
+    free(memory);
+}
+
+#define CHECK(condition) check((condition), #condition, __FILE__, __LINE__)
+
+static void check(bool ok, const char *what, const char *file, int line) {
+    if (!ok) {
+        fprintf(stderr, "%s:%d: check failed: %s\n", file, line, what);
+        failures++;
+    }
+}
+
+typedef std::basic_string<unsigned char> bytes_t;
+
+template<typename Packet>
+static bytes_t encode(PACKET_TYPE type, Packet &packet) {
+    serializer s;
+    packetHeader header;
+    header.type = type;
+    s << header;
+    s << packet;
+    return s.getData();
+}
+
+template<typename Packet>
+static bool decode(const bytes_t &data, PACKET_TYPE type, Packet &packet) {
+    deserializer d(data);
+    packetHeader header;
+    return (d >> header) && header.type == type && (d >> packet);
+}
+
+// the same bytes have to come out of the ENet packet the master sends
+template<typename Packet>
+static bool encodesLikeBuildPacket(PACKET_TYPE type, Packet &packet) {
+    packetHeader header;
+    header.type = type;
+    ENetPacket *built = buildPacket(ENET_PACKET_FLAG_RELIABLE, header, packet);
+    if (built == NULL) {
+        return false;
+    }
+    bool same = bytes_t(built->data, built->dataLength) == encode(type, packet);
+    enet_packet_destroy(built);
+    return same;
+}
+
+static void serializeNatPeers(std::mt19937_64 &rng) {
+    // golden bytes pin the field order: header, public endpoint, peer count, peers, predictions
+    packet_nat_peers p;
+    hostAddress a;
+    a.a[0] = 127; a.a[1] = 0; a.a[2] = 0; a.a[3] = 1;
+    p.yourPublicAddress = a.address;
+    p.yourPublicPort = 25900;
+    packet_nat_peers::_peer peer;
+    a.a[0] = 10; a.a[1] = 0; a.a[2] = 0; a.a[3] = 1;
+    peer.address = a.address;
+    peer.port = 5900;
+    a.a[0] = 192; a.a[1] = 168; a.a[2] = 0; a.a[3] = 1;
+    peer.localNetworkAddress = a.address;
+    peer.localNetworkPort = 6000;
+    p.peers.push_back(peer);
+    packet_nat_peers::_port_window window;
+    window.firstPort = 5901;
+    window.count = 8;
+    window.step = -2;
+    p.predictions.push_back(window);
+    p.peerCount = 1;
+    const unsigned char golden[] = { 0x02, 0x7f, 0x00, 0x00, 0x01, 0x2c, 0x65, 0x01, 0x00, 0x01,
+        0x0a, 0x00, 0x00, 0x01, 0x0c, 0x17, 0xc0, 0xa8, 0x00, 0x01, 0x70, 0x17,
+        0x01, 0x0d, 0x17, 0x08, 0x00, 0xfe, 0xff };
+    CHECK(encode(PACKET_TYPE::SERVER_NAT_PEERS, p) == bytes_t(golden, sizeof(golden)));
+
+    // every field of every record survives the round trip
+    for (size_t peers : { 0, 1, 2, 17, 255 }) {
+        for (size_t round = 0; round < 20; round++) {
+            packet_nat_peers p;
+            p.yourPublicAddress = rng();
+            p.yourPublicPort = rng();
+            for (size_t i = 0; i < peers; i++) {
+                packet_nat_peers::_peer peer;
+                peer.address = rng();
+                peer.port = rng();
+                peer.localNetworkAddress = rng();
+                peer.localNetworkPort = rng();
+                p.peers.push_back(peer);
+                packet_nat_peers::_port_window window;
+                window.firstPort = rng();
+                window.count = rng();
+                window.step = rng();
+                p.predictions.push_back(window);
+            }
+            p.peerCount = peers;
+            bytes_t data = encode(PACKET_TYPE::SERVER_NAT_PEERS, p);
+            packet_nat_peers d;
+            CHECK(decode(data, PACKET_TYPE::SERVER_NAT_PEERS, d));
+            CHECK(d.yourPublicAddress == p.yourPublicAddress);
+            CHECK(d.yourPublicPort == p.yourPublicPort);
+            CHECK(d.peerCount == p.peerCount);
+            CHECK(d.peers.size() == p.peers.size());
+            CHECK(d.predictions.size() == p.predictions.size());
+            for (size_t i = 0; i < std::min(d.peers.size(), p.peers.size()); i++) {
+                CHECK(d.peers[i].address == p.peers[i].address);
+                CHECK(d.peers[i].port == p.peers[i].port);
+                CHECK(d.peers[i].localNetworkAddress == p.peers[i].localNetworkAddress);
+                CHECK(d.peers[i].localNetworkPort == p.peers[i].localNetworkPort);
+            }
+            for (size_t i = 0; i < std::min(d.predictions.size(), p.predictions.size()); i++) {
+                CHECK(d.predictions[i].firstPort == p.predictions[i].firstPort);
+                CHECK(d.predictions[i].count == p.predictions[i].count);
+                CHECK(d.predictions[i].step == p.predictions[i].step);
+            }
+            CHECK(encodesLikeBuildPacket(PACKET_TYPE::SERVER_NAT_PEERS, p));
+        }
+    }
+
+    // a window for every peer or the packet is not written, nor accepted
+    packet_nat_peers mismatched = p;
+    mismatched.predictions.push_back(window);
+    serializer ms;
+    CHECK(!(ms << mismatched));
+    packetHeader mismatchedHeader;
+    mismatchedHeader.type = PACKET_TYPE::SERVER_NAT_PEERS;
+    CHECK(buildPacket(ENET_PACKET_FLAG_RELIABLE, mismatchedHeader, mismatched) == NULL);
+    bytes_t twoWindows = encode(PACKET_TYPE::SERVER_NAT_PEERS, p);
+    twoWindows[22] = 0x02;
+    twoWindows.append(twoWindows.end() - 6, twoWindows.end());
+    packet_nat_peers rejected;
+    CHECK(!decode(twoWindows, PACKET_TYPE::SERVER_NAT_PEERS, rejected));
+
+    // an older master sends no predictions, every peer gets an empty window
+    bytes_t old = encode(PACKET_TYPE::SERVER_NAT_PEERS, p);
+    old.resize(old.size() - 1 - 6 * p.predictions.size());
+    packet_nat_peers d;
+    CHECK(decode(old, PACKET_TYPE::SERVER_NAT_PEERS, d));
+    CHECK(d.peers.size() == 1 && d.predictions.size() == 1 && d.predictions[0].count == 0);
+}
+
+static void serializeNatPunch(std::mt19937_64 &rng) {
+    packet_nat_punch p;
+    hostAddress a;
+    a.a[0] = 10; a.a[1] = 0; a.a[2] = 0; a.a[3] = 1;
+    p.address = a.address;
+    p.port = 5900;
+    a.a[0] = 192; a.a[1] = 168; a.a[2] = 0; a.a[3] = 1;
+    p.clientLocalNetworkAddress = a.address;
+    p.clientLocalNetworkPort = 6000;
+    bytes_t data = encode(PACKET_TYPE::CLIENT_NAT_PUNCH, p);
+    CHECK(data.size() == 13);
+    CHECK(data.substr(1) == bytes_t((const unsigned char*) "\x0a\x00\x00\x01\x0c\x17\xc0\xa8\x00\x01\x70\x17", 12));
+
+    for (size_t round = 0; round < 1000; round++) {
+        packet_nat_punch p;
+        p.address = rng();
+        p.port = rng();
+        p.clientLocalNetworkAddress = rng();
+        p.clientLocalNetworkPort = rng();
+        packet_nat_punch d;
+        CHECK(decode(encode(PACKET_TYPE::CLIENT_NAT_PUNCH, p), PACKET_TYPE::CLIENT_NAT_PUNCH, d));
+        CHECK(d.address == p.address);
+        CHECK(d.port == p.port);
+        CHECK(d.clientLocalNetworkAddress == p.clientLocalNetworkAddress);
+        CHECK(d.clientLocalNetworkPort == p.clientLocalNetworkPort);
+        CHECK(encodesLikeBuildPacket(PACKET_TYPE::CLIENT_NAT_PUNCH, p));
+    }
+    // truncated packets are rejected
+    packet_nat_punch d;
+    CHECK(!decode(data.substr(0, data.size() - 1), PACKET_TYPE::CLIENT_NAT_PUNCH, d));
+}
+
+static void serializeTests() {
+    std::mt19937_64 rng(1);
+    serializeNatPeers(rng);
+    serializeNatPunch(rng);
+}
+
+// fails in the sizing pass or only when written into the packet
+struct failing_part {
+    bool inSizer = false;
+    template<typename Stream>
+    bool serialize(Stream &s) {
+        return Stream::isSizer() ? !inSizer : false;
+    }
+};
+
+// buildPacket sizes the parts and writes them into the ENet packet: no operator new,
+// the ENet allocations of exactly one packet, and none left behind when it fails
+template<typename ... Ts>
+static void checkBuildPacketAllocations(Ts &... parts) {
+    sizer size;
+    ((size << parts), ...);
+    counting = true;
+    enetMallocs = 0;
+    ENetPacket *reference = enet_packet_create(NULL, size.size, ENET_PACKET_FLAG_RELIABLE);
+    size_t perPacket = enetMallocs;
+    enet_packet_destroy(reference);
+
+    newCalls = enetMallocs = enetFrees = 0;
+    ENetPacket *packet = buildPacket(ENET_PACKET_FLAG_RELIABLE, parts...);
+    counting = false;
+    CHECK(packet != NULL && packet->dataLength == size.size);
+    CHECK(newCalls == 0);
+    CHECK(enetMallocs == perPacket);
+    CHECK(enetFrees == 0);
+    enet_packet_destroy(packet);
+}
+
+static void allocationTests() {
+    ENetCallbacks callbacks = { countedEnetMalloc, countedEnetFree, nullptr };
+    CHECK(enet_initialize_with_callbacks(ENET_VERSION, &callbacks) == 0);
+
+    packetHeader header;
+    header.type = PACKET_TYPE::SERVER_NAT_PEERS;
+    packet_nat_peers peers;
+    peers.yourPublicAddress = 0x0100007f;
+    peers.yourPublicPort = 25900;
+    peers.peers.resize(17);
+    peers.predictions.resize(17);
+    peers.peerCount = 17;
+    checkBuildPacketAllocations(header, peers);
+
+    header.type = PACKET_TYPE::CLIENT_NAT_PUNCH;
+    packet_nat_punch punch;
+    checkBuildPacketAllocations(header, punch);
+
+    header.type = PACKET_TYPE::SERVER_UPDATE;
+    packet_update update;
+    update.descr = "CTF on a map with a typical name [8/16]";
+    checkBuildPacketAllocations(header, update);
+
+    for (bool inSizer : { true, false }) {
+        failing_part failing;
+        failing.inSizer = inSizer;
+        counting = true;
+        newCalls = enetMallocs = enetFrees = 0;
+        ENetPacket *packet = buildPacket(ENET_PACKET_FLAG_RELIABLE, header, failing);
+        counting = false;
+        CHECK(packet == NULL);
+        CHECK(newCalls == 0);
+        CHECK(enetMallocs == enetFrees);
+    }
+    enet_deinitialize();
+}
+
+// binding request -> response in place -> parsed mapping equals the source address; garbage and mutated
+// requests are rejected or answered within the buffer
+static void stunTests() {
+    std::mt19937_64 rng(1);
+    unsigned char transaction[STUN_TRANSACTION_SIZE];
+    unsigned char data[DATAGRAM_MAX_SIZE];
+    for (size_t i = 0; i < 100000; i++) {
+        for (auto &b : transaction) {
+            b = rng();
+        }
+        ENetAddress from;
+        from.host = rng();
+        from.port = rng();
+        size_t length = stun::buildBindingRequest(data, sizeof(data), transaction);
+        length = stun::respondInPlace(data, length, sizeof(data), from);
+        ENetAddress mapped;
+        CHECK(length == STUN_BINDING_RESPONSE_SIZE);
+        CHECK(stun::parseBindingResponse(data, length, transaction, mapped));
+        CHECK(mapped.host == from.host && mapped.port == from.port);
+    }
+    size_t answered = 0;
+    for (size_t i = 0; i < 1000000; i++) {
+        size_t length = rng() % 64;
+        if (i % 2 == 0) {
+            length = stun::buildBindingRequest(data, sizeof(data), transaction) + (rng() % 4) * 4;
+            data[rng() % length] ^= 1 << (rng() % 8);
+        } else {
+            for (size_t b = 0; b < length; b++) {
+                data[b] = rng();
+            }
+        }
+        ENetAddress from = { 0, 0 };
+        size_t response = stun::respondInPlace(data, length, sizeof(data), from);
+        if (response > 0) {
+            answered++;
+            CHECK(response <= STUN_BINDING_RESPONSE_SIZE);
+        }
+        ENetAddress mapped;
+        stun::parseBindingResponse(data, length, transaction, mapped);
+    }
+    // a flipped bit in the transaction id still makes a valid request
+    CHECK(answered > 0);
+}
+
+// the wire is little-endian on every host: golden size prefixes, plus the swapping conversions of
+// a big-endian host emulated on byte reversed values (golden packets are in the serialize group)
+static void endianTests() {
+    struct {
+        uint32_t size;
+        bytes_t golden;
+    } sizes[] = { { 7, { 0x07 } }, { 300, { 0xfd, 0x2c, 0x01 } }, { 70000, { 0xfe, 0x70, 0x11, 0x01 } },
+        { (1 << 24) + 5, { 0xff, 0x05, 0x00, 0x00, 0x01 } } };
+    for (auto &size : sizes) {
+        serializer s;
+        writeSize(s, size.size);
+        CHECK(s.getData() == size.golden);
+        deserializer d(s.getData());
+        CHECK(readSize(d) == size.size);
+    }
+
+    // a big-endian host holds the byte reversed value in memory, its conversion must produce the same wire value
+    std::mt19937_64 rng(1);
+    for (size_t i = 0; i < 1000000; i++) {
+        uint64_t v = rng();
+        CHECK(toLittleEndianOn<false>(byteSwap<uint16_t>(v)) == (uint16_t) v);
+        CHECK(toLittleEndianOn<false>(byteSwap<uint32_t>(v)) == (uint32_t) v);
+        CHECK(toLittleEndianOn<false>(byteSwap<uint64_t>(v)) == v);
+        CHECK(toBigEndianOn<false>((uint32_t) v) == (uint32_t) v);
+        CHECK(toBigEndianOn<true>(byteSwap<uint32_t>(v)) == (uint32_t) v);
+    }
+}
+
+// sends a bind request from `end` and returns the relay's answer, 255 when there was none
+static uint8_t bindStatus(relay::relay_service &relay, udp_transport &end, port_t bindPort,
+    const relay::credentials &c, relay::ROLE role) {
+    static datagram_batch batch;
+    relay::bind_request request;
+    request.creds = c;
+    request.role = role;
+    batch.clear();
+    datagram *d = batch.next();
+    d->address.host = 0x0100007f;
+    d->address.port = bindPort;
+    buffer_serializer out(d->data, sizeof(d->data));
+    out << request;
+    d->length = out.getDataLen();
+    end.send(batch);
+    relay.service(std::chrono::steady_clock::now());
+    enet_uint32 condition = ENET_SOCKET_WAIT_RECEIVE;
+    enet_socket_wait(end.socket, &condition, 100);
+    if (end.receive(batch) == 0) {
+        return 255;
+    }
+    deserializer in(batch[0].data, batch[0].length);
+    relay::bind_response response;
+    return (in >> response) ? response.status : 255;
+}
+
+// credentials bind only the role they were issued for, from the host the master saw the end at
+static void relayTests() {
+    const port_t bindPort = 27300;
+    const address_t master = 0x0100007f;  // 127.0.0.1, where the master saw both ends
+    const address_t elsewhere = 0x0200007f; // 127.0.0.2
+    relay::relay_service relay;
+    relay::secret_t secret = relay::secretFromString("tests");
+    CHECK(relay.open(master, bindPort, bindPort + 1, 1, secret, TRANSPORT_BACKEND::BASIC));
+    ENetSocket sockets[2] = { openDatagramSocket(master, 0), openDatagramSocket(elsewhere, 0) };
+    CHECK(sockets[0] != ENET_SOCKET_NULL && sockets[1] != ENET_SOCKET_NULL);
+    if (relay.bindSocket == ENET_SOCKET_NULL || sockets[0] == ENET_SOCKET_NULL || sockets[1] == ENET_SOCKET_NULL) {
+        return;
+    }
+    auto expected = createTransport(TRANSPORT_BACKEND::BASIC, sockets[0]);
+    auto other = createTransport(TRANSPORT_BACKEND::BASIC, sockets[1]);
+    relay::issuer issuer;
+    issuer.port = bindPort;
+    issuer.secret = secret;
+    std::array<relay::credentials, 2> c = issuer.issue(master, master);
+
+    CHECK(bindStatus(relay, *other, bindPort, c[relay::CLIENT], relay::CLIENT) == relay::BAD_CREDENTIALS);
+    CHECK(bindStatus(relay, *expected, bindPort, c[relay::SERVER], relay::CLIENT) == relay::BAD_CREDENTIALS);
+    CHECK(relay.stats.sessions == 0);
+    CHECK(bindStatus(relay, *expected, bindPort, c[relay::SERVER], relay::SERVER) == relay::BOUND);
+    CHECK(bindStatus(relay, *expected, bindPort, c[relay::CLIENT], relay::CLIENT) == relay::BOUND);
+    CHECK(relay.stats.sessions == 1 && relay.stats.binds == 2 && relay.stats.rejectedBinds == 2);
+    // the session exists now, its credentials still bind nothing elsewhere
+    CHECK(bindStatus(relay, *other, bindPort, c[relay::SERVER], relay::SERVER) == relay::BAD_CREDENTIALS);
+
+    expected.reset();
+    other.reset();
+    enet_socket_destroy(sockets[0]);
+    enet_socket_destroy(sockets[1]);
+}
+
+// what reached ENet, in order
+struct recording_network: public master_network {
+    struct sent {
+        ENetPeer *peer;
+        uint8_t type;
+        std::vector<unsigned char> data = { }; // not compared
+        bool operator ==(const sent &o) const {
+            return peer == o.peer && type == o.type;
+        }
+    };
+    std::vector<sent> log;
+
+    ENetPeer* connect(const ENetAddress&, enet_uint32) override {
+        return nullptr;
+    }
+    void timeout(ENetPeer*, enet_uint32, enet_uint32, enet_uint32) override {
+    }
+    void send(ENetPeer *peer, ENetPacket *packet) override {
+        log.push_back( { peer, packet->data[0], std::vector<unsigned char>(packet->data, packet->data + packet->dataLength) });
+        enet_packet_destroy(packet);
+    }
+    void disconnect(ENetPeer*, enet_uint32) override {
+    }
+    void disconnectLater(ENetPeer*, enet_uint32) override {
+    }
+    void disconnectNow(ENetPeer*, enet_uint32) override {
+    }
+};
+
+static ENetPacket* packetOf(PACKET_TYPE type, size_t length) {
+    std::vector<unsigned char> data(length, 0);
+    data[0] = type;
+    return enet_packet_create(data.data(), length, ENET_PACKET_FLAG_RELIABLE);
+}
+
+// a delta must not overtake the list still queued for a subscriber
+static void egressTests() {
+    typedef recording_network::sent sent;
+    recording_network link;
+    egress_network egress(link);
+    egress.rate = 1000;
+    egress.burst = 1000;
+    egress.tokens = 0;
+    ENetPeer waiting, idle;
+    memset(&waiting, 0, sizeof(waiting));
+    memset(&idle, 0, sizeof(idle));
+    waiting.state = idle.state = ENET_PEER_STATE_CONNECTED;
+    waiting.connectID = 1;
+    idle.connectID = 2;
+    std::chrono::steady_clock::time_point start;
+    egress.flush(start);
+    egress.tokens = 0;
+
+    egress.send(&waiting, packetOf(PACKET_TYPE::SERVER_LIST, 500));
+    CHECK(link.log.empty());
+    egress.broadcast( { &waiting, &idle }, packetOf(PACKET_TYPE::SERVER_LIST_DELTA, 50));
+    CHECK(link.log == std::vector<sent>( { { &idle, PACKET_TYPE::SERVER_LIST_DELTA } }));
+    egress.broadcast( { &waiting, &idle }, packetOf(PACKET_TYPE::SERVER_LIST_DELTA, 50));
+    CHECK(link.log.size() == 2);
+
+    egress.flush(start + std::chrono::seconds(2));
+    CHECK(link.log == std::vector<sent>( {
+        { &idle, PACKET_TYPE::SERVER_LIST_DELTA },
+        { &idle, PACKET_TYPE::SERVER_LIST_DELTA },
+        { &waiting, PACKET_TYPE::SERVER_LIST },
+        { &waiting, PACKET_TYPE::SERVER_LIST_DELTA },
+        { &waiting, PACKET_TYPE::SERVER_LIST_DELTA } }));
+    CHECK(!egress.pending());
+    // drained, the next delta goes straight out
+    egress.broadcast( { &waiting }, packetOf(PACKET_TYPE::SERVER_LIST_DELTA, 50));
+    CHECK(link.log.size() == 6 && link.log.back() == (sent { &waiting, PACKET_TYPE::SERVER_LIST_DELTA }));
+}
+
+static const port_t SUBSCRIBED_PORT = 5910;
+
+static void listServer(entryMap &registry, address_t address, const char *descr) {
+    registry.update(address, SUBSCRIBED_PORT, descr, 0, 0, 0, 0, false);
+    registry.refresh(address, SUBSCRIBED_PORT);
+}
+
+// the deltas a peer got since `from`, the removed and upserted servers of all their pages
+static size_t deltasTo(const recording_network &link, size_t from, ENetPeer *peer, packet_serverlist_delta &merged) {
+    merged = packet_serverlist_delta();
+    size_t count = 0;
+    for (size_t i = from; i < link.log.size(); i++) {
+        const recording_network::sent &p = link.log[i];
+        if (p.peer != peer || p.type != PACKET_TYPE::SERVER_LIST_DELTA) {
+            continue;
+        }
+        deserializer d(p.data.data(), p.data.size());
+        packetHeader header;
+        packet_serverlist_delta delta;
+        CHECK((d >> header) && (d >> delta));
+        merged.removed.insert(merged.removed.end(), delta.removed.begin(), delta.removed.end());
+        merged.upserted.insert(merged.upserted.end(), delta.upserted.begin(), delta.upserted.end());
+        count++;
+    }
+    return count;
+}
+
+// coalescing of the registry changes into deltas
+static void subscriptionTests() {
+    const std::chrono::milliseconds interval(SUBSCRIPTION_INTERVAL_MS);
+    now = std::chrono::steady_clock::time_point() + std::chrono::hours(1);
+    entryMap registry;
+    list_subscriptions subscriptions;
+    recording_network link;
+    ENetPeer first, late;
+    memset(&first, 0, sizeof(first));
+    memset(&late, 0, sizeof(late));
+    first.state = late.state = ENET_PEER_STATE_CONNECTED;
+    first.connectID = 1;
+    late.connectID = 2;
+    packet_serverlist_delta delta;
+    for (address_t a = 1; a <= 3; a++) {
+        listServer(registry, a, "listed");
+    }
+
+    // the first subscriber starts from the registry as it is
+    CHECK(subscriptions.subscribe(&first, registry, link, now));
+    now += interval;
+    subscriptions.service(registry, link, now);
+    CHECK(link.log.empty());
+
+    // a server that came and went within the interval never shows up
+    listServer(registry, 10, "short lived");
+    registry.evict(registry.get(10, SUBSCRIBED_PORT));
+    now += interval;
+    subscriptions.service(registry, link, now);
+    CHECK(link.log.empty());
+
+    // ten updates of one server are one upsert with the last state
+    for (int i = 0; i < 10; i++) {
+        listServer(registry, 2, i % 2 == 0 ? "even" : "odd");
+    }
+    now += interval;
+    subscriptions.service(registry, link, now);
+    CHECK(deltasTo(link, 0, &first, delta) == 1);
+    CHECK(delta.removed.empty() && delta.upserted.size() == 1);
+    CHECK(delta.upserted.size() == 1 && delta.upserted[0].address == 2 && delta.upserted[0].descr == "odd");
+
+    // at most one delta per interval, the next one carries what happened in between
+    size_t sent = link.log.size();
+    listServer(registry, 4, "new");
+    subscriptions.service(registry, link, now + interval / 2);
+    CHECK(link.log.size() == sent);
+    now += interval;
+    subscriptions.service(registry, link, now);
+    CHECK(deltasTo(link, sent, &first, delta) == 1 && delta.upserted.size() == 1 && delta.upserted[0].address == 4);
+
+    // a server that expires is removed without anything moving the generation
+    sent = link.log.size();
+    uint64_t generation = registry.generation;
+    now += std::chrono::seconds(30);
+    for (address_t a = 2; a <= 4; a++) {
+        registry.refresh(a, SUBSCRIBED_PORT);
+    }
+    CHECK(registry.generation == generation);
+    now += std::chrono::seconds(31);
+    subscriptions.service(registry, link, now);
+    CHECK(deltasTo(link, sent, &first, delta) == 1 && delta.upserted.empty());
+    CHECK(delta.removed.size() == 1 && delta.removed[0].address == 1 && delta.removed[0].port == SUBSCRIBED_PORT);
+
+    // a late subscriber's list is the registry as it is, the pending change goes to the first one right away
+    sent = link.log.size();
+    listServer(registry, 5, "pending");
+    CHECK(subscriptions.subscribe(&late, registry, link, now));
+    CHECK(deltasTo(link, sent, &first, delta) == 1 && delta.upserted.size() == 1 && delta.upserted[0].address == 5);
+    CHECK(deltasTo(link, sent, &late, delta) == 0);
+    // so the removal reaches both, the late subscriber's list had the server
+    sent = link.log.size();
+    registry.evict(registry.get(5, SUBSCRIBED_PORT));
+    now += interval;
+    subscriptions.service(registry, link, now);
+    for (ENetPeer *peer : { &first, &late }) {
+        CHECK(deltasTo(link, sent, peer, delta) == 1 && delta.removed.size() == 1 && delta.removed[0].address == 5);
+    }
+
+    // a delta over the list limit is split into pages
+    sent = link.log.size();
+    const address_t many = SERVER_LIST_MAX_SERVERS + SERVER_LIST_MAX_SERVERS / 2;
+    for (address_t a = 100; a < 100 + many; a++) {
+        listServer(registry, a, "page");
+    }
+    now += interval;
+    subscriptions.service(registry, link, now);
+    CHECK(deltasTo(link, sent, &late, delta) == 2 && delta.upserted.size() == many && delta.removed.empty());
+    CHECK(subscriptions.stats.added == 2 + many && subscriptions.stats.updated == 1 && subscriptions.stats.removed == 2);
+
+    // a session that ended gets nothing, the first subscriber after nobody starts over
+    subscriptions.unsubscribe(&first);
+    subscriptions.unsubscribe(&late);
+    listServer(registry, 6, "while nobody listened");
+    sent = link.log.size();
+    CHECK(subscriptions.subscribe(&late, registry, link, now));
+    now += interval;
+    subscriptions.service(registry, link, now);
+    CHECK(link.log.size() == sent);
+}
+
+static void publish(shm::writer &writer, uint32_t count, uint64_t generation) {
+    shm::shm_server *records = writer.begin();
+    for (uint32_t i = 0; i < count; i++) {
+        shm::writer::fill(records[i], 0x0100000a, 5000 + i, 0, 0, 0, 0, false, 0, "shm", 3);
+    }
+    writer.commit(count, count, generation);
+}
+
+// a master restarted with another --shm-capacity while a reader still maps the old region
+static void shmTests() {
+    const std::string name = "/duel6r-servers-tests";
+    shm::writer crashed;
+    shm::reader reader;
+    shm::snapshot s;
+    if (!crashed.open(name, 4)) {
+        CHECK(!"cannot create the shared memory region");
+        return;
+    }
+    publish(crashed, 4, 1);
+    CHECK(reader.open(name));
+    CHECK(reader.read(s) && s.servers.size() == 4 && s.generation == 1);
+
+    shm::writer larger;
+    CHECK(larger.open(name, 64));
+    publish(larger, 10, 2);
+    CHECK(reader.generation() == 0);
+    CHECK(reader.read(s) && s.servers.size() == 10 && s.generation == 2);
+
+    shm::writer smaller;
+    CHECK(smaller.open(name, 2));
+    publish(smaller, 2, 3);
+    CHECK(reader.read(s) && s.servers.size() == 2 && s.generation == 3);
+    CHECK(reader.generation() == 3);
+
+    // restarted with the same capacity, the region and the reader's mapping stay
+    shm::writer same;
+    CHECK(same.open(name, 2));
+    publish(same, 1, 4);
+    CHECK(reader.generation() == 4);
+    CHECK(reader.read(s) && s.servers.size() == 1);
+}
+
+static const struct {
+    const char *name;
+    std::function<void()> run;
+} groups[] = {
+    { "serialize", serializeTests },
+    { "allocations", allocationTests },
+    { "stun", stunTests },
+    { "endian", endianTests },
+    { "relay", relayTests },
+    { "egress", egressTests },
+    { "shm", shmTests },
+    { "subscriptions", subscriptionTests },
+};
+
+int main(int argc, char *argv[]) {
+    std::vector<std::string> selected(argv + 1, argv + argc);
+    for (auto &group : groups) {
+        if (!selected.empty() && std::find(selected.begin(), selected.end(), group.name) == selected.end()) {
+            continue;
+        }
+        size_t before = failures;
+        group.run();
+        printf("%-12s %s\n", group.name, failures == before ? "ok" : "FAILED");
+    }
+    return std::min<size_t>(failures, 100);
+}